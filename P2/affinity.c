@@ -0,0 +1,54 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+
+int affinity_parse_cpus(const char *list, int *cpus, int max_cpus) {
+    int count = 0;
+    const char *cursor = list;
+
+    while (*cursor) {
+        char *end;
+        long first = strtol(cursor, &end, 10), last = first;
+        if (end == cursor || first < 0) return -1;
+        if (*end == '-') {
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor || last < first) return -1;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last && count < max_cpus; cpu++) cpus[count++] = (int) cpu;
+
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        cursor = end;
+    }
+    return count;
+}
+
+int affinity_pin_self(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int affinity_cpu_node(int cpu) {
+    char path[64];
+    sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) return -1;
+
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+        if (sscanf(entry->d_name, "node%d", &node) == 1) break;
+    closedir(dir);
+    return node;
+}
@@ -0,0 +1,19 @@
+#ifndef __AFFINITY__
+#define __AFFINITY__
+
+/* Helpers for pinning threads to CPUs. Pinned threads allocate their own
+ * per-thread state after pinning, so Linux's first-touch policy places it on
+ * the thread's local NUMA node. */
+
+/* Parses a CPU list such as "0-7,16-23" into CPUS (at most MAX_CPUS entries).
+ * Returns the number of CPUs parsed, or -1 if LIST is malformed or names a
+ * CPU at or above CPU_SETSIZE. */
+int affinity_parse_cpus(const char *list, int *cpus, int max_cpus);
+
+/* Pins the calling thread to CPU. Returns 0 on success, -1 on error. */
+int affinity_pin_self(int cpu);
+
+/* Returns the NUMA node CPU belongs to, or -1 if it cannot be determined. */
+int affinity_cpu_node(int cpu);
+
+#endif
@@ -0,0 +1,75 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+static __thread arena_t *current_arena;
+
+static void *arena_malloc(size_t size) {
+    void *memory = malloc(size);
+    if (memory == NULL) {
+        perror("Failed to allocate request arena");
+        exit(ENOMEM);
+    }
+    return memory;
+}
+
+void arena_init(arena_t *arena, size_t size) {
+    arena->base = arena_malloc(size);
+    arena->size = size;
+    arena->used = 0;
+    arena->overflow_bytes = 0;
+    arena->overflow = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    if (size <= arena->size - arena->used) {
+        void *memory = arena->base + arena->used;
+        arena->used += size;
+        return memory;
+    }
+
+    /* The header is padded to keep chunk data aligned. */
+    size_t header = (sizeof(arena_chunk_t) + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    arena_chunk_t *chunk = arena_malloc(header + size);
+    chunk->next = arena->overflow;
+    arena->overflow = chunk;
+    arena->overflow_bytes += size;
+    return (char *) chunk + header;
+}
+
+void arena_reset(arena_t *arena) {
+    if (arena->overflow != NULL) {
+        size_t high_water = arena->used + arena->overflow_bytes;
+        while (arena->overflow != NULL) {
+            arena_chunk_t *next = arena->overflow->next;
+            free(arena->overflow);
+            arena->overflow = next;
+        }
+        free(arena->base);
+        arena_init(arena, high_water > arena->size * 2 ? high_water : arena->size * 2);
+    }
+    arena->used = 0;
+}
+
+arena_t *thread_arena(void) {
+    if (current_arena == NULL) {
+        current_arena = arena_malloc(sizeof(arena_t));
+        arena_init(current_arena, ARENA_INITIAL_SIZE);
+    }
+    return current_arena;
+}
+
+void arena_swap(arena_t **arena) {
+    arena_t *swapped = current_arena;
+    current_arena = *arena;
+    *arena = swapped;
+}
+
+void arena_destroy(arena_t *arena) {
+    arena_reset(arena);
+    free(arena->base);
+    free(arena);
+}
@@ -0,0 +1,49 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for request-scoped memory. Each thread has its own arena,
+ * which the worker resets after every request; nothing allocated from it is
+ * ever freed individually. A request that outgrows the arena spills into
+ * overflow chunks, and the next reset grows the arena to the high-water mark
+ * so steady-state serving never touches the heap.
+ */
+
+#define ARENA_INITIAL_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    char data[];
+} arena_chunk_t;
+
+typedef struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+    size_t overflow_bytes; // Bytes handed out from overflow chunks since the last reset.
+    arena_chunk_t *overflow;
+} arena_t;
+
+void arena_init(arena_t *arena, size_t size);
+
+/* Returns SIZE bytes aligned to ARENA_ALIGNMENT. Exits if memory runs out. */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/* Frees everything allocated since the last reset. */
+void arena_reset(arena_t *arena);
+
+/* Returns the calling thread's arena, creating it on first use so a pinned
+ * worker gets one on its local NUMA node. */
+arena_t *thread_arena(void);
+
+/* Exchanges *ARENA with the calling thread's arena (NULL: none yet), for code
+ * that interleaves requests on one thread (see coro.h). */
+void arena_swap(arena_t **arena);
+
+/* Frees an arena from thread_arena and everything allocated from it. */
+void arena_destroy(arena_t *arena);
+
+#endif
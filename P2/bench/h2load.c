@@ -0,0 +1,318 @@
+/*
+ * A closed-loop HTTP/2 (h2c, prior knowledge) load generator for
+ * `httpserver --http2`.
+ *
+ * Each connection runs on its own thread and keeps --streams requests in
+ * flight at all times: whenever a stream ends, the next path (round-robin
+ * over --path) is requested on a new stream. The client advertises windows
+ * large enough that the server is never blocked by flow control on our side.
+ *
+ * Usage: ./bench/h2load [--host 127.0.0.1] [--port 8000] [--connections 4]
+ *                       [--streams 32] [--duration 10] [--path /index.html]...
+ *                       [--name label]
+ *
+ * The last line has the same shape as loadgen's:
+ *     RESULT <name> rps=<n> p50=<us> p99=<us> p999=<us> errors=<n>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "h2.h"
+#include "hdr_histogram.h"
+#include "hpack.h"
+#include "util.h"
+
+#define H2LOAD_MAX_PATHS 64
+#define H2LOAD_MAX_STREAMS 1024
+#define H2LOAD_HIGHEST_US 60000000LL
+#define H2LOAD_WINDOW (1 << 30)
+#define H2LOAD_BUFFER_SIZE (4 * (H2_FRAME_SIZE + 9))
+
+typedef struct h2load_stream {
+    uint32_t id;
+    uint64_t start_ns;
+    int status;
+} h2load_stream_t;
+
+typedef struct h2load_connection {
+    pthread_t thread;
+    int fd;
+    hpack_table_t encoder;
+    hpack_table_t decoder;
+    uint32_t next_stream_id;
+    unsigned int next_path;
+    long unacknowledged; // Connection window consumed since our last WINDOW_UPDATE.
+    h2load_stream_t *streams;
+    int in_flight;
+    hdr_histogram_t histogram;
+    long completed;
+    long errors;
+    uint64_t bytes;
+} h2load_connection_t;
+
+static char *paths[H2LOAD_MAX_PATHS];
+static int num_paths;
+static int streams_per_connection = 32;
+static char authority[300];
+static struct sockaddr_in target_address;
+static volatile int running = 1;
+
+static void write_frame_header(unsigned char *p, size_t length, int type, int flags, uint32_t stream_id) {
+    p[0] = length >> 16;
+    p[1] = length >> 8;
+    p[2] = length;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = stream_id >> 24;
+    p[6] = stream_id >> 16;
+    p[7] = stream_id >> 8;
+    p[8] = stream_id;
+}
+
+static int send_all(int fd, const void *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) return -1;
+        data = (const char *) data + sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+static int send_window_update(int fd, uint32_t stream_id, uint32_t increment) {
+    unsigned char frame[13];
+    write_frame_header(frame, 4, 0x8, 0, stream_id);
+    frame[9] = increment >> 24;
+    frame[10] = increment >> 16;
+    frame[11] = increment >> 8;
+    frame[12] = increment;
+    return send_all(fd, frame, sizeof(frame));
+}
+
+/* Opens a stream for the next path in SLOT. */
+static int start_request(h2load_connection_t *c, h2load_stream_t *slot) {
+    unsigned char frame[9 + 1024];
+    unsigned char *block = frame + 9;
+    size_t length = 0, capacity = sizeof(frame) - 9;
+    char *path = paths[c->next_path++ % num_paths];
+
+    length += hpack_encode_header(&c->encoder, block + length, capacity - length, ":method", "GET", 1);
+    length += hpack_encode_header(&c->encoder, block + length, capacity - length, ":scheme", "http", 1);
+    length += hpack_encode_header(&c->encoder, block + length, capacity - length, ":authority", authority, 1);
+    length += hpack_encode_header(&c->encoder, block + length, capacity - length, ":path", path, 1);
+
+    slot->id = c->next_stream_id;
+    slot->start_ns = now_ns();
+    slot->status = 0;
+    c->next_stream_id += 2;
+    c->in_flight++;
+    write_frame_header(frame, length, 0x1, 0x4 | 0x1, slot->id); // END_HEADERS | END_STREAM
+    return send_all(c->fd, frame, 9 + length);
+}
+
+static h2load_stream_t *find_stream(h2load_connection_t *c, uint32_t id) {
+    for (int i = 0; i < streams_per_connection; i++)
+        if (c->streams[i].id == id) return &c->streams[i];
+    return NULL;
+}
+
+static void on_response_header(void *context, const char *name, size_t name_length, const char *value,
+                               size_t value_length) {
+    if (name_length == 7 && memcmp(name, ":status", 7) == 0) *(int *) context = atoi(value);
+}
+
+static void finish_stream(h2load_connection_t *c, h2load_stream_t *stream, int failed) {
+    if (failed || stream->status < 200 || stream->status >= 400) {
+        c->errors++;
+    } else {
+        c->completed++;
+        hdr_record(&c->histogram, (int64_t) ((now_ns() - stream->start_ns) / 1000));
+    }
+    stream->id = 0;
+    c->in_flight--;
+    if (running) start_request(c, stream);
+}
+
+/* Handles one frame. Returns -1 if the connection should be abandoned. */
+static int handle_frame(h2load_connection_t *c, int type, int flags, uint32_t stream_id, unsigned char *payload,
+                        size_t length) {
+    h2load_stream_t *stream = stream_id ? find_stream(c, stream_id) : NULL;
+
+    if (type == 0x0) { // DATA
+        c->bytes += length;
+        c->unacknowledged += length;
+        if (c->unacknowledged > H2LOAD_WINDOW / 2) {
+            if (send_window_update(c->fd, 0, c->unacknowledged) == -1) return -1;
+            c->unacknowledged = 0;
+        }
+        if (stream && (flags & 0x1)) finish_stream(c, stream, 0);
+    } else if (type == 0x1) { // HEADERS (the server sends no padding, priority or CONTINUATION)
+        int status = 0;
+        if (hpack_decode(&c->decoder, payload, length, on_response_header, &status) == -1) return -1;
+        if (stream) {
+            stream->status = status;
+            if (flags & 0x1) finish_stream(c, stream, 0);
+        }
+    } else if (type == 0x3) { // RST_STREAM
+        if (stream) finish_stream(c, stream, 1);
+    } else if (type == 0x4 && !(flags & 0x1)) { // SETTINGS
+        unsigned char ack[9];
+        write_frame_header(ack, 0, 0x4, 0x1, 0);
+        if (send_all(c->fd, ack, sizeof(ack)) == -1) return -1;
+    } else if (type == 0x6 && !(flags & 0x1)) { // PING
+        unsigned char pong[17];
+        write_frame_header(pong, 8, 0x6, 0x1, 0);
+        memcpy(pong + 9, payload, 8);
+        if (send_all(c->fd, pong, sizeof(pong)) == -1) return -1;
+    } else if (type == 0x7) { // GOAWAY
+        return -1;
+    }
+    return 0;
+}
+
+static int connection_open(h2load_connection_t *c) {
+    c->fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) return -1;
+    int option = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    if (connect(c->fd, (struct sockaddr *) &target_address, sizeof(target_address)) == -1) return -1;
+
+    unsigned char start[H2_PREFACE_LENGTH + 9 + 12];
+    memcpy(start, H2_PREFACE, H2_PREFACE_LENGTH);
+    unsigned char *settings = start + H2_PREFACE_LENGTH;
+    write_frame_header(settings, 12, 0x4, 0, 0);
+    unsigned char values[12] = {0, 0x2, 0, 0, 0, 0, // ENABLE_PUSH 0
+                                0, 0x4, H2LOAD_WINDOW >> 24, 0, 0, 0}; // INITIAL_WINDOW_SIZE
+    memcpy(settings + 9, values, sizeof(values));
+    if (send_all(c->fd, start, sizeof(start)) == -1) return -1;
+    return send_window_update(c->fd, 0, H2LOAD_WINDOW - 65535);
+}
+
+static void *connection_thread(void *args) {
+    h2load_connection_t *c = args;
+    unsigned char *buffer = malloc(H2LOAD_BUFFER_SIZE);
+    size_t buffered = 0;
+
+    if (connection_open(c) == -1) {
+        c->errors++;
+        running = 0;
+        free(buffer);
+        return NULL;
+    }
+    for (int i = 0; i < streams_per_connection; i++) start_request(c, &c->streams[i]);
+
+    while (c->in_flight > 0) {
+        ssize_t bytes_read = recv(c->fd, buffer + buffered, H2LOAD_BUFFER_SIZE - buffered, 0);
+        if (bytes_read <= 0) break;
+        buffered += bytes_read;
+
+        size_t position = 0;
+        while (buffered - position >= 9) {
+            unsigned char *header = buffer + position;
+            size_t length = (size_t) header[0] << 16 | header[1] << 8 | header[2];
+            if (length > H2_FRAME_SIZE) goto done;
+            if (buffered - position < 9 + length) break;
+            uint32_t stream_id = ((uint32_t) header[5] << 24 | header[6] << 16 | header[7] << 8 | header[8]) &
+                                 0x7fffffff;
+            if (handle_frame(c, header[3], header[4], stream_id, header + 9, length) == -1) goto done;
+            position += 9 + length;
+        }
+        memmove(buffer, buffer + position, buffered - position);
+        buffered -= position;
+    }
+
+done:
+    c->errors += c->in_flight;
+    close(c->fd);
+    free(buffer);
+    return NULL;
+}
+
+static void exit_with_usage(char *program) {
+    fprintf(stderr, "Usage: %s [--host 127.0.0.1] [--port 8000] [--connections 4] [--streams 32] "
+                    "[--duration 10] [--path /index.html]... [--name label]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1", *name = "h2load";
+    int port = 8000, num_connections = 4;
+    double duration = 10;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp("--host", argv[i]) == 0) host = argv[++i];
+        else if (i + 1 < argc && strcmp("--port", argv[i]) == 0) port = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--connections", argv[i]) == 0) num_connections = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--streams", argv[i]) == 0) streams_per_connection = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--duration", argv[i]) == 0) duration = atof(argv[++i]);
+        else if (i + 1 < argc && strcmp("--name", argv[i]) == 0) name = argv[++i];
+        else if (i + 1 < argc && strcmp("--path", argv[i]) == 0 && num_paths < H2LOAD_MAX_PATHS)
+            paths[num_paths++] = argv[++i];
+        else exit_with_usage(argv[0]);
+    }
+    if (num_connections < 1 || streams_per_connection < 1 || streams_per_connection > H2LOAD_MAX_STREAMS ||
+        duration <= 0)
+        exit_with_usage(argv[0]);
+    if (num_paths == 0) paths[num_paths++] = "/index.html";
+
+    struct hostent *entry = gethostbyname2(host, AF_INET);
+    if (entry == NULL) {
+        fprintf(stderr, "Cannot find host: %s\n", host);
+        return ENXIO;
+    }
+    target_address.sin_family = AF_INET;
+    target_address.sin_port = htons(port);
+    memcpy(&target_address.sin_addr, entry->h_addr_list[0], sizeof(target_address.sin_addr));
+    snprintf(authority, sizeof(authority), "%s:%d", host, port);
+
+    signal(SIGPIPE, SIG_IGN);
+    h2load_connection_t *connections = calloc(num_connections, sizeof(h2load_connection_t));
+    uint64_t start_ns = now_ns();
+    for (int i = 0; i < num_connections; i++) {
+        h2load_connection_t *c = &connections[i];
+        c->next_stream_id = 1;
+        c->next_path = i;
+        c->streams = calloc(streams_per_connection, sizeof(h2load_stream_t));
+        hpack_table_init(&c->encoder, HPACK_TABLE_SIZE);
+        hpack_table_init(&c->decoder, HPACK_TABLE_SIZE);
+        hdr_init(&c->histogram, H2LOAD_HIGHEST_US);
+        pthread_create(&c->thread, NULL, connection_thread, c);
+    }
+
+    struct timespec sleep_for = {.tv_sec = (time_t) duration, .tv_nsec = (long) ((duration - (time_t) duration) * 1e9)};
+    nanosleep(&sleep_for, NULL);
+    running = 0;
+
+    hdr_histogram_t total;
+    hdr_init(&total, H2LOAD_HIGHEST_US);
+    long completed = 0, errors = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < num_connections; i++) {
+        pthread_join(connections[i].thread, NULL);
+        hdr_add(&total, &connections[i].histogram);
+        completed += connections[i].completed;
+        errors += connections[i].errors;
+        bytes += connections[i].bytes;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    printf("h2load: %d connections x %d streams, %.1fs, %ld responses, %.1f MiB/s\n", num_connections,
+           streams_per_connection, elapsed, completed, bytes / elapsed / (1 << 20));
+    printf("RESULT %s rps=%.1f p50=%ld p99=%ld p999=%ld errors=%ld\n", name, completed / elapsed,
+           (long) hdr_value_at_percentile(&total, 50), (long) hdr_value_at_percentile(&total, 99),
+           (long) hdr_value_at_percentile(&total, 99.9), errors);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdr_histogram.h"
+
+/* 2048 sub-buckets keep the relative error of every bucket under 0.1%. */
+#define HDR_SUB_BUCKET_COUNT_MAGNITUDE 11
+
+static int hdr_bucket_index(const hdr_histogram_t *h, int64_t value) {
+    int pow2_ceiling = 64 - __builtin_clzll((uint64_t) (value | h->sub_bucket_mask));
+    return pow2_ceiling - (h->sub_bucket_half_count_magnitude + 1);
+}
+
+static int hdr_counts_index(const hdr_histogram_t *h, int64_t value) {
+    int bucket_index = hdr_bucket_index(h, value);
+    int sub_bucket_index = (int) (value >> bucket_index);
+    return ((bucket_index + 1) << h->sub_bucket_half_count_magnitude) + (sub_bucket_index - h->sub_bucket_half_count);
+}
+
+/* Returns the highest value that lands in the same bucket as counts[INDEX]. */
+static int64_t hdr_highest_equivalent(const hdr_histogram_t *h, int index) {
+    int bucket_index = (index >> h->sub_bucket_half_count_magnitude) - 1;
+    int sub_bucket_index = (index & (h->sub_bucket_half_count - 1)) + h->sub_bucket_half_count;
+    if (bucket_index < 0) {
+        sub_bucket_index -= h->sub_bucket_half_count;
+        bucket_index = 0;
+    }
+    int64_t lowest = (int64_t) sub_bucket_index << bucket_index;
+    return lowest + ((int64_t) 1 << bucket_index) - 1;
+}
+
+int hdr_init(hdr_histogram_t *h, int64_t highest) {
+    memset(h, 0, sizeof(*h));
+    h->highest = highest;
+    h->sub_bucket_half_count_magnitude = HDR_SUB_BUCKET_COUNT_MAGNITUDE - 1;
+    h->sub_bucket_half_count = 1 << h->sub_bucket_half_count_magnitude;
+    h->sub_bucket_mask = ((int64_t) 1 << HDR_SUB_BUCKET_COUNT_MAGNITUDE) - 1;
+    h->counts_length = hdr_counts_index(h, highest) + 1;
+    h->counts = calloc(h->counts_length, sizeof(int64_t));
+    return h->counts ? 0 : -1;
+}
+
+void hdr_free(hdr_histogram_t *h) {
+    free(h->counts);
+    h->counts = NULL;
+}
+
+void hdr_reset(hdr_histogram_t *h) {
+    memset(h->counts, 0, h->counts_length * sizeof(int64_t));
+    h->total_count = 0;
+    h->max = 0;
+}
+
+void hdr_record(hdr_histogram_t *h, int64_t value) {
+    if (value < 1) value = 1;
+    if (value > h->highest) value = h->highest;
+    h->counts[hdr_counts_index(h, value)]++;
+    h->total_count++;
+    if (value > h->max) h->max = value;
+}
+
+void hdr_add(hdr_histogram_t *to, const hdr_histogram_t *from) {
+    for (int i = 0; i < from->counts_length && i < to->counts_length; i++) to->counts[i] += from->counts[i];
+    to->total_count += from->total_count;
+    if (from->max > to->max) to->max = from->max;
+}
+
+int64_t hdr_value_at_percentile(const hdr_histogram_t *h, double percentile) {
+    if (h->total_count == 0) return 0;
+
+    int64_t target = (int64_t) (percentile / 100.0 * h->total_count + 0.5);
+    if (target < 1) target = 1;
+
+    int64_t seen = 0;
+    for (int i = 0; i < h->counts_length; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            int64_t value = hdr_highest_equivalent(h, i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
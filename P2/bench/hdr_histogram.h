@@ -0,0 +1,37 @@
+#ifndef __HDR_HISTOGRAM__
+#define __HDR_HISTOGRAM__
+
+#include <stdint.h>
+
+/* A minimal HDR histogram: records integer values (microseconds in our tools)
+ * from 1 to HIGHEST with three significant digits of precision, in constant
+ * time and constant memory. Histograms from several threads can be merged. */
+
+typedef struct hdr_histogram {
+    int64_t highest;
+    int sub_bucket_half_count_magnitude;
+    int sub_bucket_half_count;
+    int64_t sub_bucket_mask;
+    int counts_length;
+    int64_t total_count;
+    int64_t max;
+    int64_t *counts;
+} hdr_histogram_t;
+
+/* Returns 0 on success, -1 if the counts array could not be allocated. */
+int hdr_init(hdr_histogram_t *h, int64_t highest);
+
+void hdr_free(hdr_histogram_t *h);
+
+void hdr_reset(hdr_histogram_t *h);
+
+/* Values below 1 are recorded as 1 and values above HIGHEST as HIGHEST. */
+void hdr_record(hdr_histogram_t *h, int64_t value);
+
+/* Adds every count in FROM to TO. Both must share the same HIGHEST. */
+void hdr_add(hdr_histogram_t *to, const hdr_histogram_t *from);
+
+/* Returns the value at PERCENTILE (0-100), or 0 for an empty histogram. */
+int64_t hdr_value_at_percentile(const hdr_histogram_t *h, double percentile);
+
+#endif
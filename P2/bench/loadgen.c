@@ -0,0 +1,485 @@
+/*
+ * An epoll-based HTTP load generator for httpserver.
+ *
+ * Each thread owns an epoll instance and a share of the connections.
+ *
+ *   closed loop (default): every connection sends a request, waits for the
+ *       response and immediately sends the next one.
+ *   open loop (--rate R):  requests are scheduled at a fixed total rate R
+ *       regardless of how fast responses come back. Latency is measured from
+ *       the scheduled start, so a stalled server is not hidden by the client
+ *       backing off (no coordinated omission).
+ *
+ * With --keep-alive, requests ask for persistent connections and a connection
+ * is reused whenever the server keeps it open; otherwise every request opens
+ * a new connection. Paths are chosen at random according to their weights,
+ * which is how scenarios mix small and large files.
+ *
+ * Usage: ./bench/loadgen [--host 127.0.0.1] [--port 8000] [--unix path.sock] [--threads 2]
+ *                        [--connections 32] [--duration 10] [--rate 0]
+ *                        [--keep-alive] [--path /index.html[:weight]]...
+ *                        [--name label] [--min-rps N] [--max-p99-us N]
+ *
+ * The last line of output is a machine-readable summary:
+ *     RESULT <name> rps=<n> p50=<us> p99=<us> p999=<us> errors=<n>
+ * --min-rps and --max-p99-us turn it into a regression gate: loadgen exits
+ * with status 1 when the run is slower than the given bounds.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hdr_histogram.h"
+#include "util.h"
+
+#define LOADGEN_MAX_PATHS 64
+#define LOADGEN_HEADER_MAX_SIZE 4096
+#define LOADGEN_READ_BUFFER_SIZE 65536
+#define LOADGEN_PENDING_MAX 65536
+#define LOADGEN_HIGHEST_US 3600000000LL
+
+enum conn_state {
+    CONN_CLOSED,
+    CONN_IDLE,
+    CONN_CONNECTING,
+    CONN_WRITING,
+    CONN_READING
+};
+
+typedef struct path_entry {
+    char *request;
+    size_t request_length;
+    unsigned int weight;
+} path_entry_t;
+
+typedef struct conn {
+    int fd;
+    enum conn_state state;
+    path_entry_t *path;
+    size_t written;
+    uint64_t start_ns;
+    char header[LOADGEN_HEADER_MAX_SIZE + 1];
+    size_t header_length;
+    int header_done;
+    int status;
+    long content_length; // -1 when the response is delimited by close.
+    long body_read;
+    int keep_alive;
+} conn_t;
+
+typedef struct loadgen_thread {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    conn_t *conns;
+    int num_conns;
+    uint64_t rng;
+    hdr_histogram_t histogram;
+    long completed;
+    long errors;
+
+    /* Open loop: scheduled start times waiting for a free connection. */
+    uint64_t *pending;
+    int pending_head;
+    int pending_count;
+} loadgen_thread_t;
+
+static struct sockaddr_storage target_address;
+static socklen_t target_address_length;
+static char *target_unix_path; // Connect here instead of host and port; the host still goes in Host.
+static char *target_host = "127.0.0.1";
+static int target_port = 8000;
+static int num_threads = 2;
+static int num_connections = 32;
+static int duration_seconds = 10;
+static double rate;
+static int keep_alive;
+static path_entry_t paths[LOADGEN_MAX_PATHS];
+static int num_paths;
+static unsigned int total_weight;
+static uint64_t start_ns, deadline_ns;
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static path_entry_t *pick_path(loadgen_thread_t *t) {
+    unsigned int ticket = xorshift64(&t->rng) % total_weight;
+    for (int i = 0; i < num_paths; i++) {
+        if (ticket < paths[i].weight) return &paths[i];
+        ticket -= paths[i].weight;
+    }
+    return &paths[num_paths - 1];
+}
+
+static void add_path(char *spec) {
+    if (num_paths == LOADGEN_MAX_PATHS) {
+        fprintf(stderr, "At most %d paths are supported\n", LOADGEN_MAX_PATHS);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned int weight = 1;
+    char *colon = strrchr(spec, ':');
+    if (colon && colon != spec) {
+        *colon = '\0';
+        weight = (unsigned int) atoi(colon + 1);
+        if (weight == 0) weight = 1;
+    }
+
+    path_entry_t *path = &paths[num_paths++];
+    path->weight = weight;
+    total_weight += weight;
+    path->request_length = (size_t) asprintf(&path->request, "GET %s HTTP/1.%d\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                                             spec, keep_alive, target_host, keep_alive ? "keep-alive" : "close");
+}
+
+static void conn_close(loadgen_thread_t *t, conn_t *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = CONN_CLOSED;
+}
+
+static void conn_watch(loadgen_thread_t *t, conn_t *c, uint32_t events, int op) {
+    struct epoll_event event = {.events = events, .data.ptr = c};
+    epoll_ctl(t->epoll_fd, op, c->fd, &event);
+}
+
+static void conn_fail(loadgen_thread_t *t, conn_t *c) {
+    t->errors++;
+    conn_close(t, c);
+}
+
+/* Starts a request on C. START is when the request was meant to begin. */
+static void conn_start(loadgen_thread_t *t, conn_t *c, uint64_t start) {
+    c->path = pick_path(t);
+    c->start_ns = start;
+    c->written = 0;
+    c->header_length = 0;
+    c->header_done = 0;
+    c->status = 0;
+    c->content_length = -1;
+    c->body_read = 0;
+    c->keep_alive = 0;
+
+    if (c->state == CONN_IDLE) {
+        c->state = CONN_WRITING;
+        conn_watch(t, c, EPOLLOUT, EPOLL_CTL_MOD);
+        return;
+    }
+
+    c->fd = socket(target_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        t->errors++;
+        return;
+    }
+    int option = 1;
+    if (target_address.ss_family == AF_INET) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    if (connect(c->fd, (struct sockaddr *) &target_address, target_address_length) == -1 && errno != EINPROGRESS) {
+        conn_fail(t, c);
+        return;
+    }
+    c->state = CONN_CONNECTING;
+    conn_watch(t, c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+/* Parses the status line and the headers we care about. */
+static void conn_parse_header(conn_t *c) {
+    int minor_version = 0;
+    sscanf(c->header, "HTTP/1.%d %d", &minor_version, &c->status);
+    c->keep_alive = minor_version >= 1;
+
+    char *line = strstr(c->header, "\r\n");
+    while (line && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) c->content_length = atol(line + 15);
+        else if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *value = line + 11;
+            while (*value == ' ') value++;
+            if (strncasecmp(value, "close", 5) == 0) c->keep_alive = 0;
+            else if (strncasecmp(value, "keep-alive", 10) == 0) c->keep_alive = 1;
+        }
+        line = strstr(line, "\r\n");
+    }
+    if (c->content_length < 0) c->keep_alive = 0;
+}
+
+static void conn_complete(loadgen_thread_t *t, conn_t *c) {
+    if (c->status >= 200 && c->status < 400) {
+        t->completed++;
+        hdr_record(&t->histogram, (int64_t) ((now_ns() - c->start_ns) / 1000));
+    } else {
+        t->errors++;
+    }
+
+    if (keep_alive && c->keep_alive) {
+        c->state = CONN_IDLE;
+        conn_watch(t, c, 0, EPOLL_CTL_MOD);
+    } else {
+        conn_close(t, c);
+    }
+}
+
+static void conn_read(loadgen_thread_t *t, conn_t *c, char *buffer) {
+    while (1) {
+        ssize_t bytes_read = read(c->fd, buffer, LOADGEN_READ_BUFFER_SIZE);
+        if (bytes_read < 0) {
+            if (errno != EAGAIN) conn_fail(t, c);
+            return;
+        }
+        if (bytes_read == 0) {
+            /* Without Content-Length the body ends when the server closes. */
+            c->keep_alive = 0;
+            if (c->header_done && c->content_length < 0) conn_complete(t, c);
+            else conn_fail(t, c);
+            return;
+        }
+
+        size_t body_length = bytes_read;
+        if (!c->header_done) {
+            size_t copy = bytes_read;
+            if (copy > LOADGEN_HEADER_MAX_SIZE - c->header_length) copy = LOADGEN_HEADER_MAX_SIZE - c->header_length;
+            memcpy(c->header + c->header_length, buffer, copy);
+            c->header_length += copy;
+            c->header[c->header_length] = '\0';
+
+            char *end = strstr(c->header, "\r\n\r\n");
+            if (!end) {
+                if (c->header_length == LOADGEN_HEADER_MAX_SIZE) conn_fail(t, c);
+                continue;
+            }
+            c->header_done = 1;
+            conn_parse_header(c);
+
+            body_length = bytes_read - ((end + 4 - c->header) - (c->header_length - copy));
+        }
+
+        c->body_read += body_length;
+        if (c->content_length >= 0 && c->body_read >= c->content_length) {
+            conn_complete(t, c);
+            return;
+        }
+    }
+}
+
+static void conn_write(loadgen_thread_t *t, conn_t *c) {
+    if (c->state == CONN_CONNECTING) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error) {
+            conn_fail(t, c);
+            return;
+        }
+        c->state = CONN_WRITING;
+    }
+
+    while (c->written < c->path->request_length) {
+        ssize_t bytes_sent = write(c->fd, c->path->request + c->written, c->path->request_length - c->written);
+        if (bytes_sent < 0) {
+            if (errno != EAGAIN) conn_fail(t, c);
+            return;
+        }
+        c->written += bytes_sent;
+    }
+    c->state = CONN_READING;
+    conn_watch(t, c, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+/* Open loop: queues every start time that has come due. */
+static void schedule_due(loadgen_thread_t *t, uint64_t *next_ns, uint64_t interval_ns, uint64_t now) {
+    while (*next_ns <= now && *next_ns < deadline_ns) {
+        if (t->pending_count < LOADGEN_PENDING_MAX) {
+            t->pending[(t->pending_head + t->pending_count) % LOADGEN_PENDING_MAX] = *next_ns;
+            t->pending_count++;
+        } else {
+            t->errors++; // Hopelessly behind: count the request as failed.
+        }
+        *next_ns += interval_ns;
+    }
+}
+
+/* Open loop: hands queued start times to connections that are free. */
+static void dispatch_pending(loadgen_thread_t *t) {
+    for (int i = 0; i < t->num_conns && t->pending_count > 0; i++) {
+        conn_t *c = &t->conns[i];
+        if (c->state != CONN_CLOSED && c->state != CONN_IDLE) continue;
+        uint64_t start = t->pending[t->pending_head];
+        t->pending_head = (t->pending_head + 1) % LOADGEN_PENDING_MAX;
+        t->pending_count--;
+        conn_start(t, c, start);
+    }
+}
+
+static void *loadgen_thread(void *args) {
+    loadgen_thread_t *t = args;
+    char *buffer = malloc(LOADGEN_READ_BUFFER_SIZE);
+    struct epoll_event events[256];
+    uint64_t interval_ns = 0, next_ns = start_ns;
+
+    if (rate > 0) {
+        interval_ns = (uint64_t) (1e9 * num_threads / rate);
+        next_ns = start_ns + t->id * interval_ns / num_threads;
+    }
+
+    uint64_t now;
+    while ((now = now_ns()) < deadline_ns) {
+        int timeout_ms = 10;
+        if (rate > 0) {
+            schedule_due(t, &next_ns, interval_ns, now);
+            dispatch_pending(t);
+            timeout_ms = next_ns > now ? (int) ((next_ns - now + 999999) / 1000000) : 0;
+        }
+
+        int num_events = epoll_wait(t->epoll_fd, events, 256, timeout_ms);
+        for (int i = 0; i < num_events; i++) {
+            conn_t *c = events[i].data.ptr;
+            if (c->state == CONN_CONNECTING || c->state == CONN_WRITING) conn_write(t, c);
+            else if (c->state == CONN_READING) conn_read(t, c, buffer);
+        }
+
+        /* Closed loop: every free connection goes straight to its next request. */
+        if (rate == 0)
+            for (int i = 0; i < t->num_conns; i++)
+                if (t->conns[i].state == CONN_CLOSED || t->conns[i].state == CONN_IDLE)
+                    conn_start(t, &t->conns[i], now_ns());
+    }
+
+    for (int i = 0; i < t->num_conns; i++) conn_close(t, &t->conns[i]);
+    free(buffer);
+    return NULL;
+}
+
+static void resolve_target(void) {
+    memset(&target_address, 0, sizeof(target_address));
+    if (target_unix_path != NULL) {
+        struct sockaddr_un *address = (struct sockaddr_un *) &target_address;
+        if (strlen(target_unix_path) >= sizeof(address->sun_path)) {
+            fprintf(stderr, "Unix socket path too long: %s\n", target_unix_path);
+            exit(ENAMETOOLONG);
+        }
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, target_unix_path);
+        target_address_length = sizeof(struct sockaddr_un);
+        return;
+    }
+
+    struct hostent *entry = gethostbyname2(target_host, AF_INET);
+    if (entry == NULL) {
+        fprintf(stderr, "Cannot find host: %s\n", target_host);
+        exit(ENXIO);
+    }
+    struct sockaddr_in *address = (struct sockaddr_in *) &target_address;
+    address->sin_family = AF_INET;
+    address->sin_port = htons(target_port);
+    memcpy(&address->sin_addr, entry->h_addr_list[0], sizeof(address->sin_addr));
+    target_address_length = sizeof(struct sockaddr_in);
+}
+
+static void exit_with_usage(char *program) {
+    fprintf(stderr,
+            "Usage: %s [--host 127.0.0.1] [--port 8000] [--unix path.sock] [--threads 2] [--connections 32]\n"
+            "          [--duration 10] [--rate 0] [--keep-alive] [--path /index.html[:weight]]...\n"
+            "          [--name label] [--min-rps N] [--max-p99-us N]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    char *name = "loadgen";
+    double min_rps = 0;
+    long max_p99_us = 0;
+    char *path_specs[LOADGEN_MAX_PATHS];
+    int num_path_specs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp("--host", argv[i]) == 0) target_host = argv[++i];
+        else if (i + 1 < argc && strcmp("--port", argv[i]) == 0) target_port = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--unix", argv[i]) == 0) target_unix_path = argv[++i];
+        else if (i + 1 < argc && strcmp("--threads", argv[i]) == 0) num_threads = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--connections", argv[i]) == 0) num_connections = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--duration", argv[i]) == 0) duration_seconds = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--rate", argv[i]) == 0) rate = atof(argv[++i]);
+        else if (strcmp("--keep-alive", argv[i]) == 0) keep_alive = 1;
+        else if (i + 1 < argc && strcmp("--path", argv[i]) == 0 && num_path_specs < LOADGEN_MAX_PATHS)
+            path_specs[num_path_specs++] = argv[++i];
+        else if (i + 1 < argc && strcmp("--name", argv[i]) == 0) name = argv[++i];
+        else if (i + 1 < argc && strcmp("--min-rps", argv[i]) == 0) min_rps = atof(argv[++i]);
+        else if (i + 1 < argc && strcmp("--max-p99-us", argv[i]) == 0) max_p99_us = atol(argv[++i]);
+        else exit_with_usage(argv[0]);
+    }
+    if (num_threads < 1 || num_connections < num_threads || duration_seconds < 1) exit_with_usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+    resolve_target();
+    if (num_path_specs == 0) path_specs[num_path_specs++] = "/";
+    for (int i = 0; i < num_path_specs; i++) add_path(path_specs[i]);
+
+    loadgen_thread_t *threads = calloc(num_threads, sizeof(loadgen_thread_t));
+    start_ns = now_ns();
+    deadline_ns = start_ns + (uint64_t) duration_seconds * 1000000000ull;
+
+    for (int i = 0; i < num_threads; i++) {
+        loadgen_thread_t *t = &threads[i];
+        t->id = i;
+        t->epoll_fd = epoll_create1(0);
+        t->num_conns = num_connections / num_threads + (i < num_connections % num_threads);
+        t->conns = calloc(t->num_conns, sizeof(conn_t));
+        for (int j = 0; j < t->num_conns; j++) t->conns[j].fd = -1;
+        t->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        t->pending = calloc(LOADGEN_PENDING_MAX, sizeof(uint64_t));
+        if (hdr_init(&t->histogram, LOADGEN_HIGHEST_US) != 0) {
+            perror("Failed to allocate histogram");
+            return EXIT_FAILURE;
+        }
+        pthread_create(&t->thread, NULL, loadgen_thread, t);
+    }
+
+    hdr_histogram_t total;
+    hdr_init(&total, LOADGEN_HIGHEST_US);
+    long completed = 0, errors = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        hdr_add(&total, &threads[i].histogram);
+        completed += threads[i].completed;
+        errors += threads[i].errors + threads[i].pending_count;
+    }
+
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    double rps = completed / elapsed;
+    int64_t p50 = hdr_value_at_percentile(&total, 50), p99 = hdr_value_at_percentile(&total, 99);
+    int64_t p999 = hdr_value_at_percentile(&total, 99.9);
+
+    printf("%s: %s loop, %d threads, %d connections, %ds, keep-alive %s\n", name, rate > 0 ? "open" : "closed",
+           num_threads, num_connections, duration_seconds, keep_alive ? "on" : "off");
+    printf("  requests %ld  errors %ld  rps %.1f\n", completed, errors, rps);
+    printf("  latency us: p50 %ld  p99 %ld  p999 %ld  max %ld\n", (long) p50, (long) p99, (long) p999,
+           (long) total.max);
+    printf("RESULT %s rps=%.1f p50=%ld p99=%ld p999=%ld errors=%ld\n", name, rps, (long) p50, (long) p99,
+           (long) p999, errors);
+
+    int regressed = (min_rps > 0 && rps < min_rps) || (max_p99_us > 0 && p99 > max_p99_us);
+    if (regressed) fprintf(stderr, "%s: below the configured --min-rps/--max-p99-us bounds\n", name);
+    return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,243 @@
+/*
+ * Replays a trace recorded with `httpserver --capture` against a server.
+ *
+ * Requests are sent in arrival order on fresh connections, exactly as
+ * captured. At --speed 1 (the default) each request starts at its original
+ * offset from the start of the trace, so the original concurrency falls out
+ * of the original timing; --speed N compresses the timeline N times. At
+ * --speed max the timeline is ignored and requests go out back to back with
+ * as many in flight as the trace's peak concurrency.
+ *
+ * Usage: ./bench/replay --trace trace.bin [--host 127.0.0.1] [--port 8000]
+ *                       [--speed 1|N|max] [--threads N]
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "hdr_histogram.h"
+#include "util.h"
+
+#define REPLAY_MAX_THREADS 1024
+#define REPLAY_READ_BUFFER_SIZE 65536
+#define REPLAY_HIGHEST_US 3600000000LL
+
+typedef struct replay_thread {
+    pthread_t thread;
+    hdr_histogram_t histogram;
+    long completed;
+    long errors;
+    long size_mismatches;
+} replay_thread_t;
+
+static capture_record_t *records;
+static long num_records;
+static long next_record;
+static double speed = 1.0; // 0 means as fast as possible.
+static uint64_t start_ns;
+static struct sockaddr_in target_address;
+
+static void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts = {.tv_sec = deadline_ns / 1000000000ull, .tv_nsec = deadline_ns % 1000000000ull};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int compare_arrival(const void *a, const void *b) {
+    uint64_t x = ((const capture_record_t *) a)->arrival_ns, y = ((const capture_record_t *) b)->arrival_ns;
+    return (x > y) - (x < y);
+}
+
+/* Returns the largest number of requests that were in flight at once. */
+static int peak_concurrency(void) {
+    uint64_t *ends = malloc(num_records * sizeof(uint64_t));
+    int peak = 0, in_flight = 0;
+
+    /* Records are sorted by arrival; ENDS is a min-heap of completion times. */
+    for (long i = 0; i < num_records; i++) {
+        uint64_t arrival = records[i].arrival_ns;
+        while (in_flight > 0 && ends[0] <= arrival) {
+            ends[0] = ends[--in_flight];
+            for (int j = 0;;) {
+                int smallest = j, left = 2 * j + 1, right = left + 1;
+                if (left < in_flight && ends[left] < ends[smallest]) smallest = left;
+                if (right < in_flight && ends[right] < ends[smallest]) smallest = right;
+                if (smallest == j) break;
+                uint64_t swap = ends[j];
+                ends[j] = ends[smallest];
+                ends[smallest] = swap;
+                j = smallest;
+            }
+        }
+        int j = in_flight++;
+        ends[j] = arrival + records[i].duration_ns;
+        while (j > 0 && ends[(j - 1) / 2] > ends[j]) {
+            uint64_t swap = ends[j];
+            ends[j] = ends[(j - 1) / 2];
+            ends[(j - 1) / 2] = swap;
+            j = (j - 1) / 2;
+        }
+        if (in_flight > peak) peak = in_flight;
+    }
+    free(ends);
+    return peak;
+}
+
+/* Sends RECORD and reads the whole response. Returns the number of response
+ * bytes, or -1 on error. */
+static long replay_one(capture_record_t *record, char *buffer) {
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int option = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    if (connect(fd, (struct sockaddr *) &target_address, sizeof(target_address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    size_t sent = 0;
+    while (sent < record->head_length) {
+        ssize_t bytes_sent = write(fd, record->head + sent, record->head_length - sent);
+        if (bytes_sent <= 0) {
+            close(fd);
+            return -1;
+        }
+        sent += bytes_sent;
+    }
+
+    /* Captured responses end when the server closes the connection. */
+    long received = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, REPLAY_READ_BUFFER_SIZE)) > 0) received += bytes_read;
+    close(fd);
+    return bytes_read < 0 ? -1 : received;
+}
+
+static void *replay_thread(void *args) {
+    replay_thread_t *t = args;
+    char *buffer = malloc(REPLAY_READ_BUFFER_SIZE);
+    long index;
+
+    while ((index = __atomic_fetch_add(&next_record, 1, __ATOMIC_RELAXED)) < num_records) {
+        capture_record_t *record = &records[index];
+        uint64_t scheduled_ns = now_ns();
+        if (speed > 0) {
+            scheduled_ns = start_ns + (uint64_t) (record->arrival_ns / speed);
+            sleep_until(scheduled_ns);
+        }
+
+        long received = replay_one(record, buffer);
+        if (received < 0) {
+            t->errors++;
+            continue;
+        }
+        t->completed++;
+        if ((uint64_t) received != record->response_bytes) t->size_mismatches++;
+        hdr_record(&t->histogram, (int64_t) ((now_ns() - scheduled_ns) / 1000));
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void exit_with_usage(char *program) {
+    fprintf(stderr, "Usage: %s --trace trace.bin [--host 127.0.0.1] [--port 8000] [--speed 1|N|max] "
+                    "[--threads N]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    char *trace_path = NULL, *host = "127.0.0.1";
+    int port = 8000, num_threads = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp("--trace", argv[i]) == 0) trace_path = argv[++i];
+        else if (i + 1 < argc && strcmp("--host", argv[i]) == 0) host = argv[++i];
+        else if (i + 1 < argc && strcmp("--port", argv[i]) == 0) port = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--threads", argv[i]) == 0) num_threads = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp("--speed", argv[i]) == 0) {
+            char *value = argv[++i];
+            speed = strcasecmp(value, "max") == 0 ? 0 : atof(value);
+            if (speed < 0) exit_with_usage(argv[0]);
+        } else exit_with_usage(argv[0]);
+    }
+    if (trace_path == NULL) exit_with_usage(argv[0]);
+
+    FILE *trace = fopen(trace_path, "rb");
+    if (trace == NULL || capture_read_header(trace) == -1) {
+        fprintf(stderr, "%s is not a capture trace\n", trace_path);
+        return EXIT_FAILURE;
+    }
+    long capacity = 1024;
+    records = malloc(capacity * sizeof(capture_record_t));
+    int status;
+    while ((status = capture_read(trace, &records[num_records])) == 1)
+        if (++num_records == capacity) records = realloc(records, (capacity *= 2) * sizeof(capture_record_t));
+    fclose(trace);
+    if (status == -1) fprintf(stderr, "Trace is truncated after %ld records\n", num_records);
+    if (num_records == 0) {
+        fprintf(stderr, "Trace is empty\n");
+        return EXIT_FAILURE;
+    }
+    qsort(records, num_records, sizeof(capture_record_t), compare_arrival);
+
+    struct hostent *entry = gethostbyname2(host, AF_INET);
+    if (entry == NULL) {
+        fprintf(stderr, "Cannot find host: %s\n", host);
+        return ENXIO;
+    }
+    target_address.sin_family = AF_INET;
+    target_address.sin_port = htons(port);
+    memcpy(&target_address.sin_addr, entry->h_addr_list[0], sizeof(target_address.sin_addr));
+
+    /* A timed replay needs enough threads that nobody starts late because all
+     * threads are busy; a max-speed replay runs at the original peak. */
+    int peak = peak_concurrency();
+    if (num_threads <= 0) num_threads = speed > 0 ? peak * 2 : peak;
+    if (num_threads > REPLAY_MAX_THREADS) num_threads = REPLAY_MAX_THREADS;
+    if (num_threads < 1) num_threads = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    replay_thread_t *threads = calloc(num_threads, sizeof(replay_thread_t));
+    start_ns = now_ns();
+    for (int i = 0; i < num_threads; i++) {
+        hdr_init(&threads[i].histogram, REPLAY_HIGHEST_US);
+        pthread_create(&threads[i].thread, NULL, replay_thread, &threads[i]);
+    }
+
+    hdr_histogram_t total;
+    hdr_init(&total, REPLAY_HIGHEST_US);
+    long completed = 0, errors = 0, size_mismatches = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        hdr_add(&total, &threads[i].histogram);
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+        size_mismatches += threads[i].size_mismatches;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    double original = records[num_records - 1].arrival_ns / 1e9;
+
+    char speed_label[32];
+    if (speed > 0) snprintf(speed_label, sizeof(speed_label), "%gx", speed);
+    else strcpy(speed_label, "max");
+    printf("replay: %ld requests, original span %.2fs, peak concurrency %d, speed %s, %d threads\n",
+           num_records, original, peak, speed_label, num_threads);
+    printf("  completed %ld  errors %ld  size mismatches %ld  elapsed %.2fs  rps %.1f\n",
+           completed, errors, size_mismatches, elapsed, completed / elapsed);
+    printf("  latency us: p50 %ld  p99 %ld  p999 %ld  max %ld\n", (long) hdr_value_at_percentile(&total, 50),
+           (long) hdr_value_at_percentile(&total, 99), (long) hdr_value_at_percentile(&total, 99.9),
+           (long) total.max);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# Runs the httpserver benchmark scenarios on the local machine.
+#
+#   files: a mix of 1 KiB, 16 KiB, 256 KiB and 4 MiB files served by --files,
+#          closed loop with and without keep-alive, then open loop at RATE.
+#   proxy: --proxy in front of bench/stub_upstream answering with 4 KiB bodies,
+#          then with --proxy-cache in front of a cacheable upstream that takes
+#          UPSTREAM_DELAY_MS per response; prints the cache's stats.
+#   uds:   the sidecar setup, --proxy in front of a stub on the same host, over
+#          loopback TCP and then over Unix domain sockets on both sides, with
+#          4 KiB and 256 KiB bodies.
+#   coro:  MANY_CONNECTIONS at once through --proxy to a stub that takes
+#          UPSTREAM_DELAY_MS per response, on worker threads and then on
+#          --coroutines, and the files mix over as many connections.
+#   h2:    a page's worth of small assets (48 x 4 KiB plus index.html) over
+#          HTTP/1.0 with loadgen, then over h2c with bench/h2load using
+#          H2_CONNECTIONS connections of H2_STREAMS concurrent streams.
+#
+# Usage (from P2/): ./bench/scenarios.sh [files|proxy|uds|coro|h2|all]
+#
+# Tunables (environment): DURATION (s), THREADS, CONNECTIONS, RATE (req/s),
+# SERVER_THREADS, PORT, UPSTREAM_DELAY_MS, MANY_CONNECTIONS, H2_CONNECTIONS,
+# H2_STREAMS, and MIN_RPS / MAX_P99_US to fail the run on a regression. Each
+# scenario prints a "RESULT <name> ..." line that can be diffed between
+# builds. Servers are started and stopped with test/lib.sh, as in the tests.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all bench
+
+SCENARIO=${1:-all}
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+CONNECTIONS=${CONNECTIONS:-32}
+RATE=${RATE:-1000}
+SERVER_THREADS=${SERVER_THREADS:-8}
+PORT=${PORT:-18000}
+UPSTREAM_PORT=$((PORT + 1))
+GATES="${MIN_RPS:+--min-rps $MIN_RPS} ${MAX_P99_US:+--max-p99-us $MAX_P99_US}"
+. ./test/lib.sh
+
+loadgen() {
+    ./bench/loadgen --port "$PORT" --threads "$THREADS" --connections "$CONNECTIONS" \
+        --duration "$DURATION" $GATES "$@"
+}
+
+files_scenario() {
+    mkdir -p "$WORKDIR/www"
+    head -c 1024 /dev/urandom >"$WORKDIR/www/1k.bin"
+    head -c 16384 /dev/urandom >"$WORKDIR/www/16k.bin"
+    head -c 262144 /dev/urandom >"$WORKDIR/www/256k.bin"
+    head -c 4194304 /dev/urandom >"$WORKDIR/www/4m.bin"
+    cp files/index.html "$WORKDIR/www/"
+
+    start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads "$SERVER_THREADS"
+    MIX="--path /1k.bin:60 --path /16k.bin:30 --path /256k.bin:9 --path /4m.bin:1"
+    loadgen --name files-index --path /index.html
+    loadgen --name files-mix $MIX
+    loadgen --name files-mix-keepalive --keep-alive $MIX
+    loadgen --name files-mix-open --rate "$RATE" $MIX
+    stop_all
+}
+
+proxy_scenario() {
+    start ./bench/stub_upstream --port "$UPSTREAM_PORT" --size 4096
+    start ./httpserver --proxy "127.0.0.1:$UPSTREAM_PORT" --port "$PORT" --num-threads "$SERVER_THREADS"
+    loadgen --name proxy --path /
+    loadgen --name proxy-open --rate "$RATE" --path /
+    stop_all
+
+    PATHS=""
+    for i in $(seq 1 32); do PATHS="$PATHS --path /object/$i"; done
+    start ./bench/stub_upstream --port "$UPSTREAM_PORT" --size 4096 --delay-ms "${UPSTREAM_DELAY_MS:-5}" \
+        --cache-control "max-age=60"
+    start ./httpserver --proxy "127.0.0.1:$UPSTREAM_PORT" --port "$PORT" --num-threads "$SERVER_THREADS"
+    loadgen --name proxy-uncached $PATHS
+    stop_all
+    start ./bench/stub_upstream --port "$UPSTREAM_PORT" --size 4096 --delay-ms "${UPSTREAM_DELAY_MS:-5}" \
+        --cache-control "max-age=60"
+    start ./httpserver --proxy "127.0.0.1:$UPSTREAM_PORT" --port "$PORT" --num-threads "$SERVER_THREADS" \
+        --proxy-cache 64
+    loadgen --name proxy-cached $PATHS
+    echo "STATS proxy-cache $(curl -s "http://127.0.0.1:$PORT/__proxy_cache")"
+    stop_all
+}
+
+uds_scenario() {
+    for size in 4096 262144; do
+        label=$((size / 1024))k
+        start ./bench/stub_upstream --port "$UPSTREAM_PORT" --size "$size"
+        start ./httpserver --proxy "127.0.0.1:$UPSTREAM_PORT" --port "$PORT" --num-threads "$SERVER_THREADS"
+        loadgen --name "sidecar-tcp-$label" --path /
+        stop_all
+        start ./bench/stub_upstream --unix "$WORKDIR/upstream.sock" --size "$size"
+        start ./httpserver --proxy "unix:$WORKDIR/upstream.sock" --port "$WORKDIR/httpserver.sock" \
+            --num-threads "$SERVER_THREADS"
+        loadgen --name "sidecar-uds-$label" --unix "$WORKDIR/httpserver.sock" --path /
+        stop_all
+    done
+}
+
+coro_scenario() {
+    MANY="--connections ${MANY_CONNECTIONS:-2000}"
+    for mode in threads coroutines; do
+        FLAGS=""
+        [ "$mode" = coroutines ] && FLAGS=--coroutines
+        start ./bench/stub_upstream --port "$UPSTREAM_PORT" --size 4096 --delay-ms "${UPSTREAM_DELAY_MS:-5}"
+        start ./httpserver --proxy "127.0.0.1:$UPSTREAM_PORT" --port "$PORT" --num-threads "$SERVER_THREADS" $FLAGS
+        loadgen --name "many-proxy-$mode" $MANY --path /
+        stop_all
+    done
+
+    mkdir -p "$WORKDIR/www"
+    head -c 1024 /dev/urandom >"$WORKDIR/www/1k.bin"
+    head -c 262144 /dev/urandom >"$WORKDIR/www/256k.bin"
+    start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads "$SERVER_THREADS" --coroutines
+    loadgen --name many-files-coroutines $MANY --path /1k.bin:9 --path /256k.bin:1
+    stop_all
+}
+
+h2_scenario() {
+    mkdir -p "$WORKDIR/www/assets"
+    ASSETS=""
+    for i in $(seq 1 48); do
+        head -c 4096 /dev/urandom >"$WORKDIR/www/assets/$i.bin"
+        ASSETS="$ASSETS --path /assets/$i.bin"
+    done
+    cp files/index.html "$WORKDIR/www/"
+
+    # Every h2 connection holds a worker, so leave room for all of them.
+    start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads "$SERVER_THREADS" --http2
+    loadgen --name h1-assets --path /index.html $ASSETS
+    ./bench/h2load --port "$PORT" --connections "${H2_CONNECTIONS:-4}" --streams "${H2_STREAMS:-32}" \
+        --duration "$DURATION" --name h2-assets --path /index.html $ASSETS
+    stop_all
+}
+
+case "$SCENARIO" in
+    files) files_scenario ;;
+    proxy) proxy_scenario ;;
+    uds) uds_scenario ;;
+    coro) coro_scenario ;;
+    h2) h2_scenario ;;
+    all) files_scenario; proxy_scenario; uds_scenario; coro_scenario; h2_scenario ;;
+    *) echo "Usage: $0 [files|proxy|uds|coro|h2|all]" >&2; exit 1 ;;
+esac
@@ -0,0 +1,135 @@
+/*
+ * A stub HTTP upstream for proxy benchmarks. Every request, whatever its
+ * path, gets a 200 response with a fixed-size body, optionally after a delay.
+ * One thread per connection keeps it simple and out of the way of the server
+ * being measured.
+ *
+ * --log appends each request's first line to a file, for tests to count
+ * what reached the upstream.
+ *
+ * Usage: ./bench/stub_upstream --port 9000 | --unix path.sock [--size 4096] [--delay-ms 0]
+ *                               [--cache-control "max-age=60"] [--header "X-Stub: a"]
+ *                               [--status 200] [--log FILE]
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define STUB_REQUEST_MAX_SIZE 8192
+
+static char *response;
+static size_t response_length;
+static int delay_ms;
+static FILE *request_log;
+
+static void *stub_connection(void *args) {
+    int fd = (int) (long) args;
+    char request[STUB_REQUEST_MAX_SIZE + 1];
+    size_t request_length = 0;
+    ssize_t bytes_read;
+
+    /* Read until the end of the request headers. */
+    while (request_length < STUB_REQUEST_MAX_SIZE &&
+           (bytes_read = read(fd, request + request_length, STUB_REQUEST_MAX_SIZE - request_length)) > 0) {
+        request_length += bytes_read;
+        request[request_length] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+
+    if (request_length > 0) {
+        if (request_log) fprintf(request_log, "%.*s\n", (int) strcspn(request, "\r\n"), request);
+        if (delay_ms > 0) usleep(delay_ms * 1000);
+        size_t sent = 0;
+        ssize_t bytes_sent;
+        while (sent < response_length && (bytes_sent = write(fd, response + sent, response_length - sent)) > 0)
+            sent += bytes_sent;
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int port = 9000;
+    char *unix_path = NULL;
+    size_t body_size = 4096;
+    char *cache_control = NULL;
+    char *extra_header = NULL;
+    int status_code = 200;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--port", argv[i]) == 0 && i + 1 < argc) port = atoi(argv[++i]);
+        else if (strcmp("--unix", argv[i]) == 0 && i + 1 < argc) unix_path = argv[++i];
+        else if (strcmp("--size", argv[i]) == 0 && i + 1 < argc) body_size = strtoul(argv[++i], NULL, 10);
+        else if (strcmp("--delay-ms", argv[i]) == 0 && i + 1 < argc) delay_ms = atoi(argv[++i]);
+        else if (strcmp("--cache-control", argv[i]) == 0 && i + 1 < argc) cache_control = argv[++i];
+        else if (strcmp("--header", argv[i]) == 0 && i + 1 < argc) extra_header = argv[++i];
+        else if (strcmp("--status", argv[i]) == 0 && i + 1 < argc) status_code = atoi(argv[++i]);
+        else if (strcmp("--log", argv[i]) == 0 && i + 1 < argc) {
+            if ((request_log = fopen(argv[++i], "a")) == NULL) {
+                perror("Failed to open the log");
+                return EXIT_FAILURE;
+            }
+            setvbuf(request_log, NULL, _IOLBF, 0);
+        } else {
+            fprintf(stderr, "Usage: %s --port 9000 | --unix path.sock [--size 4096] [--delay-ms 0] [--cache-control value]\n"
+                            "       [--header \"Name: value\"] [--status 200] [--log FILE]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char header[1024];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 %d Stub\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n%s%s%s%s%s\r\n",
+                                 status_code, body_size,
+                                 cache_control ? "Cache-Control: " : "", cache_control ? cache_control : "",
+                                 cache_control ? "\r\n" : "",
+                                 extra_header ? extra_header : "", extra_header ? "\r\n" : "");
+    response_length = header_length + body_size;
+    response = malloc(response_length);
+    memcpy(response, header, header_length);
+    memset(response + header_length, 'x', body_size);
+
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    memset(&address, 0, sizeof(address));
+    if (unix_path != NULL) {
+        struct sockaddr_un *unix_address = (struct sockaddr_un *) &address;
+        unix_address->sun_family = AF_UNIX;
+        strncpy(unix_address->sun_path, unix_path, sizeof(unix_address->sun_path) - 1);
+        address_length = sizeof(struct sockaddr_un);
+        unlink(unix_path);
+    } else {
+        struct sockaddr_in *inet_address = (struct sockaddr_in *) &address;
+        inet_address->sin_family = AF_INET;
+        inet_address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        inet_address->sin_port = htons(port);
+        address_length = sizeof(struct sockaddr_in);
+    }
+
+    int server_fd = socket(address.ss_family, SOCK_STREAM, 0);
+    int socket_option = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &socket_option, sizeof(socket_option));
+    if (bind(server_fd, (struct sockaddr *) &address, address_length) == -1 || listen(server_fd, 1024) == -1) {
+        perror("Failed to listen");
+        return errno;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) continue;
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, stub_connection, (void *) (long) fd) != 0) close(fd);
+    }
+}
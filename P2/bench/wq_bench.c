@@ -0,0 +1,187 @@
+/*
+ * Compares the global work queue (wq_t) with the per-worker work-stealing
+ * pool (wq_pool_t). A single producer plays the acceptor and pushes item ids;
+ * workers pop them and spin for a fixed amount of simulated work.
+ *
+ * Two numbers are reported per configuration:
+ *   - throughput: items per second when the producer pushes as fast as it can,
+ *   - p99 wait:   push-to-pop latency when items arrive at a steady rate that
+ *                 keeps the workers LOAD busy (0.7 by default).
+ *
+ * With --cpus, workers are pinned round-robin to the listed CPUs and allocate
+ * their deques after pinning, the same way httpserver does. Running with and
+ * without --cpus on a multi-socket machine shows what placement buys.
+ *
+ * Usage: ./bench/wq_bench [--items 200000] [--work-us 5] [--load 0.7]
+ *                         [--workers 4,16,64] [--cpus 0-7,16-23]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "affinity.h"
+#include "util.h"
+#include "wq.h"
+
+#define MAX_CPUS 1024
+
+enum queue_kind {
+    QUEUE_GLOBAL,
+    QUEUE_STEAL
+};
+
+typedef struct bench {
+    enum queue_kind kind;
+    wq_t global;
+    wq_pool_t pool;
+    int num_items;
+    int num_workers;
+    int *cpus;
+    int num_cpus;
+    long work_ns;
+    pthread_barrier_t ready;
+    uint64_t *push_ns;
+    uint64_t *wait_ns;
+} bench_t;
+
+typedef struct bench_worker {
+    bench_t *bench;
+    int id;
+} bench_worker_t;
+
+static void spin_until(uint64_t deadline) {
+    while (now_ns() < deadline);
+}
+
+static void bench_push(bench_t *bench, int item) {
+    if (bench->kind == QUEUE_GLOBAL) wq_push(&bench->global, item);
+    else wq_pool_push(&bench->pool, item);
+}
+
+static int bench_pop(bench_t *bench, int worker_id) {
+    if (bench->kind == QUEUE_GLOBAL) return wq_pop(&bench->global);
+    return wq_pool_pop(&bench->pool, worker_id);
+}
+
+static void *bench_worker(void *args) {
+    bench_worker_t *worker = args;
+    bench_t *bench = worker->bench;
+    int item;
+
+    if (bench->num_cpus) {
+        affinity_pin_self(bench->cpus[worker->id % bench->num_cpus]);
+        if (bench->kind == QUEUE_STEAL) wq_pool_rehome(&bench->pool, worker->id);
+    }
+    pthread_barrier_wait(&bench->ready);
+
+    /* Item ids at or past num_items are stop sentinels. */
+    while ((item = bench_pop(bench, worker->id)) < bench->num_items) {
+        uint64_t start = now_ns();
+        bench->wait_ns[item] = start - bench->push_ns[item];
+        spin_until(start + bench->work_ns);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Runs one configuration. INTERVAL_NS of 0 pushes as fast as possible.
+ * Returns the elapsed wall time and leaves per-item waits in bench->wait_ns. */
+static uint64_t bench_run(bench_t *bench, uint64_t interval_ns) {
+    if (bench->kind == QUEUE_GLOBAL) wq_init(&bench->global);
+    else wq_pool_init(&bench->pool, bench->num_workers);
+
+    pthread_barrier_init(&bench->ready, NULL, bench->num_workers + 1);
+    pthread_t threads[bench->num_workers];
+    bench_worker_t workers[bench->num_workers];
+    for (int i = 0; i < bench->num_workers; i++) {
+        workers[i].bench = bench;
+        workers[i].id = i;
+        pthread_create(&threads[i], NULL, bench_worker, &workers[i]);
+    }
+    pthread_barrier_wait(&bench->ready);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < bench->num_items; i++) {
+        if (interval_ns) spin_until(start + i * interval_ns);
+        bench->push_ns[i] = now_ns();
+        bench_push(bench, i);
+    }
+    for (int i = 0; i < bench->num_workers; i++) bench_push(bench, bench->num_items + i);
+    for (int i = 0; i < bench->num_workers; i++) pthread_join(threads[i], NULL);
+    uint64_t elapsed = now_ns() - start;
+    pthread_barrier_destroy(&bench->ready);
+    return elapsed;
+}
+
+static void bench_report(bench_t *bench, double load) {
+    uint64_t elapsed = bench_run(bench, 0);
+    double throughput = bench->num_items / (elapsed / 1e9);
+
+    uint64_t interval_ns = (uint64_t) (bench->work_ns / (bench->num_workers * load));
+    bench_run(bench, interval_ns);
+    qsort(bench->wait_ns, bench->num_items, sizeof(uint64_t), compare_u64);
+    uint64_t p50 = bench->wait_ns[bench->num_items / 2];
+    uint64_t p99 = bench->wait_ns[(int) (bench->num_items * 0.99)];
+
+    printf("%-6s %8d %14.0f %12.1f %12.1f\n", bench->kind == QUEUE_GLOBAL ? "global" : "steal",
+           bench->num_workers, throughput, p50 / 1e3, p99 / 1e3);
+}
+
+int main(int argc, char **argv) {
+    int num_items = 200000;
+    long work_us = 5;
+    double load = 0.7;
+    char *worker_list = "4,16,64";
+    int cpus[MAX_CPUS], num_cpus = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--items", argv[i]) == 0 && i + 1 < argc) num_items = atoi(argv[++i]);
+        else if (strcmp("--work-us", argv[i]) == 0 && i + 1 < argc) work_us = atol(argv[++i]);
+        else if (strcmp("--load", argv[i]) == 0 && i + 1 < argc) load = atof(argv[++i]);
+        else if (strcmp("--workers", argv[i]) == 0 && i + 1 < argc) worker_list = argv[++i];
+        else if (strcmp("--cpus", argv[i]) == 0 && i + 1 < argc) {
+            if ((num_cpus = affinity_parse_cpus(argv[++i], cpus, MAX_CPUS)) < 1) {
+                fprintf(stderr, "Expected a CPU list such as 0-3,8 after --cpus\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--items N] [--work-us US] [--load L] [--workers 4,16,64] [--cpus LIST]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_items < 1 || load <= 0) {
+        fprintf(stderr, "--items and --load must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_t bench = {
+            .num_items = num_items,
+            .cpus = cpus,
+            .num_cpus = num_cpus,
+            .work_ns = work_us * 1000,
+            .push_ns = calloc(num_items, sizeof(uint64_t)),
+            .wait_ns = calloc(num_items, sizeof(uint64_t))
+    };
+
+    printf("%-6s %8s %14s %12s %12s\n", "queue", "workers", "items/s", "p50 wait us", "p99 wait us");
+    char *list = strdup(worker_list), *saveptr = NULL;
+    for (char *token = strtok_r(list, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        if ((bench.num_workers = atoi(token)) < 1) continue;
+        bench.kind = QUEUE_GLOBAL;
+        bench_report(&bench, load);
+        bench.kind = QUEUE_STEAL;
+        bench_report(&bench, load);
+    }
+    free(list);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bundle.h"
+
+int bundle_open(bundle_t *bundle, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat bundle_stat;
+    if (fstat(fd, &bundle_stat) == -1 || (size_t) bundle_stat.st_size < sizeof(bundle_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, bundle_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    /* Only the header and index bounds are checked, so opening is O(1); each
+     * entry is checked when it is looked at. */
+    const bundle_header_t *header = base;
+    size_t index_size = (size_t) header->num_entries * sizeof(bundle_entry_t);
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->total_size != (uint64_t) bundle_stat.st_size ||
+        header->index_offset > header->total_size || index_size > header->total_size - header->index_offset ||
+        header->strings_offset > header->total_size) {
+        munmap(base, bundle_stat.st_size);
+        return -1;
+    }
+
+    bundle->base = base;
+    bundle->size = bundle_stat.st_size;
+    bundle->header = header;
+    bundle->entries = (const bundle_entry_t *) ((const char *) base + header->index_offset);
+    return 0;
+}
+
+static int bundle_range_valid(const bundle_t *bundle, uint64_t offset, uint64_t length) {
+    return offset <= bundle->size && length <= bundle->size - offset;
+}
+
+const bundle_entry_t *bundle_find(const bundle_t *bundle, const char *path) {
+    size_t length = strlen(path);
+    uint32_t low = 0, high = bundle->header->num_entries;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        const bundle_entry_t *entry = &bundle->entries[middle];
+        if (!bundle_range_valid(bundle, entry->path_offset, entry->path_length)) return NULL;
+        size_t common = entry->path_length < length ? entry->path_length : length;
+        int order = memcmp(bundle->base + entry->path_offset, path, common);
+        if (order == 0) order = (entry->path_length > length) - (entry->path_length < length);
+
+        if (order == 0) return entry;
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+    return NULL;
+}
+
+int bundle_entry_valid(const bundle_t *bundle, const bundle_entry_t *entry) {
+    if (!bundle_range_valid(bundle, entry->path_offset, entry->path_length) ||
+        !bundle_range_valid(bundle, entry->etag_offset, entry->etag_length) ||
+        !bundle_range_valid(bundle, entry->head_offset, entry->head_length) ||
+        !bundle_range_valid(bundle, entry->body_offset, entry->body_length))
+        return 0;
+    return !(entry->flags & BUNDLE_ENTRY_GZIP) ||
+           (bundle_range_valid(bundle, entry->gzip_head_offset, entry->gzip_head_length) &&
+            bundle_range_valid(bundle, entry->gzip_body_offset, entry->gzip_body_length));
+}
@@ -0,0 +1,67 @@
+#ifndef __BUNDLE__
+#define __BUNDLE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A bundle packs a directory tree into one file that httpserver mmaps and
+ * serves without touching the filesystem again (see mkbundle.c). Layout,
+ * host byte order:
+ *
+ *     bundle_header_t
+ *     bodies             - file contents and gzip variants, 16-byte aligned
+ *     bundle_entry_t[]   - sorted by path (bytewise), at header.index_offset
+ *     strings            - paths, pre-rendered response heads and ETags
+ *
+ * Every request path has its own entry: "/docs" and "/docs/" both point at
+ * the directory's index.html (or a pre-rendered listing).
+ */
+
+#define BUNDLE_MAGIC "HTBUNDL1"
+#define BUNDLE_ENTRY_GZIP 0x1 // The gzip_* fields describe a compressed variant.
+
+typedef struct bundle_header {
+    char magic[8];
+    uint32_t num_entries;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t strings_offset;
+    uint64_t total_size;
+} bundle_header_t;
+
+typedef struct bundle_entry {
+    uint64_t path_offset;
+    uint32_t path_length;
+    uint32_t flags;
+    uint64_t etag_offset;
+    uint32_t etag_length;
+    uint32_t head_length;
+    uint64_t head_offset; // "HTTP/1.0 200 OK\r\n...\r\n\r\n" for the identity body.
+    uint64_t body_offset;
+    uint64_t body_length;
+    uint64_t gzip_head_offset;
+    uint32_t gzip_head_length;
+    uint32_t reserved;
+    uint64_t gzip_body_offset;
+    uint64_t gzip_body_length;
+} bundle_entry_t;
+
+typedef struct bundle {
+    const char *base;
+    size_t size;
+    const bundle_header_t *header;
+    const bundle_entry_t *entries;
+} bundle_t;
+
+/* Maps the bundle at PATH and checks its header. Returns 0 or -1. */
+int bundle_open(bundle_t *bundle, const char *path);
+
+/* Returns the entry for request PATH, or NULL. Entries whose path lies
+ * outside the mapping are never matched. */
+const bundle_entry_t *bundle_find(const bundle_t *bundle, const char *path);
+
+/* Returns whether every range ENTRY points at lies within the mapping. */
+int bundle_entry_valid(const bundle_t *bundle, const bundle_entry_t *entry);
+
+#endif
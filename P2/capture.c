@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+
+#define CAPTURE_RECORD_MAX_SIZE (4 * 10 + CAPTURE_HEAD_MAX_SIZE)
+
+static FILE *capture_file;
+static uint64_t capture_start_ns;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t varint_encode(char *buffer, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (char) value;
+    return length;
+}
+
+static int varint_read(FILE *file, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) return shift == 0 ? 0 : -1;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 1;
+    }
+    return -1;
+}
+
+int capture_open(const char *path, uint64_t start_ns) {
+    capture_file = fopen(path, "wb");
+    if (capture_file == NULL) return -1;
+    setvbuf(capture_file, NULL, _IOFBF, 1 << 20);
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_file);
+    capture_start_ns = start_ns;
+    return 0;
+}
+
+int capture_enabled(void) {
+    return capture_file != NULL;
+}
+
+void capture_request(uint64_t accepted_ns, uint64_t completed_ns, uint64_t response_bytes,
+                     const char *head, size_t head_length) {
+    char record[CAPTURE_RECORD_MAX_SIZE];
+    size_t length = 0;
+
+    if (head_length > CAPTURE_HEAD_MAX_SIZE) head_length = CAPTURE_HEAD_MAX_SIZE;
+    if (accepted_ns < capture_start_ns) accepted_ns = capture_start_ns;
+    if (completed_ns < accepted_ns) completed_ns = accepted_ns;
+
+    length += varint_encode(record + length, accepted_ns - capture_start_ns);
+    length += varint_encode(record + length, completed_ns - accepted_ns);
+    length += varint_encode(record + length, response_bytes);
+    length += varint_encode(record + length, head_length);
+    memcpy(record + length, head, head_length);
+    length += head_length;
+
+    pthread_mutex_lock(&capture_mutex);
+    fwrite(record, 1, length, capture_file);
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+int capture_read_header(FILE *file) {
+    char magic[sizeof(CAPTURE_MAGIC)];
+    if (fread(magic, 1, strlen(CAPTURE_MAGIC), file) != strlen(CAPTURE_MAGIC)) return -1;
+    return memcmp(magic, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) == 0 ? 0 : -1;
+}
+
+int capture_read(FILE *file, capture_record_t *record) {
+    uint64_t head_length;
+    int status = varint_read(file, &record->arrival_ns);
+    if (status <= 0) return status;
+    if (varint_read(file, &record->duration_ns) != 1 || varint_read(file, &record->response_bytes) != 1 ||
+        varint_read(file, &head_length) != 1 || head_length > CAPTURE_HEAD_MAX_SIZE)
+        return -1;
+
+    record->head_length = head_length;
+    record->head = malloc(head_length + 1);
+    if (record->head == NULL || fread(record->head, 1, head_length, file) != head_length) {
+        free(record->head);
+        return -1;
+    }
+    record->head[head_length] = '\0';
+    return 1;
+}
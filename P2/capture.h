@@ -0,0 +1,51 @@
+#ifndef __CAPTURE__
+#define __CAPTURE__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Request traffic capture. A trace file is the 8-byte magic "HTTRACE1"
+ * followed by one record per served request:
+ *
+ *     varint arrival_ns      - accept time, relative to the start of capture
+ *     varint duration_ns     - accept to response complete
+ *     varint response_bytes  - bytes written back to the client
+ *     varint head_length
+ *     bytes  head            - request line and headers as received
+ *
+ * Varints are LEB128. Records are written in completion order, so readers
+ * that care about arrival order must sort by arrival_ns. The file is fully
+ * buffered and flushed when the server exits.
+ */
+
+#define CAPTURE_MAGIC "HTTRACE1"
+#define CAPTURE_HEAD_MAX_SIZE 8192
+
+typedef struct capture_record {
+    uint64_t arrival_ns;
+    uint64_t duration_ns;
+    uint64_t response_bytes;
+    size_t head_length;
+    char *head;
+} capture_record_t;
+
+/* Starts capturing to PATH. Returns 0 on success, -1 on error. */
+int capture_open(const char *path, uint64_t start_ns);
+
+/* Returns 1 if a capture is in progress. */
+int capture_enabled(void);
+
+/* Appends a record. ACCEPTED_NS and COMPLETED_NS are monotonic timestamps.
+ * Safe to call from several threads. */
+void capture_request(uint64_t accepted_ns, uint64_t completed_ns, uint64_t response_bytes,
+                     const char *head, size_t head_length);
+
+/* Reads the file header. Returns 0 if FILE is a trace, -1 otherwise. */
+int capture_read_header(FILE *file);
+
+/* Reads the next record into RECORD, allocating RECORD->head.
+ * Returns 1 on success, 0 at end of file and -1 on a malformed record. */
+int capture_read(FILE *file, capture_record_t *record);
+
+#endif
@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "coro.h"
+#include "util.h"
+
+#define CORO_EVENTS 256                   // epoll events taken per wait.
+#define CORO_CONNECT_RETRY_NS 1000000ull  // Wait before connecting again to a full Unix socket.
+
+struct coro {
+#if defined(__x86_64__)
+    void *sp; // Saved stack pointer while switched away.
+#else
+    ucontext_t context;
+#endif
+    char *stack; // Guard page, then the stack.
+    void (*fn)(void *args);
+    void *args;
+    coro_t *next;   // In the run queue or the pool.
+    coro_t *joiner; // Waiting for this one in coro_join.
+    int joinable;
+    int finished;
+    int canceled;
+    int queued;
+    int timed_out;
+    int timer_index; // In the loop's timer heap, or -1.
+    uint64_t deadline_ns;
+    char locals[] __attribute__((aligned(16)));
+};
+
+/* Coroutines waiting for an fd. Each fd is added to the epoll set the first
+ * time one waits for it, for both directions and edge-triggered, and stays
+ * until it is closed. */
+typedef struct coro_waiters {
+    coro_t *reader;
+    coro_t *writer;
+    int registered;
+} coro_waiters_t;
+
+struct coro_loop {
+    int epoll_fd;
+    int wake_fd; // An eventfd, written when the inbox fills.
+    void (*handler)(int fd);
+
+    pthread_mutex_t inbox_mutex;
+    int *inbox, *draining;
+    size_t inbox_length, inbox_capacity, draining_capacity;
+
+    coro_t *main; // The loop's own context.
+    coro_t *current;
+    coro_t *ready_head, *ready_tail;
+    coro_t *pool;
+    int pool_size;
+
+    coro_t **timers; // Min-heap on deadline_ns.
+    int num_timers, timers_capacity;
+
+    coro_waiters_t *waiters; // Indexed by fd.
+    int waiters_size;
+};
+
+static size_t stack_size = 256 * 1024;
+static size_t guard_size;
+static coro_locals_t locals;
+
+static __thread coro_loop_t *this_loop;
+
+/*
+ * Switching contexts. On x86-64, coro_switch_stack pushes the registers the
+ * ABI has callees preserve, saves the stack pointer in *FROM_SP and pops the
+ * same from TO_SP: a switch costs a few instructions and no system call.
+ * Elsewhere ucontext does it, with a sigprocmask call each way.
+ */
+static void coro_trampoline(void);
+
+#if defined(__x86_64__)
+
+void coro_switch_stack(void **from_sp, void *to_sp);
+__asm__(".text\n"
+        ".type coro_switch_stack, @function\n"
+        "coro_switch_stack:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coro_switch_stack, .-coro_switch_stack\n");
+
+/* Lays out the stack as if coro_switch_stack had been called from the start
+ * of coro_trampoline, so the first switch returns into it. */
+static void context_init(coro_t *coroutine) {
+    void **sp = (void **) (((uintptr_t) coroutine->stack + guard_size + stack_size) & ~(uintptr_t) 15);
+    *--sp = NULL; // coro_trampoline's return address: it never returns.
+    *--sp = (void *) coro_trampoline;
+    for (int i = 0; i < 6; i++) *--sp = NULL;
+    coroutine->sp = sp;
+}
+
+static void context_switch(coro_t *from, coro_t *to) {
+    coro_switch_stack(&from->sp, to->sp);
+}
+
+#else
+
+static void context_init(coro_t *coroutine) {
+    getcontext(&coroutine->context);
+    coroutine->context.uc_stack.ss_sp = coroutine->stack + guard_size;
+    coroutine->context.uc_stack.ss_size = stack_size;
+    coroutine->context.uc_link = NULL;
+    makecontext(&coroutine->context, coro_trampoline, 0);
+}
+
+static void context_switch(coro_t *from, coro_t *to) {
+    swapcontext(&from->context, &to->context);
+}
+
+#endif
+
+static void switch_to(coro_t *to) {
+    coro_loop_t *loop = this_loop;
+    coro_t *from = loop->current;
+    if (locals.swap != NULL) {
+        locals.swap(from->locals);
+        locals.swap(to->locals);
+    }
+    loop->current = to;
+    context_switch(from, to);
+}
+
+static void make_ready(coro_t *coroutine) {
+    coro_loop_t *loop = this_loop;
+    if (coroutine->queued || coroutine->finished || coroutine == loop->current) return;
+    coroutine->queued = 1;
+    coroutine->next = NULL;
+    if (loop->ready_tail) loop->ready_tail->next = coroutine;
+    else loop->ready_head = coroutine;
+    loop->ready_tail = coroutine;
+}
+
+/*
+ * The timer heap.
+ */
+static void timer_place(coro_loop_t *loop, int index, coro_t *coroutine) {
+    loop->timers[index] = coroutine;
+    coroutine->timer_index = index;
+}
+
+static void timer_sift(coro_loop_t *loop, int index) {
+    coro_t *coroutine = loop->timers[index];
+    while (index > 0 && loop->timers[(index - 1) / 2]->deadline_ns > coroutine->deadline_ns) {
+        timer_place(loop, index, loop->timers[(index - 1) / 2]);
+        index = (index - 1) / 2;
+    }
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= loop->num_timers) break;
+        if (child + 1 < loop->num_timers && loop->timers[child + 1]->deadline_ns < loop->timers[child]->deadline_ns)
+            child++;
+        if (loop->timers[child]->deadline_ns >= coroutine->deadline_ns) break;
+        timer_place(loop, index, loop->timers[child]);
+        index = child;
+    }
+    timer_place(loop, index, coroutine);
+}
+
+static void timer_add(coro_loop_t *loop, coro_t *coroutine) {
+    if (loop->num_timers == loop->timers_capacity) {
+        loop->timers_capacity = loop->timers_capacity ? loop->timers_capacity * 2 : 64;
+        loop->timers = realloc(loop->timers, loop->timers_capacity * sizeof(coro_t *));
+        if (loop->timers == NULL) {
+            perror("Failed to allocate coroutine timers");
+            exit(ENOMEM);
+        }
+    }
+    loop->timers[loop->num_timers] = coroutine;
+    timer_sift(loop, loop->num_timers++);
+}
+
+static void timer_remove(coro_loop_t *loop, coro_t *coroutine) {
+    int index = coroutine->timer_index;
+    if (index < 0) return;
+    coroutine->timer_index = -1;
+    if (index == --loop->num_timers) return;
+    loop->timers[index] = loop->timers[loop->num_timers];
+    timer_sift(loop, index);
+}
+
+/*
+ * Switches to the loop until this coroutine is made ready again, or until
+ * TIMEOUT_MS (-1: no limit) has passed. Returns 1, 0 on timeout, or -1 with
+ * errno ECANCELED.
+ */
+static int park_for(int timeout_ms) {
+    coro_loop_t *loop = this_loop;
+    coro_t *self = loop->current;
+    if (self->canceled) {
+        errno = ECANCELED;
+        return -1;
+    }
+    self->timed_out = 0;
+    if (timeout_ms >= 0) {
+        self->deadline_ns = now_ns() + (uint64_t) timeout_ms * 1000000ull;
+        timer_add(loop, self);
+    }
+    switch_to(loop->main);
+    timer_remove(loop, self);
+    if (self->canceled) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return !self->timed_out;
+}
+
+void coro_init(size_t coroutine_stack_size, const coro_locals_t *coroutine_locals) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    guard_size = page;
+    stack_size = (coroutine_stack_size + page - 1) & ~(page - 1);
+    if (coroutine_locals != NULL) locals = *coroutine_locals;
+}
+
+static coro_t *coro_allocate(void) {
+    coro_t *coroutine = calloc(1, sizeof(coro_t) + locals.size);
+    if (coroutine == NULL) return NULL;
+    coroutine->timer_index = -1;
+    return coroutine;
+}
+
+/* Takes a coroutine from the pool or maps a new stack, ready to run FN(ARGS).
+ * Returns NULL if out of memory or mappings. */
+static coro_t *coro_create(coro_loop_t *loop, void (*fn)(void *args), void *args) {
+    coro_t *coroutine = loop->pool;
+    if (coroutine != NULL) {
+        loop->pool = coroutine->next;
+        loop->pool_size--;
+    } else {
+        if ((coroutine = coro_allocate()) == NULL) return NULL;
+        coroutine->stack = mmap(NULL, guard_size + stack_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (coroutine->stack == MAP_FAILED || mprotect(coroutine->stack, guard_size, PROT_NONE) == -1) {
+            if (coroutine->stack != MAP_FAILED) munmap(coroutine->stack, guard_size + stack_size);
+            free(coroutine);
+            return NULL;
+        }
+    }
+
+    coroutine->fn = fn;
+    coroutine->args = args;
+    coroutine->next = coroutine->joiner = NULL;
+    coroutine->joinable = coroutine->finished = coroutine->canceled = coroutine->queued = 0;
+    context_init(coroutine);
+    return coroutine;
+}
+
+/* Pools a finished coroutine, or unmaps it once the pool is full. */
+static void coro_free(coro_loop_t *loop, coro_t *coroutine) {
+    if (locals.recycle != NULL) locals.recycle(coroutine->locals);
+    if (loop->pool_size < CORO_POOL_SIZE) {
+        coroutine->next = loop->pool;
+        loop->pool = coroutine;
+        loop->pool_size++;
+        return;
+    }
+    if (locals.release != NULL) locals.release(coroutine->locals);
+    munmap(coroutine->stack, guard_size + stack_size);
+    free(coroutine);
+}
+
+static void coro_trampoline(void) {
+    coro_loop_t *loop = this_loop;
+    coro_t *self = loop->current;
+    self->fn(self->args);
+
+    self->finished = 1;
+    if (self->joiner != NULL) make_ready(self->joiner);
+    switch_to(loop->main); // The loop frees or pools us; we are never resumed.
+    abort();
+}
+
+coro_loop_t *coro_loop_create(void (*handler)(int fd)) {
+    coro_loop_t *loop = calloc(1, sizeof(coro_loop_t));
+    if (loop == NULL || (loop->main = coro_allocate()) == NULL) return NULL;
+    loop->handler = handler;
+    pthread_mutex_init(&loop->inbox_mutex, NULL);
+
+    struct rlimit limit;
+    loop->waiters_size = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+                         ? (int) limit.rlim_cur : 65536;
+    loop->waiters = calloc(loop->waiters_size, sizeof(coro_waiters_t));
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = loop->wake_fd};
+    if (loop->waiters == NULL || loop->epoll_fd == -1 || loop->wake_fd == -1 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) == -1)
+        return NULL;
+    return loop;
+}
+
+void coro_loop_submit(coro_loop_t *loop, int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_lock(&loop->inbox_mutex);
+    if (loop->inbox_length == loop->inbox_capacity) {
+        loop->inbox_capacity = loop->inbox_capacity ? loop->inbox_capacity * 2 : 64;
+        loop->inbox = realloc(loop->inbox, loop->inbox_capacity * sizeof(int));
+        if (loop->inbox == NULL) {
+            perror("Failed to queue a connection");
+            exit(ENOMEM);
+        }
+    }
+    loop->inbox[loop->inbox_length++] = fd;
+    int was_empty = loop->inbox_length == 1;
+    pthread_mutex_unlock(&loop->inbox_mutex);
+
+    /* An inbox that already held fds has a wake-up on the way. */
+    uint64_t one = 1;
+    if (was_empty && write(loop->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("Failed to wake a coroutine loop");
+}
+
+static void run_handler(void *args) {
+    this_loop->handler((int) (long) args);
+}
+
+/* Starts a coroutine for each submitted fd. */
+static void adopt_submitted(coro_loop_t *loop) {
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) == -1) return;
+
+    pthread_mutex_lock(&loop->inbox_mutex);
+    int *fds = loop->inbox;
+    size_t length = loop->inbox_length, capacity = loop->inbox_capacity;
+    loop->inbox = loop->draining;
+    loop->inbox_capacity = loop->draining_capacity;
+    loop->inbox_length = 0;
+    pthread_mutex_unlock(&loop->inbox_mutex);
+
+    for (size_t i = 0; i < length; i++) {
+        coro_t *coroutine = coro_create(loop, run_handler, (void *) (long) fds[i]);
+        if (coroutine == NULL) {
+            perror("Failed to start a coroutine");
+            close(fds[i]);
+            continue;
+        }
+        make_ready(coroutine);
+    }
+    loop->draining = fds;
+    loop->draining_capacity = capacity;
+}
+
+static void wake_waiters(coro_loop_t *loop, struct epoll_event *event) {
+    int fd = event->data.fd;
+    if (fd < 0 || fd >= loop->waiters_size) return;
+    coro_waiters_t *waiters = &loop->waiters[fd];
+    if (waiters->reader != NULL && (event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        make_ready(waiters->reader);
+    if (waiters->writer != NULL && (event->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+        make_ready(waiters->writer);
+}
+
+_Noreturn void coro_loop_run(coro_loop_t *loop) {
+    struct epoll_event events[CORO_EVENTS];
+    this_loop = loop;
+    loop->current = loop->main;
+
+    while (1) {
+        coro_t *coroutine;
+        while ((coroutine = loop->ready_head) != NULL) {
+            loop->ready_head = coroutine->next;
+            if (loop->ready_head == NULL) loop->ready_tail = NULL;
+            coroutine->queued = 0;
+            switch_to(coroutine);
+            if (coroutine->finished && !coroutine->joinable) coro_free(loop, coroutine);
+        }
+
+        int timeout_ms = -1;
+        if (loop->num_timers > 0) {
+            uint64_t now = now_ns(), deadline_ns = loop->timers[0]->deadline_ns;
+            timeout_ms = deadline_ns <= now ? 0 : (int) ((deadline_ns - now + 999999) / 1000000);
+        }
+        int num_events = epoll_wait(loop->epoll_fd, events, CORO_EVENTS, timeout_ms);
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.fd == loop->wake_fd) adopt_submitted(loop);
+            else wake_waiters(loop, &events[i]);
+        }
+
+        uint64_t now = now_ns();
+        while (loop->num_timers > 0 && loop->timers[0]->deadline_ns <= now) {
+            coroutine = loop->timers[0];
+            timer_remove(loop, coroutine);
+            if (!coroutine->queued) coroutine->timed_out = 1;
+            make_ready(coroutine);
+        }
+    }
+}
+
+int coro_active(void) {
+    return this_loop != NULL && this_loop->current != this_loop->main;
+}
+
+coro_t *coro_self(void) {
+    return coro_active() ? this_loop->current : NULL;
+}
+
+coro_t *coro_spawn(void (*fn)(void *args), void *args) {
+    if (!coro_active()) return NULL;
+    coro_t *child = coro_create(this_loop, fn, args);
+    if (child == NULL) return NULL;
+    child->joinable = 1;
+    make_ready(child);
+    return child;
+}
+
+void coro_join(coro_t *child) {
+    coro_t *self = coro_self();
+    while (!child->finished) {
+        child->joiner = self;
+        switch_to(this_loop->main);
+    }
+    coro_free(this_loop, child);
+}
+
+void coro_park(void) {
+    if (coro_active()) park_for(-1);
+}
+
+void coro_wake(coro_t *coroutine) {
+    make_ready(coroutine);
+}
+
+void coro_cancel(coro_t *coroutine) {
+    if (coroutine->finished) return;
+    coroutine->canceled = 1;
+    make_ready(coroutine);
+}
+
+int coro_wait_fd(int fd, short events, int timeout_ms) {
+    coro_t *self = coro_self();
+    if (self == NULL) return -1;
+    coro_loop_t *loop = this_loop;
+    if (fd < 0 || fd >= loop->waiters_size) {
+        errno = EBADF;
+        return -1;
+    }
+
+    coro_waiters_t *waiters = &loop->waiters[fd];
+    if (!waiters->registered && events != 0) {
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+            return errno == EPERM ? 1 : -1; // EPERM: a regular file, always ready.
+        waiters->registered = 1;
+    }
+    if (events & POLLIN) waiters->reader = self;
+    if (events & POLLOUT) waiters->writer = self;
+    int result = park_for(timeout_ms);
+    if (waiters->reader == self) waiters->reader = NULL;
+    if (waiters->writer == self) waiters->writer = NULL;
+    return result;
+}
+
+int coro_sleep(uint64_t ns) {
+    if (!coro_active()) {
+        struct timespec delay = {(time_t) (ns / 1000000000ull), (long) (ns % 1000000000ull)};
+        while (nanosleep(&delay, &delay) == -1 && errno == EINTR) continue;
+        return 0;
+    }
+    uint64_t deadline_ns = now_ns() + ns;
+    coro_t *self = this_loop->current;
+    do {
+        if (self->canceled) {
+            errno = ECANCELED;
+            return -1;
+        }
+        self->deadline_ns = deadline_ns;
+        self->timed_out = 0;
+        timer_add(this_loop, self);
+        switch_to(this_loop->main);
+        timer_remove(this_loop, self);
+    } while (!self->timed_out && !self->canceled);
+    return self->canceled ? -1 : 0;
+}
+
+/*
+ * Wrappers for the calls httpserver makes on sockets, linked in place of the
+ * real ones with ld --wrap (see the Makefile). On a coroutine, where sockets
+ * are non-blocking, EAGAIN becomes a wait on the loop; anywhere else they
+ * are the plain calls.
+ */
+ssize_t __real_read(int fd, void *buffer, size_t count);
+ssize_t __real_write(int fd, const void *buffer, size_t count);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __real_recv(int fd, void *buffer, size_t length, int flags);
+ssize_t __real_send(int fd, const void *buffer, size_t length, int flags);
+ssize_t __real_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+ssize_t __real_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t length, unsigned int flags);
+int __real_connect(int fd, const struct sockaddr *address, socklen_t address_length);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_nanosleep(const struct timespec *duration, struct timespec *remaining);
+int __real_close(int fd);
+
+/* Retries CALL, on fd FD, for as long as it would block and FD becomes ready
+ * for EVENTS. */
+#define CORO_RETRY(call, fd, events)                                                  \
+    do {                                                                              \
+        ssize_t result;                                                               \
+        while ((result = (call)) == -1 && errno == EAGAIN && coro_wait_fd(fd, events, -1) == 1) \
+            continue;                                                                 \
+        return result;                                                                \
+    } while (0)
+
+ssize_t __wrap_read(int fd, void *buffer, size_t count) {
+    CORO_RETRY(__real_read(fd, buffer, count), fd, POLLIN);
+}
+
+ssize_t __wrap_write(int fd, const void *buffer, size_t count) {
+    CORO_RETRY(__real_write(fd, buffer, count), fd, POLLOUT);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+    CORO_RETRY(__real_writev(fd, iov, iovcnt), fd, POLLOUT);
+}
+
+ssize_t __wrap_send(int fd, const void *buffer, size_t length, int flags) {
+    if (flags & MSG_DONTWAIT) return __real_send(fd, buffer, length, flags);
+    CORO_RETRY(__real_send(fd, buffer, length, flags), fd, POLLOUT);
+}
+
+ssize_t __wrap_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    CORO_RETRY(__real_sendfile(out_fd, in_fd, offset, count), out_fd, POLLOUT);
+}
+
+/* A peek asking for all LENGTH bytes waits for them, as on a blocking socket. */
+ssize_t __wrap_recv(int fd, void *buffer, size_t length, int flags) {
+    if (flags & MSG_DONTWAIT) return __real_recv(fd, buffer, length, flags);
+    int peek_all = (flags & (MSG_PEEK | MSG_WAITALL)) == (MSG_PEEK | MSG_WAITALL);
+    ssize_t result;
+    while (((result = __real_recv(fd, buffer, length, flags)) == -1 && errno == EAGAIN) ||
+           (peek_all && result > 0 && (size_t) result < length)) {
+        if (coro_wait_fd(fd, POLLIN, -1) != 1) break;
+    }
+    return result;
+}
+
+/* Either end may be the one that is not ready: wait for whichever it is. */
+ssize_t __wrap_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t length, unsigned int flags) {
+    ssize_t result;
+    while ((result = __real_splice(fd_in, off_in, fd_out, off_out, length, flags)) == -1 && errno == EAGAIN) {
+        struct pollfd in = {fd_in, POLLIN, 0};
+        int in_ready = __real_poll(&in, 1, 0) == 1;
+        if (coro_wait_fd(in_ready ? fd_out : fd_in, in_ready ? POLLOUT : POLLIN, -1) != 1) break;
+    }
+    return result;
+}
+
+int __wrap_connect(int fd, const struct sockaddr *address, socklen_t address_length) {
+    if (!coro_active()) return __real_connect(fd, address, address_length);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    while (__real_connect(fd, address, address_length) == -1) {
+        if (errno == EAGAIN) { // A Unix socket with a full backlog.
+            if (coro_sleep(CORO_CONNECT_RETRY_NS) == -1) return -1;
+            continue;
+        }
+        if (errno != EINPROGRESS || coro_wait_fd(fd, POLLOUT, -1) != 1) return -1;
+
+        int error;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1) return -1;
+        if (error == 0) return 0;
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Only a poll on a single fd, and with a timeout, waits on the loop. */
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    if (nfds != 1 || timeout == 0 || !coro_active()) return __real_poll(fds, nfds, timeout);
+
+    uint64_t deadline_ns = timeout > 0 ? now_ns() + (uint64_t) timeout * 1000000ull : 0;
+    while (1) {
+        int ready = __real_poll(fds, 1, 0);
+        if (ready != 0) return ready;
+
+        int timeout_ms = -1;
+        if (timeout > 0) {
+            uint64_t now = now_ns();
+            if (now >= deadline_ns) return 0;
+            timeout_ms = (int) ((deadline_ns - now + 999999) / 1000000);
+        }
+        int waited = coro_wait_fd(fds[0].fd, fds[0].events, timeout_ms);
+        if (waited == -1) return -1;
+        if (waited == 0) return __real_poll(fds, 1, 0);
+    }
+}
+
+/* A canceled sleep ends early; the calls after it fail. */
+int __wrap_nanosleep(const struct timespec *duration, struct timespec *remaining) {
+    if (!coro_active()) return __real_nanosleep(duration, remaining);
+    coro_sleep((uint64_t) duration->tv_sec * 1000000000ull + duration->tv_nsec);
+    if (remaining != NULL) remaining->tv_sec = remaining->tv_nsec = 0;
+    return 0;
+}
+
+/* A closed fd leaves the epoll set by itself; its number may come back for
+ * another socket, which must be added anew. */
+int __wrap_close(int fd) {
+    coro_loop_t *loop = this_loop;
+    if (loop != NULL && fd >= 0 && fd < loop->waiters_size) loop->waiters[fd].registered = 0;
+    return __real_close(fd);
+}
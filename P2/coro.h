@@ -0,0 +1,102 @@
+#ifndef __CORO__
+#define __CORO__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Stackful coroutines on per-thread epoll loops, so handler code written for
+ * blocking sockets can keep many thousands of connections open on a few
+ * threads. Each loop runs the connections handed to it as coroutines, on
+ * pooled stacks with a guard page below each.
+ *
+ * Nothing has to be rewritten to yield: httpserver is linked with the socket
+ * calls wrapped (see CORO_WRAPPED in the Makefile), and on a coroutine a call
+ * that would block (EAGAIN on the non-blocking sockets a loop runs) waits for
+ * the loop to see the fd ready instead, then tries again. Everywhere else the
+ * wrappers pass straight through. Regular files never return EAGAIN, so disk
+ * reads still block their loop.
+ *
+ * Per-thread state the handlers keep for the connection they serve (arenas,
+ * pacers, flight recorder context...) has to follow each coroutine: see
+ * coro_locals_t. A coroutine must not block on a lock another coroutine on
+ * its loop may be holding across a yield.
+ *
+ * Each stack and its guard are separate mappings: to hold 100k connections,
+ * raise vm.max_map_count (65530 by default) along with RLIMIT_NOFILE.
+ */
+
+#define CORO_POOL_SIZE 1024 // Finished coroutines each loop keeps for reuse.
+
+typedef struct coro coro_t;
+typedef struct coro_loop coro_loop_t;
+
+/*
+ * State each coroutine keeps its own copy of: SIZE bytes, zeroed for a new
+ * coroutine. SWAP exchanges them with the calling thread's state, and is run
+ * for the coroutine switched away from and the one switched to. When a
+ * coroutine finishes, RECYCLE resets what must not carry over to the next one
+ * to run on its pooled stack (buffers can stay), and RELEASE frees the rest if
+ * its stack is not pooled after all.
+ */
+typedef struct coro_locals {
+    size_t size;
+    void (*swap)(void *locals);
+    void (*recycle)(void *locals);
+    void (*release)(void *locals);
+} coro_locals_t;
+
+/* Sets the STACK_SIZE of coroutines and their LOCALS. Call before creating
+ * any loop. */
+void coro_init(size_t stack_size, const coro_locals_t *locals);
+
+/* Creates a loop that runs HANDLER(fd) on a coroutine for each fd submitted
+ * to it. */
+coro_loop_t *coro_loop_create(void (*handler)(int fd));
+
+/* Hands the connected socket FD to LOOP, from any thread. FD is made
+ * non-blocking. */
+void coro_loop_submit(coro_loop_t *loop, int fd);
+
+/* Runs LOOP on the calling thread. */
+_Noreturn void coro_loop_run(coro_loop_t *loop);
+
+/* Returns 1 if the caller runs on a coroutine. */
+int coro_active(void);
+
+/* Starts FN(ARGS) on a new coroutine on the caller's loop. It must be waited
+ * for with coro_join. Returns NULL if the caller is not on a coroutine. */
+coro_t *coro_spawn(void (*fn)(void *args), void *args);
+
+/* Waits for CHILD (from coro_spawn) to finish, and frees it. */
+void coro_join(coro_t *child);
+
+/* Waits until another coroutine calls coro_wake on this one. Wake-ups are
+ * not counted, so check what was waited for again afterwards. */
+void coro_park(void);
+
+/* Makes COROUTINE, parked or waiting, runnable. Must be called from its loop. */
+void coro_wake(coro_t *coroutine);
+
+/* Returns the calling coroutine, or NULL. */
+coro_t *coro_self(void);
+
+/*
+ * Makes every wait of COROUTINE, the current one and those after it, fail
+ * with ECANCELED, so the wrapped calls it blocks in return -1 and its code
+ * unwinds as on a closed socket. Does nothing to one that has finished.
+ */
+void coro_cancel(coro_t *coroutine);
+
+/*
+ * Waits up to TIMEOUT_MS (-1: forever) for FD to become ready for EVENTS
+ * (POLLIN, POLLOUT). Returns 1 when it may be, 0 on timeout, and -1 with
+ * errno ECANCELED if canceled. Returns -1 leaving errno alone if the caller
+ * is not on a coroutine.
+ */
+int coro_wait_fd(int fd, short events, int timeout_ms);
+
+/* Sleeps for NS nanoseconds. Returns 0, or -1 if canceled. */
+int coro_sleep(uint64_t ns);
+
+#endif
@@ -0,0 +1,186 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filecache.h"
+#include "util.h"
+
+#define FILECACHE_BUCKETS 1024
+#define FILECACHE_ADMIT_SLOTS 4096
+#define FILECACHE_ADMIT_RESET (FILECACHE_ADMIT_SLOTS / 2) // Marks set between clears.
+
+static size_t filecache_budget;
+static size_t filecache_max_file_size;
+static size_t mapped_bytes;
+static filecache_entry_t *buckets[FILECACHE_BUCKETS];
+static filecache_entry_t *lru_head; // Most recently used.
+static filecache_entry_t *lru_tail;
+static unsigned char admit_marks[FILECACHE_ADMIT_SLOTS]; // Whether a path hash was seen since the last clear.
+static size_t admit_marked;
+static pthread_mutex_t filecache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void filecache_init(size_t budget) {
+    filecache_budget = budget;
+    /* A single file may take at most a quarter of the budget. */
+    filecache_max_file_size = budget / 4 < FILECACHE_MAX_FILE_SIZE ? budget / 4 : FILECACHE_MAX_FILE_SIZE;
+}
+
+int filecache_enabled(void) {
+    return filecache_budget > 0;
+}
+
+int filecache_too_big(size_t size) {
+    return size > (filecache_enabled() ? filecache_max_file_size : FILECACHE_MAX_FILE_SIZE);
+}
+
+/* Marks HASH as seen, and returns whether it already was. The marks are all
+ * cleared every FILECACHE_ADMIT_RESET new ones, or paths seen once long ago
+ * would fill the slots until every first request looked like a second. The
+ * caller holds filecache_mutex. */
+static int admit_mark(uint32_t hash) {
+    unsigned char *count = &admit_marks[hash % FILECACHE_ADMIT_SLOTS];
+    if (*count) return 1;
+    if (admit_marked == FILECACHE_ADMIT_RESET) {
+        memset(admit_marks, 0, sizeof(admit_marks));
+        admit_marked = 0;
+    }
+    *count = 1;
+    admit_marked++;
+    return 0;
+}
+
+static void lru_unlink(filecache_entry_t *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(filecache_entry_t *entry) {
+    entry->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = entry;
+    lru_head = entry;
+    if (lru_tail == NULL) lru_tail = entry;
+}
+
+void filecache_release(filecache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    munmap(entry->data, entry->size);
+    free(entry->path);
+    free(entry);
+}
+
+/* Removes ENTRY from the table and drops the cache's reference. The caller
+ * holds filecache_mutex. */
+static void filecache_remove(filecache_entry_t *entry, uint32_t hash) {
+    filecache_entry_t **link = &buckets[hash % FILECACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    lru_unlink(entry);
+    mapped_bytes -= entry->size;
+    filecache_release(entry);
+}
+
+static filecache_entry_t *filecache_map(const char *path, const struct stat *st) {
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd < 0) return NULL;
+    char *data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+    close(file_fd);
+    if (data == MAP_FAILED) return NULL;
+
+    /* Fault the file in ahead of the first response, and let the kernel back
+     * large files with huge pages where the filesystem supports it. */
+    madvise(data, st->st_size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    if ((size_t) st->st_size >= FILECACHE_HUGEPAGE_SIZE) madvise(data, st->st_size, MADV_HUGEPAGE);
+#endif
+
+    filecache_entry_t *entry = calloc(1, sizeof(filecache_entry_t));
+    entry->path = strdup(path);
+    entry->data = data;
+    entry->size = st->st_size;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->refs = 1;
+    return entry;
+}
+
+filecache_entry_t *filecache_acquire(const char *path, const struct stat *st) {
+    size_t size = st->st_size;
+    if (!filecache_enabled() || size < FILECACHE_MIN_FILE_SIZE || size > filecache_max_file_size) return NULL;
+
+    uint32_t hash = fnv1a(path, strlen(path));
+    pthread_mutex_lock(&filecache_mutex);
+
+    filecache_entry_t *entry;
+    for (entry = buckets[hash % FILECACHE_BUCKETS]; entry; entry = entry->next)
+        if (strcmp(entry->path, path) == 0) break;
+
+    if (entry != NULL) {
+        if (entry->size == size && entry->dev == st->st_dev && entry->ino == st->st_ino &&
+            entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+            lru_unlink(entry);
+            lru_push_front(entry);
+            pthread_mutex_unlock(&filecache_mutex);
+            return entry;
+        }
+        filecache_remove(entry, hash); // Stale: the file changed on disk.
+    } else if (!admit_mark(hash)) {
+        /* One-hit wonders are streamed; map a file once it comes back. */
+        pthread_mutex_unlock(&filecache_mutex);
+        return NULL;
+    }
+
+    while (mapped_bytes + size > filecache_budget && lru_tail != NULL)
+        filecache_remove(lru_tail, fnv1a(lru_tail->path, strlen(lru_tail->path)));
+
+    entry = filecache_map(path, st);
+    if (entry != NULL) {
+        entry->next = buckets[hash % FILECACHE_BUCKETS];
+        buckets[hash % FILECACHE_BUCKETS] = entry;
+        lru_push_front(entry);
+        mapped_bytes += size;
+        entry->refs++;
+    }
+    pthread_mutex_unlock(&filecache_mutex);
+    return entry;
+}
+
+size_t filecache_snapshot(const char *prefix, char *out, size_t capacity) {
+    size_t length = 0, prefix_length = strlen(prefix);
+    pthread_mutex_lock(&filecache_mutex);
+    for (filecache_entry_t *entry = lru_head; entry; entry = entry->lru_next) {
+        if (strncmp(entry->path, prefix, prefix_length) != 0) continue;
+        size_t path_length = strlen(entry->path + prefix_length);
+        if (length + path_length + 1 > capacity) break;
+        memcpy(out + length, entry->path + prefix_length, path_length);
+        length += path_length;
+        out[length++] = '\n';
+    }
+    pthread_mutex_unlock(&filecache_mutex);
+    return length;
+}
+
+int filecache_warm(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+
+    /* Count the file as seen once, so it is admitted straight away. */
+    uint32_t hash = fnv1a(path, strlen(path));
+    pthread_mutex_lock(&filecache_mutex);
+    admit_mark(hash);
+    pthread_mutex_unlock(&filecache_mutex);
+
+    filecache_entry_t *entry = filecache_acquire(path, &st);
+    if (entry == NULL) return -1;
+    filecache_release(entry);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef __FILECACHE__
+#define __FILECACHE__
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Cache of read-only file mappings for mid-size hot files. A file is mapped
+ * the second time it is requested and stays mapped until it changes on disk
+ * or is evicted (least recently used first) to keep the mapped bytes within
+ * the budget. Entries are refcounted: eviction only drops the cache's
+ * reference, and the mapping goes away when the last response using it ends.
+ */
+
+#define FILECACHE_MIN_FILE_SIZE (16 * 1024)
+#define FILECACHE_MAX_FILE_SIZE (64 * 1024 * 1024)
+#define FILECACHE_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct filecache_entry {
+    char *path;
+    char *data;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int refs; // One for the cache while the entry is in the table, one per user.
+    struct filecache_entry *next; // Hash chain.
+    struct filecache_entry *lru_prev;
+    struct filecache_entry *lru_next;
+} filecache_entry_t;
+
+/* Enables the cache with a budget of BUDGET mapped bytes. */
+void filecache_init(size_t budget);
+
+/* Returns 1 if the cache is enabled. */
+int filecache_enabled(void);
+
+/* Returns 1 if a file of SIZE bytes is too big to cache and will be streamed. */
+int filecache_too_big(size_t size);
+
+/* Returns a referenced mapping of PATH, whose current metadata is ST, or NULL
+ * if it is not (yet) worth caching. Release it with filecache_release. */
+filecache_entry_t *filecache_acquire(const char *path, const struct stat *st);
+
+void filecache_release(filecache_entry_t *entry);
+
+/* Writes the paths of the cached files that start with PREFIX, without it,
+ * one per line and most recently used first. Returns the length written to
+ * OUT; paths that do not fit are left out. */
+size_t filecache_snapshot(const char *prefix, char *out, size_t capacity);
+
+/* Maps PATH ahead of its first request. Returns 0, or -1 if it is not worth
+ * caching or cannot be mapped. */
+int filecache_warm(const char *path);
+
+#endif
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flight.h"
+#include "util.h"
+
+typedef struct flight_record {
+    uint64_t sequence; // Slot index + 1 once the record is complete, 0 while it is written.
+    const char *name;
+    uint64_t request_id;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} flight_record_t;
+
+typedef struct flight_ring {
+    flight_record_t records[FLIGHT_RING_SIZE];
+    uint64_t head;
+    int tid;
+    struct flight_ring *next;
+} flight_ring_t;
+
+static int flight_sample_every;
+static flight_ring_t *flight_rings;
+static pthread_mutex_t flight_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t flight_next_request_id;
+
+static __thread flight_ring_t *ring;
+static __thread unsigned long requests_seen;
+static __thread uint64_t current_request_id;
+static __thread uint64_t current_accepted_ns;
+
+static flight_ring_t *flight_ring(void) {
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(flight_ring_t));
+        ring->tid = (int) syscall(SYS_gettid);
+        pthread_mutex_lock(&flight_rings_mutex);
+        ring->next = flight_rings;
+        flight_rings = ring;
+        pthread_mutex_unlock(&flight_rings_mutex);
+    }
+    return ring;
+}
+
+static void flight_record(const char *name, uint64_t start_ns, uint64_t end_ns) {
+    flight_ring_t *r = flight_ring();
+    uint64_t index = r->head;
+    flight_record_t *record = &r->records[index % FLIGHT_RING_SIZE];
+
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->name = name;
+    record->request_id = current_request_id;
+    record->start_ns = start_ns;
+    record->end_ns = end_ns;
+    __atomic_store_n(&record->sequence, index + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, index + 1, __ATOMIC_RELEASE);
+}
+
+void flight_init(int sample_every) {
+    flight_sample_every = sample_every;
+}
+
+int flight_enabled(void) {
+    return flight_sample_every > 0;
+}
+
+void flight_begin(uint64_t accepted_ns, uint64_t pop_start_ns, uint64_t popped_ns) {
+    current_request_id = 0;
+    if (flight_sample_every <= 0 || requests_seen++ % flight_sample_every != 0) return;
+
+    current_request_id = __atomic_add_fetch(&flight_next_request_id, 1, __ATOMIC_RELAXED);
+    current_accepted_ns = accepted_ns;
+    flight_record("accept_queue", accepted_ns, popped_ns);
+    /* Time the request waited while this worker was already looking for work:
+     * the wake-up and steal latency of the queue itself. */
+    flight_record("wq_pop", pop_start_ns > accepted_ns ? pop_start_ns : accepted_ns, popped_ns);
+}
+
+void flight_end(void) {
+    if (current_request_id == 0) return;
+    flight_record("request", current_accepted_ns, now_ns());
+    current_request_id = 0;
+}
+
+uint64_t flight_clock(void) {
+    return current_request_id ? now_ns() : 0;
+}
+
+void flight_span(const char *name, uint64_t start_ns) {
+    if (current_request_id && start_ns) flight_record(name, start_ns, now_ns());
+}
+
+void flight_swap(flight_context_t *context) {
+    flight_context_t swapped = {current_request_id, current_accepted_ns};
+    current_request_id = context->request_id;
+    current_accepted_ns = context->accepted_ns;
+    *context = swapped;
+}
+
+void flight_dump(FILE *out) {
+    int first = 1;
+    pid_t pid = getpid();
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    pthread_mutex_lock(&flight_rings_mutex);
+    for (flight_ring_t *r = flight_rings; r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t oldest = head > FLIGHT_RING_SIZE ? head - FLIGHT_RING_SIZE : 0;
+
+        for (uint64_t index = oldest; index < head; index++) {
+            flight_record_t *slot = &r->records[index % FLIGHT_RING_SIZE], copy;
+            uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+            copy = *slot;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            /* Skip slots the owner overwrote while we were copying them. */
+            if (sequence != index + 1 || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) continue;
+
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%lu}}",
+                    first ? "" : ",", copy.name, (int) pid, r->tid, copy.start_ns / 1e3,
+                    (copy.end_ns - copy.start_ns) / 1e3, (unsigned long) copy.request_id);
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&flight_rings_mutex);
+    fprintf(out, "\n]}\n");
+}
@@ -0,0 +1,57 @@
+#ifndef __FLIGHT__
+#define __FLIGHT__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Flight recorder: per-request stage timings kept in a per-thread ring buffer
+ * and dumped on demand as Chrome trace-event JSON (chrome://tracing or
+ * ui.perfetto.dev).
+ *
+ * Only one request in every SAMPLE_EVERY is recorded. For the others, every
+ * stamp is a thread-local flag check, so the recorder can stay on in
+ * production. Typical use at a stamp site:
+ *
+ *     uint64_t start = flight_clock();
+ *     stat(path, &st);
+ *     flight_span("stat", start);
+ */
+
+#define FLIGHT_RING_SIZE 4096
+#define FLIGHT_ADMIN_PATH "/__flight"
+
+/* Turns the recorder on. Must be called before worker threads start. */
+void flight_init(int sample_every);
+
+/* Returns 1 if the recorder is on. */
+int flight_enabled(void);
+
+/* Starts recording a request on the calling thread if it is sampled.
+ * ACCEPTED_NS is when the acceptor accepted it, POP_START_NS when the worker
+ * began looking for work and POPPED_NS when it got this request. */
+void flight_begin(uint64_t accepted_ns, uint64_t pop_start_ns, uint64_t popped_ns);
+
+/* Records the whole request span and stops recording on the calling thread. */
+void flight_end(void);
+
+/* Returns the monotonic time if the current request is sampled, 0 otherwise. */
+uint64_t flight_clock(void);
+
+/* Records a span from START_NS (a flight_clock() value) to now. */
+void flight_span(const char *name, uint64_t start_ns);
+
+/* The request a thread is recording, for code that interleaves requests on
+ * one thread (see coro.h). */
+typedef struct flight_context {
+    uint64_t request_id;
+    uint64_t accepted_ns;
+} flight_context_t;
+
+/* Exchanges *CONTEXT with the calling thread's current request. */
+void flight_swap(flight_context_t *context);
+
+/* Writes every thread's ring to OUT as Chrome trace-event JSON. */
+void flight_dump(FILE *out);
+
+#endif
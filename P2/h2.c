@@ -0,0 +1,713 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "h2.h"
+#include "hpack.h"
+
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_IN_BUFFER_SIZE (2 * (H2_FRAME_SIZE + H2_FRAME_HEADER_SIZE))
+#define H2_MAX_PEER_FRAME_SIZE 16777215
+#define H2_METHOD_SIZE 32
+#define H2_PATH_SIZE 4096 // Longer paths are answered 414 without reaching the handler.
+
+enum h2_frame_type {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum h2_error {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+};
+
+enum h2_setting {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+typedef struct h2_stream {
+    uint32_t id; // 0 while the slot is free.
+    int64_t window; // What the peer lets us send on this stream.
+    int headers_sent;
+    int head_only; // HEAD request: headers, no body.
+    size_t body_sent;
+    struct http_response response;
+    arena_t *arena; // The handler's memory (listings): made on first use, reset when the stream closes.
+} h2_stream_t;
+
+typedef struct h2_connection {
+    int fd;
+    h2_handler_t handler;
+    int64_t window;           // Connection-level send window.
+    int64_t initial_window;   // Peer's SETTINGS_INITIAL_WINDOW_SIZE.
+    long pending_table_size;  // Table size update owed before the next header block, or -1.
+    uint32_t last_stream_id;
+    int num_streams;
+    int next_stream;          // Where the next round-robin pass starts.
+    int preface_pending;
+    int going_away;           // No new streams: the peer sent GOAWAY.
+    int closing;              // We sent GOAWAY: flush and close.
+    hpack_table_t decoder;
+    hpack_table_t encoder;
+    uint32_t header_stream_id; // Stream whose header block awaits CONTINUATION, or 0.
+    size_t header_length;
+    unsigned char header_block[H2_HEADER_BLOCK_SIZE];
+    size_t in_length;
+    unsigned char in[H2_IN_BUFFER_SIZE];
+    size_t out_start;
+    size_t out_length;
+    unsigned char out[H2_OUT_BUFFER_SIZE];
+    h2_stream_t streams[H2_MAX_STREAMS];
+} h2_connection_t;
+
+/* Decoded into fixed buffers, so a stream that is refused costs no memory. */
+typedef struct h2_request_headers {
+    int has_method;
+    int has_path;
+    int too_long; // A value did not fit its buffer.
+    char method[H2_METHOD_SIZE];
+    char path[H2_PATH_SIZE];
+} h2_request_headers_t;
+
+/* Connections are large and a worker serves one at a time, so each worker
+ * keeps one around instead of allocating it per connection (each coroutine,
+ * on coroutine loops: see h2_swap_connection). */
+static __thread h2_connection_t *thread_connection;
+
+static uint32_t read_u32(const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void write_u32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/* Sends everything buffered, blocking. Returns 0, or -1 if the peer is gone. */
+static int flush_all(h2_connection_t *c) {
+    while (c->out_length > 0) {
+        ssize_t sent = send(c->fd, c->out + c->out_start, c->out_length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) continue;
+            c->out_length = 0;
+            return -1;
+        }
+        c->out_start += sent;
+        c->out_length -= sent;
+    }
+    c->out_start = 0;
+    return 0;
+}
+
+/* Returns room for SIZE more bytes at the end of the output buffer, or NULL.
+ * Control frames pass MUST_FIT and get room by blocking on a flush. */
+static unsigned char *out_reserve(h2_connection_t *c, size_t size, int must_fit) {
+    if (c->out_start + c->out_length + size > H2_OUT_BUFFER_SIZE && c->out_start > 0) {
+        memmove(c->out, c->out + c->out_start, c->out_length);
+        c->out_start = 0;
+    }
+    if (c->out_length + size > H2_OUT_BUFFER_SIZE) {
+        if (!must_fit || flush_all(c) == -1) return NULL;
+    }
+    return c->out + c->out_start + c->out_length;
+}
+
+static void write_frame_header(unsigned char *p, size_t length, int type, int flags, uint32_t stream_id) {
+    p[0] = length >> 16;
+    p[1] = length >> 8;
+    p[2] = length;
+    p[3] = type;
+    p[4] = flags;
+    write_u32(p + 5, stream_id & 0x7fffffff);
+}
+
+static void queue_frame(h2_connection_t *c, int type, int flags, uint32_t stream_id, const void *payload,
+                        size_t length) {
+    unsigned char *p = out_reserve(c, H2_FRAME_HEADER_SIZE + length, 1);
+    if (p == NULL) return;
+    write_frame_header(p, length, type, flags, stream_id);
+    if (length) memcpy(p + H2_FRAME_HEADER_SIZE, payload, length);
+    c->out_length += H2_FRAME_HEADER_SIZE + length;
+}
+
+static void queue_window_update(h2_connection_t *c, uint32_t stream_id, uint32_t increment) {
+    unsigned char payload[4];
+    write_u32(payload, increment);
+    queue_frame(c, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void connection_error(h2_connection_t *c, enum h2_error error) {
+    if (c->closing) return;
+    unsigned char payload[8];
+    write_u32(payload, c->last_stream_id);
+    write_u32(payload + 4, error);
+    queue_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->closing = 1;
+}
+
+static void reset_stream(h2_connection_t *c, uint32_t stream_id, enum h2_error error) {
+    unsigned char payload[4];
+    write_u32(payload, error);
+    queue_frame(c, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static h2_stream_t *find_stream(h2_connection_t *c, uint32_t stream_id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        if (c->streams[i].id == stream_id) return &c->streams[i];
+    return NULL;
+}
+
+static void close_stream(h2_connection_t *c, h2_stream_t *stream) {
+    http_response_release(&stream->response);
+    stream->id = 0;
+    /* Each stream's memory goes with it, however long the others stay open. */
+    if (stream->arena != NULL) arena_reset(stream->arena);
+    c->num_streams--;
+}
+
+/* Opens a stream and resolves it; a NULL PATH was too long to keep. */
+static void start_stream(h2_connection_t *c, uint32_t stream_id, char *method, char *path) {
+    h2_stream_t *stream = find_stream(c, 0);
+    stream->id = stream_id;
+    stream->window = c->initial_window;
+    stream->headers_sent = 0;
+    stream->head_only = strcmp(method, "HEAD") == 0;
+    stream->body_sent = 0;
+    c->num_streams++;
+
+    if (path == NULL) {
+        http_response_init(&stream->response, 414);
+        return;
+    }
+    /* The handler allocates from the stream's arena instead of the thread's. */
+    struct http_request request = {.method = method, .path = path, .head = "", .head_length = 0};
+    arena_swap(&stream->arena);
+    c->handler(&request, &stream->response);
+    arena_swap(&stream->arena);
+}
+
+static void on_request_header(void *context, const char *name, size_t name_length, const char *value,
+                              size_t value_length) {
+    h2_request_headers_t *headers = context;
+    char *field;
+    size_t size;
+    if (name_length == 7 && memcmp(name, ":method", 7) == 0) {
+        field = headers->method;
+        size = sizeof(headers->method);
+        headers->has_method = 1;
+    } else if (name_length == 5 && memcmp(name, ":path", 5) == 0) {
+        field = headers->path;
+        size = sizeof(headers->path);
+        headers->has_path = 1;
+    } else {
+        return;
+    }
+
+    if (value_length >= size) {
+        headers->too_long = 1;
+        value_length = 0;
+    }
+    memcpy(field, value, value_length);
+    field[value_length] = '\0';
+}
+
+static void process_header_block(h2_connection_t *c, uint32_t stream_id) {
+    h2_request_headers_t headers;
+    headers.has_method = headers.has_path = headers.too_long = 0;
+    int status = hpack_decode(&c->decoder, c->header_block, c->header_length, on_request_header, &headers);
+    c->header_stream_id = 0;
+    c->header_length = 0;
+    if (status == -1) {
+        connection_error(c, H2_COMPRESSION_ERROR);
+        return;
+    }
+
+    if (stream_id <= c->last_stream_id) {
+        /* Trailers on a stream we are answering are ignored; anything else is
+         * a stream the client already finished with. */
+        if (find_stream(c, stream_id) == NULL) connection_error(c, H2_STREAM_CLOSED);
+        return;
+    }
+    c->last_stream_id = stream_id;
+
+    if (c->going_away) return;
+    if (!headers.has_method || !headers.has_path) reset_stream(c, stream_id, H2_PROTOCOL_ERROR);
+    else if (c->num_streams == H2_MAX_STREAMS) reset_stream(c, stream_id, H2_REFUSED_STREAM);
+    else start_stream(c, stream_id, headers.method, headers.too_long ? NULL : headers.path);
+}
+
+static void append_header_fragment(h2_connection_t *c, const unsigned char *fragment, size_t length) {
+    if (c->header_length + length > H2_HEADER_BLOCK_SIZE) {
+        connection_error(c, H2_PROTOCOL_ERROR);
+        return;
+    }
+    memcpy(c->header_block + c->header_length, fragment, length);
+    c->header_length += length;
+}
+
+static void apply_settings(h2_connection_t *c, const unsigned char *payload, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        int id = payload[i] << 8 | payload[i + 1];
+        uint32_t value = read_u32(payload + i + 2);
+
+        if (id == H2_SETTINGS_HEADER_TABLE_SIZE) {
+            size_t size = value < HPACK_TABLE_SIZE ? value : HPACK_TABLE_SIZE;
+            if (size != c->encoder.max_size) {
+                hpack_table_resize(&c->encoder, size);
+                c->pending_table_size = size;
+            }
+        } else if (id == H2_SETTINGS_ENABLE_PUSH && value > 1) {
+            connection_error(c, H2_PROTOCOL_ERROR);
+        } else if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > H2_MAX_WINDOW) {
+                connection_error(c, H2_FLOW_CONTROL_ERROR);
+                return;
+            }
+            /* The change applies to every open stream's window. */
+            int64_t delta = (int64_t) value - c->initial_window;
+            for (int j = 0; j < H2_MAX_STREAMS; j++) {
+                if (c->streams[j].id == 0) continue;
+                c->streams[j].window += delta;
+                if (c->streams[j].window > H2_MAX_WINDOW) {
+                    connection_error(c, H2_FLOW_CONTROL_ERROR);
+                    return;
+                }
+            }
+            c->initial_window = value;
+        } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+            /* Valid values only let us send bigger frames; we stay at 16 KiB. */
+            if (value < H2_FRAME_SIZE || value > H2_MAX_PEER_FRAME_SIZE) {
+                connection_error(c, H2_PROTOCOL_ERROR);
+                return;
+            }
+        }
+    }
+}
+
+static void handle_window_update(h2_connection_t *c, uint32_t stream_id, uint32_t increment) {
+    if (stream_id == 0) {
+        if (increment == 0) connection_error(c, H2_PROTOCOL_ERROR);
+        else if (c->window + increment > H2_MAX_WINDOW) connection_error(c, H2_FLOW_CONTROL_ERROR);
+        else c->window += increment;
+        return;
+    }
+
+    h2_stream_t *stream = find_stream(c, stream_id);
+    if (stream == NULL) return; // Updates may race with the end of a stream.
+    if (increment == 0 || stream->window + increment > H2_MAX_WINDOW) {
+        reset_stream(c, stream_id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        close_stream(c, stream);
+        return;
+    }
+    stream->window += increment;
+}
+
+static void handle_frame(h2_connection_t *c, int type, int flags, uint32_t stream_id, const unsigned char *payload,
+                         size_t length) {
+    /* A header block must be continued without anything in between. */
+    if (c->header_stream_id && (type != H2_CONTINUATION || stream_id != c->header_stream_id)) {
+        connection_error(c, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+        case H2_DATA:
+            if (stream_id == 0) {
+                connection_error(c, H2_PROTOCOL_ERROR);
+                return;
+            }
+            /* Request bodies are not used; hand the window straight back. */
+            if (length > 0) {
+                queue_window_update(c, 0, length);
+                if (find_stream(c, stream_id)) queue_window_update(c, stream_id, length);
+            }
+            break;
+
+        case H2_HEADERS:
+            if (stream_id == 0 || stream_id % 2 == 0) {
+                connection_error(c, H2_PROTOCOL_ERROR);
+                return;
+            }
+            if (flags & H2_FLAG_PADDED) {
+                if (length < 1 || payload[0] >= length) {
+                    connection_error(c, H2_PROTOCOL_ERROR);
+                    return;
+                }
+                length -= 1 + payload[0];
+                payload++;
+            }
+            if (flags & H2_FLAG_PRIORITY) {
+                if (length < 5) {
+                    connection_error(c, H2_PROTOCOL_ERROR);
+                    return;
+                }
+                payload += 5;
+                length -= 5;
+            }
+            append_header_fragment(c, payload, length);
+            if (flags & H2_FLAG_END_HEADERS) process_header_block(c, stream_id);
+            else c->header_stream_id = stream_id;
+            break;
+
+        case H2_CONTINUATION:
+            if (c->header_stream_id == 0) {
+                connection_error(c, H2_PROTOCOL_ERROR);
+                return;
+            }
+            append_header_fragment(c, payload, length);
+            if (flags & H2_FLAG_END_HEADERS) process_header_block(c, stream_id);
+            break;
+
+        case H2_PRIORITY:
+            if (length != 5) reset_stream(c, stream_id, H2_FRAME_SIZE_ERROR);
+            break; // Streams are served round-robin regardless of priority.
+
+        case H2_RST_STREAM:
+            if (stream_id == 0 || length != 4) {
+                connection_error(c, stream_id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            h2_stream_t *stream = find_stream(c, stream_id);
+            if (stream) close_stream(c, stream);
+            break;
+
+        case H2_SETTINGS:
+            if (stream_id != 0) {
+                connection_error(c, H2_PROTOCOL_ERROR);
+                return;
+            }
+            if ((flags & H2_FLAG_ACK) ? length != 0 : length % 6 != 0) {
+                connection_error(c, H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            if (flags & H2_FLAG_ACK) return;
+            apply_settings(c, payload, length);
+            queue_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+            break;
+
+        case H2_PING:
+            if (stream_id != 0 || length != 8) {
+                connection_error(c, stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            if (!(flags & H2_FLAG_ACK)) queue_frame(c, H2_PING, H2_FLAG_ACK, 0, payload, length);
+            break;
+
+        case H2_GOAWAY:
+            c->going_away = 1;
+            break;
+
+        case H2_WINDOW_UPDATE:
+            if (length != 4) {
+                connection_error(c, H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            handle_window_update(c, stream_id, read_u32(payload) & 0x7fffffff);
+            break;
+
+        case H2_PUSH_PROMISE:
+            connection_error(c, H2_PROTOCOL_ERROR); // Clients cannot push.
+            break;
+
+        default:
+            break; // Unknown frame types are ignored.
+    }
+}
+
+/* Reads what the peer sent and handles every complete frame. Returns -1 once
+ * the connection is finished. */
+static int read_frames(h2_connection_t *c) {
+    ssize_t bytes_read = recv(c->fd, c->in + c->in_length, H2_IN_BUFFER_SIZE - c->in_length, 0);
+    if (bytes_read <= 0) return bytes_read < 0 && errno == EINTR ? 0 : -1;
+    c->in_length += bytes_read;
+
+    size_t position = 0;
+    if (c->preface_pending) {
+        if (c->in_length < H2_PREFACE_LENGTH) return 0;
+        if (memcmp(c->in, H2_PREFACE, H2_PREFACE_LENGTH) != 0) return -1;
+        c->preface_pending = 0;
+        position = H2_PREFACE_LENGTH;
+    }
+
+    while (!c->closing && c->in_length - position >= H2_FRAME_HEADER_SIZE) {
+        unsigned char *header = c->in + position;
+        size_t length = (size_t) header[0] << 16 | header[1] << 8 | header[2];
+        if (length > H2_FRAME_SIZE) {
+            connection_error(c, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (c->in_length - position < H2_FRAME_HEADER_SIZE + length) break;
+        handle_frame(c, header[3], header[4], read_u32(header + 5) & 0x7fffffff, header + H2_FRAME_HEADER_SIZE,
+                     length);
+        position += H2_FRAME_HEADER_SIZE + length;
+    }
+
+    memmove(c->in, c->in + position, c->in_length - position);
+    c->in_length -= position;
+    return 0;
+}
+
+/* Queues the response HEADERS for STREAM. Returns 0, or -1 if the output
+ * buffer is too full. */
+static int send_headers(h2_connection_t *c, h2_stream_t *stream) {
+    unsigned char *p = out_reserve(c, H2_FRAME_HEADER_SIZE + 512, 0);
+    if (p == NULL) return -1;
+
+    unsigned char *block = p + H2_FRAME_HEADER_SIZE;
+    size_t length = 0, capacity = 512;
+    if (c->pending_table_size >= 0) {
+        length += hpack_encode_size_update(block, capacity, c->pending_table_size);
+        c->pending_table_size = -1;
+    }
+
+    char status[4], content_length[24];
+    snprintf(status, sizeof(status), "%d", stream->response.status_code);
+    snprintf(content_length, sizeof(content_length), "%zu", stream->response.content_length);
+    length += hpack_encode_header(&c->encoder, block + length, capacity - length, ":status", status, 0);
+    length += hpack_encode_header(&c->encoder, block + length, capacity - length, "content-type",
+                                  stream->response.content_type, 1);
+    length += hpack_encode_header(&c->encoder, block + length, capacity - length, "content-length",
+                                  content_length, 0);
+
+    int end_stream = stream->head_only || stream->response.content_length == 0;
+    write_frame_header(p, length, H2_HEADERS, H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0),
+                       stream->id);
+    c->out_length += H2_FRAME_HEADER_SIZE + length;
+    stream->headers_sent = 1;
+    if (end_stream) close_stream(c, stream);
+    return 0;
+}
+
+/* Queues the next DATA frame of STREAM. Returns 1 if a frame was queued, 0 if
+ * the stream is blocked by flow control, and -1 if the buffer is full. */
+static int send_data(h2_connection_t *c, h2_stream_t *stream) {
+    size_t chunk = stream->response.content_length - stream->body_sent;
+    if (chunk > H2_FRAME_SIZE) chunk = H2_FRAME_SIZE;
+    if ((int64_t) chunk > c->window) chunk = c->window > 0 ? c->window : 0;
+    if ((int64_t) chunk > stream->window) chunk = stream->window > 0 ? stream->window : 0;
+    if (chunk == 0) return 0;
+
+    unsigned char *p = out_reserve(c, H2_FRAME_HEADER_SIZE + chunk, 0);
+    if (p == NULL) return -1;
+
+    unsigned char *payload = p + H2_FRAME_HEADER_SIZE;
+    if (stream->response.data) {
+        memcpy(payload, stream->response.data + stream->body_sent, chunk);
+    } else {
+        ssize_t bytes_read = pread(stream->response.file_fd, payload, chunk, stream->body_sent);
+        if (bytes_read <= 0) {
+            reset_stream(c, stream->id, H2_INTERNAL_ERROR);
+            close_stream(c, stream);
+            return 1;
+        }
+        chunk = bytes_read;
+    }
+
+    stream->body_sent += chunk;
+    c->window -= chunk;
+    stream->window -= chunk;
+    int end_stream = stream->body_sent == stream->response.content_length;
+    write_frame_header(p, chunk, H2_DATA, end_stream ? H2_FLAG_END_STREAM : 0, stream->id);
+    c->out_length += H2_FRAME_HEADER_SIZE + chunk;
+    if (end_stream) close_stream(c, stream);
+    return 1;
+}
+
+/* Fills the output buffer: pending headers first, then one DATA frame per
+ * stream per round until the buffer is full or every stream is blocked. */
+static void schedule(h2_connection_t *c) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        h2_stream_t *stream = &c->streams[i];
+        if (stream->id && !stream->headers_sent && send_headers(c, stream) == -1) return;
+    }
+
+    int progress = 1;
+    while (progress && c->num_streams > 0) {
+        progress = 0;
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            h2_stream_t *stream = &c->streams[(c->next_stream + i) % H2_MAX_STREAMS];
+            if (stream->id == 0 || !stream->headers_sent) continue;
+            int status = send_data(c, stream);
+            if (status == -1) return;
+            progress |= status;
+        }
+        c->next_stream = (c->next_stream + 1) % H2_MAX_STREAMS;
+    }
+}
+
+static h2_connection_t *connection_open(int fd, h2_handler_t handler) {
+    if (thread_connection == NULL && (thread_connection = malloc(sizeof(h2_connection_t))) == NULL) return NULL;
+    h2_connection_t *c = thread_connection;
+    c->fd = fd;
+    c->handler = handler;
+    c->window = H2_DEFAULT_WINDOW;
+    c->initial_window = H2_DEFAULT_WINDOW;
+    c->pending_table_size = -1;
+    c->last_stream_id = 0;
+    c->num_streams = 0;
+    c->next_stream = 0;
+    c->preface_pending = 1;
+    c->going_away = 0;
+    c->closing = 0;
+    c->header_stream_id = 0;
+    c->header_length = 0;
+    c->in_length = 0;
+    c->out_start = 0;
+    c->out_length = 0;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        c->streams[i].id = 0;
+        c->streams[i].arena = NULL;
+    }
+    hpack_table_init(&c->decoder, HPACK_TABLE_SIZE);
+    hpack_table_init(&c->encoder, HPACK_TABLE_SIZE);
+
+    unsigned char settings[6];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(settings + 2, H2_MAX_STREAMS);
+    queue_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    return c;
+}
+
+static void connection_run(h2_connection_t *c) {
+    while (!c->closing || c->out_length > 0) {
+        if (!c->closing) schedule(c);
+        if (c->going_away && c->num_streams == 0 && c->out_length == 0) break;
+
+        struct pollfd pfd = {.fd = c->fd, .events = (c->closing ? 0 : POLLIN) | (c->out_length ? POLLOUT : 0)};
+        int ready = poll(&pfd, 1, H2_IDLE_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) break;
+        if (ready == 0) {
+            if (c->closing) break;
+            connection_error(c, H2_NO_ERROR); // Idle: say goodbye.
+            continue;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t sent = send(c->fd, c->out + c->out_start, c->out_length, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno != EAGAIN && errno != EINTR) break;
+            if (sent > 0) {
+                c->out_start += sent;
+                c->out_length -= sent;
+                if (c->out_length == 0) c->out_start = 0;
+            }
+        }
+        if ((pfd.revents & POLLIN) && read_frames(c) == -1) break;
+        if ((pfd.revents & (POLLERR | POLLHUP)) && !(pfd.revents & POLLIN)) break;
+    }
+
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->streams[i].id) close_stream(c, &c->streams[i]);
+        if (c->streams[i].arena != NULL) arena_destroy(c->streams[i].arena);
+        c->streams[i].arena = NULL;
+    }
+    hpack_table_destroy(&c->decoder);
+    hpack_table_destroy(&c->encoder);
+}
+
+int h2_preface_pending(int fd) {
+    /* Every HTTP/1 request line has at least four bytes, so waiting for them
+     * cannot stall a well-formed client. */
+    char peek[4];
+    return recv(fd, peek, sizeof(peek), MSG_PEEK | MSG_WAITALL) == sizeof(peek) &&
+           memcmp(peek, H2_PREFACE, sizeof(peek)) == 0;
+}
+
+int h2_upgrade_requested(struct http_request *request) {
+    char value[128];
+    return http_request_header(request, "Upgrade", value, sizeof(value)) && strcasestr(value, "h2c") != NULL &&
+           http_request_header(request, "HTTP2-Settings", value, sizeof(value));
+}
+
+void h2_serve(int fd, h2_handler_t handler) {
+    h2_connection_t *c = connection_open(fd, handler);
+    if (c == NULL) return;
+    connection_run(c);
+}
+
+/* Decodes unpadded base64url. Returns the decoded length, or -1. */
+static long base64url_decode(const char *in, unsigned char *out, size_t capacity) {
+    uint32_t bits = 0;
+    int num_bits = 0;
+    size_t length = 0;
+    for (; *in && *in != '='; in++) {
+        int value;
+        if (*in >= 'A' && *in <= 'Z') value = *in - 'A';
+        else if (*in >= 'a' && *in <= 'z') value = *in - 'a' + 26;
+        else if (*in >= '0' && *in <= '9') value = *in - '0' + 52;
+        else if (*in == '-') value = 62;
+        else if (*in == '_') value = 63;
+        else return -1;
+        bits = bits << 6 | value;
+        num_bits += 6;
+        if (num_bits >= 8) {
+            if (length == capacity) return -1;
+            num_bits -= 8;
+            out[length++] = bits >> num_bits;
+        }
+    }
+    return (long) length;
+}
+
+void h2_serve_upgrade(int fd, struct http_request *request, h2_handler_t handler) {
+    char encoded[256];
+    unsigned char settings[192];
+    http_request_header(request, "HTTP2-Settings", encoded, sizeof(encoded));
+    long settings_length = base64url_decode(encoded, settings, sizeof(settings));
+    if (settings_length < 0 || settings_length % 6 != 0) {
+        http_start_response(fd, 400);
+        http_end_headers(fd);
+        return;
+    }
+
+    char *switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    http_send_data(fd, switching, strlen(switching));
+
+    /* The upgrade request becomes stream 1, half-closed by the client. */
+    h2_connection_t *c = connection_open(fd, handler);
+    if (c == NULL) return;
+    apply_settings(c, settings, settings_length);
+    c->last_stream_id = 1;
+    start_stream(c, 1, request->method, request->path);
+    connection_run(c);
+}
+
+void h2_swap_connection(void **connection) {
+    h2_connection_t *swapped = thread_connection;
+    thread_connection = *connection;
+    *connection = swapped;
+}
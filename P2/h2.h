@@ -0,0 +1,48 @@
+#ifndef __H2__
+#define __H2__
+
+#include "libhttp.h"
+
+/*
+ * HTTP/2 over cleartext TCP (h2c, RFC 9113), entered either with prior
+ * knowledge (the client opens with the connection preface) or through an
+ * HTTP/1.1 "Upgrade: h2c" request. One worker serves the whole connection:
+ * streams are resolved as their HEADERS arrive and their bodies are
+ * interleaved one DATA frame per stream per round, within the peer's
+ * connection and stream flow-control windows.
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+#define H2_MAX_STREAMS 100           // SETTINGS_MAX_CONCURRENT_STREAMS we advertise.
+#define H2_FRAME_SIZE 16384          // Largest frame we accept and send.
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 2147483647
+#define H2_HEADER_BLOCK_SIZE 65536   // Limit on HEADERS plus CONTINUATION.
+#define H2_OUT_BUFFER_SIZE (4 * (H2_FRAME_SIZE + 9))
+#define H2_IDLE_TIMEOUT_MS 10000
+
+/* Fills RESPONSE for REQUEST. REQUEST->head is empty: only the method and the
+ * path are passed on. */
+typedef void (*h2_handler_t)(struct http_request *request, struct http_response *response);
+
+/* Returns 1 if the client on FD has started with the HTTP/2 preface. Only
+ * peeks, so an HTTP/1 request can still be parsed afterwards. */
+int h2_preface_pending(int fd);
+
+/* Returns 1 if REQUEST asks to upgrade to h2c. */
+int h2_upgrade_requested(struct http_request *request);
+
+/* Serves an HTTP/2 connection that opened with the preface. */
+void h2_serve(int fd, h2_handler_t handler);
+
+/* Accepts the upgrade REQUEST asked for and serves the connection, answering
+ * REQUEST itself on stream 1. */
+void h2_serve_upgrade(int fd, struct http_request *request, h2_handler_t handler);
+
+/* Exchanges *CONNECTION with the connection state the calling thread reuses
+ * (NULL: none yet), for code that interleaves connections on one thread (see
+ * coro.h). Between connections the state holds nothing but itself: free() it. */
+void h2_swap_connection(void **connection);
+
+#endif
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "hotrestart.h"
+
+typedef struct handoff_server {
+    char *path;
+    int control_fd;
+    int listen_fd;
+    size_t (*snapshot)(char *out, size_t capacity);
+    void (*stop)(void);
+} handoff_server_t;
+
+static int old_server_fd = -1; // Our connection to the server we are taking over from.
+
+static int fill_address(struct sockaddr_un *address, const char *path) {
+    if (strlen(path) >= sizeof(address->sun_path)) return -1;
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+static int read_all(int fd, void *data, size_t size) {
+    while (size > 0) {
+        ssize_t bytes_read = read(fd, data, size);
+        if (bytes_read <= 0) return -1;
+        data = (char *) data + bytes_read;
+        size -= bytes_read;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) return -1;
+        data = (const char *) data + written;
+        size -= written;
+    }
+    return 0;
+}
+
+/* Sends LISTEN_FD along with the snapshot's LENGTH. */
+static int send_listen_fd(int fd, int listen_fd, uint32_t length) {
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {&length, sizeof(length)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &listen_fd, sizeof(int));
+    return sendmsg(fd, &message, 0) == sizeof(length) ? 0 : -1;
+}
+
+int hotrestart_take_over(const char *path, char *snapshot, size_t capacity, size_t *snapshot_length) {
+    struct sockaddr_un address;
+    if (fill_address(&address, path) == -1) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t length = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&length, sizeof(length)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    int listen_fd = -1;
+    if (recvmsg(fd, &message, MSG_CMSG_CLOEXEC) == sizeof(length)) {
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            memcpy(&listen_fd, CMSG_DATA(header), sizeof(int));
+    }
+    if (listen_fd == -1 || length > capacity || read_all(fd, snapshot, length) == -1) {
+        if (listen_fd >= 0) close(listen_fd);
+        close(fd);
+        return -1;
+    }
+
+    *snapshot_length = length;
+    old_server_fd = fd;
+    return listen_fd;
+}
+
+int hotrestart_ready(void) {
+    char reply = HOTRESTART_READY;
+    int ok = write_all(old_server_fd, &reply, 1) == 0 && read_all(old_server_fd, &reply, 1) == 0 &&
+             reply == HOTRESTART_DONE;
+    close(old_server_fd);
+    old_server_fd = -1;
+    return ok ? 0 : -1;
+}
+
+/*
+ * Hands the listening socket to each process that connects until one of them
+ * reports it is ready; one that goes away or stalls before that changes
+ * nothing here. Running out of fds or memory is waited out; any other accept
+ * error ends hot restart for this process, which goes on serving.
+ */
+static void *handoff_thread(void *args) {
+    handoff_server_t *server = args;
+    char *snapshot = malloc(HOTRESTART_SNAPSHOT_MAX_SIZE);
+    struct timeval timeout = {HOTRESTART_TIMEOUT_MS / 1000, (HOTRESTART_TIMEOUT_MS % 1000) * 1000};
+
+    while (1) {
+        int fd = accept4(server->control_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                usleep(HOTRESTART_ACCEPT_BACKOFF_MS * 1000);
+                continue;
+            }
+            perror("Hot restart stopped: accept");
+            close(server->control_fd);
+            unlink(server->path);
+            break;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char reply;
+        uint32_t length = server->snapshot(snapshot, HOTRESTART_SNAPSHOT_MAX_SIZE);
+        if (send_listen_fd(fd, server->listen_fd, length) == 0 && write_all(fd, snapshot, length) == 0 &&
+            read_all(fd, &reply, 1) == 0 && reply == HOTRESTART_READY) {
+            /* Give the control socket up before saying so, so the new process
+             * can bind it in turn. */
+            close(server->control_fd);
+            unlink(server->path);
+            reply = HOTRESTART_DONE;
+            write_all(fd, &reply, 1);
+            close(fd);
+            server->stop();
+            break;
+        }
+        fprintf(stderr, "Hot restart abandoned by the new process\n");
+        close(fd);
+    }
+
+    free(snapshot);
+    return NULL;
+}
+
+int hotrestart_serve(const char *path, int listen_fd, size_t (*snapshot)(char *out, size_t capacity),
+                     void (*stop)(void)) {
+    struct sockaddr_un address;
+    if (fill_address(&address, path) == -1) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    /* A socket file left by a server that exited without handing off. */
+    struct stat path_stat;
+    if (stat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(fd, 4) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    handoff_server_t *server = malloc(sizeof(handoff_server_t));
+    *server = (handoff_server_t) {strdup(path), fd, listen_fd, snapshot, stop};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handoff_thread, server) != 0) {
+        close(fd);
+        free(server->path);
+        free(server);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
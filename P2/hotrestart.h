@@ -0,0 +1,48 @@
+#ifndef __HOTRESTART__
+#define __HOTRESTART__
+
+#include <stddef.h>
+
+/*
+ * Hot restart: a new server process takes the listening socket over from the
+ * running one through a control socket (a Unix domain socket both are given
+ * with --hot-restart), so no connection is refused or reset while a new
+ * binary or content root is deployed.
+ *
+ *   new                                   old
+ *   connect to the control socket  --->   accept
+ *                                  <---   listening fd (SCM_RIGHTS), snapshot
+ *   warm caches, start workers
+ *   "ready"                        --->   give up the control socket
+ *                                  <---   "done"; stop accepting, drain, exit
+ *   serve handoffs at the control socket
+ *
+ * Connections waiting in the kernel's accept queue belong to the shared
+ * listening socket, so the new process simply accepts them; those the old one
+ * already accepted are finished by its workers before it exits.
+ */
+
+#define HOTRESTART_SNAPSHOT_MAX_SIZE (1024 * 1024)
+#define HOTRESTART_READY 'R'
+#define HOTRESTART_DONE 'D'
+#define HOTRESTART_TIMEOUT_MS 30000 // How long the old server waits on each step of the new one, warming included.
+#define HOTRESTART_ACCEPT_BACKOFF_MS 100 // Retry delay when out of fds or memory for the control connection.
+
+/* Asks the server whose control socket is at PATH for its listening socket.
+ * Returns the socket, or -1 if no server answers there. The old server's
+ * snapshot is read into SNAPSHOT (up to CAPACITY bytes) and its length stored
+ * in *SNAPSHOT_LENGTH. Call hotrestart_ready once ready to accept. */
+int hotrestart_take_over(const char *path, char *snapshot, size_t capacity, size_t *snapshot_length);
+
+/* Tells the old server to stop accepting, and waits until it has given up the
+ * control socket. Returns 0, or -1 if it went away first. */
+int hotrestart_ready(void);
+
+/* Serves handoffs of LISTEN_FD at the control socket PATH from a new thread.
+ * SNAPSHOT fills in the snapshot sent to the new process and returns its
+ * length; STOP is called once the new process is ready, and must make this one
+ * stop accepting. Returns 0, or -1 if PATH cannot be bound. */
+int hotrestart_serve(const char *path, int listen_fd, size_t (*snapshot)(char *out, size_t capacity),
+                     void (*stop)(void));
+
+#endif
@@ -0,0 +1,354 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+#define HPACK_HUFFMAN_SYMBOLS 257 // 256 octets and EOS.
+#define HPACK_HUFFMAN_EOS 256
+#define HPACK_HUFFMAN_MAX_LENGTH 30
+
+typedef struct hpack_static_entry {
+    const char *name;
+    const char *value;
+} hpack_static_entry_t;
+
+/* RFC 7541 Appendix A. Index 1 is STATIC_TABLE[0]. */
+static const hpack_static_entry_t STATIC_TABLE[HPACK_STATIC_ENTRIES] = {
+        {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+        {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+        {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+        {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""},
+        {"cache-control", ""}, {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+        {"content-length", ""}, {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+        {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+        {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+        {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""},
+        {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+        {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+        {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+
+/*
+ * Code lengths of the HPACK Huffman code (RFC 7541 Appendix B), by symbol.
+ * The code is canonical: sorting symbols by (length, symbol) and counting up
+ * reproduces every code in the appendix, so the codes themselves are derived
+ * from these lengths at startup. The lengths satisfy Kraft's equality
+ * (sum of 2^-length is exactly 1), i.e. every bit string decodes.
+ */
+static const unsigned char HUFFMAN_LENGTHS[HPACK_HUFFMAN_SYMBOLS] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+        30,
+};
+
+static uint32_t huffman_codes[HPACK_HUFFMAN_SYMBOLS];
+static uint32_t huffman_first_code[HPACK_HUFFMAN_MAX_LENGTH + 1]; // First code of each length.
+static uint16_t huffman_count[HPACK_HUFFMAN_MAX_LENGTH + 1];      // Number of codes of each length.
+static uint16_t huffman_offset[HPACK_HUFFMAN_MAX_LENGTH + 1];     // Index of the first one in SORTED.
+static uint16_t huffman_sorted[HPACK_HUFFMAN_SYMBOLS];            // Symbols ordered by (length, symbol).
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init(void) {
+    for (int symbol = 0; symbol < HPACK_HUFFMAN_SYMBOLS; symbol++) huffman_count[HUFFMAN_LENGTHS[symbol]]++;
+
+    uint32_t code = 0;
+    uint16_t offset = 0;
+    for (int length = 1; length <= HPACK_HUFFMAN_MAX_LENGTH; length++) {
+        code = (code + huffman_count[length - 1]) << 1;
+        huffman_first_code[length] = code;
+        huffman_offset[length] = offset;
+        offset += huffman_count[length];
+    }
+
+    uint16_t next[HPACK_HUFFMAN_MAX_LENGTH + 1];
+    memcpy(next, huffman_offset, sizeof(next));
+    for (int symbol = 0; symbol < HPACK_HUFFMAN_SYMBOLS; symbol++) {
+        int length = HUFFMAN_LENGTHS[symbol];
+        huffman_codes[symbol] = huffman_first_code[length] + (next[length] - huffman_offset[length]);
+        huffman_sorted[next[length]++] = symbol;
+    }
+}
+
+long hpack_huffman_decode(const unsigned char *in, size_t length, char *out, size_t capacity) {
+    pthread_once(&huffman_once, huffman_init);
+
+    uint32_t code = 0;
+    int code_length = 0;
+    size_t decoded = 0;
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((in[i] >> bit) & 1);
+            code_length++;
+            uint32_t rank = code - huffman_first_code[code_length];
+            if (code >= huffman_first_code[code_length] && rank < huffman_count[code_length]) {
+                int symbol = huffman_sorted[huffman_offset[code_length] + rank];
+                if (symbol == HPACK_HUFFMAN_EOS || decoded == capacity) return -1;
+                out[decoded++] = (char) symbol;
+                code = 0;
+                code_length = 0;
+            } else if (code_length == HPACK_HUFFMAN_MAX_LENGTH) {
+                return -1;
+            }
+        }
+    }
+
+    /* Padding is at most 7 bits and must be a prefix of EOS (all ones). */
+    if (code_length > 7 || code != (1u << code_length) - 1) return -1;
+    return (long) decoded;
+}
+
+size_t hpack_huffman_length(const char *in, size_t length) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < length; i++) bits += HUFFMAN_LENGTHS[(unsigned char) in[i]];
+    return (bits + 7) / 8;
+}
+
+void hpack_huffman_encode(const char *in, size_t length, unsigned char *out) {
+    pthread_once(&huffman_once, huffman_init);
+
+    uint64_t bits = 0;
+    int num_bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char symbol = in[i];
+        bits = (bits << HUFFMAN_LENGTHS[symbol]) | huffman_codes[symbol];
+        num_bits += HUFFMAN_LENGTHS[symbol];
+        while (num_bits >= 8) {
+            num_bits -= 8;
+            *out++ = (unsigned char) (bits >> num_bits);
+        }
+    }
+    if (num_bits > 0) *out = (unsigned char) ((bits << (8 - num_bits)) | (0xff >> num_bits));
+}
+
+void hpack_table_init(hpack_table_t *table, size_t max_size) {
+    memset(table, 0, sizeof(hpack_table_t));
+    table->max_size = max_size;
+}
+
+static void table_evict_oldest(hpack_table_t *table) {
+    hpack_entry_t *entry = &table->entries[table->first];
+    table->size -= entry->name_length + entry->value_length + HPACK_ENTRY_OVERHEAD;
+    free(entry->name);
+    table->first = (table->first + 1) % HPACK_MAX_ENTRIES;
+    table->count--;
+}
+
+void hpack_table_destroy(hpack_table_t *table) {
+    while (table->count > 0) table_evict_oldest(table);
+}
+
+void hpack_table_resize(hpack_table_t *table, size_t max_size) {
+    table->max_size = max_size;
+    while (table->size > table->max_size) table_evict_oldest(table);
+}
+
+static void table_insert(hpack_table_t *table, const char *name, size_t name_length, const char *value,
+                         size_t value_length) {
+    size_t size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+
+    /* Copy first: NAME may belong to an entry the insertion evicts. */
+    char *copy = malloc(name_length + value_length + 2);
+    memcpy(copy, name, name_length);
+    copy[name_length] = '\0';
+    memcpy(copy + name_length + 1, value, value_length);
+    copy[name_length + 1 + value_length] = '\0';
+
+    while (table->count > 0 && table->size + size > table->max_size) table_evict_oldest(table);
+    if (size > table->max_size) {
+        free(copy); // Too big for any table: it just empties it.
+        return;
+    }
+
+    hpack_entry_t *entry = &table->entries[(table->first + table->count) % HPACK_MAX_ENTRIES];
+    entry->name = copy;
+    entry->value = copy + name_length + 1;
+    entry->name_length = name_length;
+    entry->value_length = value_length;
+    table->size += size;
+    table->count++;
+}
+
+/* Looks up INDEX in the static and dynamic tables. Returns 0 or -1. */
+static int table_get(hpack_table_t *table, uint64_t index, const char **name, size_t *name_length,
+                     const char **value, size_t *value_length) {
+    if (index == 0) return -1;
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name = STATIC_TABLE[index - 1].name;
+        *value = STATIC_TABLE[index - 1].value;
+        *name_length = strlen(*name);
+        *value_length = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= (uint64_t) table->count) return -1;
+    hpack_entry_t *entry = &table->entries[(table->first + table->count - 1 - index) % HPACK_MAX_ENTRIES];
+    *name = entry->name;
+    *value = entry->value;
+    *name_length = entry->name_length;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+/* Decodes an integer with an N-bit prefix (RFC 7541 section 5.1). */
+static int decode_integer(const unsigned char **p, const unsigned char *end, int prefix_bits, uint64_t *value) {
+    if (*p >= end) return -1;
+    uint64_t limit = (1u << prefix_bits) - 1;
+    *value = *(*p)++ & limit;
+    if (*value < limit) return 0;
+
+    for (int shift = 0; *p < end && shift <= 56; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value += (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return 0;
+    }
+    return -1;
+}
+
+/* Decodes a string literal into BUFFER. Returns its length or -1. */
+static long decode_string(const unsigned char **p, const unsigned char *end, char *buffer) {
+    if (*p >= end) return -1;
+    int huffman = **p & 0x80;
+    uint64_t length;
+    if (decode_integer(p, end, 7, &length) == -1 || length > (uint64_t) (end - *p)) return -1;
+
+    const unsigned char *data = *p;
+    *p += length;
+    if (huffman) return hpack_huffman_decode(data, length, buffer, HPACK_MAX_STRING_SIZE);
+    if (length > HPACK_MAX_STRING_SIZE) return -1;
+    memcpy(buffer, data, length);
+    return (long) length;
+}
+
+int hpack_decode(hpack_table_t *table, const unsigned char *block, size_t length,
+                 hpack_header_callback_t callback, void *context) {
+    const unsigned char *p = block, *end = block + length;
+    char name_buffer[HPACK_MAX_STRING_SIZE], value_buffer[HPACK_MAX_STRING_SIZE];
+    int headers_seen = 0;
+
+    while (p < end) {
+        const char *name, *value;
+        size_t name_length, value_length;
+        uint64_t index;
+        int add_to_table = 0;
+
+        if (*p & 0x80) {
+            /* Indexed header field. */
+            if (decode_integer(&p, end, 7, &index) == -1 ||
+                table_get(table, index, &name, &name_length, &value, &value_length) == -1)
+                return -1;
+        } else if ((*p & 0xe0) == 0x20) {
+            /* Dynamic table size update, only allowed before the first header. */
+            if (headers_seen || decode_integer(&p, end, 5, &index) == -1 || index > HPACK_TABLE_SIZE) return -1;
+            hpack_table_resize(table, index);
+            continue;
+        } else {
+            /* Literal with incremental indexing (01), without indexing (0000)
+             * or never indexed (0001); the name is either indexed or literal. */
+            add_to_table = (*p & 0xc0) == 0x40;
+            if (decode_integer(&p, end, add_to_table ? 6 : 4, &index) == -1) return -1;
+            if (index) {
+                if (table_get(table, index, &name, &name_length, &value, &value_length) == -1) return -1;
+            } else {
+                long string_length = decode_string(&p, end, name_buffer);
+                if (string_length == -1) return -1;
+                name = name_buffer;
+                name_length = string_length;
+            }
+            long string_length = decode_string(&p, end, value_buffer);
+            if (string_length == -1) return -1;
+            value = value_buffer;
+            value_length = string_length;
+        }
+
+        headers_seen = 1;
+        callback(context, name, name_length, value, value_length);
+        if (add_to_table) table_insert(table, name, name_length, value, value_length);
+    }
+    return 0;
+}
+
+static size_t encode_integer(unsigned char *out, size_t capacity, unsigned char flags, int prefix_bits,
+                             uint64_t value) {
+    uint64_t limit = (1u << prefix_bits) - 1;
+    if (capacity == 0) return 0;
+    if (value < limit) {
+        out[0] = flags | (unsigned char) value;
+        return 1;
+    }
+
+    size_t written = 0;
+    out[written++] = flags | (unsigned char) limit;
+    value -= limit;
+    while (value >= 0x80) {
+        if (written == capacity) return 0;
+        out[written++] = (unsigned char) (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (written == capacity) return 0;
+    out[written++] = (unsigned char) value;
+    return written;
+}
+
+static size_t encode_string(unsigned char *out, size_t capacity, const char *string) {
+    size_t length = strlen(string), huffman_length = hpack_huffman_length(string, length);
+    int huffman = huffman_length < length;
+    size_t encoded_length = huffman ? huffman_length : length;
+
+    size_t written = encode_integer(out, capacity, huffman ? 0x80 : 0, 7, encoded_length);
+    if (written == 0 || capacity - written < encoded_length) return 0;
+    if (huffman) hpack_huffman_encode(string, length, out + written);
+    else memcpy(out + written, string, length);
+    return written + encoded_length;
+}
+
+size_t hpack_encode_header(hpack_table_t *table, unsigned char *out, size_t capacity,
+                           const char *name, const char *value, int index) {
+    size_t name_index = 0;
+    for (int i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        if (strcmp(STATIC_TABLE[i].name, name) != 0) continue;
+        if (strcmp(STATIC_TABLE[i].value, value) == 0) return encode_integer(out, capacity, 0x80, 7, i + 1);
+        if (name_index == 0) name_index = i + 1;
+    }
+    for (int i = 0; i < table->count; i++) {
+        hpack_entry_t *entry = &table->entries[(table->first + table->count - 1 - i) % HPACK_MAX_ENTRIES];
+        if (strcmp(entry->name, name) != 0) continue;
+        if (strcmp(entry->value, value) == 0)
+            return encode_integer(out, capacity, 0x80, 7, HPACK_STATIC_ENTRIES + 1 + i);
+        if (name_index == 0) name_index = HPACK_STATIC_ENTRIES + 1 + i;
+    }
+
+    size_t written = index ? encode_integer(out, capacity, 0x40, 6, name_index)
+                           : encode_integer(out, capacity, 0x00, 4, name_index);
+    if (written == 0) return 0;
+    if (name_index == 0) {
+        size_t name_written = encode_string(out + written, capacity - written, name);
+        if (name_written == 0) return 0;
+        written += name_written;
+    }
+    size_t value_written = encode_string(out + written, capacity - written, value);
+    if (value_written == 0) return 0;
+
+    if (index) table_insert(table, name, strlen(name), value, strlen(value));
+    return written + value_written;
+}
+
+size_t hpack_encode_size_update(unsigned char *out, size_t capacity, size_t max_size) {
+    return encode_integer(out, capacity, 0x20, 5, max_size);
+}
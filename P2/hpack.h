@@ -0,0 +1,70 @@
+#ifndef __HPACK__
+#define __HPACK__
+
+#include <stddef.h>
+
+/*
+ * HPACK (RFC 7541) header compression for the HTTP/2 front end. A connection
+ * keeps one table per direction: the decoder table mirrors the peer's encoder
+ * and the encoder table mirrors the peer's decoder, so both must see every
+ * header block in order.
+ */
+
+#define HPACK_TABLE_SIZE 4096 // SETTINGS_HEADER_TABLE_SIZE we accept, and the default.
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_MAX_STRING_SIZE 8192
+
+typedef struct hpack_entry {
+    char *name; // NAME and VALUE share one allocation.
+    char *value;
+    size_t name_length;
+    size_t value_length;
+} hpack_entry_t;
+
+typedef struct hpack_table {
+    hpack_entry_t entries[HPACK_MAX_ENTRIES]; // Ring buffer, oldest at FIRST.
+    int first;
+    int count;
+    size_t size;     // Sum of entry sizes as defined by RFC 7541 section 4.1.
+    size_t max_size;
+} hpack_table_t;
+
+/* Called once per decoded header. The strings are only valid during the call. */
+typedef void (*hpack_header_callback_t)(void *context, const char *name, size_t name_length,
+                                        const char *value, size_t value_length);
+
+void hpack_table_init(hpack_table_t *table, size_t max_size);
+
+void hpack_table_destroy(hpack_table_t *table);
+
+/* Changes the table's maximum size, evicting entries as needed. */
+void hpack_table_resize(hpack_table_t *table, size_t max_size);
+
+/* Decodes one complete header block. Returns 0, or -1 on a compression error,
+ * after which the table is out of sync and the connection must be closed. */
+int hpack_decode(hpack_table_t *table, const unsigned char *block, size_t length,
+                 hpack_header_callback_t callback, void *context);
+
+/* Appends a header to OUT, using the static table, the dynamic table and
+ * Huffman coding where they help. INDEX adds the header to the dynamic table
+ * (for values that repeat across responses). Returns the number of bytes
+ * written, or 0 if CAPACITY is too small. */
+size_t hpack_encode_header(hpack_table_t *table, unsigned char *out, size_t capacity,
+                           const char *name, const char *value, int index);
+
+/* Appends a dynamic table size update. Returns the number of bytes written. */
+size_t hpack_encode_size_update(unsigned char *out, size_t capacity, size_t max_size);
+
+/* Huffman-decodes IN into OUT. Returns the decoded length, or -1 if IN is not
+ * a valid Huffman string or does not fit. */
+long hpack_huffman_decode(const unsigned char *in, size_t length, char *out, size_t capacity);
+
+/* Returns the Huffman-encoded length of IN in bytes. */
+size_t hpack_huffman_length(const char *in, size_t length);
+
+/* Huffman-encodes IN into OUT, which must hold hpack_huffman_length bytes. */
+void hpack_huffman_encode(const char *in, size_t length, unsigned char *out);
+
+#endif
@@ -1,21 +1,44 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "arena.h"
+#include "bundle.h"
+#include "capture.h"
+#include "coro.h"
+#include "filecache.h"
+#include "flight.h"
+#include "h2.h"
+#include "hotrestart.h"
 #include "libhttp.h"
+#include "mime.h"
+#include "proxycache.h"
+#include "ratelimit.h"
+#include "tls.h"
+#include "upload.h"
+#include "upstream.h"
+#include "util.h"
 #include "wq.h"
 
 /*
@@ -26,52 +49,128 @@
  */
 #define MAX_DIR_COUNT 50
 #define MAX_PROXY_RESPONSE_SIZE 10000
-wq_t work_queue;
+#define PROXY_SPLICE_SIZE 65536
+#define MAX_CPUS 1024
+#define WORKER_BUFFER_SIZE 65536
+#define HOT_RESTART_DRAIN_TIMEOUT_MS 30000
+#define COROUTINE_STACK_SIZE (256 * 1024)
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+wq_pool_t work_pool;
 int num_threads;
 int server_port;
+char *server_socket_path; // Listen on this Unix domain socket instead of server_port.
+char *hot_restart_path;   // Control socket for handing the listening socket to a new process.
+int hot_restart_stop_pipe[2];
+int connections_in_flight; // Accepted and not yet served by a worker.
 char *server_files_directory;
-char *server_proxy_hostname;
-int server_proxy_port;
+bundle_t server_bundle;
+int server_bundle_loaded;
+char *server_proxy_targets;
+int worker_cpus[MAX_CPUS];
+int num_worker_cpus;
+int acceptor_cpu = -1;
+int steer_incoming_cpu;
+int http2_enabled;
+int coroutines_enabled;
+size_t max_upload_size; // Largest PUT or POST body stored (--max-upload); none are if 0.
+
+static __thread char *io_buffer;
+static __thread ratelimit_key_t *current_client; // Rate-limited client of the connection being served.
 
 /*
- * Serves the contents the file stored at `path` to the client socket `fd`.
+ * Per-connection facts recorded by the acceptor, indexed by socket fd.
+ */
+typedef struct conn_info {
+    uint64_t accepted_ns;
+    int has_client; // Whether CLIENT is set: the peer has an IP address and rate limiting is on.
+    ratelimit_key_t client;
+} conn_info_t;
+conn_info_t *conn_table;
+int conn_table_size;
+
+void init_conn_table() {
+    struct rlimit limit;
+    conn_table_size = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+                      ? (int) limit.rlim_cur : 65536;
+    conn_table = calloc(conn_table_size, sizeof(conn_info_t));
+}
+
+/* Returns when the acceptor accepted FD, or now if it is not known. */
+uint64_t conn_accepted_ns(int fd) {
+    if (fd < 0 || fd >= conn_table_size) return now_ns();
+    return conn_table[fd].accepted_ns;
+}
+
+/*
+ * Returns the calling thread's I/O buffer. It is allocated on first use, so a
+ * pinned worker gets a buffer on its local NUMA node.
+ */
+char *thread_io_buffer() {
+    if (io_buffer == NULL && (io_buffer = malloc(WORKER_BUFFER_SIZE)) == NULL) {
+        perror("Failed to allocate I/O buffer");
+        exit(errno);
+    }
+    return io_buffer;
+}
+
+#define NOT_FOUND_PAGE "<center>" \
+                       "<h1>404 Not Found</h1>" \
+                       "<hr>" \
+                       "<p>Nothing is here yet.</p>" \
+                       "<p><a href=\"/\">Back to home</a></p>" \
+                       "</center>"
+
+void release_cached_file(struct http_response *response) {
+    filecache_release(response->release_context);
+}
+
+/*
+ * Describes the file stored at `path` in `response`, mapped from the cache
+ * when it is hot and opened for streaming otherwise.
  * It is the caller's responsibility to ensure that the file stored at `path` exists.
- * You can change these functions to anything you want.
  * 
  * ATTENTION: Be careful to optimize your code. Judge is
  *            sensitive to time-out errors.
  */
-void serve_file(int fd, char *path, off_t size) {
-    char content_length[20];
-    sprintf(content_length, "%ld", (long) size);
-
-    http_start_response(fd, 200);
-    http_send_header(fd, "Content-Type", http_get_mime_type(path));
-    http_send_header(fd, "Content-Length", content_length);
-    http_end_headers(fd);
-
-    int file_fd = open(path, O_RDONLY);
-    // I will exceptionally use malloc here because the file size may be too large
-    char *buffer = malloc(size + 1);
-    read(file_fd, buffer, size);
-    buffer[size] = '\0';
+void resolve_file(struct http_response *response, char *path, struct stat *path_stat) {
+    response->content_type = http_get_mime_type(path);
+    response->content_length = path_stat->st_size;
+
+    uint64_t span_start = flight_clock();
+    filecache_entry_t *entry = filecache_acquire(path, path_stat);
+    flight_span("file_cache", span_start);
+    if (entry != NULL) {
+        response->data = entry->data;
+        response->release = release_cached_file;
+        response->release_context = entry;
+        return;
+    }
 
-    http_send_data(fd, buffer, size + 1);
+    response->file_fd = open(path, O_RDONLY);
+    if (response->file_fd < 0) {
+        http_response_init(response, 403);
+        return;
+    }
 
-    close(file_fd);
-    free(buffer);
+    /* Files too big for the cache are streamed; let the kernel read ahead. */
+    if (filecache_too_big(path_stat->st_size)) posix_fadvise(response->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 }
 
-void serve_directory(int fd, char *path) {
-    http_start_response(fd, 200);
-    http_send_header(fd, "Content-Type", http_get_mime_type(".html"));
-    http_end_headers(fd);
-
+void resolve_directory(struct http_response *response, char *path) {
     DIR *dir = opendir(path);
+    if (dir == NULL) {
+        http_response_init(response, 403);
+        return;
+    }
 
-    // Start building the response
-    char response[(FILENAME_MAX * 2 + 100) * MAX_DIR_COUNT];
-    sprintf(response, "<html><head><title>Content of directory</title></head><body><h2>Content of %s</h2><ul>", path);
+    // Start building the response in the request arena; names are at most NAME_MAX bytes
+    size_t size = strlen(path) + 128 + (2 * NAME_MAX + 32) * (MAX_DIR_COUNT + 1);
+    char *listing = arena_alloc(thread_arena(), size);
+    size_t length = snprintf(listing, size,
+                             "<html><head><title>Content of directory</title></head><body><h2>Content of %s</h2><ul>",
+                             path);
 
     // Read the directory contents
     struct dirent *entry;
@@ -81,18 +180,223 @@ void serve_directory(int fd, char *path) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
 
         // Add a list item with a link
-        sprintf(response + strlen(response), "<li><a href=\"./%s\">%s</a></li>", entry->d_name, entry->d_name);
+        length += snprintf(listing + length, size - length, "<li><a href=\"./%s\">%s</a></li>", entry->d_name,
+                           entry->d_name);
         entry_count++;
     }
 
     // If there are more entries, add an ellipsis
-    if (entry != NULL) strcat(response, "<li>...</li>");
+    if (entry != NULL) length += snprintf(listing + length, size - length, "<li>...</li>");
 
-    strcat(response, "</ul></body></html>");
-    http_send_string(fd, response);
+    length += snprintf(listing + length, size - length, "</ul></body></html>");
     closedir(dir);
+
+    response->content_type = http_get_mime_type(".html");
+    response->data = listing;
+    response->content_length = length;
+}
+
+void resolve_not_found(struct http_response *response) {
+    http_response_init(response, 404);
+    response->data = NOT_FOUND_PAGE;
+    response->content_length = sizeof(NOT_FOUND_PAGE) - 1;
+}
+
+/*
+ * Appends `path` to server_files_directory in FULL_PATH. Returns 200, or 400
+ * if the path is not absolute and 403 if it could lead out of the directory.
+ */
+int files_full_path(char *path, char *full_path, size_t size) {
+    if (path[0] != '/') return 400;
+    if (strstr(path, "..") != NULL) return 403;
+    snprintf(full_path, size, "%s/%s", server_files_directory, path);
+    return 200;
+}
+
+/*
+ * Works out the response to a request for `path` under server_files_directory:
+ *
+ *   1) If the path names an existing file, the file.
+ *   2) If it names a directory containing index.html, that file.
+ *   3) If it names another directory, a list of its files with links to each.
+ *   4) Otherwise 404 Not Found.
+ *
+ * Both the HTTP/1.0 and the HTTP/2 front ends serve files through here.
+ * Release the response with http_response_release once its body is sent.
+ */
+void resolve_files_request(char *path, struct http_response *response) {
+    http_response_init(response, 200);
+    char full_path[FILENAME_MAX];
+    if ((response->status_code = files_full_path(path, full_path, sizeof(full_path))) != 200) return;
+
+    struct stat path_stat;
+
+    printf("requested: %s\n", full_path);
+
+    // Check if the path exists
+    uint64_t span_start = flight_clock();
+    int stat_result = stat(full_path, &path_stat);
+    flight_span("stat", span_start);
+    if (stat_result == 0 && S_ISREG(path_stat.st_mode)) {
+        resolve_file(response, full_path, &path_stat);
+    } else if (stat_result == 0 && S_ISDIR(path_stat.st_mode)) {
+        // Check if the directory contains "index.html"
+        char index_path[FILENAME_MAX + 11];
+        sprintf(index_path, "%s/index.html", full_path);
+        struct stat index_stat;
+
+        span_start = flight_clock();
+        stat_result = stat(index_path, &index_stat);
+        flight_span("stat", span_start);
+        if (stat_result == 0 && S_ISREG(index_stat.st_mode))
+            resolve_file(response, index_path, &index_stat);
+        else
+            resolve_directory(response, full_path);
+    } else {
+        resolve_not_found(response);
+    }
+}
+
+/*
+ * Sends `response` as HTTP/1.0. An in-memory body goes out with the head in
+ * one writev; a file goes out with sendfile, or is streamed through the
+ * worker's buffer where sendfile is not supported.
+ */
+void send_response(int fd, struct http_response *response) {
+    char head[256];
+    int head_length = snprintf(head, sizeof(head), "HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                               response->status_code, http_get_response_message(response->status_code),
+                               response->content_type, response->content_length);
+
+    uint64_t span_start = flight_clock();
+    if (response->file_fd < 0) {
+        struct iovec iov[2] = {{head, head_length}, {response->data, response->data ? response->content_length : 0}};
+        http_send_vector(fd, iov, 2);
+        flight_span("socket_write", span_start);
+        return;
+    }
+    http_send_data(fd, head, head_length);
+    flight_span("socket_write", span_start);
+
+    span_start = flight_clock();
+    if (http_send_file(fd, response->file_fd, 0, response->content_length) != -1) {
+        flight_span("sendfile", span_start);
+        return;
+    }
+
+    char *buffer = thread_io_buffer();
+    ssize_t bytes_read;
+    span_start = flight_clock();
+    while ((bytes_read = read(response->file_fd, buffer, WORKER_BUFFER_SIZE)) > 0) {
+        flight_span("file_io", span_start);
+        span_start = flight_clock();
+        http_send_data(fd, buffer, bytes_read);
+        flight_span("socket_write", span_start);
+        span_start = flight_clock();
+    }
+}
+
+void serve_not_found(int fd) {
+    struct http_response response;
+    resolve_not_found(&response);
+    send_response(fd, &response);
+}
+
+static ssize_t write_response_stream(void *cookie, const char *data, size_t size) {
+    http_send_data((int) (long) cookie, (char *) data, size);
+    return size;
+}
+
+/*
+ * Returns a stream that writes to the client on FD with http_send_data, so
+ * what goes out through it is counted and paced like the rest, and waits on a
+ * coroutine's loop rather than fail on a non-blocking socket. Closing the
+ * stream leaves FD open.
+ */
+FILE *open_response_stream(int fd) {
+    cookie_io_functions_t functions = {.write = write_response_stream};
+    return fopencookie((void *) (long) fd, "w", functions);
+}
+
+/*
+ * Sends the flight recorder's contents as Chrome trace-event JSON.
+ */
+void serve_flight_dump(int fd) {
+    http_start_response(fd, 200);
+    http_send_header(fd, "Content-Type", "application/json");
+    http_end_headers(fd);
+
+    FILE *out = open_response_stream(fd);
+    if (out == NULL) return;
+    flight_dump(out);
+    fclose(out);
+}
+
+/*
+ * Takes in what the client has sent so far before its connection is closed
+ * with a request left unread, so closing does not reset the connection and
+ * discard the response before the client reads it.
+ */
+void discard_unread_request(int fd) {
+    char discard[4096];
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) continue;
+}
+
+/*
+ * Stores the body of a PUT or POST at the request path (see upload.h), if
+ * --max-upload allows uploads, and answers with how it went.
+ */
+void respond_upload(int fd, struct http_request *request) {
+    struct http_response response;
+    http_response_init(&response, 405);
+
+    char full_path[FILENAME_MAX];
+    if (max_upload_size > 0 &&
+        (response.status_code = files_full_path(request->path, full_path, sizeof(full_path))) == 200) {
+        uint64_t span_start = flight_clock();
+        response.status_code = upload_store(fd, request, full_path, max_upload_size);
+        flight_span("upload", span_start);
+        printf("uploaded: %s (%d)\n", full_path, response.status_code);
+    }
+    send_response(fd, &response);
+    if (response.status_code >= 400) discard_unread_request(fd);
+}
+
+/*
+ * Writes the response to an already parsed request (see handle_files_request).
+ */
+void respond_files_request(int fd, struct http_request *request) {
+    if (flight_enabled() && request != NULL && strcmp(request->path, FLIGHT_ADMIN_PATH) == 0) {
+        serve_flight_dump(fd);
+        return;
+    }
+    if (request != NULL && (strcmp(request->method, "PUT") == 0 || strcmp(request->method, "POST") == 0)) {
+        respond_upload(fd, request);
+        return;
+    }
+
+    struct http_response response;
+    if (request != NULL) {
+        resolve_files_request(request->path, &response);
+    } else {
+        http_response_init(&response, 400);
+    }
+    send_response(fd, &response);
+    http_response_release(&response);
 }
 
+/*
+ * Answers one HTTP/2 stream (see h2.h) through the static-file path.
+ */
+void respond_files_h2(struct http_request *request, struct http_response *response) {
+    /* Each stream is a request of its own against the client's rate. */
+    if (current_client != NULL && ratelimit_admit(current_client) > 0) {
+        http_response_init(response, 429);
+        return;
+    }
+    resolve_files_request(request->path, response);
+}
 
 /*
  * Reads an HTTP request from stream (fd), and writes an HTTP response
@@ -108,61 +412,100 @@ void serve_directory(int fd, char *path) {
  *   Closes the client socket (fd) when finished.
  */
 void handle_files_request(int fd) {
+    if (http2_enabled && h2_preface_pending(fd)) {
+        h2_serve(fd, respond_files_h2);
+        close(fd);
+        return;
+    }
 
+    uint64_t span_start = flight_clock();
     struct http_request *request = http_request_parse(fd);
+    flight_span("parse", span_start);
+
+    if (http2_enabled && request != NULL && h2_upgrade_requested(request)) {
+        h2_serve_upgrade(fd, request, respond_files_h2);
+        close(fd);
+        return;
+    }
+
+    http_reset_bytes_sent();
+    respond_files_request(fd, request);
 
+    if (capture_enabled() && request != NULL)
+        capture_request(conn_accepted_ns(fd), now_ns(), http_bytes_sent(), request->head, request->head_length);
+    close(fd);
+}
+
+/*
+ * Writes the response to REQUEST from the bundle loaded with --bundle. Heads
+ * and bodies come straight from the mapping; nothing touches the filesystem.
+ */
+void respond_bundle_request(int fd, struct http_request *request) {
     if (request == NULL || request->path[0] != '/') {
         http_start_response(fd, 400);
         http_send_header(fd, "Content-Type", "text/html");
         http_end_headers(fd);
-        close(fd);
         return;
     }
 
-    if (strstr(request->path, "..") != NULL) {
-        http_start_response(fd, 403);
+    if (flight_enabled() && strcmp(request->path, FLIGHT_ADMIN_PATH) == 0) {
+        serve_flight_dump(fd);
+        return;
+    }
+
+    uint64_t span_start = flight_clock();
+    const bundle_entry_t *entry = bundle_find(&server_bundle, request->path);
+    flight_span("bundle_lookup", span_start);
+    if (entry == NULL) {
+        serve_not_found(fd);
+        return;
+    }
+    if (!bundle_entry_valid(&server_bundle, entry)) {
+        http_start_response(fd, 500);
         http_send_header(fd, "Content-Type", "text/html");
         http_end_headers(fd);
-        close(fd);
         return;
     }
 
-    struct stat path_stat;
+    char *etag = (char *) server_bundle.base + entry->etag_offset;
+    char value[256];
+    if (http_request_header(request, "If-None-Match", value, sizeof(value)) &&
+        (strcmp(value, "*") == 0 || memmem(value, strlen(value), etag, entry->etag_length) != NULL)) {
+        char etag_value[64];
+        snprintf(etag_value, sizeof(etag_value), "%.*s", (int) entry->etag_length, etag);
+        http_start_response(fd, 304);
+        http_send_header(fd, "ETag", etag_value);
+        http_end_headers(fd);
+        return;
+    }
 
-    // Append server_files_directory to the beginning of the given path
-    char full_path[FILENAME_MAX];
-    sprintf(full_path, "./%s/%s", server_files_directory, request->path);
+    int use_gzip = (entry->flags & BUNDLE_ENTRY_GZIP) &&
+                   http_request_header(request, "Accept-Encoding", value, sizeof(value)) &&
+                   strstr(value, "gzip") != NULL;
+    struct iovec iov[2];
+    iov[0].iov_base = (char *) server_bundle.base + (use_gzip ? entry->gzip_head_offset : entry->head_offset);
+    iov[0].iov_len = use_gzip ? entry->gzip_head_length : entry->head_length;
+    iov[1].iov_base = (char *) server_bundle.base + (use_gzip ? entry->gzip_body_offset : entry->body_offset);
+    iov[1].iov_len = use_gzip ? entry->gzip_body_length : entry->body_length;
+
+    span_start = flight_clock();
+    http_send_vector(fd, iov, 2);
+    flight_span("socket_write", span_start);
+}
 
-    printf("requested: %s\n", full_path);
+/*
+ * Like handle_files_request, but serves from the bundle loaded with --bundle.
+ */
+void handle_bundle_request(int fd) {
+    uint64_t span_start = flight_clock();
+    struct http_request *request = http_request_parse(fd);
+    flight_span("parse", span_start);
 
-    // Check if the path exists
-    if (stat(full_path, &path_stat) == 0) {
-        // Check if the path is a file
-        if (S_ISREG(path_stat.st_mode)) {
-            serve_file(fd, full_path, path_stat.st_size);
-        } else if (S_ISDIR(path_stat.st_mode)) {
-            // Check if the directory contains "index.html"
-            char index_path[FILENAME_MAX + 11];
-            sprintf(index_path, "%s/index.html", full_path);
-            struct stat index_stat;
-
-            if (stat(index_path, &index_stat) == 0 && S_ISREG(index_stat.st_mode))
-                serve_file(fd, index_path, index_stat.st_size);
-            else
-                serve_directory(fd, full_path);
-        }
-    } else {
-        http_start_response(fd, 404);
-        http_send_header(fd, "Content-Type", "text/html");
-        http_end_headers(fd);
-        http_send_string(fd,
-                         "<center>"
-                         "<h1>404 Not Found</h1>"
-                         "<hr>"
-                         "<p>Nothing is here yet.</p>"
-                         "<p><a href=\"/\">Back to home</a></p>"
-                         "</center>");
-    }
+    http_reset_bytes_sent();
+    respond_bundle_request(fd, request);
+
+    if (capture_enabled() && request != NULL)
+        capture_request(conn_accepted_ns(fd), now_ns(), http_bytes_sent(), request->head, request->head_length);
     close(fd);
 }
 
@@ -170,81 +513,404 @@ typedef struct proxy_object {
     int src_socket;
     int dst_socket;
     int is_alive;
+    size_t bytes_relayed;
+    uint64_t first_byte_ns;
+    int status_code; // Of the response, when relaying from the upstream.
+    ratelimit_key_t *client; // Pace what is relayed to this client, or NULL.
+    pthread_mutex_t *mutex; // Guards IS_ALIVE when relaying on threads.
     pthread_cond_t *cond;
+    coro_t *waiter; // Woken instead of signalling COND when relaying on coroutines.
 } proxy_object;
 
+void close_pipe(void *args) {
+    int *pipe_fds = args;
+    if (pipe_fds[0] < 0) return;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+/*
+ * Relays from src_socket to dst_socket until src_socket closes. The first
+ * chunk is read so the response status can be seen; the rest is spliced
+ * socket to socket through a pipe, opened into PIPE_FDS, where the kernel
+ * supports it.
+ */
+void relay(proxy_object *proxy, int pipe_fds[2]) {
+    if (proxy->client != NULL) http_set_pacer(ratelimit_pace, proxy->client);
+    int can_splice = pipe2(pipe_fds, O_CLOEXEC) == 0;
+    char buffer[MAX_PROXY_RESPONSE_SIZE];
+    ssize_t size;
+    while (1) {
+        if (can_splice && proxy->bytes_relayed > 0) {
+            size = http_splice_data(proxy->dst_socket, proxy->src_socket, pipe_fds, PROXY_SPLICE_SIZE);
+            if (size == -1 && errno == EINVAL) {
+                can_splice = 0;
+                continue;
+            }
+        } else if ((size = read(proxy->src_socket, buffer, MAX_PROXY_RESPONSE_SIZE)) > 0) {
+            if (proxy->bytes_relayed == 0) {
+                proxy->first_byte_ns = now_ns();
+                buffer[size < MAX_PROXY_RESPONSE_SIZE ? size : size - 1] = '\0';
+                sscanf(buffer, "HTTP/%*d.%*d %d", &proxy->status_code);
+            }
+            http_send_data(proxy->dst_socket, buffer, size);
+        }
+        if (size <= 0) break;
+        proxy->bytes_relayed += size;
+    }
+}
+
 void *proxy_handler(void *args) {
     proxy_object *proxy = (proxy_object *) args;
 
-    char buffer[MAX_PROXY_RESPONSE_SIZE];
-    size_t size;
-    while ((size = read(proxy->src_socket, buffer, MAX_PROXY_RESPONSE_SIZE)) > 0)
-        http_send_data(proxy->dst_socket, buffer, size);
+    int pipe_fds[2] = {-1, -1};
+    pthread_cleanup_push(close_pipe, pipe_fds);
+    relay(proxy, pipe_fds);
+    pthread_cleanup_pop(1);
 
+    pthread_mutex_lock(proxy->mutex);
     proxy->is_alive = 0;
     pthread_cond_signal(proxy->cond);
+    pthread_mutex_unlock(proxy->mutex);
     return 0;
 }
 
+/* proxy_handler for a coroutine, which is canceled rather than its thread. */
+void proxy_coroutine(void *args) {
+    proxy_object *proxy = (proxy_object *) args;
+
+    int pipe_fds[2] = {-1, -1};
+    relay(proxy, pipe_fds);
+    close_pipe(pipe_fds);
+
+    proxy->is_alive = 0;
+    coro_wake(proxy->waiter);
+}
 
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
- *
- *   +--------+     +------------+     +--------------+
- *   | client | <-> | httpserver | <-> | proxy target |
- *   +--------+     +------------+     +--------------+
+ * Relays both ways on coroutines, as handle_proxy_request does on threads:
+ * until either direction ends, after which the other is canceled.
  */
-void handle_proxy_request(int fd) {
+void relay_on_coroutines(proxy_object *proxy_request, proxy_object *proxy_response) {
+    proxy_request->waiter = proxy_response->waiter = coro_self();
+    coro_t *request_coroutine = coro_spawn(proxy_coroutine, proxy_request);
+    coro_t *response_coroutine = coro_spawn(proxy_coroutine, proxy_response);
+    if (request_coroutine == NULL) proxy_request->is_alive = 0;
+    if (response_coroutine == NULL) proxy_response->is_alive = 0;
+
+    while (proxy_request->is_alive && proxy_response->is_alive) coro_park();
+
+    /* The caller looks at which direction was still going when the relay
+     * stopped, not at the canceled one winding down. */
+    int request_alive = proxy_request->is_alive, response_alive = proxy_response->is_alive;
+    if (request_coroutine != NULL) {
+        coro_cancel(request_coroutine);
+        coro_join(request_coroutine);
+    }
+    if (response_coroutine != NULL) {
+        coro_cancel(response_coroutine);
+        coro_join(response_coroutine);
+    }
+    proxy_request->is_alive = request_alive;
+    proxy_response->is_alive = response_alive;
+}
+
+
+/*
+ * Opens a connection to an upstream picked for the request to PATH, moving on
+ * to the next pick while connections are refused. Returns the socket and sets
+ * *UPSTREAM, which must be reported back with upstream_done, or returns -1.
+ */
+int connect_to_upstream(const char *path, upstream_t **upstream) {
+    uint64_t tried = 0;
+    while ((*upstream = upstream_pick(path, tried)) != NULL) {
+        uint64_t span_start = flight_clock();
+        int target_fd = upstream_connect(*upstream);
+        flight_span("upstream_connect", span_start);
+        if (target_fd >= 0) return target_fd;
+
+        upstream_done(*upstream, 0, 0);
+        tried |= 1ull << (*upstream)->index;
+    }
+    return -1;
+}
 
-    /*
-    * The code below does a DNS lookup of server_proxy_hostname and
-    * opens a connection to it. Please do not modify.
-    */
+void serve_bad_gateway(int fd) {
+    http_start_response(fd, 502);
+    http_send_header(fd, "Content-Type", "text/html");
+    http_end_headers(fd);
+    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+}
 
-    struct sockaddr_in target_address;
-    memset(&target_address, 0, sizeof(target_address));
-    target_address.sin_family = AF_INET;
-    target_address.sin_port = htons(server_proxy_port);
+/*
+ * Sends the proxy cache's counters as JSON.
+ */
+void serve_proxy_cache_stats(int fd) {
+    http_start_response(fd, 200);
+    http_send_header(fd, "Content-Type", "application/json");
+    http_end_headers(fd);
 
-    struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+    FILE *out = open_response_stream(fd);
+    if (out == NULL) return;
+    proxycache_dump_stats(out);
+    fclose(out);
+}
 
-    int target_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (target_fd == -1) {
-        fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-        close(fd);
-        exit(errno);
+void send_cached_response(int fd, proxycache_entry_t *entry) {
+    char trailer[64];
+    int trailer_length = snprintf(trailer, sizeof(trailer), "Age: %ld\r\nX-Cache: HIT\r\n\r\n",
+                                  proxycache_age(entry, time(NULL)));
+
+    uint64_t span_start = flight_clock();
+    struct iovec iov[3] = {{entry->head, entry->head_length}, {trailer, trailer_length},
+                           {entry->body, entry->body ? entry->body_length : 0}};
+    http_send_vector(fd, iov, 3);
+    if (entry->body == NULL) http_send_file(fd, entry->body_fd, 0, entry->body_length);
+    flight_span("socket_write", span_start);
+}
+
+/*
+ * Fetches REQUEST from the upstream as HTTP/1.0 and relays the response to the
+ * client, keeping a copy for the cache if the upstream allows it and STORE is
+ * set.
+ */
+void fetch_proxy_get(int fd, struct http_request *request, int store) {
+    upstream_t *upstream;
+    int target_fd = connect_to_upstream(request->path, &upstream);
+    if (target_fd < 0) {
+        serve_bad_gateway(fd);
+        return;
+    }
+
+    /* Connection: close lets the upstream end the body by closing. */
+    arena_t *arena = thread_arena();
+    size_t capacity = request->head_length + strlen(request->path) + 64;
+    char *upstream_request = arena_alloc(arena, capacity);
+    int length = snprintf(upstream_request, capacity, "GET %s HTTP/1.0\r\n", request->path);
+    long headers_length = proxycache_end_to_end_headers(request->head, request->head_length,
+                                                        upstream_request + length, capacity - length);
+    length += headers_length > 0 ? headers_length : 0;
+    length += snprintf(upstream_request + length, capacity - length, "Connection: close\r\n\r\n");
+
+    uint64_t sent_ns = now_ns();
+    uint64_t span_start = flight_clock();
+    http_send_data(target_fd, upstream_request, length);
+
+    /* Read up to the end of the response head. */
+    char *head = arena_alloc(arena, PROXYCACHE_HEAD_MAX_SIZE);
+    size_t head_read = 0;
+    ssize_t bytes_read = 0;
+    char *head_end = NULL;
+    while (head_end == NULL && head_read < PROXYCACHE_HEAD_MAX_SIZE &&
+           (bytes_read = read(target_fd, head + head_read, PROXYCACHE_HEAD_MAX_SIZE - head_read)) > 0) {
+        head_read += bytes_read;
+        head_end = memmem(head, head_read, "\r\n\r\n", 4);
+    }
+    flight_span("upstream_wait", span_start);
+    uint64_t latency_ns = head_read > 0 ? now_ns() - sent_ns : 0;
+    size_t upstream_bytes = head_read;
+
+    long age = 0, ttl = -1;
+    size_t head_length = head_end ? (size_t) (head_end + 4 - head) : head_read;
+    char *clean_head = arena_alloc(arena, PROXYCACHE_HEAD_MAX_SIZE + 32);
+    long clean_length = head_end ? proxycache_clean_head(head, head_length, clean_head, PROXYCACHE_HEAD_MAX_SIZE) : -1;
+
+    char *body = NULL;
+    size_t body_length = 0, body_capacity = 0;
+    size_t content_length = SIZE_MAX;
+    if (clean_length < 0) {
+        /* Not a head we understand: pass it through untouched. */
+        http_send_data(fd, head, head_read);
+    } else {
+        char value[32];
+        if (store) ttl = proxycache_freshness(head, head_length, time(NULL), &age);
+        if (http_head_header(head, head_length, "Content-Length", value, sizeof(value)))
+            content_length = strtoull(value, NULL, 10);
+        if (ttl > 0 && content_length != SIZE_MAX && content_length > proxycache_max_object_size()) ttl = -1;
+
+        clean_length += sprintf(clean_head + clean_length, "X-Cache: MISS\r\n\r\n");
+        struct iovec iov[2] = {{clean_head, clean_length}, {head + head_length, head_read - head_length}};
+        http_send_vector(fd, iov, 2);
+        clean_length -= strlen("X-Cache: MISS\r\n\r\n");
+
+        if (ttl > 0) {
+            body_capacity = content_length != SIZE_MAX ? content_length : WORKER_BUFFER_SIZE;
+            if (body_capacity < head_read - head_length) body_capacity = head_read - head_length;
+            /* Without memory to keep it in, the response is only relayed. */
+            if ((body = malloc(body_capacity ? body_capacity : 1)) != NULL) {
+                memcpy(body, head + head_length, head_read - head_length);
+                body_length = head_read - head_length;
+            }
+        }
+    }
+
+    char *buffer = thread_io_buffer();
+    span_start = flight_clock();
+    /* A body we are not keeping is spliced through without copies. */
+    int pipe_fds[2], spliced = 0;
+    if (body == NULL && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        while ((bytes_read = http_splice_data(fd, target_fd, pipe_fds, PROXY_SPLICE_SIZE)) > 0)
+            upstream_bytes += bytes_read;
+        spliced = bytes_read != -1 || errno != EINVAL;
+        close_pipe(pipe_fds);
+    }
+    while (!spliced && (bytes_read = read(target_fd, buffer, WORKER_BUFFER_SIZE)) > 0) {
+        upstream_bytes += bytes_read;
+        http_send_data(fd, buffer, bytes_read);
+        if (body == NULL) continue;
+        if (body_length + bytes_read > proxycache_max_object_size()) {
+            free(body); // Too big to store after all; keep relaying.
+            body = NULL;
+            continue;
+        }
+        if (body_length + bytes_read > body_capacity) {
+            char *grown = realloc(body, (body_length + bytes_read) * 2);
+            if (grown == NULL) {
+                free(body); // Out of memory; keep relaying too.
+                body = NULL;
+                continue;
+            }
+            body = grown;
+            body_capacity = (body_length + bytes_read) * 2;
+        }
+        memcpy(body + body_length, buffer, bytes_read);
+        body_length += bytes_read;
+    }
+    flight_span("relay", span_start);
+    proxycache_count_upstream(upstream_bytes);
+
+    int status_code = 0;
+    if (head_end) sscanf(head, "HTTP/%*d.%*d %d", &status_code);
+    upstream_done(upstream, status_code > 0 && status_code < 500, latency_ns);
+
+    /* Only a body that arrived in full is stored. */
+    if (body != NULL && bytes_read == 0 && (content_length == SIZE_MAX || body_length == content_length))
+        proxycache_insert(request, clean_head, clean_length, body, body_length, ttl, age);
+    free(body);
+    close(target_fd);
+}
+
+/*
+ * Answers a GET in caching proxy mode: from the cache when it holds a fresh
+ * response, otherwise from the upstream, waiting for a fetch of the same path
+ * that is already under way.
+ */
+void respond_proxy_get(int fd, struct http_request *request) {
+    if (strcmp(request->path, PROXYCACHE_ADMIN_PATH) == 0) {
+        serve_proxy_cache_stats(fd);
+        return;
+    }
+
+    int fetching = 0;
+    int cacheable = proxycache_request_cacheable(request);
+    if (cacheable) {
+        uint64_t span_start = flight_clock();
+        proxycache_entry_t *entry = proxycache_lookup(request, &fetching);
+        flight_span("cache_lookup", span_start);
+        if (entry != NULL) {
+            send_cached_response(fd, entry);
+            proxycache_release(entry);
+            return;
+        }
     }
 
-    if (target_dns_entry == NULL) {
-        fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-        close(target_fd);
+    fetch_proxy_get(fd, request, cacheable);
+    if (fetching) proxycache_fetch_done(request->path);
+}
+
+/*
+ * Copies the method and path of the request the client on FD is sending into
+ * METHOD and PATH. Returns 1 if the request line was there to see, 0 if not,
+ * and -1 if the client closed without sending anything. Only peeks, so the
+ * request can still be parsed or relayed.
+ */
+int peek_request_line(int fd, char *method, size_t method_size, char *path, size_t path_size) {
+    char line[1024];
+    ssize_t length = recv(fd, line, sizeof(line) - 1, MSG_PEEK);
+    if (length <= 0) return -1;
+    line[length] = '\0';
+
+    char *method_end = strchr(line, ' ');
+    if (method_end == NULL) return 0;
+    char *path_end = method_end + 1 + strcspn(method_end + 1, " \r\n");
+    if (*path_end == '\0' || (size_t) (method_end - line) >= method_size ||
+        (size_t) (path_end - method_end - 1) >= path_size)
+        return 0;
+    memcpy(method, line, method_end - line);
+    method[method_end - line] = '\0';
+    memcpy(path, method_end + 1, path_end - method_end - 1);
+    path[path_end - method_end - 1] = '\0';
+    return 1;
+}
+
+/*
+ * Sends the upstream pool's state as JSON.
+ */
+void serve_upstream_stats(int fd) {
+    http_start_response(fd, 200);
+    http_send_header(fd, "Content-Type", "application/json");
+    http_end_headers(fd);
+
+    FILE *out = open_response_stream(fd);
+    if (out == NULL) return;
+    upstream_dump_stats(out);
+    fclose(out);
+}
+
+/*
+ * Relays traffic between the stream fd and an upstream picked from the pool
+ * (see upstream.h). HTTP requests from the client (fd) should be sent to the
+ * upstream, and HTTP responses from the upstream should be sent to the client
+ * (fd). With the proxy cache on, GETs are parsed and answered by
+ * respond_proxy_get instead.
+ *
+ *   +--------+     +------------+     +-----------+
+ *   | client | <-> | httpserver | <-> | upstreams |
+ *   +--------+     +------------+     +-----------+
+ */
+void handle_proxy_request(int fd) {
+    char method[16], path[1024];
+    int have_request_line = peek_request_line(fd, method, sizeof(method), path, sizeof(path));
+    if (have_request_line == -1) {
         close(fd);
-        exit(ENXIO);
+        return;
     }
+    int admin_request = have_request_line && strcmp(path, UPSTREAM_ADMIN_PATH) == 0;
 
-    char *dns_address = target_dns_entry->h_addr_list[0];
+    if (admin_request || (proxycache_enabled() && have_request_line && strcmp(method, "GET") == 0)) {
+        uint64_t span_start = flight_clock();
+        struct http_request *request = http_request_parse(fd);
+        flight_span("parse", span_start);
 
-    memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-    int connection_status = connect(target_fd, (struct sockaddr *) &target_address,
-                                    sizeof(target_address));
+        http_reset_bytes_sent();
+        if (request != NULL && admin_request) serve_upstream_stats(fd);
+        else if (request != NULL) respond_proxy_get(fd, request);
+        else serve_bad_gateway(fd);
 
-    if (connection_status < 0) {
+        if (capture_enabled() && request != NULL)
+            capture_request(conn_accepted_ns(fd), now_ns(), http_bytes_sent(), request->head, request->head_length);
+        close(fd);
+        return;
+    }
+
+    upstream_t *upstream;
+    int target_fd = connect_to_upstream(have_request_line ? path : NULL, &upstream);
+    if (target_fd < 0) {
         /* Dummy request parsing, just to be compliant. */
         http_request_parse(fd);
-
-        http_start_response(fd, 502);
-        http_send_header(fd, "Content-Type", "text/html");
-        http_end_headers(fd);
-        http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
-        close(target_fd);
+        serve_bad_gateway(fd);
         close(fd);
         return;
     }
 
+    /* Peek at the request head for the capture; the relay still sends it. */
+    char head[CAPTURE_HEAD_MAX_SIZE];
+    ssize_t head_length = 0;
+    if (capture_enabled() && (head_length = recv(fd, head, sizeof(head), MSG_PEEK)) > 0) {
+        char *head_end = memmem(head, head_length, "\r\n\r\n", 4);
+        if (head_end) head_length = head_end + 4 - head;
+    }
+
     pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
     pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 
@@ -252,123 +918,595 @@ void handle_proxy_request(int fd) {
             .src_socket = fd,
             .dst_socket = target_fd,
             .is_alive = 1,
+            .bytes_relayed = 0,
+            .mutex = &mutex,
             .cond = &cond
     };
     proxy_object proxy_response = {
             .src_socket = target_fd,
             .dst_socket = fd,
             .is_alive = 1,
+            .bytes_relayed = 0,
+            .client = current_client,
+            .mutex = &mutex,
             .cond = &cond
     };
 
     pthread_t request_thread, response_thread;
+    uint64_t span_start = flight_clock();
+    uint64_t relay_start_ns = now_ns();
 
-    pthread_create(&request_thread, NULL, proxy_handler, &proxy_request);
-    pthread_create(&response_thread, NULL, proxy_handler, &proxy_response);
-
-    while (proxy_request.is_alive && proxy_response.is_alive) pthread_cond_wait(&cond, &mutex);
-
-    pthread_cancel(request_thread);
-    pthread_cancel(response_thread);
+    if (coro_active()) {
+        relay_on_coroutines(&proxy_request, &proxy_response);
+        flight_span("relay", span_start);
+    } else {
+        pthread_create(&request_thread, NULL, proxy_handler, &proxy_request);
+        pthread_create(&response_thread, NULL, proxy_handler, &proxy_response);
+
+        pthread_mutex_lock(&mutex);
+        while (proxy_request.is_alive && proxy_response.is_alive) pthread_cond_wait(&cond, &mutex);
+        /* As on coroutines: what counts is which direction was still going. */
+        int request_alive = proxy_request.is_alive, response_alive = proxy_response.is_alive;
+        pthread_mutex_unlock(&mutex);
+
+        flight_span("relay", span_start);
+        /* Both threads use the objects above and the sockets until they are
+         * joined, so nothing is read or closed before. */
+        pthread_cancel(request_thread);
+        pthread_cancel(response_thread);
+        pthread_join(request_thread, NULL);
+        pthread_join(response_thread, NULL);
+        proxy_request.is_alive = request_alive;
+        proxy_response.is_alive = response_alive;
+    }
     pthread_mutex_destroy(&mutex);
     pthread_cond_destroy(&cond);
 
+    /* An upstream that closed without a response or answered 5xx failed; a
+     * client that left first says nothing about it. */
+    int ok = proxy_response.is_alive ||
+             (proxy_response.bytes_relayed > 0 && proxy_response.status_code < 500);
+    upstream_done(upstream, ok, proxy_response.bytes_relayed > 0 ? proxy_response.first_byte_ns - relay_start_ns : 0);
+
+    if (head_length > 0)
+        capture_request(conn_accepted_ns(fd), now_ns(), proxy_response.bytes_relayed, head, head_length);
+
     close(fd);
     close(target_fd);
 }
 
+/*
+ * Answers a client over its request rate without reading the request: the
+ * response is canned and written at once, so refusing costs next to nothing.
+ */
+void serve_too_many_requests(int fd, long retry_after) {
+    char response[128];
+    int length = snprintf(response, sizeof(response),
+                          "HTTP/1.0 429 Too Many Requests\r\nRetry-After: %ld\r\nContent-Length: 0\r\n\r\n",
+                          retry_after);
+    http_send_data(fd, response, length);
+    discard_unread_request(fd);
+}
+
+/*
+ * Runs REQUEST_HANDLER on FD, unless its client is over its request rate,
+ * pacing what the handler sends to the client's bandwidth.
+ */
+void serve_connection(int fd, void (*request_handler)(int)) {
+    if (!ratelimit_enabled() || fd >= conn_table_size || !conn_table[fd].has_client) {
+        request_handler(fd);
+        return;
+    }
+
+    ratelimit_key_t client = conn_table[fd].client; // The handler closes FD, freeing its slot.
+    long retry_after = ratelimit_admit(&client);
+    if (retry_after > 0) {
+        serve_too_many_requests(fd, retry_after);
+        close(fd);
+        return;
+    }
+
+    current_client = &client;
+    http_set_pacer(ratelimit_pace, &client);
+    request_handler(fd);
+    http_set_pacer(NULL, NULL);
+    current_client = NULL;
+}
+
+/*
+ * Runs REQUEST_HANDLER on CLIENT_SOCKET_FD, terminating TLS first when it is
+ * enabled. The handler closes the fd it is given.
+ */
+void handle_connection(int client_socket_fd, void (*request_handler)(int)) {
+    if (!tls_enabled()) {
+        serve_connection(client_socket_fd, request_handler);
+        return;
+    }
+
+    tls_connection_t *connection;
+    uint64_t span_start = flight_clock();
+    int handler_fd = tls_accept(client_socket_fd, &connection);
+    flight_span("tls_handshake", span_start);
+    if (handler_fd < 0) {
+        close(client_socket_fd);
+        return;
+    }
+    if (handler_fd < conn_table_size && client_socket_fd < conn_table_size)
+        conn_table[handler_fd] = conn_table[client_socket_fd];
+
+    serve_connection(handler_fd, request_handler);
+    tls_finish(connection);
+}
+
+typedef struct worker {
+    int id;
+    int cpu; // CPU the worker is pinned to, or -1 if it floats.
+    void (*request_handler)(int);
+    coro_loop_t *loop; // With --coroutines: the loop the worker runs instead.
+} worker_t;
+
+pthread_barrier_t workers_ready;
+int cpu_to_worker[MAX_CPUS];
+
 _Noreturn void *thread_handler(void *args) {
-    void (*func)(int) = args;
-    while (1) func(wq_pop(&work_queue));
+    worker_t *worker = args;
+
+    /* Pin first, then allocate per-worker state so it is local to the CPU. */
+    if (worker->cpu >= 0) {
+        if (affinity_pin_self(worker->cpu) != 0)
+            fprintf(stderr, "Failed to pin worker %d to CPU %d\n", worker->id, worker->cpu);
+        wq_pool_rehome(&work_pool, worker->id);
+    }
+    thread_io_buffer();
+    thread_arena();
+    pthread_barrier_wait(&workers_ready);
+
+    while (1) {
+        uint64_t pop_start_ns = flight_enabled() ? now_ns() : 0;
+        int client_socket_fd = wq_pool_pop(&work_pool, worker->id);
+        if (flight_enabled()) flight_begin(conn_accepted_ns(client_socket_fd), pop_start_ns, now_ns());
+        handle_connection(client_socket_fd, worker->request_handler);
+        arena_reset(thread_arena());
+        flight_end();
+        __atomic_sub_fetch(&connections_in_flight, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * The per-connection state handlers keep in thread-locals, of which each
+ * coroutine needs its own copy when connections share a worker
+ * (--coroutines). Swapped on every switch; see coro_locals_t.
+ */
+typedef struct connection_locals {
+    arena_t *arena;
+    char *io_buffer;
+    void *h2_connection;
+    ratelimit_key_t *client;
+    flight_context_t flight;
+    struct http_thread_state http;
+} connection_locals_t;
+
+void swap_connection_locals(void *args) {
+    connection_locals_t *locals = args;
+    char *buffer = io_buffer;
+    io_buffer = locals->io_buffer;
+    locals->io_buffer = buffer;
+    ratelimit_key_t *client = current_client;
+    current_client = locals->client;
+    locals->client = client;
+    arena_swap(&locals->arena);
+    h2_swap_connection(&locals->h2_connection);
+    flight_swap(&locals->flight);
+    http_swap_thread_state(&locals->http);
+}
+
+/* Keeps the buffers for the next connection served on the same stack. */
+void recycle_connection_locals(void *args) {
+    connection_locals_t *locals = args;
+    if (locals->arena != NULL) arena_reset(locals->arena);
+    *locals = (connection_locals_t) {.arena = locals->arena, .io_buffer = locals->io_buffer,
+                                     .h2_connection = locals->h2_connection};
+}
+
+void release_connection_locals(void *args) {
+    connection_locals_t *locals = args;
+    if (locals->arena != NULL) arena_destroy(locals->arena);
+    free(locals->io_buffer);
+    free(locals->h2_connection);
+}
+
+void (*coroutine_request_handler)(int);
+coro_loop_t **coroutine_loops;
+unsigned int next_coroutine_loop;
+
+/* Serves one connection on a coroutine loop. */
+void serve_coroutine(int client_socket_fd) {
+    if (flight_enabled()) {
+        uint64_t started_ns = now_ns();
+        flight_begin(conn_accepted_ns(client_socket_fd), started_ns, started_ns);
+    }
+    handle_connection(client_socket_fd, coroutine_request_handler);
+    flight_end();
+    __atomic_sub_fetch(&connections_in_flight, 1, __ATOMIC_RELEASE);
+}
+
+_Noreturn void *loop_thread_handler(void *args) {
+    worker_t *worker = args;
+    if (worker->cpu >= 0 && affinity_pin_self(worker->cpu) != 0)
+        fprintf(stderr, "Failed to pin worker %d to CPU %d\n", worker->id, worker->cpu);
+    pthread_barrier_wait(&workers_ready);
+    coro_loop_run(worker->loop);
+}
+
+/* Sets the workers up to run coroutine loops (--coroutines). */
+void init_coroutine_loops(int pool_num_threads, void (*request_handler)(int)) {
+    coro_locals_t locals = {sizeof(connection_locals_t), swap_connection_locals, recycle_connection_locals,
+                            release_connection_locals};
+    coro_init(COROUTINE_STACK_SIZE, &locals);
+    coroutine_request_handler = request_handler;
+    coroutine_loops = calloc(pool_num_threads, sizeof(coro_loop_t *));
+    for (int i = 0; i < pool_num_threads; i++) {
+        if ((coroutine_loops[i] = coro_loop_create(serve_coroutine)) == NULL) {
+            perror("Failed to create a coroutine loop");
+            exit(errno);
+        }
+    }
 }
 
 void init_thread_pool(int pool_num_threads, void (*request_handler)(int)) {
-    wq_init(&work_queue);
+    if (coroutines_enabled) init_coroutine_loops(pool_num_threads, request_handler);
+    else wq_pool_init(&work_pool, pool_num_threads);
+    pthread_barrier_init(&workers_ready, NULL, pool_num_threads + 1);
+    for (int i = 0; i < MAX_CPUS; i++) cpu_to_worker[i] = -1;
 
     pthread_t threads[pool_num_threads];
-    for (int i = 0; i < pool_num_threads; i++)
-        pthread_create(&threads[i], NULL, thread_handler, request_handler);
+    worker_t *workers = calloc(pool_num_threads, sizeof(worker_t));
+    for (int i = 0; i < pool_num_threads; i++) {
+        workers[i].id = i;
+        workers[i].cpu = num_worker_cpus ? worker_cpus[i % num_worker_cpus] : -1;
+        workers[i].request_handler = request_handler;
+        workers[i].loop = coroutines_enabled ? coroutine_loops[i] : NULL;
+        if (workers[i].cpu >= 0 && cpu_to_worker[workers[i].cpu] < 0) cpu_to_worker[workers[i].cpu] = i;
+        pthread_create(&threads[i], NULL, coroutines_enabled ? loop_thread_handler : thread_handler, &workers[i]);
+    }
+    pthread_barrier_wait(&workers_ready);
+
+    if (num_worker_cpus)
+        for (int i = 0; i < num_worker_cpus && i < pool_num_threads; i++)
+            printf("Worker %d pinned to CPU %d (NUMA node %d)\n", i, worker_cpus[i],
+                   affinity_cpu_node(worker_cpus[i]));
 }
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Returns the worker pinned to the CPU that received CLIENT_SOCKET_FD's
+ * packets (the CPU the NIC queue interrupts), or -1 if there is none.
  */
-_Noreturn void serve_forever(int *socket_number, void (*request_handler)(int)) {
-    struct sockaddr_in server_address, client_address;
-    size_t client_address_length = sizeof(client_address);
-    int client_socket_number;
+int incoming_cpu_worker(int client_socket_fd) {
+    int cpu;
+    socklen_t cpu_length = sizeof(cpu);
+    if (getsockopt(client_socket_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_length) == -1) return -1;
+    if (cpu < 0 || cpu >= MAX_CPUS) return -1;
+    return cpu_to_worker[cpu];
+}
 
-    *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-    if (*socket_number == -1) {
-        perror("Failed to create a new socket");
-        exit(errno);
+/*
+ * Fills in *ADDRESS with server_socket_path if it is set, or else with port
+ * server_port on all interfaces. Returns the address length.
+ */
+socklen_t server_bind_address(struct sockaddr_storage *address) {
+    memset(address, 0, sizeof(*address));
+    if (server_socket_path != NULL) {
+        struct sockaddr_un *unix_address = (struct sockaddr_un *) address;
+        unix_address->sun_family = AF_UNIX;
+        strcpy(unix_address->sun_path, server_socket_path);
+        return sizeof(struct sockaddr_un);
     }
 
-    int socket_option = 1;
-    if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
-                   sizeof(socket_option)) == -1) {
-        perror("Failed to set socket options");
-        exit(errno);
+    struct sockaddr_in *inet_address = (struct sockaddr_in *) address;
+    inet_address->sin_family = AF_INET;
+    inet_address->sin_addr.s_addr = INADDR_ANY;
+    inet_address->sin_port = htons(server_port);
+    return sizeof(struct sockaddr_in);
+}
+
+/*
+ * Maps the files listed in SNAPSHOT (paths under server_files_directory, most
+ * recently used first), least recently used first so the LRU order carries
+ * over.
+ */
+void warm_file_cache(char *snapshot, size_t length) {
+    if (!filecache_enabled() || server_files_directory == NULL) return;
+
+    char full_path[PATH_MAX];
+    int warmed = 0;
+    for (size_t end = length; end > 0;) {
+        size_t start = end - 1;
+        while (start > 0 && snapshot[start - 1] != '\n') start--;
+        snprintf(full_path, sizeof(full_path), "%s/%.*s", server_files_directory, (int) (end - 1 - start),
+                 snapshot + start);
+        warmed += filecache_warm(full_path) == 0;
+        end = start;
     }
+    fprintf(stderr, "Warmed the file cache with %d files\n", warmed);
+}
 
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(server_port);
+size_t snapshot_file_cache(char *out, size_t capacity) {
+    if (!filecache_enabled() || server_files_directory == NULL) return 0;
+    char prefix[PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s/", server_files_directory);
+    return filecache_snapshot(prefix, out, capacity);
+}
 
-    if (bind(*socket_number, (struct sockaddr *) &server_address,
-             sizeof(server_address)) == -1) {
-        perror("Failed to bind on socket");
-        exit(errno);
+/*
+ * Takes the listening socket over from the server whose control socket is at
+ * hot_restart_path, if one is running there. Returns the socket, or -1.
+ */
+int take_over_listener(void) {
+    char *snapshot = malloc(HOTRESTART_SNAPSHOT_MAX_SIZE);
+    size_t snapshot_length;
+    int fd = hotrestart_take_over(hot_restart_path, snapshot, HOTRESTART_SNAPSHOT_MAX_SIZE, &snapshot_length);
+    if (fd >= 0) {
+        fprintf(stderr, "Took the listening socket over from %s\n", hot_restart_path);
+        warm_file_cache(snapshot, snapshot_length);
     }
+    free(snapshot);
+    return fd;
+}
 
-    if (listen(*socket_number, 1024) == -1) {
-        perror("Failed to listen on socket");
-        exit(errno);
-    }
+/* Called by the hot restart thread once the new process accepts. */
+void stop_accepting(void) {
+    server_socket_path = NULL; // The new process owns the socket file now.
+    if (write(hot_restart_stop_pipe[1], "x", 1) == -1) perror("Failed to stop accepting");
+}
 
-    printf("Listening on port %d...\n", server_port);
+/*
+ * Waits until the listening socket has a connection for us. Returns 0 once
+ * the server has handed off to a new process instead.
+ */
+int wait_for_connection(int socket_number) {
+    struct pollfd fds[2] = {{socket_number, POLLIN, 0}, {hot_restart_stop_pipe[0], POLLIN, 0}};
+    while (poll(fds, 2, -1) == -1 && errno == EINTR) continue;
+    return !(fds[1].revents & POLLIN);
+}
 
-    init_thread_pool(num_threads, request_handler);
+/*
+ * Lets the workers finish the connections this process accepted, for up to
+ * HOT_RESTART_DRAIN_TIMEOUT_MS, and exits.
+ */
+_Noreturn void drain_and_exit(void) {
+    int remaining = __atomic_load_n(&connections_in_flight, __ATOMIC_ACQUIRE);
+    fprintf(stderr, "Handed off; draining %d connections\n", remaining);
+    uint64_t deadline_ns = now_ns() + HOT_RESTART_DRAIN_TIMEOUT_MS * 1000000ull;
+    while ((remaining = __atomic_load_n(&connections_in_flight, __ATOMIC_ACQUIRE)) > 0 && now_ns() < deadline_ns)
+        usleep(1000);
+    if (remaining > 0) fprintf(stderr, "Exiting with %d connections still open\n", remaining);
+    if (proxycache_enabled()) proxycache_dump_stats(stdout);
+    exit(0);
+}
 
-    while (1) {
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO, or a
+ * Unix domain socket at server_socket_path, or takes one over from a running
+ * server (hot restart). Saves the fd number of the server socket in
+ * *socket_number. For each accepted connection, calls request_handler with the
+ * accepted fd number.
+ */
+_Noreturn void serve_forever(int *socket_number, void (*request_handler)(int)) {
+    struct sockaddr_storage server_address, client_address;
+    socklen_t server_address_length = server_bind_address(&server_address);
+    socklen_t client_address_length;
+    int client_socket_number;
+
+    *socket_number = hot_restart_path != NULL ? take_over_listener() : -1;
+    int took_over = *socket_number >= 0;
+    if (!took_over) {
+        *socket_number = socket(server_address.ss_family, SOCK_STREAM, 0);
+        if (*socket_number == -1) {
+            perror("Failed to create a new socket");
+            exit(errno);
+        }
+
+        int socket_option = 1;
+        if (server_socket_path == NULL &&
+            setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+                       sizeof(socket_option)) == -1) {
+            perror("Failed to set socket options");
+            exit(errno);
+        }
+
+        /* A socket file left behind by an earlier run would make bind fail. */
+        struct stat socket_stat;
+        if (server_socket_path != NULL && stat(server_socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode))
+            unlink(server_socket_path);
+
+        if (bind(*socket_number, (struct sockaddr *) &server_address,
+                 server_address_length) == -1) {
+            perror("Failed to bind on socket");
+            exit(errno);
+        }
+
+        if (listen(*socket_number, 1024) == -1) {
+            perror("Failed to listen on socket");
+            exit(errno);
+        }
+
+        if (server_socket_path != NULL) printf("Listening on %s...\n", server_socket_path);
+        else printf("Listening on port %d...\n", server_port);
+    }
+
+    if (acceptor_cpu >= 0 && affinity_pin_self(acceptor_cpu) != 0)
+        fprintf(stderr, "Failed to pin acceptor to CPU %d\n", acceptor_cpu);
+
+    init_conn_table();
+    if (num_threads != 0) init_thread_pool(num_threads, request_handler);
+
+    if (hot_restart_path != NULL) {
+        if (took_over && hotrestart_ready() == -1)
+            fprintf(stderr, "The old server went away during the handoff\n");
+        /* Non-blocking, as the socket may be shared with the next process
+         * while it takes over: a connection we are woken for can be gone. */
+        if (pipe2(hot_restart_stop_pipe, O_CLOEXEC) == -1 ||
+            fcntl(*socket_number, F_SETFL, fcntl(*socket_number, F_GETFL) | O_NONBLOCK) == -1 ||
+            hotrestart_serve(hot_restart_path, *socket_number, snapshot_file_cache, stop_accepting) == -1) {
+            perror("Failed to set up hot restart");
+            exit(errno);
+        }
+    }
+
+    while (hot_restart_path == NULL || wait_for_connection(*socket_number)) {
+        client_address_length = sizeof(client_address);
         client_socket_number = accept(*socket_number,
                                       (struct sockaddr *) &client_address,
-                                      (socklen_t *) &client_address_length);
+                                      &client_address_length);
         if (client_socket_number < 0) {
-            perror("Error accepting socket");
+            if (errno != EAGAIN) perror("Error accepting socket");
             continue;
         }
+        if (client_socket_number < conn_table_size) {
+            conn_info_t *conn = &conn_table[client_socket_number];
+            conn->accepted_ns = now_ns();
+            conn->has_client = ratelimit_enabled() && ratelimit_key(&client_address, &conn->client) == 0;
+        }
 
-        printf("Accepted connection from %s on port %d\n",
-               inet_ntoa(client_address.sin_addr),
-               client_address.sin_port);
-
-        if (num_threads != 0) wq_push(&work_queue, client_socket_number);
-        else {
-            request_handler(client_socket_number);
-            close(client_socket_number);
+        if (client_address.ss_family == AF_INET)
+            printf("Accepted connection from %s on port %d\n",
+                   inet_ntoa(((struct sockaddr_in *) &client_address)->sin_addr),
+                   ((struct sockaddr_in *) &client_address)->sin_port);
+        else
+            printf("Accepted connection on a Unix socket\n");
+
+        if (num_threads != 0) {
+            __atomic_add_fetch(&connections_in_flight, 1, __ATOMIC_RELAXED);
+            int worker_id = steer_incoming_cpu ? incoming_cpu_worker(client_socket_number) : -1;
+            if (coroutines_enabled)
+                coro_loop_submit(coroutine_loops[worker_id >= 0 ? worker_id : next_coroutine_loop++ % num_threads],
+                                 client_socket_number);
+            else if (worker_id >= 0) wq_pool_push_to(&work_pool, worker_id, client_socket_number);
+            else wq_pool_push(&work_pool, client_socket_number);
+        } else {
+            uint64_t accepted_ns = conn_accepted_ns(client_socket_number);
+            if (flight_enabled()) flight_begin(accepted_ns, accepted_ns, now_ns());
+            handle_connection(client_socket_number, request_handler);
+            arena_reset(thread_arena());
+            flight_end();
+            if (!tls_enabled()) close(client_socket_number);
         }
     }
 
-    shutdown(*socket_number, SHUT_RDWR);
+    /* The listening socket is the new process's now: close it, do not shut
+     * it down. */
     close(*socket_number);
+    drain_and_exit();
 }
 
 int server_fd;
+char *flight_dump_path;
+
+/*
+ * Waits for SIGUSR2 and writes the flight recorder to flight_dump_path.
+ * SIGUSR2 is blocked in every other thread, so it is always delivered here.
+ */
+void *flight_signal_handler(void *args) {
+    sigset_t *signals = args;
+    int signum;
+    while (sigwait(signals, &signum) == 0) {
+        FILE *out = fopen(flight_dump_path, "w");
+        if (out == NULL) {
+            perror("Failed to open flight recorder dump");
+            continue;
+        }
+        flight_dump(out);
+        fclose(out);
+        printf("Flight recorder dumped to %s\n", flight_dump_path);
+    }
+    return NULL;
+}
+
+void init_flight_recorder(int sample_every) {
+    static sigset_t signals;
+    static char default_dump_path[64];
+
+    flight_init(sample_every);
+    if (flight_dump_path == NULL) {
+        sprintf(default_dump_path, "flight-%d.json", (int) getpid());
+        flight_dump_path = default_dump_path;
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_t dump_thread;
+    pthread_create(&dump_thread, NULL, flight_signal_handler, &signals);
+}
 
 void signal_callback_handler(int signum) {
     printf("Caught signal %d: %s\n", signum, strsignal(signum));
     printf("Closing socket %d\n", server_fd);
     if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
+    if (server_socket_path != NULL) unlink(server_socket_path);
+    if (proxycache_enabled()) proxycache_dump_stats(stdout);
     exit(0);
 }
 
 char *USAGE =
         "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-        "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+        "       ./httpserver --bundle site.bundle --port 8000 [--num-threads 5]\n"
+        "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+        "\n"
+        "       Build a bundle with ./mkbundle [--gzip] www_directory/ site.bundle\n"
+        "\n"
+        "       --coroutines         Serve each connection on a coroutine on its worker's\n"
+        "                            epoll loop, so it holds no thread while it waits and\n"
+        "                            a few workers keep many thousands open (not HTTPS)\n"
+        "       --file-cache MB      Keep up to MB MiB of hot files mapped and serve them\n"
+        "                            with writev (--files mode)\n"
+        "       --hot-restart ctl    Take the listening socket and hot files over from the\n"
+        "                            server whose control socket is ctl, if one runs, and\n"
+        "                            hand them on to the next one started the same way\n"
+        "       --http2              Also speak cleartext HTTP/2, with prior knowledge or\n"
+        "                            through Upgrade: h2c (--files mode)\n"
+        "       --lb policy          Pick an upstream per request by fewest requests in\n"
+        "                            flight (least-outstanding, the default) or by path on\n"
+        "                            a consistent-hash ring; failing and slow upstreams are\n"
+        "                            ejected for a while (state at GET " UPSTREAM_ADMIN_PATH ")\n"
+        "       --max-upload MB      Store PUT and POST bodies of up to MB MiB at their\n"
+        "                            path (--files mode), Content-Length or chunked;\n"
+        "                            each replaces the file at once when complete\n"
+        "       --port /path.sock    Listen on a Unix domain socket instead; --proxy takes\n"
+        "                            unix:/path upstreams too\n"
+        "       --proxy-cache MB     Cache fresh GET responses from the upstream in MB MiB\n"
+        "                            of memory; stats at GET " PROXYCACHE_ADMIN_PATH " (--proxy mode)\n"
+        "       --proxy-cache-dir d  Spill larger and colder responses to files in d...\n"
+        "       --proxy-cache-disk MB ...up to MB MiB (1024)\n"
+        "\n"
+        "Per-client limits (by IP address):\n"
+        "       --rate-limit N       Answer requests beyond N a second with 429 Too Many\n"
+        "                            Requests, before reading them\n"
+        "       --bandwidth-limit KB Pace responses down to KB KiB a second\n"
+        "\n"
+        "HTTPS:\n"
+        "       --tls-cert cert.pem  Serve HTTPS with this certificate chain...\n"
+        "       --tls-key key.pem    ...and private key; sessions resume with tickets\n"
+        "       --tls12-ktls         Cap TLS at 1.2 so the kernel (kTLS) can take over both\n"
+        "                            directions and files go out with sendfile\n"
+        "\n"
+        "Placement options:\n"
+        "       --cpus 0-7,16-23     Pin worker i to the i-th listed CPU (wrapping around)\n"
+        "       --acceptor-cpu 0     Pin the accepting thread to a CPU\n"
+        "       --incoming-cpu       Hand each connection to the worker pinned to the CPU\n"
+        "                            that received it (SO_INCOMING_CPU)\n"
+        "\n"
+        "Traffic capture:\n"
+        "       --capture trace.bin  Record every request head, its accept time, service\n"
+        "                            time and response size (replay with bench/replay)\n"
+        "\n"
+        "Flight recorder:\n"
+        "       --flight-recorder N  Record stage timings of one request in N; dump them as\n"
+        "                            Chrome trace JSON on SIGUSR2 or GET " FLIGHT_ADMIN_PATH "\n"
+        "       --flight-dump path   Where SIGUSR2 writes the dump (flight-<pid>.json)\n"
+        "\n"
+        "       --mime-types file    Merge a mime.types file over the built-in types\n";
 
 void exit_with_usage() {
     fprintf(stderr, "%s", USAGE);
@@ -382,6 +1520,12 @@ int main(int argc, char **argv) {
     /* Default settings */
     server_port = 8000;
     void (*request_handler)(int) = NULL;
+    int flight_sample_every = 0;
+    char *tls_cert_path = NULL, *tls_key_path = NULL;
+    int tls_ktls_tls12 = 0;
+    char *proxy_cache_dir = NULL;
+    upstream_policy_t upstream_policy = UPSTREAM_LEAST_OUTSTANDING;
+    long proxy_cache_disk_mb = 1024;
 
     int i;
     for (i = 1; i < argc; i++) {
@@ -393,37 +1537,177 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "Expected argument after --files\n");
                 exit_with_usage();
             }
+        } else if (strcmp("--bundle", argv[i]) == 0) {
+            request_handler = handle_bundle_request;
+            char *bundle_path = argv[++i];
+            if (!bundle_path) {
+                fprintf(stderr, "Expected argument after --bundle\n");
+                exit_with_usage();
+            }
+            if (bundle_open(&server_bundle, bundle_path) == -1) {
+                fprintf(stderr, "Failed to load bundle %s\n", bundle_path);
+                exit(EXIT_FAILURE);
+            }
+            server_bundle_loaded = 1;
         } else if (strcmp("--proxy", argv[i]) == 0) {
             request_handler = handle_proxy_request;
 
-            char *proxy_target = argv[++i];
-            if (!proxy_target) {
+            server_proxy_targets = argv[++i];
+            if (!server_proxy_targets) {
                 fprintf(stderr, "Expected argument after --proxy\n");
                 exit_with_usage();
             }
-
-            char *colon_pointer = strchr(proxy_target, ':');
-            if (colon_pointer != NULL) {
-                *colon_pointer = '\0';
-                server_proxy_hostname = proxy_target;
-                server_proxy_port = atoi(colon_pointer + 1);
+            if (upstream_add_list(server_proxy_targets) == -1) {
+                fprintf(stderr, "Cannot use upstreams: %s\n", server_proxy_targets);
+                exit(ENXIO);
+            }
+        } else if (strcmp("--lb", argv[i]) == 0) {
+            char *policy = argv[++i];
+            if (policy && strcmp(policy, "least-outstanding") == 0) {
+                upstream_policy = UPSTREAM_LEAST_OUTSTANDING;
+            } else if (policy && strcmp(policy, "consistent-hash") == 0) {
+                upstream_policy = UPSTREAM_CONSISTENT_HASH;
             } else {
-                server_proxy_hostname = proxy_target;
-                server_proxy_port = 80;
+                fprintf(stderr, "Expected least-outstanding or consistent-hash after --lb\n");
+                exit_with_usage();
             }
+        } else if (strcmp("--http2", argv[i]) == 0) {
+            http2_enabled = 1;
+        } else if (strcmp("--coroutines", argv[i]) == 0) {
+            coroutines_enabled = 1;
+        } else if (strcmp("--proxy-cache", argv[i]) == 0) {
+            char *budget_str = argv[++i];
+            long budget_mb;
+            if (!budget_str || (budget_mb = atol(budget_str)) < 1) {
+                fprintf(stderr, "Expected a size in MiB after --proxy-cache\n");
+                exit_with_usage();
+            }
+            proxycache_init((size_t) budget_mb << 20);
+        } else if (strcmp("--proxy-cache-dir", argv[i]) == 0) {
+            if (!(proxy_cache_dir = argv[++i])) {
+                fprintf(stderr, "Expected a directory after --proxy-cache-dir\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--proxy-cache-disk", argv[i]) == 0) {
+            char *budget_str = argv[++i];
+            if (!budget_str || (proxy_cache_disk_mb = atol(budget_str)) < 1) {
+                fprintf(stderr, "Expected a size in MiB after --proxy-cache-disk\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--tls-cert", argv[i]) == 0) {
+            if (!(tls_cert_path = argv[++i])) {
+                fprintf(stderr, "Expected a PEM file after --tls-cert\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--tls-key", argv[i]) == 0) {
+            if (!(tls_key_path = argv[++i])) {
+                fprintf(stderr, "Expected a PEM file after --tls-key\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--tls12-ktls", argv[i]) == 0) {
+            tls_ktls_tls12 = 1;
+        } else if (strcmp("--file-cache", argv[i]) == 0) {
+            char *budget_str = argv[++i];
+            long budget_mb;
+            if (!budget_str || (budget_mb = atol(budget_str)) < 1) {
+                fprintf(stderr, "Expected a size in MiB after --file-cache\n");
+                exit_with_usage();
+            }
+            filecache_init((size_t) budget_mb << 20);
         } else if (strcmp("--port", argv[i]) == 0) {
             char *server_port_string = argv[++i];
             if (!server_port_string) {
                 fprintf(stderr, "Expected argument after --port\n");
                 exit_with_usage();
             }
-            server_port = atoi(server_port_string);
+            if (strchr(server_port_string, '/') == NULL) {
+                server_port = atoi(server_port_string);
+            } else if (strlen(server_port_string) < sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+                server_socket_path = server_port_string;
+            } else {
+                fprintf(stderr, "Unix socket path too long: %s\n", server_port_string);
+                exit_with_usage();
+            }
+        } else if (strcmp("--hot-restart", argv[i]) == 0) {
+            if (!(hot_restart_path = argv[++i])) {
+                fprintf(stderr, "Expected a control socket path after --hot-restart\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--rate-limit", argv[i]) == 0) {
+            char *rate_str = argv[++i];
+            double rate;
+            if (!rate_str || (rate = atof(rate_str)) <= 0) {
+                fprintf(stderr, "Expected requests per second after --rate-limit\n");
+                exit_with_usage();
+            }
+            ratelimit_init_requests(rate);
+        } else if (strcmp("--bandwidth-limit", argv[i]) == 0) {
+            char *bandwidth_str = argv[++i];
+            double bandwidth_kb;
+            if (!bandwidth_str || (bandwidth_kb = atof(bandwidth_str)) <= 0) {
+                fprintf(stderr, "Expected KiB per second after --bandwidth-limit\n");
+                exit_with_usage();
+            }
+            ratelimit_init_bandwidth(bandwidth_kb * 1024, HTTP_PACE_CHUNK_SIZE);
         } else if (strcmp("--num-threads", argv[i]) == 0) {
             char *num_threads_str = argv[++i];
             if (!num_threads_str || (num_threads = atoi(num_threads_str)) < 1) {
                 fprintf(stderr, "Expected positive integer after --num-threads\n");
                 exit_with_usage();
             }
+        } else if (strcmp("--cpus", argv[i]) == 0) {
+            char *cpu_list = argv[++i];
+            if (!cpu_list || (num_worker_cpus = affinity_parse_cpus(cpu_list, worker_cpus, MAX_CPUS)) < 1) {
+                fprintf(stderr, "Expected a CPU list such as 0-3,8 after --cpus\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--acceptor-cpu", argv[i]) == 0) {
+            char *acceptor_cpu_str = argv[++i];
+            if (!acceptor_cpu_str || (acceptor_cpu = atoi(acceptor_cpu_str)) < 0) {
+                fprintf(stderr, "Expected a CPU number after --acceptor-cpu\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--incoming-cpu", argv[i]) == 0) {
+            steer_incoming_cpu = 1;
+        } else if (strcmp("--capture", argv[i]) == 0) {
+            char *capture_path = argv[++i];
+            if (!capture_path) {
+                fprintf(stderr, "Expected a trace file after --capture\n");
+                exit_with_usage();
+            }
+            if (capture_open(capture_path, now_ns()) == -1) {
+                perror("Failed to open capture file");
+                exit(errno);
+            }
+        } else if (strcmp("--flight-recorder", argv[i]) == 0) {
+            char *sample_str = argv[++i];
+            if (!sample_str || (flight_sample_every = atoi(sample_str)) < 1) {
+                fprintf(stderr, "Expected positive integer after --flight-recorder\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--flight-dump", argv[i]) == 0) {
+            if (!(flight_dump_path = argv[++i])) {
+                fprintf(stderr, "Expected a file name after --flight-dump\n");
+                exit_with_usage();
+            }
+        } else if (strcmp("--max-upload", argv[i]) == 0) {
+            char *size_str = argv[++i];
+            long size_mb;
+            if (!size_str || (size_mb = atol(size_str)) < 1) {
+                fprintf(stderr, "Expected a size in MiB after --max-upload\n");
+                exit_with_usage();
+            }
+            max_upload_size = (size_t) size_mb << 20;
+        } else if (strcmp("--mime-types", argv[i]) == 0) {
+            char *mime_types_path = argv[++i];
+            if (!mime_types_path) {
+                fprintf(stderr, "Expected a file name after --mime-types\n");
+                exit_with_usage();
+            }
+            if (mime_load(mime_types_path) == -1) {
+                fprintf(stderr, "Failed to load MIME types from %s\n", mime_types_path);
+                exit(EXIT_FAILURE);
+            }
         } else if (strcmp("--help", argv[i]) == 0) {
             exit_with_usage();
         } else {
@@ -432,12 +1716,45 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (server_files_directory == NULL && server_proxy_hostname == NULL) {
-        fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
-                        "                      \"--proxy [HOSTNAME:PORT]\"\n");
+    if (server_files_directory == NULL && server_proxy_targets == NULL && !server_bundle_loaded) {
+        fprintf(stderr, "Please specify either \"--files [DIRECTORY]\", \n"
+                        "                      \"--bundle [FILE]\" or \n"
+                        "                      \"--proxy [HOSTNAME:PORT,...]\"\n");
         exit_with_usage();
     }
 
+    if (server_proxy_targets != NULL) upstream_init(upstream_policy);
+
+    if (proxy_cache_dir != NULL) {
+        if (!proxycache_enabled()) {
+            fprintf(stderr, "--proxy-cache-dir needs --proxy-cache\n");
+            exit_with_usage();
+        }
+        if (proxycache_init_disk(proxy_cache_dir, (size_t) proxy_cache_disk_mb << 20) == -1) {
+            perror("Failed to use the proxy cache directory");
+            exit(errno);
+        }
+    }
+
+    if (coroutines_enabled && (tls_cert_path != NULL || tls_key_path != NULL)) {
+        fprintf(stderr, "--coroutines cannot serve HTTPS\n");
+        exit_with_usage();
+    }
+    if (coroutines_enabled && num_threads == 0) num_threads = 1;
+
+    if (tls_cert_path != NULL || tls_key_path != NULL) {
+        if (tls_cert_path == NULL || tls_key_path == NULL) {
+            fprintf(stderr, "HTTPS needs both --tls-cert and --tls-key\n");
+            exit_with_usage();
+        }
+        if (tls_init(tls_cert_path, tls_key_path, tls_ktls_tls12) == -1) {
+            fprintf(stderr, "Failed to set up TLS with %s and %s\n", tls_cert_path, tls_key_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (flight_sample_every) init_flight_recorder(flight_sample_every);
+
     serve_forever(&server_fd, request_handler);
 
     return EXIT_SUCCESS;
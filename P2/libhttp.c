@@ -1,26 +1,61 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "libhttp.h"
+#include "mime.h"
 
 #define LIBHTTP_REQUEST_MAX_SIZE 8192
 
+static __thread size_t response_bytes_sent;
+static __thread void (*send_pacer)(void *context, size_t bytes);
+static __thread void *send_pacer_context;
+
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+/*
+ * Returns where the blank line that ends a head starts in DATA: at the "\n"
+ * of the last header line, followed by "\r\n", or by "\n" alone from clients
+ * that end lines with LF. Sets *LENGTH to the terminator's length. Returns
+ * NULL if the head has not ended yet.
+ */
+static char *http_find_head_end(char *data, size_t size, size_t *length) {
+  char *crlf = memmem(data, size, "\n\r\n", 3);
+  char *lf = memmem(data, size, "\n\n", 2);
+  if (lf && (crlf == NULL || lf < crlf)) {
+    *length = 2;
+    return lf;
+  }
+  *length = 3;
+  return crlf;
+}
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
+struct http_request *http_request_parse(int fd) {
+  arena_t *arena = thread_arena();
+  struct http_request *request = arena_alloc(arena, sizeof(struct http_request));
+  char *read_buffer = arena_alloc(arena, LIBHTTP_REQUEST_MAX_SIZE + 1);
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
+  /* The head may arrive in pieces: read until its blank line, a full buffer
+   * or the end of the stream. */
+  size_t bytes_read = 0, terminator_length;
+  while (bytes_read < LIBHTTP_REQUEST_MAX_SIZE) {
+    ssize_t chunk = read(fd, read_buffer + bytes_read, LIBHTTP_REQUEST_MAX_SIZE - bytes_read);
+    if (chunk <= 0) break;
+    size_t searched = bytes_read > 2 ? bytes_read - 2 : 0;
+    bytes_read += chunk;
+    if (http_find_head_end(read_buffer + searched, bytes_read - searched, &terminator_length) != NULL) break;
+  }
   read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
 
   char *read_start, *read_end;
@@ -32,7 +67,7 @@ struct http_request *http_request_parse(int fd) {
     while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
     read_size = read_end - read_start;
     if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
+    request->method = arena_alloc(arena, read_size + 1);
     memcpy(request->method, read_start, read_size);
     request->method[read_size] = '\0';
 
@@ -46,7 +81,7 @@ struct http_request *http_request_parse(int fd) {
     while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
     read_size = read_end - read_start;
     if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
+    request->path = arena_alloc(arena, read_size + 1);
     memcpy(request->path, read_start, read_size);
     request->path[read_size] = '\0';
 
@@ -56,23 +91,63 @@ struct http_request *http_request_parse(int fd) {
     if (*read_end != '\n') break;
     read_end++;
 
-    free(read_buffer);
+    /* Keep the raw head around, up to and including the blank line. */
+    char *head_end = http_find_head_end(read_end - 1, bytes_read - (read_end - 1 - read_buffer), &terminator_length);
+    request->head = read_buffer;
+    request->head_length = head_end ? (size_t) (head_end + terminator_length - read_buffer) : bytes_read;
+    request->body = read_buffer + request->head_length;
+    request->body_length = bytes_read - request->head_length;
     return request;
   } while (0);
 
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+  /* An error occurred. The arena reclaims the buffers. */
   return NULL;
 
 }
 
+int http_head_header(const char *head, size_t head_length, const char *name, char *value, size_t size) {
+  size_t name_length = strlen(name);
+  const char *head_end = head + head_length;
+
+  /* Skip the start line, then look at one header line at a time. */
+  const char *line = memchr(head, '\n', head_length);
+  while (line && ++line < head_end) {
+    const char *line_end = memchr(line, '\n', head_end - line);
+    if (line_end == NULL) line_end = head_end;
+
+    if ((size_t) (line_end - line) > name_length && line[name_length] == ':' &&
+        strncasecmp(line, name, name_length) == 0) {
+      const char *start = line + name_length + 1, *end = line_end;
+      while (start < end && (*start == ' ' || *start == '\t')) start++;
+      while (end > start && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+
+      size_t length = end - start;
+      if (length > size - 1) length = size - 1;
+      memcpy(value, start, length);
+      value[length] = '\0';
+      return 1;
+    }
+    line = line_end < head_end ? line_end : NULL;
+  }
+  return 0;
+}
+
+int http_request_header(struct http_request *request, char *name, char *value, size_t size) {
+  return http_head_header(request->head, request->head_length, name, value, size);
+}
+
 char* http_get_response_message(int status_code) {
   switch (status_code) {
     case 100:
       return "Continue";
+    case 101:
+      return "Switching Protocols";
     case 200:
       return "OK";
+    case 201:
+      return "Created";
+    case 204:
+      return "No Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,22 +164,101 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 409:
+      return "Conflict";
+    case 411:
+      return "Length Required";
+    case 413:
+      return "Content Too Large";
+    case 414:
+      return "URI Too Long";
+    case 429:
+      return "Too Many Requests";
+    case 501:
+      return "Not Implemented";
     default:
       return "Internal Server Error";
   }
 }
 
+void http_response_init(struct http_response *response, int status_code) {
+  response->status_code = status_code;
+  response->content_type = "text/html";
+  response->content_length = 0;
+  response->data = NULL;
+  response->file_fd = -1;
+  response->release = NULL;
+  response->release_context = NULL;
+}
+
+void http_response_release(struct http_response *response) {
+  if (response->file_fd >= 0) close(response->file_fd);
+  if (response->release) response->release(response);
+  response->file_fd = -1;
+  response->release = NULL;
+}
+
+static void http_count_bytes(ssize_t written) {
+  if (written > 0) response_bytes_sent += written;
+}
+
+void http_set_pacer(void (*pace)(void *context, size_t bytes), void *context) {
+  send_pacer = pace;
+  send_pacer_context = context;
+}
+
+/* Returns how much of SIZE to send next, after waiting for the pacer if
+ * there is one. */
+static size_t http_pace(size_t size) {
+  if (send_pacer == NULL)
+    return size;
+  if (size > HTTP_PACE_CHUNK_SIZE)
+    size = HTTP_PACE_CHUNK_SIZE;
+  send_pacer(send_pacer_context, size);
+  return size;
+}
+
+/* Writes a formatted line of the head, unpaced. Not with dprintf: its writes
+ * happen inside libc, out of reach of httpserver's wrapped socket calls. */
+static void http_send_line(int fd, const char *format, ...) {
+  char line[1024];
+  char *data = line;
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(line, sizeof(line), format, arguments);
+  va_end(arguments);
+  if (length < 0)
+    return;
+  if ((size_t) length >= sizeof(line)) {
+    if ((data = malloc(length + 1)) == NULL)
+      return;
+    va_start(arguments, format);
+    vsnprintf(data, length + 1, format, arguments);
+    va_end(arguments);
+  }
+
+  for (char *next = data; length > 0;) {
+    ssize_t written = write(fd, next, length);
+    if (written < 0)
+      break;
+    http_count_bytes(written);
+    next += written;
+    length -= written;
+  }
+  if (data != line)
+    free(data);
+}
+
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
-      http_get_response_message(status_code));
+  http_send_line(fd, "HTTP/1.0 %d %s\r\n", status_code, http_get_response_message(status_code));
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  http_send_line(fd, "%s: %s\r\n", key, value);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  http_send_line(fd, "\r\n");
 }
 
 void http_send_string(int fd, char *data) {
@@ -114,33 +268,93 @@ void http_send_string(int fd, char *data) {
 void http_send_data(int fd, char *data, size_t size) {
   ssize_t bytes_sent;
   while (size > 0) {
-    bytes_sent = write(fd, data, size);
+    bytes_sent = write(fd, data, http_pace(size));
     if (bytes_sent < 0)
       return;
+    http_count_bytes(bytes_sent);
     size -= bytes_sent;
     data += bytes_sent;
   }
 }
 
+ssize_t http_send_file(int fd, int file_fd, off_t offset, size_t size) {
+  size_t total = 0;
+  while (total < size) {
+    ssize_t bytes_sent = sendfile(fd, file_fd, &offset, http_pace(size - total));
+    if (bytes_sent <= 0)
+      return (total > 0 || bytes_sent == 0) ? (ssize_t) total : -1;
+    http_count_bytes(bytes_sent);
+    total += bytes_sent;
+  }
+  return total;
+}
+
+ssize_t http_splice_data(int fd, int source_fd, int pipe_fds[2], size_t size) {
+  if (send_pacer != NULL && size > HTTP_PACE_CHUNK_SIZE)
+    size = HTTP_PACE_CHUNK_SIZE;
+  ssize_t bytes_read = splice(source_fd, NULL, pipe_fds[1], NULL, size, SPLICE_F_MOVE);
+  if (bytes_read <= 0)
+    return bytes_read;
+  if (send_pacer != NULL)
+    send_pacer(send_pacer_context, bytes_read);
+  for (ssize_t left = bytes_read; left > 0;) {
+    ssize_t bytes_sent = splice(pipe_fds[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+    if (bytes_sent <= 0)
+      return -1;
+    http_count_bytes(bytes_sent);
+    left -= bytes_sent;
+  }
+  return bytes_read;
+}
+
+void http_send_vector(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t bytes_sent;
+  if (send_pacer != NULL) {
+    /* Paced: one buffer, one chunk at a time. */
+    for (int i = 0; i < iovcnt; i++)
+      http_send_data(fd, iov[i].iov_base, iov[i].iov_len);
+    return;
+  }
+  while (iovcnt > 0) {
+    bytes_sent = writev(fd, iov, iovcnt);
+    if (bytes_sent < 0)
+      return;
+    http_count_bytes(bytes_sent);
+    /* Skip what was fully written and advance into a partially written iovec. */
+    while (iovcnt > 0 && (size_t) bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+}
+
+void http_reset_bytes_sent() {
+  response_bytes_sent = 0;
+}
+
+size_t http_bytes_sent() {
+  return response_bytes_sent;
+}
+
+void http_swap_thread_state(struct http_thread_state *state) {
+  struct http_thread_state swapped = {response_bytes_sent, send_pacer, send_pacer_context};
+  response_bytes_sent = state->bytes_sent;
+  send_pacer = state->pace;
+  send_pacer_context = state->pace_context;
+  *state = swapped;
+}
+
 char *http_get_mime_type(char *file_name) {
   char *file_extension = strrchr(file_name, '.');
-  if (file_extension == NULL) {
+  if (file_extension == NULL || strchr(file_extension, '/') != NULL) {
     return "text/plain";
   }
 
-  if (strcmp(file_extension, ".html") == 0 || strcmp(file_extension, ".htm") == 0) {
-    return "text/html";
-  } else if (strcmp(file_extension, ".jpg") == 0 || strcmp(file_extension, ".jpeg") == 0) {
-    return "image/jpeg";
-  } else if (strcmp(file_extension, ".png") == 0) {
-    return "image/png";
-  } else if (strcmp(file_extension, ".css") == 0) {
-    return "text/css";
-  } else if (strcmp(file_extension, ".js") == 0) {
-    return "application/javascript";
-  } else if (strcmp(file_extension, ".pdf") == 0) {
-    return "application/pdf";
-  } else {
-    return "text/plain";
-  }
+  const char *mime_type = mime_lookup(file_extension + 1);
+  return mime_type ? (char *) mime_type : "text/plain";
 }
@@ -20,24 +20,104 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 /*
  * Functions for parsing an HTTP request.
  */
 struct http_request {
   char *method;
   char *path;
+  char *head;         /* Request line and headers exactly as read. */
+  size_t head_length;
+  char *body;         /* The start of the body, read along with the head; the */
+  size_t body_length; /* rest is still to be read from the socket. */
 };
 
+/*
+ * The request and its strings are allocated from the calling thread's arena
+ * (see arena.h) and stay valid until the arena is reset.
+ */
 struct http_request *http_request_parse(int fd);
 
+/*
+ * Copies the value of header NAME (case-insensitive) into VALUE, truncated to
+ * SIZE - 1 bytes. Returns 1 if the header is present, 0 otherwise.
+ */
+int http_request_header(struct http_request *request, char *name, char *value, size_t size);
+
+/*
+ * Like http_request_header, for any head of HEAD_LENGTH bytes that starts with
+ * a request or status line (e.g. an upstream response).
+ */
+int http_head_header(const char *head, size_t head_length, const char *name, char *value, size_t size);
+
+/*
+ * A response worked out ahead of sending, so the HTTP/1.0 and HTTP/2 front
+ * ends can frame the same thing. The body is DATA if set, otherwise
+ * CONTENT_LENGTH bytes read from FILE_FD.
+ */
+struct http_response {
+  int status_code;
+  char *content_type;
+  size_t content_length;
+  char *data;
+  int file_fd;
+  void (*release)(struct http_response *response); /* Frees DATA, may be NULL. */
+  void *release_context;
+};
+
+/* Sets up an empty text/html response with STATUS_CODE and no body. */
+void http_response_init(struct http_response *response, int status_code);
+
+/* Closes FILE_FD and calls RELEASE. */
+void http_response_release(struct http_response *response);
+
 /*
  * Functions for sending an HTTP response.
  */
+char *http_get_response_message(int status_code);
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
+void http_send_vector(int fd, struct iovec *iov, int iovcnt);
+/* Sends SIZE bytes of FILE_FD from OFFSET with sendfile, leaving the file
+ * position alone. Returns the bytes sent, or -1 if sendfile failed before
+ * sending any. */
+ssize_t http_send_file(int fd, int file_fd, off_t offset, size_t size);
+/* Moves up to SIZE bytes from SOURCE_FD to FD through the pipe PIPE_FDS, so
+ * they never enter userspace. Returns the bytes moved, 0 at the end of
+ * SOURCE_FD, or -1 (EINVAL if either fd cannot splice). */
+ssize_t http_splice_data(int fd, int source_fd, int pipe_fds[2], size_t size);
+
+/*
+ * While a pacer is set on this thread, the functions above (except for the
+ * status line and headers) send at most HTTP_PACE_CHUNK_SIZE bytes at a time,
+ * each chunk after PACE(CONTEXT, its size) returns. Pass NULL to stop pacing.
+ */
+#define HTTP_PACE_CHUNK_SIZE 65536
+void http_set_pacer(void (*pace)(void *context, size_t bytes), void *context);
+
+/*
+ * Per-thread count of response bytes written by the functions above.
+ */
+void http_reset_bytes_sent();
+size_t http_bytes_sent();
+
+/*
+ * The per-thread state above, for code that interleaves connections on one
+ * thread (see coro.h): exchanges *STATE with the calling thread's.
+ */
+struct http_thread_state {
+  size_t bytes_sent;
+  void (*pace)(void *context, size_t bytes);
+  void *pace_context;
+};
+void http_swap_thread_state(struct http_thread_state *state);
 
 /*
  * Helper function: gets the Content-Type based on a file name.
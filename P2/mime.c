@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mime.h"
+#include "util.h"
+
+#define MIME_MAX_DISPLACEMENT 1000000
+
+static const mime_table_t *active_table = &mime_builtin_table;
+
+/* FNV-1a over the lower-cased extension, finished with murmur3's fmix32 so
+ * that different seeds give unrelated slots. */
+static uint32_t mime_hash(const char *extension, uint32_t seed) {
+    uint32_t h = FNV1A_OFFSET_BASIS ^ (seed * 0x9e3779b9u);
+    for (const unsigned char *c = (const unsigned char *) extension; *c; c++) {
+        h ^= (*c >= 'A' && *c <= 'Z') ? *c | 0x20 : *c;
+        h *= FNV1A_PRIME;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+const char *mime_table_lookup(const mime_table_t *table, const char *extension) {
+    uint32_t bucket = mime_hash(extension, 0) % table->num_buckets;
+    const mime_entry_t *slot = &table->slots[mime_hash(extension, table->displacements[bucket]) & table->size_mask];
+    if (slot->extension && strcasecmp(slot->extension, extension) == 0) return slot->type;
+    return NULL;
+}
+
+typedef struct mime_bucket {
+    uint32_t index;
+    int count;
+    int *members;
+} mime_bucket_t;
+
+static int compare_bucket_size(const void *a, const void *b) {
+    const mime_bucket_t *x = a, *y = b;
+    if (x->count != y->count) return y->count - x->count;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/* Tries to place every bucket into SIZE slots. Returns 0 on success. */
+static int mime_table_place(const mime_entry_t *entries, mime_bucket_t *buckets, uint32_t num_buckets,
+                            uint32_t size, mime_entry_t *slots, uint32_t *displacements) {
+    uint32_t positions[64];
+    memset(slots, 0, size * sizeof(mime_entry_t));
+
+    for (uint32_t b = 0; b < num_buckets && buckets[b].count > 0; b++) {
+        mime_bucket_t *bucket = &buckets[b];
+        if (bucket->count > 64) return -1;
+
+        uint32_t displacement;
+        for (displacement = 1; displacement < MIME_MAX_DISPLACEMENT; displacement++) {
+            int fits = 1;
+            for (int i = 0; i < bucket->count && fits; i++) {
+                positions[i] = mime_hash(entries[bucket->members[i]].extension, displacement) & (size - 1);
+                if (slots[positions[i]].extension) fits = 0;
+                for (int j = 0; j < i && fits; j++)
+                    if (positions[j] == positions[i]) fits = 0;
+            }
+            if (fits) break;
+        }
+        if (displacement == MIME_MAX_DISPLACEMENT) return -1;
+
+        displacements[bucket->index] = displacement;
+        for (int i = 0; i < bucket->count; i++) slots[positions[i]] = entries[bucket->members[i]];
+    }
+    return 0;
+}
+
+int mime_table_build(mime_table_t *table, const mime_entry_t *entries, int count) {
+    uint32_t num_buckets = count / 2 > 0 ? count / 2 : 1;
+    uint32_t size = 8;
+    while (size < (uint32_t) count + count / 4 + 1) size <<= 1;
+
+    mime_bucket_t *buckets = calloc(num_buckets, sizeof(mime_bucket_t));
+    int *members = malloc((count > 0 ? count : 1) * sizeof(int));
+    uint32_t *displacements = calloc(num_buckets, sizeof(uint32_t));
+    if (!buckets || !members || !displacements) goto fail;
+
+    /* Group entries by bucket. MEMBERS is laid out bucket after bucket. */
+    uint32_t *bucket_of = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (!bucket_of) goto fail;
+    for (int i = 0; i < count; i++) {
+        bucket_of[i] = mime_hash(entries[i].extension, 0) % num_buckets;
+        buckets[bucket_of[i]].count++;
+    }
+    int offset = 0;
+    for (uint32_t b = 0; b < num_buckets; b++) {
+        buckets[b].index = b;
+        buckets[b].members = members + offset;
+        offset += buckets[b].count;
+        buckets[b].count = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        mime_bucket_t *bucket = &buckets[bucket_of[i]];
+        for (int j = 0; j < bucket->count; j++)
+            if (strcasecmp(entries[bucket->members[j]].extension, entries[i].extension) == 0) {
+                free(bucket_of);
+                goto fail;
+            }
+        bucket->members[bucket->count++] = i;
+    }
+    free(bucket_of);
+
+    /* Biggest buckets first, while the table is still empty. */
+    qsort(buckets, num_buckets, sizeof(mime_bucket_t), compare_bucket_size);
+
+    mime_entry_t *slots = NULL;
+    for (; size <= (1u << 20); size <<= 1) {
+        free(slots);
+        if ((slots = malloc(size * sizeof(mime_entry_t))) == NULL) goto fail;
+        if (mime_table_place(entries, buckets, num_buckets, size, slots, displacements) == 0) break;
+    }
+    if (size > (1u << 20)) {
+        free(slots);
+        goto fail;
+    }
+
+    table->size_mask = size - 1;
+    table->num_buckets = num_buckets;
+    table->displacements = displacements;
+    table->slots = slots;
+    free(buckets);
+    free(members);
+    return 0;
+
+fail:
+    free(buckets);
+    free(members);
+    free(displacements);
+    return -1;
+}
+
+int mime_types_read(FILE *file, mime_entry_t **entries) {
+    int count = 0, capacity = 256;
+    char *line = NULL;
+    size_t line_capacity = 0;
+
+    *entries = malloc(capacity * sizeof(mime_entry_t));
+    if (*entries == NULL) return -1;
+
+    while (getline(&line, &line_capacity, file) != -1) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *saveptr = NULL;
+        char *type = strtok_r(line, " \t\r\n", &saveptr);
+        if (type == NULL) continue;
+        type = strdup(type);
+
+        for (char *extension; (extension = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL;) {
+            for (char *c = extension; *c; c++) *c = (char) tolower((unsigned char) *c);
+
+            int existing;
+            for (existing = 0; existing < count; existing++)
+                if (strcmp((*entries)[existing].extension, extension) == 0) break;
+            if (existing < count) {
+                (*entries)[existing].type = type;
+                continue;
+            }
+
+            if (count == capacity) {
+                mime_entry_t *grown = realloc(*entries, (capacity *= 2) * sizeof(mime_entry_t));
+                if (grown == NULL) {
+                    free(line);
+                    return -1;
+                }
+                *entries = grown;
+            }
+            (*entries)[count].extension = strdup(extension);
+            (*entries)[count].type = type;
+            count++;
+        }
+    }
+    free(line);
+    return count;
+}
+
+const char *mime_lookup(const char *extension) {
+    return mime_table_lookup(active_table, extension);
+}
+
+int mime_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    mime_entry_t *loaded;
+    int num_loaded = mime_types_read(file, &loaded);
+    fclose(file);
+    if (num_loaded < 0) return -1;
+
+    /* Built-in entries first, then the loaded ones that are new or override. */
+    int capacity = (int) mime_builtin_table.size_mask + 1 + num_loaded, count = 0;
+    mime_entry_t *merged = malloc(capacity * sizeof(mime_entry_t));
+    if (merged == NULL) return -1;
+    for (uint32_t i = 0; i <= mime_builtin_table.size_mask; i++) {
+        const mime_entry_t *slot = &mime_builtin_table.slots[i];
+        if (slot->extension == NULL) continue;
+        int overridden = 0;
+        for (int j = 0; j < num_loaded && !overridden; j++)
+            overridden = strcmp(loaded[j].extension, slot->extension) == 0;
+        if (!overridden) merged[count++] = *slot;
+    }
+    memcpy(merged + count, loaded, num_loaded * sizeof(mime_entry_t));
+    count += num_loaded;
+
+    mime_table_t *table = malloc(sizeof(mime_table_t));
+    if (table == NULL || mime_table_build(table, merged, count) == -1) {
+        free(table);
+        free(merged);
+        return -1;
+    }
+    free(merged);
+    active_table = table;
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef __MIME__
+#define __MIME__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Extension to media type lookup through a collision-free perfect hash
+ * ("hash and displace"): a first hash picks a bucket, the bucket's
+ * displacement seeds a second hash that picks the one slot the extension can
+ * be in. A lookup is two hashes and one case-insensitive compare, and it
+ * never allocates.
+ *
+ * The built-in table is generated from mime.types at build time by mime_gen;
+ * mime_load() merges a mime.types file over it at startup.
+ */
+
+typedef struct mime_entry {
+    const char *extension; // Lower case, without the dot. NULL for an empty slot.
+    const char *type;
+} mime_entry_t;
+
+typedef struct mime_table {
+    uint32_t size_mask; // Number of slots minus one; the number of slots is a power of two.
+    uint32_t num_buckets;
+    const uint32_t *displacements;
+    const mime_entry_t *slots;
+} mime_table_t;
+
+extern const mime_table_t mime_builtin_table;
+
+/* Returns the media type for EXTENSION (no dot, any case) in TABLE, or NULL. */
+const char *mime_table_lookup(const mime_table_t *table, const char *extension);
+
+/* Builds a perfect hash over COUNT entries with distinct extensions into
+ * TABLE. The entries are copied by pointer, not duplicated. Returns 0 on
+ * success, -1 if an extension is repeated or memory runs out. */
+int mime_table_build(mime_table_t *table, const mime_entry_t *entries, int count);
+
+/* Reads a mime.types file into a newly allocated array. Later lines win over
+ * earlier ones for the same extension. Returns the number of entries, or -1
+ * on error. */
+int mime_types_read(FILE *file, mime_entry_t **entries);
+
+/* Returns the media type for EXTENSION in the active table, or NULL. */
+const char *mime_lookup(const char *extension);
+
+/* Merges the mime.types file at PATH over the built-in table and makes the
+ * result the active table. Call once at startup. Returns 0 or -1. */
+int mime_load(const char *path);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Compiles a mime.types file into the perfect-hash table that httpserver
+ * uses by default. Run by the Makefile:
+ *
+ *     ./mime_gen mime.types > mime_builtin.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mime.h"
+
+/* mime.c refers to the built-in table; the generator has none yet. */
+const mime_table_t mime_builtin_table;
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s mime.types > mime_builtin.c\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(argv[1], "r");
+    if (file == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    mime_entry_t *entries;
+    int count = mime_types_read(file, &entries);
+    fclose(file);
+
+    mime_table_t table;
+    if (count < 1 || mime_table_build(&table, entries, count) == -1) {
+        fprintf(stderr, "%s: failed to build a perfect hash table\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    printf("/* Generated by mime_gen from %s: %d extensions in %u slots. Do not edit. */\n\n", argv[1], count,
+           table.size_mask + 1);
+    printf("#include \"mime.h\"\n\n");
+
+    printf("static const uint32_t displacements[%u] = {", table.num_buckets);
+    for (uint32_t i = 0; i < table.num_buckets; i++)
+        printf("%s%u", i == 0 ? "\n        " : i % 12 ? ", " : ",\n        ", table.displacements[i]);
+    printf("\n};\n\n");
+
+    printf("static const mime_entry_t slots[%u] = {\n", table.size_mask + 1);
+    for (uint32_t i = 0; i <= table.size_mask; i++)
+        if (table.slots[i].extension)
+            printf("        [%u] = {\"%s\", \"%s\"},\n", i, table.slots[i].extension, table.slots[i].type);
+    printf("};\n\n");
+
+    printf("const mime_table_t mime_builtin_table = {\n"
+           "        .size_mask = %u,\n"
+           "        .num_buckets = %u,\n"
+           "        .displacements = displacements,\n"
+           "        .slots = slots\n"
+           "};\n", table.size_mask, table.num_buckets);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,304 @@
+/*
+ * Packs a directory tree into a bundle for `httpserver --bundle` (the format
+ * is described in bundle.h). Every file gets a pre-rendered response head and
+ * an ETag. Directories get "/dir" and "/dir/" entries that serve their
+ * index.html, or a pre-rendered listing when there is none. With --gzip,
+ * compressible files that shrink by at least 10% also get a gzip variant.
+ *
+ * Usage: ./mkbundle [--gzip] www_directory/ site.bundle
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "bundle.h"
+#include "libhttp.h"
+
+#define BUNDLE_ALIGNMENT 16
+
+typedef struct item {
+    char *path;          // Request path, e.g. "/docs/index.html".
+    char *source;        // File to read, or NULL for a generated listing.
+    char *listing;       // Generated directory listing.
+    struct item *alias;  // Item whose body this entry serves, or NULL.
+    bundle_entry_t entry;
+    char *etag;
+    char *head;
+    char *gzip_head;
+} item_t;
+
+static item_t **items;
+static int num_items, items_capacity;
+static int use_gzip;
+
+static item_t *add_item(char *path) {
+    if (num_items == items_capacity) {
+        items_capacity = items_capacity ? items_capacity * 2 : 256;
+        items = realloc(items, items_capacity * sizeof(item_t *));
+    }
+    item_t *item = calloc(1, sizeof(item_t));
+    item->path = path;
+    items[num_items++] = item;
+    return item;
+}
+
+static char *join(const char *a, const char *b) {
+    char *joined;
+    if (asprintf(&joined, "%s/%s", a, b) < 0) exit(ENOMEM);
+    return joined;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Adds entries for the directory at FS_PATH served under URL_PATH ("" for the
+ * root), then recurses into its subdirectories. */
+static void walk(const char *fs_path, const char *url_path) {
+    DIR *dir = opendir(fs_path);
+    if (dir == NULL) {
+        perror(fs_path);
+        exit(EXIT_FAILURE);
+    }
+
+    char **names = NULL;
+    int num_names = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) continue;
+        names = realloc(names, (num_names + 1) * sizeof(char *));
+        names[num_names++] = strdup(dirent->d_name);
+    }
+    closedir(dir);
+    qsort(names, num_names, sizeof(char *), compare_names);
+
+    item_t *index = NULL;
+    for (int i = 0; i < num_names; i++) {
+        char *child_fs = join(fs_path, names[i]), *child_url = join(url_path, names[i]);
+        struct stat child_stat;
+        if (stat(child_fs, &child_stat) == -1) {
+            perror(child_fs);
+            exit(EXIT_FAILURE);
+        }
+        if (S_ISDIR(child_stat.st_mode)) {
+            walk(child_fs, child_url);
+            free(child_fs);
+            free(child_url);
+        } else if (S_ISREG(child_stat.st_mode)) {
+            item_t *item = add_item(child_url);
+            item->source = child_fs;
+            if (strcmp(names[i], "index.html") == 0) index = item;
+        }
+    }
+
+    /* The directory itself, with and without the trailing slash. */
+    char *slash_path;
+    if (asprintf(&slash_path, "%s/", url_path) < 0) exit(ENOMEM);
+    item_t *self = add_item(slash_path);
+    if (index) {
+        self->alias = index;
+    } else {
+        size_t length = 0;
+        char *listing = NULL;
+        FILE *out = open_memstream(&listing, &length);
+        fprintf(out, "<html><head><title>Content of directory</title></head><body><h2>Content of %s</h2><ul>",
+                slash_path);
+        for (int i = 0; i < num_names; i++)
+            fprintf(out, "<li><a href=\"./%s\">%s</a></li>", names[i], names[i]);
+        fprintf(out, "</ul></body></html>");
+        fclose(out);
+        self->listing = listing;
+    }
+    if (url_path[0] != '\0') add_item(strdup(url_path))->alias = index ? index : self;
+
+    for (int i = 0; i < num_names; i++) free(names[i]);
+    free(names);
+}
+
+static char *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = malloc(*length ? *length : 1);
+    if (fread(data, 1, *length, file) != *length) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    return data;
+}
+
+static int is_compressible(const char *mime_type) {
+    return strncmp(mime_type, "text/", 5) == 0 || strstr(mime_type, "json") || strstr(mime_type, "javascript") ||
+           strstr(mime_type, "xml") || strstr(mime_type, "wasm");
+}
+
+/* Returns a gzip-compressed copy of DATA, or NULL if it does not pay off. */
+static char *gzip(const char *data, size_t length, size_t *compressed_length) {
+    z_stream stream = {0};
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+    size_t capacity = deflateBound(&stream, length);
+    char *compressed = malloc(capacity);
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = length;
+    stream.next_out = (Bytef *) compressed;
+    stream.avail_out = capacity;
+    int status = deflate(&stream, Z_FINISH);
+    *compressed_length = stream.total_out;
+    deflateEnd(&stream);
+
+    if (status != Z_STREAM_END || *compressed_length > length - length / 10) {
+        free(compressed);
+        return NULL;
+    }
+    return compressed;
+}
+
+static uint64_t align(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+static void write_at(FILE *out, uint64_t offset, const void *data, size_t length) {
+    if (fseek(out, offset, SEEK_SET) == -1 || fwrite(data, 1, length, out) != length) {
+        perror("Failed to write bundle");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Writes the bodies of every item that owns one, starting at *OFFSET. */
+static void write_bodies(FILE *out, uint64_t *offset) {
+    for (int i = 0; i < num_items; i++) {
+        item_t *item = items[i];
+        if (item->alias) continue;
+
+        size_t length;
+        char *data = item->source ? read_file(item->source, &length) : item->listing;
+        if (!item->source) length = strlen(item->listing);
+        char *mime_type = http_get_mime_type(item->source ? item->source : "listing.html");
+
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t j = 0; j < length; j++) hash = (hash ^ (unsigned char) data[j]) * 1099511628211ull;
+        if (asprintf(&item->etag, "\"%016llx-%zx\"", (unsigned long long) hash, length) < 0) exit(ENOMEM);
+
+        *offset = align(*offset, BUNDLE_ALIGNMENT);
+        item->entry.body_offset = *offset;
+        item->entry.body_length = length;
+        write_at(out, *offset, data, length);
+        *offset += length;
+
+        size_t compressed_length = 0;
+        char *compressed = use_gzip && is_compressible(mime_type) ? gzip(data, length, &compressed_length) : NULL;
+        const char *vary = compressed ? "Vary: Accept-Encoding\r\n" : "";
+        if (compressed) {
+            *offset = align(*offset, BUNDLE_ALIGNMENT);
+            item->entry.flags |= BUNDLE_ENTRY_GZIP;
+            item->entry.gzip_body_offset = *offset;
+            item->entry.gzip_body_length = compressed_length;
+            write_at(out, *offset, compressed, compressed_length);
+            *offset += compressed_length;
+            if (asprintf(&item->gzip_head, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                                           "Content-Encoding: gzip\r\n%sETag: %s\r\n\r\n",
+                         mime_type, compressed_length, vary, item->etag) < 0)
+                exit(ENOMEM);
+            free(compressed);
+        }
+        if (asprintf(&item->head, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sETag: %s\r\n\r\n",
+                     mime_type, length, vary, item->etag) < 0)
+            exit(ENOMEM);
+
+        if (item->source) free(data);
+    }
+}
+
+static uint64_t append_string(FILE *out, uint64_t *offset, const char *string) {
+    uint64_t start = *offset;
+    write_at(out, start, string, strlen(string));
+    *offset += strlen(string);
+    return start;
+}
+
+static int compare_items(const void *a, const void *b) {
+    return strcmp((*(item_t *const *) a)->path, (*(item_t *const *) b)->path);
+}
+
+int main(int argc, char **argv) {
+    int argi = 1;
+    if (argi < argc && strcmp(argv[argi], "--gzip") == 0) {
+        use_gzip = 1;
+        argi++;
+    }
+    if (argc - argi != 2) {
+        fprintf(stderr, "Usage: %s [--gzip] www_directory/ site.bundle\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char *directory = argv[argi], *output = argv[argi + 1];
+    size_t directory_length = strlen(directory);
+    while (directory_length > 1 && directory[directory_length - 1] == '/') directory[--directory_length] = '\0';
+
+    walk(directory, "");
+    qsort(items, num_items, sizeof(item_t *), compare_items);
+
+    FILE *out = fopen(output, "wb");
+    if (out == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t offset = sizeof(bundle_header_t);
+    write_bodies(out, &offset);
+
+    /* Aliases take the body, head and ETag of the item they point at. */
+    for (int i = 0; i < num_items; i++) {
+        item_t *item = items[i], *target = item->alias;
+        if (target == NULL) continue;
+        while (target->alias) target = target->alias;
+        item->entry = target->entry;
+        item->etag = target->etag;
+        item->head = target->head;
+        item->gzip_head = target->gzip_head;
+    }
+
+    bundle_header_t header = {.num_entries = (uint32_t) num_items};
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.index_offset = align(offset, 8);
+    header.strings_offset = header.index_offset + (uint64_t) num_items * sizeof(bundle_entry_t);
+
+    offset = header.strings_offset;
+    for (int i = 0; i < num_items; i++) {
+        bundle_entry_t *entry = &items[i]->entry;
+        entry->path_offset = append_string(out, &offset, items[i]->path);
+        entry->path_length = strlen(items[i]->path);
+        entry->etag_offset = append_string(out, &offset, items[i]->etag);
+        entry->etag_length = strlen(items[i]->etag);
+        entry->head_offset = append_string(out, &offset, items[i]->head);
+        entry->head_length = strlen(items[i]->head);
+        if (entry->flags & BUNDLE_ENTRY_GZIP) {
+            entry->gzip_head_offset = append_string(out, &offset, items[i]->gzip_head);
+            entry->gzip_head_length = strlen(items[i]->gzip_head);
+        }
+        write_at(out, header.index_offset + i * sizeof(bundle_entry_t), entry, sizeof(bundle_entry_t));
+    }
+    header.total_size = offset;
+    write_at(out, 0, &header, sizeof(header));
+
+    if (fclose(out) != 0) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    printf("Bundled %d paths from %s into %s (%llu bytes)\n", num_items, directory, output,
+           (unsigned long long) header.total_size);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "proxycache.h"
+#include "util.h"
+
+typedef struct proxycache_fetch {
+    char *path;
+    struct proxycache_fetch *next;
+} proxycache_fetch_t;
+
+typedef struct proxycache_tier {
+    size_t budget;
+    size_t max_object_size;
+    size_t used;
+    proxycache_entry_t *lru_head; // Most recently used.
+    proxycache_entry_t *lru_tail;
+} proxycache_tier_t;
+
+static int cache_enabled;
+static char *disk_directory;
+static proxycache_tier_t memory_tier;
+static proxycache_tier_t disk_tier;
+static proxycache_entry_t *buckets[PROXYCACHE_BUCKETS];
+static proxycache_fetch_t *fetches; // Paths being fetched by a coalesced miss.
+static pthread_mutex_t proxycache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_done = PTHREAD_COND_INITIALIZER;
+
+static struct {
+    size_t memory_hits;
+    size_t disk_hits;
+    size_t misses;
+    size_t coalesced; // Misses that waited for another request's fetch.
+    size_t stored;
+    size_t demoted;   // Moved from memory to disk.
+    size_t upstream_bytes;
+    size_t bytes_saved;
+} stats;
+
+/* Hop-by-hop headers (RFC 9110 section 7.6.1), plus Age, which we recompute. */
+static const char *hop_by_hop_headers[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade", "Trailer", "Age", NULL
+};
+
+void proxycache_init(size_t memory_budget) {
+    cache_enabled = 1;
+    memory_tier.budget = memory_budget;
+    /* A single object may take at most a quarter of a tier. */
+    memory_tier.max_object_size = memory_budget / 4 < PROXYCACHE_MEMORY_OBJECT_MAX
+                                  ? memory_budget / 4 : PROXYCACHE_MEMORY_OBJECT_MAX;
+}
+
+int proxycache_init_disk(const char *directory, size_t disk_budget) {
+    int fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) return -1;
+    close(fd);
+    disk_directory = strdup(directory);
+    disk_tier.budget = disk_budget;
+    disk_tier.max_object_size = disk_budget / 4 < PROXYCACHE_DISK_OBJECT_MAX
+                                ? disk_budget / 4 : PROXYCACHE_DISK_OBJECT_MAX;
+    return 0;
+}
+
+int proxycache_enabled(void) {
+    return cache_enabled;
+}
+
+size_t proxycache_max_object_size(void) {
+    return disk_directory && disk_tier.max_object_size > memory_tier.max_object_size
+           ? disk_tier.max_object_size : memory_tier.max_object_size;
+}
+
+/*
+ * Returns 1 if the comma-separated directive list LIST has NAME, storing its
+ * "=N" argument in *VALUE if there is one and VALUE is not NULL.
+ */
+static int has_directive(const char *list, const char *name, long *value) {
+    size_t name_length = strlen(name);
+    while (*list) {
+        while (*list == ' ' || *list == '\t' || *list == ',') list++;
+        const char *end = list + strcspn(list, ",");
+        if ((size_t) (end - list) >= name_length && strncasecmp(list, name, name_length) == 0 &&
+            (list + name_length == end || list[name_length] == '=' || list[name_length] == ' ')) {
+            if (value && list[name_length] == '=') {
+                const char *argument = list + name_length + 1;
+                if (*argument == '"') argument++;
+                *value = atol(argument);
+            }
+            return 1;
+        }
+        list = end;
+    }
+    return 0;
+}
+
+/* Parses an IMF-fixdate (RFC 9110 section 5.6.7). Returns -1 if VALUE is not one. */
+static time_t parse_http_date(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) return -1;
+    return timegm(&tm);
+}
+
+int proxycache_request_cacheable(struct http_request *request) {
+    char value[PROXYCACHE_VARY_MAX_SIZE];
+    long max_age = -1;
+
+    if (request->method == NULL || strcmp(request->method, "GET") != 0) return 0;
+    if (http_request_header(request, "Authorization", value, sizeof(value)) ||
+        http_request_header(request, "Range", value, sizeof(value)))
+        return 0;
+    if (http_request_header(request, "Cache-Control", value, sizeof(value)) &&
+        (has_directive(value, "no-store", NULL) || has_directive(value, "no-cache", NULL) ||
+         (has_directive(value, "max-age", &max_age) && max_age == 0)))
+        return 0;
+    if (http_request_header(request, "Pragma", value, sizeof(value)) && has_directive(value, "no-cache", NULL))
+        return 0;
+    return 1;
+}
+
+long proxycache_freshness(const char *head, size_t head_length, time_t now, long *age) {
+    char value[PROXYCACHE_VARY_MAX_SIZE];
+    int status_code;
+    long lifetime = -1;
+    *age = 0;
+
+    if (sscanf(head, "HTTP/%*d.%*d %d", &status_code) != 1) return -1;
+    if (status_code != 200 && status_code != 203 && status_code != 301 && status_code != 404 && status_code != 410)
+        return -1;
+
+    /* Chunked bodies are relayed as is; cookies are per user. */
+    if (http_head_header(head, head_length, "Transfer-Encoding", value, sizeof(value)) ||
+        http_head_header(head, head_length, "Set-Cookie", value, sizeof(value)))
+        return -1;
+    if (http_head_header(head, head_length, "Vary", value, sizeof(value)) && strchr(value, '*'))
+        return -1;
+
+    if (http_head_header(head, head_length, "Age", value, sizeof(value)) && atol(value) > 0)
+        *age = atol(value);
+
+    if (http_head_header(head, head_length, "Cache-Control", value, sizeof(value))) {
+        if (has_directive(value, "no-store", NULL) || has_directive(value, "no-cache", NULL) ||
+            has_directive(value, "private", NULL))
+            return -1;
+        /* s-maxage applies to shared caches like us and overrides max-age. */
+        if (!has_directive(value, "s-maxage", &lifetime)) has_directive(value, "max-age", &lifetime);
+    }
+    if (lifetime < 0 && http_head_header(head, head_length, "Expires", value, sizeof(value))) {
+        time_t expires = parse_http_date(value), date = -1;
+        if (http_head_header(head, head_length, "Date", value, sizeof(value))) date = parse_http_date(value);
+        lifetime = expires == -1 ? 0 : expires - (date != -1 ? date : now);
+    }
+    return lifetime - *age;
+}
+
+static int is_hop_by_hop(const char *line, size_t length) {
+    for (const char **name = hop_by_hop_headers; *name; name++) {
+        size_t name_length = strlen(*name);
+        if (length > name_length && line[name_length] == ':' && strncasecmp(line, *name, name_length) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+long proxycache_end_to_end_headers(const char *head, size_t head_length, char *out, size_t capacity) {
+    const char *head_end = head + head_length;
+    const char *line = memchr(head, '\n', head_length);
+    size_t length = 0;
+
+    while (line && ++line < head_end) {
+        const char *line_end = memchr(line, '\n', head_end - line);
+        if (line_end == NULL) line_end = head_end;
+        size_t line_length = line_end - line;
+        if (line_length > 0 && line[line_length - 1] == '\r') line_length--;
+        if (line_length == 0) break; // The blank line ending the head.
+
+        if (!is_hop_by_hop(line, line_length)) {
+            if (length + line_length + 2 > capacity) return -1;
+            memcpy(out + length, line, line_length);
+            memcpy(out + length + line_length, "\r\n", 2);
+            length += line_length + 2;
+        }
+        line = line_end < head_end ? line_end : NULL;
+    }
+    return length;
+}
+
+long proxycache_clean_head(const char *head, size_t head_length, char *out, size_t capacity) {
+    /* Keep the status code and reason phrase, but speak our HTTP version. */
+    const char *status = memchr(head, ' ', head_length);
+    const char *status_end = memchr(head, '\n', head_length);
+    if (status == NULL || status_end == NULL || status > status_end) return -1;
+    size_t status_length = status_end - status;
+    if (status_length > 0 && status[status_length - 1] == '\r') status_length--;
+    if (status_length + 10 > capacity) return -1;
+
+    memcpy(out, "HTTP/1.0", 8);
+    memcpy(out + 8, status, status_length);
+    memcpy(out + 8 + status_length, "\r\n", 2);
+    size_t length = 10 + status_length;
+
+    long headers_length = proxycache_end_to_end_headers(head, head_length, out + length, capacity - length);
+    return headers_length < 0 ? -1 : (long) length + headers_length;
+}
+
+/* Writes the request's values of the comma-separated header names in VARY to OUT. */
+static void vary_values(struct http_request *request, const char *vary, char *out, size_t capacity) {
+    char name[256], value[PROXYCACHE_VARY_MAX_SIZE];
+    size_t length = 0;
+    out[0] = '\0';
+
+    while (*vary) {
+        size_t name_length = strcspn(vary, ",");
+        if (name_length > 0 && name_length < sizeof(name)) {
+            memcpy(name, vary, name_length);
+            name[name_length] = '\0';
+            if (!http_request_header(request, name, value, sizeof(value))) value[0] = '\0';
+            length += snprintf(out + length, length < capacity ? capacity - length : 0, "%s\n", value);
+            if (length >= capacity) {
+                out[capacity - 1] = '\0';
+                return;
+            }
+        }
+        vary += name_length;
+        if (*vary == ',') vary++;
+    }
+}
+
+static void lru_unlink(proxycache_tier_t *tier, proxycache_entry_t *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else tier->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else tier->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(proxycache_tier_t *tier, proxycache_entry_t *entry) {
+    entry->lru_next = tier->lru_head;
+    if (tier->lru_head) tier->lru_head->lru_prev = entry;
+    tier->lru_head = entry;
+    if (tier->lru_tail == NULL) tier->lru_tail = entry;
+}
+
+static proxycache_tier_t *entry_tier(proxycache_entry_t *entry) {
+    return entry->body_fd >= 0 ? &disk_tier : &memory_tier;
+}
+
+/* Bytes ENTRY counts against its tier. The head always stays in memory. */
+static size_t entry_size(proxycache_entry_t *entry) {
+    return entry->body_fd >= 0 ? entry->body_length : entry->head_length + entry->body_length;
+}
+
+void proxycache_release(proxycache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (entry->body_fd >= 0) close(entry->body_fd);
+    free(entry->body);
+    free(entry->path);
+    free(entry->vary);
+    free(entry->vary_values);
+    free(entry->head);
+    free(entry);
+}
+
+/* Links ENTRY into the table and its tier. The caller holds proxycache_mutex. */
+static void proxycache_link(proxycache_entry_t *entry) {
+    uint32_t bucket = fnv1a(entry->path, strlen(entry->path)) % PROXYCACHE_BUCKETS;
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push_front(entry_tier(entry), entry);
+    entry_tier(entry)->used += entry_size(entry);
+}
+
+/* Removes ENTRY from the table and drops the cache's reference. The caller
+ * holds proxycache_mutex. */
+static void proxycache_remove(proxycache_entry_t *entry) {
+    proxycache_entry_t **link = &buckets[fnv1a(entry->path, strlen(entry->path)) % PROXYCACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    lru_unlink(entry_tier(entry), entry);
+    entry_tier(entry)->used -= entry_size(entry);
+    proxycache_release(entry);
+}
+
+/* Returns an unlinked file in the disk tier holding BODY, or -1. */
+static int disk_store(const char *body, size_t length) {
+    int fd = open(disk_directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) return -1;
+    while (length > 0) {
+        ssize_t written = write(fd, body, length);
+        if (written <= 0) {
+            close(fd);
+            return -1;
+        }
+        body += written;
+        length -= written;
+    }
+    return fd;
+}
+
+/* Returns a new entry with copies of its strings and no body yet, or NULL if
+ * memory ran out. */
+static proxycache_entry_t *entry_new(const char *path, const char *vary, const char *vary_values,
+                                     const char *head, size_t head_length) {
+    proxycache_entry_t *entry = calloc(1, sizeof(proxycache_entry_t));
+    if (entry == NULL) return NULL;
+    entry->body_fd = -1;
+    entry->refs = 1;
+    entry->path = strdup(path);
+    entry->vary = strdup(vary);
+    entry->vary_values = strdup(vary_values);
+    entry->head = malloc(head_length + 1);
+    if (!entry->path || !entry->vary || !entry->vary_values || !entry->head) {
+        proxycache_release(entry);
+        return NULL;
+    }
+    memcpy(entry->head, head, head_length);
+    entry->head[head_length] = '\0';
+    entry->head_length = head_length;
+    return entry;
+}
+
+static proxycache_entry_t *entry_copy(proxycache_entry_t *entry) {
+    proxycache_entry_t *copy = entry_new(entry->path, entry->vary, entry->vary_values, entry->head,
+                                         entry->head_length);
+    if (copy == NULL) return NULL;
+    copy->body_length = entry->body_length;
+    copy->stored_at = entry->stored_at;
+    copy->expires_at = entry->expires_at;
+    copy->initial_age = entry->initial_age;
+    return copy;
+}
+
+/*
+ * Brings both tiers back within budget, moving the memory tier's least
+ * recently used entries to disk when they fit there. Entries never change, so
+ * a moved entry is a copy and readers of the old one keep their body. The
+ * caller holds proxycache_mutex; the copy is written under it, but it only
+ * reaches the page cache.
+ */
+static void proxycache_enforce_budgets(void) {
+    while (memory_tier.used > memory_tier.budget && memory_tier.lru_tail != NULL) {
+        proxycache_entry_t *victim = memory_tier.lru_tail;
+        if (disk_directory && victim->body_length <= disk_tier.max_object_size) {
+            int body_fd = disk_store(victim->body, victim->body_length);
+            proxycache_entry_t *copy = body_fd >= 0 ? entry_copy(victim) : NULL;
+            if (copy == NULL && body_fd >= 0) close(body_fd);
+            if (copy != NULL) {
+                copy->body_fd = body_fd;
+                proxycache_remove(victim);
+                proxycache_link(copy);
+                stats.demoted++;
+                continue;
+            }
+        }
+        proxycache_remove(victim);
+    }
+    while (disk_tier.used > disk_tier.budget && disk_tier.lru_tail != NULL)
+        proxycache_remove(disk_tier.lru_tail);
+}
+
+/* Returns REQUEST's fresh variant, dropping it if it went stale. The caller
+ * holds proxycache_mutex. */
+static proxycache_entry_t *find_fresh(struct http_request *request, time_t now) {
+    char values[PROXYCACHE_VARY_MAX_SIZE];
+    proxycache_entry_t *entry = buckets[fnv1a(request->path, strlen(request->path)) % PROXYCACHE_BUCKETS];
+
+    for (; entry; entry = entry->next) {
+        if (strcmp(entry->path, request->path) != 0) continue;
+        vary_values(request, entry->vary, values, sizeof(values));
+        if (strcmp(entry->vary_values, values) != 0) continue;
+        if (entry->expires_at > now) return entry;
+        proxycache_remove(entry);
+        return NULL;
+    }
+    return NULL;
+}
+
+static int fetch_in_flight(const char *path) {
+    for (proxycache_fetch_t *fetch = fetches; fetch; fetch = fetch->next)
+        if (strcmp(fetch->path, path) == 0) return 1;
+    return 0;
+}
+
+proxycache_entry_t *proxycache_lookup(struct http_request *request, int *fetching) {
+    time_t now = time(NULL);
+    *fetching = 0;
+    pthread_mutex_lock(&proxycache_mutex);
+
+    proxycache_entry_t *entry = find_fresh(request, now);
+    if (entry == NULL && fetch_in_flight(request->path)) {
+        /* Wait once. If the response turns out not to be cacheable, the
+         * waiters fetch on their own rather than queueing up one by one. */
+        stats.coalesced++;
+        while (fetch_in_flight(request->path)) {
+            if (!coro_active()) {
+                pthread_cond_wait(&fetch_done, &proxycache_mutex);
+                continue;
+            }
+            /* The fetch may be on this coroutine's own loop: poll for it
+             * rather than block the thread it needs. */
+            pthread_mutex_unlock(&proxycache_mutex);
+            coro_sleep(PROXYCACHE_FETCH_POLL_NS);
+            pthread_mutex_lock(&proxycache_mutex);
+        }
+        entry = find_fresh(request, time(NULL));
+    } else if (entry == NULL) {
+        /* Out of memory, the fetch goes ahead without others waiting on it. */
+        proxycache_fetch_t *fetch = malloc(sizeof(proxycache_fetch_t));
+        if (fetch != NULL && (fetch->path = strdup(request->path)) != NULL) {
+            fetch->next = fetches;
+            fetches = fetch;
+            *fetching = 1;
+        } else {
+            free(fetch);
+        }
+    }
+
+    if (entry != NULL) {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        lru_unlink(entry_tier(entry), entry);
+        lru_push_front(entry_tier(entry), entry);
+        if (entry->body_fd >= 0) stats.disk_hits++;
+        else stats.memory_hits++;
+        stats.bytes_saved += entry->head_length + entry->body_length;
+    } else {
+        stats.misses++;
+    }
+    pthread_mutex_unlock(&proxycache_mutex);
+    return entry;
+}
+
+void proxycache_fetch_done(const char *path) {
+    pthread_mutex_lock(&proxycache_mutex);
+    for (proxycache_fetch_t **link = &fetches; *link; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) == 0) {
+            proxycache_fetch_t *fetch = *link;
+            *link = fetch->next;
+            free(fetch->path);
+            free(fetch);
+            break;
+        }
+    }
+    pthread_cond_broadcast(&fetch_done);
+    pthread_mutex_unlock(&proxycache_mutex);
+}
+
+void proxycache_insert(struct http_request *request, const char *head, size_t head_length,
+                       const char *body, size_t body_length, long ttl, long age) {
+    char vary[PROXYCACHE_VARY_MAX_SIZE], values[PROXYCACHE_VARY_MAX_SIZE];
+    int in_memory = head_length + body_length <= memory_tier.max_object_size;
+    if (ttl <= 0 || (!in_memory && (!disk_directory || body_length > disk_tier.max_object_size))) return;
+
+    /* Normalize Vary to lower-case names without spaces. */
+    size_t vary_length = 0;
+    if (http_head_header(head, head_length, "Vary", values, sizeof(values)))
+        for (char *c = values; *c; c++)
+            if (*c != ' ' && *c != '\t') vary[vary_length++] = tolower((unsigned char) *c);
+    vary[vary_length] = '\0';
+    vary_values(request, vary, values, sizeof(values));
+
+    /* Out of memory, the response is just not stored. */
+    proxycache_entry_t *entry = entry_new(request->path, vary, values, head, head_length);
+    if (entry == NULL) return;
+    entry->body_length = body_length;
+    entry->stored_at = time(NULL);
+    entry->expires_at = entry->stored_at + ttl;
+    entry->initial_age = age;
+
+    if (in_memory) {
+        if ((entry->body = malloc(body_length ? body_length : 1)) == NULL) {
+            proxycache_release(entry);
+            return;
+        }
+        memcpy(entry->body, body, body_length);
+    } else if ((entry->body_fd = disk_store(body, body_length)) == -1) {
+        proxycache_release(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&proxycache_mutex);
+    proxycache_entry_t *existing = buckets[fnv1a(entry->path, strlen(entry->path)) % PROXYCACHE_BUCKETS];
+    for (; existing; existing = existing->next) {
+        if (strcmp(existing->path, entry->path) == 0 && strcmp(existing->vary_values, entry->vary_values) == 0) {
+            proxycache_remove(existing);
+            break;
+        }
+    }
+    proxycache_link(entry);
+    stats.stored++;
+    proxycache_enforce_budgets();
+    pthread_mutex_unlock(&proxycache_mutex);
+}
+
+long proxycache_age(proxycache_entry_t *entry, time_t now) {
+    return entry->initial_age + (now - entry->stored_at);
+}
+
+void proxycache_count_upstream(size_t bytes) {
+    __atomic_add_fetch(&stats.upstream_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void proxycache_dump_stats(FILE *out) {
+    pthread_mutex_lock(&proxycache_mutex);
+    size_t hits = stats.memory_hits + stats.disk_hits;
+    size_t lookups = hits + stats.misses;
+    fprintf(out, "{\"hits\": %zu, \"memory_hits\": %zu, \"disk_hits\": %zu, \"misses\": %zu, "
+                 "\"coalesced\": %zu, \"hit_ratio\": %.4f, \"stored\": %zu, \"demoted\": %zu, "
+                 "\"upstream_bytes\": %zu, \"upstream_bytes_saved\": %zu, "
+                 "\"memory_bytes\": %zu, \"disk_bytes\": %zu}\n",
+            hits, stats.memory_hits, stats.disk_hits, stats.misses, stats.coalesced,
+            lookups ? (double) hits / lookups : 0.0, stats.stored, stats.demoted,
+            __atomic_load_n(&stats.upstream_bytes, __ATOMIC_RELAXED), stats.bytes_saved,
+            memory_tier.used, disk_tier.used);
+    pthread_mutex_unlock(&proxycache_mutex);
+}
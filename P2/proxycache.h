@@ -0,0 +1,103 @@
+#ifndef __PROXYCACHE__
+#define __PROXYCACHE__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+/*
+ * Response cache for proxy mode, shared by all workers. Only GET responses the
+ * upstream marks fresh (Cache-Control s-maxage or max-age, or Expires) are
+ * stored, one variant per combination of the request headers named by Vary.
+ * Small bodies live in memory; with a disk tier, larger ones and those the
+ * memory tier evicts (least recently used first) move to unlinked files there.
+ *
+ * Concurrent misses for one path are coalesced: the first becomes the fetch,
+ * the others wait for it and then look again.
+ *
+ * Entries are refcounted like filecache entries and never change once stored.
+ */
+
+#define PROXYCACHE_BUCKETS 4096
+#define PROXYCACHE_HEAD_MAX_SIZE 16384
+#define PROXYCACHE_VARY_MAX_SIZE 1024
+#define PROXYCACHE_MEMORY_OBJECT_MAX (1024 * 1024)
+#define PROXYCACHE_DISK_OBJECT_MAX (64 * 1024 * 1024)
+#define PROXYCACHE_ADMIN_PATH "/__proxy_cache"
+#define PROXYCACHE_FETCH_POLL_NS 1000000 // How often a coroutine checks on a fetch it waits for.
+
+typedef struct proxycache_entry {
+    char *path;
+    char *vary;        // Lower-case header names from Vary, comma separated.
+    char *vary_values; // The request's values of those headers, each followed by '\n'.
+    char *head;        // HTTP/1.0 status line and end-to-end headers, without the blank line.
+    size_t head_length;
+    char *body;        // NULL when the body is in the disk tier...
+    int body_fd;       // ...in this unlinked file.
+    size_t body_length;
+    time_t stored_at;
+    time_t expires_at;
+    long initial_age;  // Age the upstream reported.
+    int refs;          // One for the cache while the entry is in the table, one per user.
+    struct proxycache_entry *next; // Hash chain, shared by a path's variants.
+    struct proxycache_entry *lru_prev; // Memory or disk LRU list, by tier.
+    struct proxycache_entry *lru_next;
+} proxycache_entry_t;
+
+/* Enables the cache with MEMORY_BUDGET bytes for heads and in-memory bodies. */
+void proxycache_init(size_t memory_budget);
+
+/* Adds a disk tier of DISK_BUDGET bytes in DIRECTORY. Returns 0, or -1 if
+ * DIRECTORY cannot hold temporary files. */
+int proxycache_init_disk(const char *directory, size_t disk_budget);
+
+int proxycache_enabled(void);
+
+/* Returns 1 if REQUEST may be answered from the cache and its response
+ * stored: a GET without credentials, a range, or a no-cache directive. */
+int proxycache_request_cacheable(struct http_request *request);
+
+/* Returns a fresh entry for REQUEST, or NULL on a miss. On a miss *FETCHING is
+ * set if the caller is the fetch others will wait for, and must then call
+ * proxycache_fetch_done. */
+proxycache_entry_t *proxycache_lookup(struct http_request *request, int *fetching);
+
+/* Wakes the requests waiting on the fetch of PATH. */
+void proxycache_fetch_done(const char *path);
+
+/* Returns for how many more seconds the upstream response HEAD may be served
+ * from the cache (zero or less if it may not be stored), and its Age in *AGE. */
+long proxycache_freshness(const char *head, size_t head_length, time_t now, long *age);
+
+/* Rewrites the upstream response HEAD for our clients: an HTTP/1.0 status
+ * line and the end-to-end headers, without Age and the blank line. Returns
+ * the length written to OUT, or -1 if it does not fit or HEAD has no status
+ * line. */
+long proxycache_clean_head(const char *head, size_t head_length, char *out, size_t capacity);
+
+/* Copies the end-to-end header lines of HEAD (skipping its start line) to OUT.
+ * Returns the length written, or -1 if they do not fit. */
+long proxycache_end_to_end_headers(const char *head, size_t head_length, char *out, size_t capacity);
+
+/* Largest body the cache will store. */
+size_t proxycache_max_object_size(void);
+
+/* Stores the response to REQUEST: HEAD as returned by proxycache_clean_head,
+ * fresh for TTL more seconds with the upstream's AGE. */
+void proxycache_insert(struct http_request *request, const char *head, size_t head_length,
+                       const char *body, size_t body_length, long ttl, long age);
+
+/* Returns the Age to send with ENTRY. */
+long proxycache_age(proxycache_entry_t *entry, time_t now);
+
+void proxycache_release(proxycache_entry_t *entry);
+
+/* Counts bytes read from the upstream. */
+void proxycache_count_upstream(size_t bytes);
+
+/* Writes hit ratio, upstream bytes saved and occupancy as JSON. */
+void proxycache_dump_stats(FILE *out);
+
+#endif
@@ -0,0 +1,154 @@
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "util.h"
+
+typedef struct ratelimit_client {
+    ratelimit_key_t key;
+    double requests; // Tokens left in each bucket; bytes go negative while paced.
+    double bytes;
+    uint64_t refilled_ns;
+    struct ratelimit_client *next;
+} ratelimit_client_t;
+
+typedef struct stripe {
+    pthread_mutex_t mutex;
+    unsigned int sweep_cursor; // Next of this stripe's buckets to sweep.
+} __attribute__((aligned(64))) stripe_t;
+
+static double request_rate, request_burst;
+static double byte_rate, byte_burst;
+static ratelimit_client_t *buckets[RATELIMIT_BUCKETS];
+static stripe_t stripes[RATELIMIT_STRIPES];
+
+static void init_stripes(void) {
+    for (int i = 0; i < RATELIMIT_STRIPES; i++) pthread_mutex_init(&stripes[i].mutex, NULL);
+}
+
+void ratelimit_init_requests(double requests_per_second) {
+    if (!ratelimit_enabled()) init_stripes();
+    request_rate = requests_per_second;
+    request_burst = requests_per_second < 1 ? 1 : requests_per_second;
+}
+
+void ratelimit_init_bandwidth(double bytes_per_second, size_t min_burst) {
+    if (!ratelimit_enabled()) init_stripes();
+    byte_rate = bytes_per_second;
+    byte_burst = bytes_per_second < min_burst ? min_burst : bytes_per_second;
+}
+
+int ratelimit_enabled(void) {
+    return request_rate > 0 || byte_rate > 0;
+}
+
+int ratelimit_key(const struct sockaddr_storage *address, ratelimit_key_t *key) {
+    memset(key, 0, sizeof(*key));
+    if (address->ss_family == AF_INET) {
+        key->address[10] = key->address[11] = 0xff;
+        memcpy(key->address + 12, &((const struct sockaddr_in *) address)->sin_addr, 4);
+        return 0;
+    }
+    if (address->ss_family == AF_INET6) {
+        memcpy(key->address, &((const struct sockaddr_in6 *) address)->sin6_addr, 8);
+        return 0;
+    }
+    return -1;
+}
+
+static uint32_t hash_key(const ratelimit_key_t *key) {
+    return fnv1a(key->address, sizeof(key->address));
+}
+
+/* Brings CLIENT's buckets up to NOW. Returns 1 if both are full, so that
+ * forgetting the client would change nothing. */
+static int refill(ratelimit_client_t *client, uint64_t now) {
+    double elapsed = (now - client->refilled_ns) / 1e9;
+    client->refilled_ns = now;
+    client->requests += elapsed * request_rate;
+    client->bytes += elapsed * byte_rate;
+    int full = client->requests >= request_burst && client->bytes >= byte_burst;
+    if (client->requests > request_burst) client->requests = request_burst;
+    if (client->bytes > byte_burst) client->bytes = byte_burst;
+    return full;
+}
+
+/* Frees the clients of BUCKET whose buckets have filled up again. The caller
+ * holds the bucket's stripe. */
+static void sweep(unsigned int bucket, uint64_t now) {
+    ratelimit_client_t **link = &buckets[bucket];
+    while (*link != NULL) {
+        ratelimit_client_t *client = *link;
+        if (!refill(client, now)) {
+            link = &client->next;
+            continue;
+        }
+        *link = client->next;
+        free(client);
+    }
+}
+
+/* Returns KEY's client with its buckets refilled to NOW, adding it if it is
+ * new. The caller holds the stripe of KEY's bucket. */
+static ratelimit_client_t *lookup(const ratelimit_key_t *key, unsigned int bucket, uint64_t now) {
+    stripe_t *stripe = &stripes[bucket % RATELIMIT_STRIPES];
+    unsigned int other = (stripe->sweep_cursor++ * RATELIMIT_STRIPES + bucket % RATELIMIT_STRIPES) % RATELIMIT_BUCKETS;
+    if (other != bucket) sweep(other, now);
+
+    ratelimit_client_t *client;
+    for (client = buckets[bucket]; client; client = client->next)
+        if (memcmp(&client->key, key, sizeof(*key)) == 0) break;
+
+    if (client == NULL) {
+        client = malloc(sizeof(ratelimit_client_t));
+        client->key = *key;
+        client->requests = request_burst;
+        client->bytes = byte_burst;
+        client->refilled_ns = now;
+        client->next = buckets[bucket];
+        buckets[bucket] = client;
+    }
+    refill(client, now);
+    return client;
+}
+
+long ratelimit_admit(const ratelimit_key_t *key) {
+    if (request_rate <= 0) return 0;
+
+    unsigned int bucket = hash_key(key) % RATELIMIT_BUCKETS;
+    pthread_mutex_t *mutex = &stripes[bucket % RATELIMIT_STRIPES].mutex;
+    pthread_mutex_lock(mutex);
+    ratelimit_client_t *client = lookup(key, bucket, now_ns());
+    long retry_after = 0;
+    if (client->requests >= 1) {
+        client->requests -= 1;
+    } else {
+        double wait = (1 - client->requests) / request_rate;
+        retry_after = (long) wait + ((long) wait < wait);
+    }
+    pthread_mutex_unlock(mutex);
+    return retry_after;
+}
+
+void ratelimit_pace(void *key, size_t bytes) {
+    if (byte_rate <= 0) return;
+
+    unsigned int bucket = hash_key(key) % RATELIMIT_BUCKETS;
+    pthread_mutex_t *mutex = &stripes[bucket % RATELIMIT_STRIPES].mutex;
+    pthread_mutex_lock(mutex);
+    ratelimit_client_t *client = lookup(key, bucket, now_ns());
+    client->bytes -= bytes;
+    double debt = -client->bytes;
+    pthread_mutex_unlock(mutex);
+
+    /* Sleeping off our own debt paces all of the client's connections
+     * together: each waits for what it and those before it took. */
+    if (debt > 0) {
+        double seconds = debt / byte_rate;
+        struct timespec delay = {(time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9)};
+        while (nanosleep(&delay, &delay) == -1) continue;
+    }
+}
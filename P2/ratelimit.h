@@ -0,0 +1,54 @@
+#ifndef __RATELIMIT__
+#define __RATELIMIT__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Per-client token buckets, one for requests and one for response bytes,
+ * each filling at its rate up to a burst of one second's worth. A client is
+ * an IPv4 address, or an IPv6 /64, since a host can rotate through those.
+ *
+ * Requests over the rate are refused; bytes over the rate are delayed, so
+ * a client's transfers are paced down to its share instead of cut off. All
+ * connections from a client draw on the same buckets, so opening more of
+ * them buys it nothing.
+ *
+ * Clients live in a hash table whose buckets are spread over
+ * RATELIMIT_STRIPES locks. Each lookup also sweeps another table bucket under
+ * the same lock, in turn, forgetting the clients whose token buckets have
+ * filled up again: that changes nothing for them, and departed clients do not
+ * pile up.
+ */
+
+#define RATELIMIT_BUCKETS 4096
+#define RATELIMIT_STRIPES 64
+
+typedef struct ratelimit_key {
+    uint8_t address[16]; // IPv4 addresses are mapped into IPv6.
+} ratelimit_key_t;
+
+/* Limits each client to REQUESTS_PER_SECOND. */
+void ratelimit_init_requests(double requests_per_second);
+
+/* Limits each client to BYTES_PER_SECOND of responses, with a burst of at
+ * least MIN_BURST bytes. */
+void ratelimit_init_bandwidth(double bytes_per_second, size_t min_burst);
+
+int ratelimit_enabled(void);
+
+/* Fills in the KEY of the client at ADDRESS. Returns 0, or -1 if it is not an
+ * IP client (a Unix socket peer), and is not limited. */
+int ratelimit_key(const struct sockaddr_storage *address, ratelimit_key_t *key);
+
+/* Takes a request token from client KEY. Returns 0, or the seconds until the
+ * client may try again. */
+long ratelimit_admit(const ratelimit_key_t *key);
+
+/* Charges BYTES to the bandwidth of client KEY (a ratelimit_key_t), then
+ * sleeps until the client is back within it. Made to be libhttp's pacer (see
+ * http_set_pacer). */
+void ratelimit_pace(void *key, size_t bytes);
+
+#endif
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# --coroutines: one worker keeps a thousand connections to files going, holds
+# hundreds of proxied requests open on a slow upstream at once (on threads,
+# one worker would serve them one at a time, 10 a second), coalesces cached
+# fetches and speaks HTTP/2, all without errors. HTTPS is refused.
+#
+# Usage (from P2/): ./test/coro.sh
+#
+# Needs curl. PORT (default 18900) and the port after it are used.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all bench
+
+PORT=${PORT:-18900}
+UPSTREAM=$((PORT + 1))
+. ./test/lib.sh
+
+# Runs loadgen with the arguments given and checks it saw no errors.
+load() {
+    ./bench/loadgen --port "$PORT" --threads 1 --duration 2 "$@" >"$WORKDIR/result" 2>&1 ||
+        fail "loadgen $*: $(tail -1 "$WORKDIR/result")"
+    tail -1 "$WORKDIR/result" | grep -q "errors=0$" || fail "loadgen $*: $(tail -1 "$WORKDIR/result")"
+}
+
+mkdir "$WORKDIR/www"
+head -c 4096 /dev/urandom >"$WORKDIR/www/4k.bin"
+head -c 262144 /dev/urandom >"$WORKDIR/www/256k.bin"
+
+start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads 1 --coroutines --http2
+load --connections 1000 --path /4k.bin:9 --path /256k.bin:1
+[ "$(curl -s --http2-prior-knowledge -o /dev/null -w "%{http_version} %{size_download}" \
+    "http://127.0.0.1:$PORT/256k.bin")" = "2 262144" ] || fail "HTTP/2 on a coroutine"
+stop_all
+
+# 100 ms upstream: 200 connections at once make about 2000 requests a second.
+start ./bench/stub_upstream --port "$UPSTREAM" --delay-ms 100
+start ./httpserver --proxy "127.0.0.1:$UPSTREAM" --port "$PORT" --num-threads 1 --coroutines
+load --connections 200 --path /slow --min-rps 500
+stop_all
+
+start ./bench/stub_upstream --port "$UPSTREAM" --delay-ms 100 --cache-control max-age=60
+start ./httpserver --proxy "127.0.0.1:$UPSTREAM" --port "$PORT" --num-threads 1 --coroutines --proxy-cache 16
+load --connections 200 --path /a --path /b
+curl -s "http://127.0.0.1:$PORT/__proxy_cache" | grep -q '"misses": 2,' || fail "fetches not coalesced"
+stop_all
+
+timeout 2 ./httpserver --files "$WORKDIR/www" --port "$PORT" --coroutines --tls-cert x --tls-key y 2>&1 |
+    grep -q "cannot serve HTTPS" || fail "--coroutines with HTTPS accepted"
+
+echo "PASS: coro"
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Cleartext HTTP/2 (--http2) in --files mode: several GETs multiplexed on one
+# prior-knowledge connection, an HTTP/1.1 request upgraded with Upgrade: h2c,
+# a 404, and a file larger than the 65535-byte initial flow-control window
+# coming back intact.
+#
+# Usage (from P2/): ./test/h2.sh
+#
+# Needs nghttp and curl built with HTTP/2. PORT (default 18800) picks the
+# listening port. The multiplexed GETs use nghttp: curl 7.88's -Z loses all
+# but the first transfer on a shared HTTP/2 connection, against any server.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all
+
+PORT=${PORT:-18800}
+URL="http://127.0.0.1:$PORT"
+. ./test/lib.sh
+
+command -v nghttp >/dev/null || fail "nghttp not found"
+curl -V | grep -q HTTP2 || fail "curl has no HTTP/2 support"
+
+mkdir -p "$WORKDIR/www"
+echo "<html><body>hello over h2</body></html>" >"$WORKDIR/www/index.html"
+# One DATA frame each, so the bodies cannot interleave in nghttp's output.
+for i in 1 2 3 4 5 6; do
+    seq -f "small$i line %g" $((i * 100)) >"$WORKDIR/www/small$i.txt"
+done
+head -c 300000 /dev/urandom >"$WORKDIR/www/large.bin"
+
+start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads 2 --http2
+
+# Six GETs sent at once on one connection (nghttp never opens a second).
+nghttp -v "$URL/small1.txt" "$URL/small2.txt" "$URL/small3.txt" "$URL/small4.txt" "$URL/small5.txt" \
+    "$URL/small6.txt" >"$WORKDIR/nghttp.txt" || fail "multiplexed GETs failed"
+[ "$(grep -c "send HEADERS frame" "$WORKDIR/nghttp.txt")" = 6 ] || fail "six GETs were not all sent"
+[ "$(grep -c ":status: 200" "$WORKDIR/nghttp.txt")" = 6 ] || fail "six GETs were not all answered with 200"
+nghttp "$URL/small1.txt" "$URL/small2.txt" "$URL/small3.txt" "$URL/small4.txt" "$URL/small5.txt" \
+    "$URL/small6.txt" | sort >"$WORKDIR/got"
+cat "$WORKDIR"/www/small*.txt | sort | cmp -s - "$WORKDIR/got" || fail "multiplexed bodies differ"
+
+# curl --http2 on plain http:// sends Upgrade: h2c.
+version=$(curl -s --http2 -o "$WORKDIR/got" -w "%{http_version}" "$URL/index.html")
+[ "$version" = 2 ] || fail "Upgrade: h2c answered over HTTP/$version"
+cmp -s "$WORKDIR/got" "$WORKDIR/www/index.html" || fail "index.html differs after the upgrade"
+
+status=$(curl -s --http2-prior-knowledge -o /dev/null -w "%{http_code}" "$URL/missing")
+[ "$status" = 404 ] || fail "missing file answered $status over HTTP/2"
+
+curl -s --http2-prior-knowledge -o "$WORKDIR/got" "$URL/large.bin" || fail "large.bin failed"
+cmp -s "$WORKDIR/got" "$WORKDIR/www/large.bin" || fail "large.bin differs"
+stop_all
+
+echo "PASS: h2"
@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# Hot restart under load: two servers in turn take the listening socket over
+# from the one before (--hot-restart) while loadgen keeps requesting files,
+# first on a TCP port and then on a Unix socket. No request may fail, every
+# old server must exit once drained, and each new one must start with the
+# old one's hot files mapped.
+#
+# Usage (from P2/): ./test/hotrestart.sh
+#
+# Needs curl. PORT (default 18700) is used.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all bench
+
+PORT=${PORT:-18700}
+. ./test/lib.sh
+
+mkdir "$WORKDIR/www"
+FILES=""
+for i in $(seq 1 8); do
+    head -c 65536 /dev/urandom >"$WORKDIR/www/$i.bin"
+    FILES="$FILES --path /$i.bin"
+done
+
+# Starts server number $1 listening on $2, taking over from any before it.
+start_server() {
+    ./httpserver --files "$WORKDIR/www" --port "$2" --num-threads 4 --file-cache 64 \
+        --hot-restart "$WORKDIR/control.sock" >"$WORKDIR/server$1.log" 2>&1 &
+    PIDS="$PIDS $!"
+    LAST_PID=$!
+    sleep 0.3
+}
+
+# Waits up to 5 s for process $1 to exit.
+wait_exit() {
+    for i in $(seq 1 50); do
+        kill -0 "$1" 2>/dev/null || return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# Runs loadgen ($2...) through two restarts of servers listening on $1.
+restart_under_load() {
+    listen=$1
+    shift
+    start_server 1 "$listen"
+    OLD=$LAST_PID
+    for i in 1 2; do
+        for path in $FILES; do
+            [ "$path" = --path ] || curl -s -o /dev/null "http://127.0.0.1:$PORT$path" ${UNIX:+--unix-socket "$UNIX"}
+        done
+    done
+    ./bench/loadgen --duration 3 --connections 16 "$@" $FILES >"$WORKDIR/loadgen" 2>&1 &
+    LOADGEN=$!
+    for n in 2 3; do
+        sleep 1
+        start_server "$n" "$listen"
+        wait_exit "$OLD" || fail "server $((n - 1)) did not exit after the handoff"
+        grep -q "Warmed the file cache with 8 files" "$WORKDIR/server$n.log" ||
+            fail "server $n not warmed: $(cat "$WORKDIR/server$n.log")"
+        OLD=$LAST_PID
+    done
+    wait "$LOADGEN" || fail "loadgen: $(cat "$WORKDIR/loadgen")"
+    grep -q "errors=0" "$WORKDIR/loadgen" || fail "requests failed across restarts: $(tail -1 "$WORKDIR/loadgen")"
+    kill "$OLD"
+    wait "$OLD" 2>/dev/null || true
+}
+
+UNIX= restart_under_load "$PORT" --port "$PORT"
+UNIX="$WORKDIR/http.sock" restart_under_load "$WORKDIR/http.sock" --unix "$WORKDIR/http.sock"
+
+echo "PASS: hotrestart"
@@ -0,0 +1,136 @@
+/*
+ * Checks hpack_decode against the examples of RFC 7541 Appendix C: each
+ * header block must decode to the listed headers, and leave the dynamic
+ * table at the listed size. Blocks of one example share a table, as they
+ * would on a connection. A few malformed blocks must be rejected.
+ *
+ * Usage (from P2/): ./test/hpack_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+#define DECODED_MAX_SIZE 1024
+
+typedef struct block {
+    const char *hex;
+    const char *headers; // "name: value\n" for each header, in order.
+    size_t table_size;   // After the block.
+} block_t;
+
+typedef struct example {
+    const char *name;
+    size_t max_size;
+    block_t blocks[3];
+} example_t;
+
+#define C3_HEADERS_1 ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+#define C3_HEADERS_2 C3_HEADERS_1 "cache-control: no-cache\n"
+#define C3_HEADERS_3 ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n" \
+                     "custom-key: custom-value\n"
+#define C5_HEADERS_1 ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n" \
+                     "location: https://www.example.com\n"
+#define C5_HEADERS_2 ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n" \
+                     "location: https://www.example.com\n"
+#define C5_HEADERS_3 ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n" \
+                     "location: https://www.example.com\ncontent-encoding: gzip\n" \
+                     "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n"
+
+static const example_t examples[] = {
+    {"C.2.1 literal with indexing", 4096,
+     {{"400a637573746f6d2d6b65790d637573746f6d2d686561646572", "custom-key: custom-header\n", 55}}},
+    {"C.2.2 literal without indexing", 4096, {{"040c2f73616d706c652f70617468", ":path: /sample/path\n", 0}}},
+    {"C.2.3 literal never indexed", 4096, {{"100870617373776f726406736563726574", "password: secret\n", 0}}},
+    {"C.2.4 indexed", 4096, {{"82", ":method: GET\n", 0}}},
+    {"C.3 requests", 4096,
+     {{"828684410f7777772e6578616d706c652e636f6d", C3_HEADERS_1, 57},
+      {"828684be58086e6f2d6361636865", C3_HEADERS_2, 110},
+      {"828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565", C3_HEADERS_3, 164}}},
+    {"C.4 requests with Huffman", 4096,
+     {{"828684418cf1e3c2e5f23a6ba0ab90f4ff", C3_HEADERS_1, 57},
+      {"828684be5886a8eb10649cbf", C3_HEADERS_2, 110},
+      {"828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", C3_HEADERS_3, 164}}},
+    {"C.5 responses", 256,
+     {{"4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032303a31333a323120474d546e17"
+       "68747470733a2f2f7777772e6578616d706c652e636f6d", C5_HEADERS_1, 222},
+      {"4803333037c1c0bf", C5_HEADERS_2, 222},
+      {"88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a04677a69707738666f6f3d41"
+       "53444a4b48514b425a584f5157454f50495541585157454f49553b206d61782d6167653d333630303b2076657273"
+       "696f6e3d31", C5_HEADERS_3, 215}}},
+    {"C.6 responses with Huffman", 256,
+     {{"488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97"
+       "c8e9ae82ae43d3", C5_HEADERS_1, 222},
+      {"4883640effc1c0bf", C5_HEADERS_2, 222},
+      {"88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5"
+       "b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007", C5_HEADERS_3, 215}}},
+};
+
+/* Blocks a decoder must reject, each on a fresh table. */
+static const struct {
+    const char *name;
+    const char *hex;
+} malformed[] = {
+    {"index 0", "80"},
+    {"index past the tables", "be"},
+    {"string longer than the block", "400a6375"},
+    {"Huffman string with EOS", "4085ffffffffff0161"},
+    {"size update past the maximum", "3fe21f"},
+};
+
+typedef struct decoded {
+    char text[DECODED_MAX_SIZE];
+    size_t length;
+} decoded_t;
+
+static void on_header(void *context, const char *name, size_t name_length, const char *value,
+                      size_t value_length) {
+    decoded_t *decoded = context;
+    decoded->length += snprintf(decoded->text + decoded->length, DECODED_MAX_SIZE - decoded->length, "%.*s: %.*s\n",
+                                (int) name_length, name, (int) value_length, value);
+    if (decoded->length >= DECODED_MAX_SIZE) decoded->length = DECODED_MAX_SIZE - 1;
+}
+
+static size_t from_hex(const char *hex, unsigned char *out) {
+    size_t length = strlen(hex) / 2;
+    for (size_t i = 0; i < length; i++) sscanf(hex + 2 * i, "%2hhx", &out[i]);
+    return length;
+}
+
+int main(void) {
+    unsigned char block[256];
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(examples) / sizeof(examples[0]); i++) {
+        hpack_table_t table;
+        hpack_table_init(&table, examples[i].max_size);
+        for (int b = 0; b < 3 && examples[i].blocks[b].hex; b++) {
+            const block_t *expected = &examples[i].blocks[b];
+            decoded_t decoded = {"", 0};
+            int status = hpack_decode(&table, block, from_hex(expected->hex, block), on_header, &decoded);
+            if (status != 0 || strcmp(decoded.text, expected->headers) != 0 || table.size != expected->table_size) {
+                printf("FAIL: %s, block %d: status %d, table size %zu (expected %zu), headers:\n%s", examples[i].name,
+                       b + 1, status, table.size, expected->table_size, decoded.text);
+                failures++;
+            }
+        }
+        hpack_table_destroy(&table);
+    }
+
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        hpack_table_t table;
+        decoded_t decoded = {"", 0};
+        hpack_table_init(&table, HPACK_TABLE_SIZE);
+        if (hpack_decode(&table, block, from_hex(malformed[i].hex, block), on_header, &decoded) != -1) {
+            printf("FAIL: %s accepted\n", malformed[i].name);
+            failures++;
+        }
+        hpack_table_destroy(&table);
+    }
+
+    if (failures) return EXIT_FAILURE;
+    printf("PASS: hpack\n");
+    return EXIT_SUCCESS;
+}
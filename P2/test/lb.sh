@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Proxy load balancing against local stub upstreams (bench/stub_upstream):
+# least-outstanding steers around a slow upstream and ejects it as an
+# outlier, a refused upstream is retried elsewhere and ejected after repeated
+# failures, and consistent hashing keeps each path on one upstream, moving
+# only the paths of an upstream that goes away.
+#
+# Usage (from P2/): ./test/lb.sh
+#
+# Needs curl. PORT (default 18600) and the three ports after it are used.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all bench
+
+PORT=${PORT:-18600}
+A=$((PORT + 1))
+B=$((PORT + 2))
+C=$((PORT + 3))
+UPSTREAMS="127.0.0.1:$A,127.0.0.1:$B,127.0.0.1:$C"
+. ./test/lib.sh
+
+# Prints the stats line of upstream $1 (a port).
+upstream_stats() {
+    curl -s "http://127.0.0.1:$PORT/__upstreams" | grep "127.0.0.1:$1\""
+}
+
+requests() {
+    upstream_stats "$1" | sed 's/.*"requests": \([0-9]*\).*/\1/'
+}
+
+# Prints which stub answered path $1.
+served_by() {
+    curl -s -D - -o /dev/null "http://127.0.0.1:$PORT$1" | tr -d '\r' | sed -n 's/^X-Stub: //p'
+}
+
+# Least outstanding requests, with C 200 ms slower than A and B.
+start ./bench/stub_upstream --port "$A" --header "X-Stub: a"
+start ./bench/stub_upstream --port "$B" --header "X-Stub: b"
+start ./bench/stub_upstream --port "$C" --header "X-Stub: c" --delay-ms 200
+start ./httpserver --proxy "$UPSTREAMS" --port "$PORT" --num-threads 8
+./bench/loadgen --port "$PORT" --connections 8 --duration 2 --path / >"$WORKDIR/loadgen" 2>&1 ||
+    fail "loadgen: $(cat "$WORKDIR/loadgen")"
+upstream_stats "$C" | grep -q '"ejected": true' ||
+    fail "slow upstream not ejected: $(curl -s "http://127.0.0.1:$PORT/__upstreams")"
+[ "$(requests "$C")" -lt "$(requests "$A")" ] || fail "slow upstream got as many requests as a fast one"
+stop_all
+
+# A refused upstream: every request still succeeds, and B is ejected.
+start ./bench/stub_upstream --port "$A" --header "X-Stub: a"
+start ./bench/stub_upstream --port "$C" --header "X-Stub: c"
+start ./httpserver --proxy "$UPSTREAMS" --port "$PORT" --num-threads 4
+for i in $(seq 1 20); do
+    status=$(curl -s -o /dev/null -w "%{http_code}" "http://127.0.0.1:$PORT/")
+    [ "$status" = 200 ] || fail "request $i answered $status with an upstream down"
+done
+upstream_stats "$B" | grep -q '"ejected": true' || fail "refusing upstream not ejected: $(upstream_stats "$B")"
+stop_all
+
+# Consistent hashing: stable placement, and only A's paths move without A.
+start ./bench/stub_upstream --port "$A" --header "X-Stub: a"
+STUB_A=$LAST_PID
+start ./bench/stub_upstream --port "$B" --header "X-Stub: b"
+start ./bench/stub_upstream --port "$C" --header "X-Stub: c"
+start ./httpserver --proxy "$UPSTREAMS" --port "$PORT" --num-threads 4 --lb consistent-hash
+for i in $(seq 1 30); do echo "/item/$i $(served_by "/item/$i")"; done >"$WORKDIR/placement"
+for i in $(seq 1 30); do echo "/item/$i $(served_by "/item/$i")"; done | cmp -s - "$WORKDIR/placement" ||
+    fail "placement changed between rounds"
+[ "$(cut -d' ' -f2 "$WORKDIR/placement" | sort -u | wc -l)" -eq 3 ] || fail "paths not spread over all upstreams"
+kill "$STUB_A"
+while read -r path stub; do
+    now=$(served_by "$path")
+    [ -n "$now" ] || fail "$path not served without a"
+    [ "$stub" = a ] || [ "$now" = "$stub" ] || fail "$path moved from $stub to $now"
+done <"$WORKDIR/placement"
+stop_all
+
+echo "PASS: lb"
@@ -0,0 +1,36 @@
+# Helpers shared by the test scripts and bench/scenarios.sh, sourced from P2/
+# once the build is done:
+#
+#     . ./test/lib.sh
+#
+# WORKDIR is a scratch directory, removed on exit along with every process
+# whose pid is in PIDS.
+
+WORKDIR=$(mktemp -d)
+PIDS=""
+cleanup() {
+    for pid in $PIDS; do kill "$pid" 2>/dev/null || true; done
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# Runs "$@" in the background, logging to $WORKDIR/log, and gives it 0.3 s
+# to come up. Its pid is left in LAST_PID.
+start() {
+    "$@" >>"$WORKDIR/log" 2>&1 &
+    PIDS="$PIDS $!"
+    LAST_PID=$!
+    sleep 0.3
+}
+
+# Stops every process started so far and waits for them to exit.
+stop_all() {
+    for pid in $PIDS; do kill "$pid" 2>/dev/null || true; done
+    for pid in $PIDS; do wait "$pid" 2>/dev/null || true; done
+    PIDS=""
+}
@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# The caching proxy (--proxy-cache) against a local stub upstream
+# (bench/stub_upstream): a fresh response is a MISS and then a HIT with an
+# Age, no-store and private responses are never stored, each Vary variant is
+# cached on its own, concurrent misses for one path make a single upstream
+# request, and responses that no longer fit in memory are demoted to the disk
+# tier and still served from there.
+#
+# Usage (from P2/): ./test/proxycache.sh
+#
+# Needs curl. PORT (default 18700) and the port after it are used.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all bench
+
+PORT=${PORT:-18700}
+UPSTREAM=$((PORT + 1))
+URL="http://127.0.0.1:$PORT"
+. ./test/lib.sh
+
+# Prints the X-Cache header of GET $1, with curl arguments $2...
+x_cache() {
+    path=$1
+    shift
+    curl -s -D - -o /dev/null "$@" "$URL$path" | tr -d '\r' | sed -n 's/^X-Cache: //p'
+}
+
+# Checks that GET $2 (with curl arguments $3...) answers X-Cache $1.
+expect_cache() {
+    status=$1
+    shift
+    got=$(x_cache "$@")
+    [ "$got" = "$status" ] || fail "GET $*: X-Cache $got, expected $status"
+}
+
+# Prints counter $1 of the cache stats.
+stat() {
+    curl -s "$URL/__proxy_cache" | sed -n "s/.*\"$1\": \([0-9]*\).*/\1/p"
+}
+
+# Starts the stub upstream with arguments "$@" and a proxy in front of it
+# with the proxy arguments in PROXY_ARGS.
+start_pair() {
+    : >"$WORKDIR/upstream.log"
+    start ./bench/stub_upstream --port "$UPSTREAM" --log "$WORKDIR/upstream.log" "$@"
+    start ./httpserver --proxy "127.0.0.1:$UPSTREAM" --port "$PORT" --num-threads 8 $PROXY_ARGS
+}
+
+PROXY_ARGS="--proxy-cache 16"
+start_pair --cache-control "max-age=60" --header "Vary: Accept-Language" --delay-ms 300
+expect_cache MISS /a
+sleep 1.1
+curl -s -D - -o /dev/null "$URL/a" | tr -d '\r' >"$WORKDIR/hit.txt"
+grep -q "^X-Cache: HIT" "$WORKDIR/hit.txt" || fail "second GET /a was not a hit"
+age=$(sed -n 's/^Age: //p' "$WORKDIR/hit.txt")
+[ -n "$age" ] && [ "$age" -ge 1 ] || fail "hit has Age '$age', expected at least 1"
+
+expect_cache MISS /v -H "Accept-Language: en"
+expect_cache MISS /v -H "Accept-Language: fr"
+expect_cache HIT /v -H "Accept-Language: en"
+expect_cache HIT /v -H "Accept-Language: fr"
+
+clients=""
+for _ in 1 2 3 4 5 6; do
+    curl -s -o /dev/null "$URL/c" &
+    clients="$clients $!"
+done
+for pid in $clients; do wait "$pid"; done
+requests=$(grep -c "^GET /c " "$WORKDIR/upstream.log")
+[ "$requests" = 1 ] || fail "6 concurrent misses made $requests upstream requests, expected 1"
+[ "$(stat coalesced)" -ge 1 ] || fail "no miss was coalesced"
+stop_all
+
+for directives in "no-store" "private, max-age=60"; do
+    start_pair --cache-control "$directives"
+    expect_cache MISS /n
+    expect_cache MISS /n
+    [ "$(grep -c "^GET /n " "$WORKDIR/upstream.log")" = 2 ] || fail "$directives: not every GET reached the upstream"
+    [ "$(stat stored)" = 0 ] || fail "$directives: response stored"
+    stop_all
+done
+
+# 1 MiB of memory holds four of these at most; the rest go to disk.
+mkdir -p "$WORKDIR/disk"
+PROXY_ARGS="--proxy-cache 1 --proxy-cache-dir $WORKDIR/disk --proxy-cache-disk 64"
+start_pair --cache-control "max-age=60" --size 200000
+for i in 1 2 3 4 5 6 7 8; do
+    expect_cache MISS "/d$i"
+done
+[ "$(stat demoted)" -ge 1 ] || fail "nothing was demoted to disk"
+expect_cache HIT /d1
+[ "$(stat disk_hits)" -ge 1 ] || fail "/d1 was not served from disk"
+[ "$(curl -s "$URL/d1" | wc -c)" = 200000 ] || fail "/d1 from disk has the wrong length"
+[ "$(grep -c "^GET /d1 " "$WORKDIR/upstream.log")" = 1 ] || fail "/d1 fetched again"
+stop_all
+
+echo "PASS: proxycache"
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Per-client limits: requests over --rate-limit get a 429 with Retry-After
+# while another client address is still served, and --bandwidth-limit paces
+# a client's parallel downloads to its rate together without slowing down
+# another client. 127.0.0.2 stands in for the other client.
+#
+# Usage (from P2/): ./test/ratelimit.sh
+#
+# Needs curl. PORT (default 18800) is used.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all
+
+PORT=${PORT:-18800}
+. ./test/lib.sh
+
+mkdir "$WORKDIR/www"
+echo ok >"$WORKDIR/www/small.txt"
+head -c 1048576 /dev/urandom >"$WORKDIR/www/1m.bin"
+
+# 5 requests a second: a burst of 5, then 429s.
+start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads 4 --rate-limit 5
+for i in $(seq 1 10); do
+    curl -s -o /dev/null -w "%{http_code}\n" "http://127.0.0.1:$PORT/small.txt"
+done >"$WORKDIR/statuses"
+[ "$(grep -c 200 "$WORKDIR/statuses")" -le 6 ] || fail "rate not limited: $(tr '\n' ' ' <"$WORKDIR/statuses")"
+[ "$(grep -c 429 "$WORKDIR/statuses")" -ge 4 ] || fail "too few 429s: $(tr '\n' ' ' <"$WORKDIR/statuses")"
+curl -s -D - -o /dev/null "http://127.0.0.1:$PORT/small.txt" | grep -q "^Retry-After: [1-9]" ||
+    fail "429 without Retry-After"
+[ "$(curl -s -o /dev/null -w "%{http_code}" --interface 127.0.0.2 "http://127.0.0.1:$PORT/small.txt")" = 200 ] ||
+    fail "another client was limited too"
+sleep 1.2
+[ "$(curl -s -o /dev/null -w "%{http_code}" "http://127.0.0.1:$PORT/small.txt")" = 200 ] ||
+    fail "client still refused after its bucket refilled"
+stop_all
+
+# 512 KiB a second with a burst of as much: 1 MiB takes about 1 s, and two
+# at once from one client about 3 s.
+start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads 4 --bandwidth-limit 512
+download() {
+    curl -s -o /dev/null -w "%{time_total} %{size_download}\n" "$@" "http://127.0.0.1:$PORT/1m.bin"
+}
+download >"$WORKDIR/a1" &
+A1=$!
+download >"$WORKDIR/a2" &
+A2=$!
+download --interface 127.0.0.2 >"$WORKDIR/b"
+wait "$A1" "$A2"
+cat "$WORKDIR/a1" "$WORKDIR/a2" "$WORKDIR/b" | while read -r seconds bytes; do
+    [ "$bytes" = 1048576 ] || fail "download cut short at $bytes bytes"
+done
+slowest_a=$(cat "$WORKDIR/a1" "$WORKDIR/a2" | cut -d' ' -f1 | sort -n | tail -1)
+b=$(cut -d' ' -f1 "$WORKDIR/b")
+awk "BEGIN { exit !($slowest_a >= 2.5) }" || fail "parallel downloads not paced together: $slowest_a s"
+awk "BEGIN { exit !($b >= 0.8 && $b < 1.5) }" || fail "other client paced wrongly: $b s"
+stop_all
+
+echo "PASS: ratelimit"
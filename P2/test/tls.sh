@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# HTTPS checks against a locally generated self-signed certificate: files of
+# several sizes come back intact over TLS 1.3 and over TLS 1.2 with
+# --tls12-ktls, and a saved session is resumed from its ticket.
+#
+# Usage (from P2/): ./test/tls.sh
+#
+# Needs openssl and curl. PORT (default 18443) picks the listening port.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all
+
+PORT=${PORT:-18443}
+. ./test/lib.sh
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" \
+    -keyout "$WORKDIR/key.pem" -out "$WORKDIR/cert.pem" 2>/dev/null
+
+mkdir -p "$WORKDIR/www"
+echo "<html><body>hello over tls</body></html>" > "$WORKDIR/www/index.html"
+head -c 300000 /dev/urandom > "$WORKDIR/www/medium.bin"
+head -c 5000000 /dev/urandom > "$WORKDIR/www/large.bin"
+
+start_server() {
+    ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads 4 \
+        --tls-cert "$WORKDIR/cert.pem" --tls-key "$WORKDIR/key.pem" "$@" > "$WORKDIR/server.log" 2>&1 &
+    PIDS="$PIDS $!"
+    for _ in 1 2 3 4 5 6 7 8 9 10; do
+        curl -sk -o /dev/null "https://localhost:$PORT/" && return
+        sleep 0.2
+    done
+    fail "server did not come up: $(cat "$WORKDIR/server.log")"
+}
+
+check_files() {
+    for file in index.html medium.bin large.bin; do
+        curl -sk "$@" -o "$WORKDIR/got" "https://localhost:$PORT/$file" || fail "$file: curl $*"
+        cmp -s "$WORKDIR/got" "$WORKDIR/www/$file" || fail "$file differs ($*)"
+    done
+    status=$(curl -sk "$@" -o /dev/null -w "%{http_code}" "https://localhost:$PORT/missing")
+    [ "$status" = 404 ] || fail "missing file answered $status ($*)"
+}
+
+# The first client sends a request only after a pause and reads the answer,
+# so it is still connected when the TLS 1.3 ticket, sent after the
+# handshake, arrives.
+check_resumption() {
+    rm -f "$WORKDIR/session.pem"
+    (sleep 0.5; printf 'GET / HTTP/1.0\r\n\r\n') |
+        openssl s_client -connect "localhost:$PORT" "$@" -sess_out "$WORKDIR/session.pem" \
+        > "$WORKDIR/first.txt" 2>&1 || fail "first handshake ($*): $(cat "$WORKDIR/first.txt")"
+    grep -q "^New," "$WORKDIR/first.txt" || fail "first handshake ($*): $(cat "$WORKDIR/first.txt")"
+    [ -s "$WORKDIR/session.pem" ] || fail "no session saved ($*): $(cat "$WORKDIR/first.txt")"
+    (sleep 0.5; printf 'GET / HTTP/1.0\r\n\r\n') |
+        openssl s_client -connect "localhost:$PORT" "$@" -sess_in "$WORKDIR/session.pem" \
+        > "$WORKDIR/second.txt" 2>&1 || fail "second handshake ($*): $(cat "$WORKDIR/second.txt")"
+    grep -q "^Reused," "$WORKDIR/second.txt" || fail "session was not resumed ($*)"
+}
+
+start_server
+check_files --tlsv1.3
+check_files --tlsv1.2 --tls-max 1.2
+check_resumption -tls1_3
+check_resumption -tls1_2
+curl -s -o /dev/null "http://localhost:$PORT/" && fail "plain HTTP accepted on the HTTPS port"
+stop_all
+
+start_server --tls12-ktls
+check_files
+check_resumption
+curl -sk --tlsv1.3 -o /dev/null "https://localhost:$PORT/" && fail "TLS 1.3 accepted with --tls12-ktls"
+stop_all
+
+echo "PASS: tls"
@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Uploads with --max-upload: PUT creates (201) and replaces (204) a file,
+# chunked bodies arrive intact, bodies over the limit get a 413 whether their
+# size is announced or not, directories and missing parents a 409, paths out
+# of the directory a 403, a head split over two writes or ended by a bare
+# LF is not taken for the body, and no temporary file is left behind.
+# Without --max-upload, uploads get a 405.
+#
+# Usage (from P2/): ./test/upload.sh
+#
+# Needs curl and python3. PORT (default 19000) is used.
+
+set -e
+
+cd "$(dirname "$0")/.."
+make -s all
+
+PORT=${PORT:-19000}
+URL="http://127.0.0.1:$PORT"
+. ./test/lib.sh
+
+# Checks that the request made by curl with arguments $2... answers status $1.
+expect() {
+    status=$1
+    shift
+    got=$(curl -s -o /dev/null -w "%{http_code}" "$@")
+    [ "$got" = "$status" ] || fail "curl $*: $got, expected $status"
+}
+
+mkdir -p "$WORKDIR/www/dir"
+head -c 524288 /dev/urandom >"$WORKDIR/512k.bin"
+head -c 2097152 /dev/urandom >"$WORKDIR/2m.bin"
+
+start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads 2 --max-upload 1
+expect 201 -T "$WORKDIR/512k.bin" "$URL/a.bin"
+cmp -s "$WORKDIR/512k.bin" "$WORKDIR/www/a.bin" || fail "stored body differs"
+expect 204 -T "$WORKDIR/512k.bin" "$URL/a.bin"
+expect 201 --data-binary @"$WORKDIR/512k.bin" "$URL/dir/posted.bin"
+cmp -s "$WORKDIR/512k.bin" "$WORKDIR/www/dir/posted.bin" || fail "posted body differs"
+cat "$WORKDIR/512k.bin" | expect 201 -T - "$URL/chunked.bin"
+cmp -s "$WORKDIR/512k.bin" "$WORKDIR/www/chunked.bin" || fail "chunked body differs"
+curl -s "$URL/chunked.bin" | cmp -s "$WORKDIR/512k.bin" - || fail "uploaded file not served"
+
+status=$(python3 - "$PORT" <<'EOF'
+import socket, sys, time
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.sendall(b"PUT /split.txt HTTP/1.1\r\nContent-Length: 5\r\n")
+time.sleep(0.2)
+s.sendall(b"Host: a\r\n\r\nhello")
+print(s.recv(4096).split(b" ")[1].decode())
+EOF
+)
+[ "$status" = 201 ] || fail "split head: $status, expected 201"
+[ "$(cat "$WORKDIR/www/split.txt")" = hello ] || fail "split head stored as body"
+
+status=$(python3 - "$PORT" <<'EOF'
+import socket, sys
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.settimeout(5)
+s.sendall(b"PUT /lf.txt HTTP/1.1\nContent-Length: 5\n\nhello")
+print(s.recv(4096).split(b" ")[1].decode())
+EOF
+)
+[ "$status" = 201 ] || fail "LF-only head: $status, expected 201"
+[ "$(cat "$WORKDIR/www/lf.txt")" = hello ] || fail "LF-only head stored wrong"
+
+expect 413 -T "$WORKDIR/2m.bin" "$URL/big.bin"
+cat "$WORKDIR/2m.bin" | expect 413 -T - "$URL/big.bin"
+[ ! -e "$WORKDIR/www/big.bin" ] || fail "oversized upload stored"
+expect 409 -T "$WORKDIR/512k.bin" "$URL/dir"
+expect 409 -T "$WORKDIR/512k.bin" "$URL/missing/a.bin"
+expect 403 --path-as-is -T "$WORKDIR/512k.bin" "$URL/../a.bin"
+[ -z "$(find "$WORKDIR/www" -name '.upload-*')" ] || fail "temporary files left behind"
+stop_all
+
+start ./httpserver --files "$WORKDIR/www" --port "$PORT" --num-threads 2
+expect 405 -T "$WORKDIR/512k.bin" "$URL/a.bin"
+stop_all
+
+echo "PASS: upload"
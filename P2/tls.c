@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "tls.h"
+
+struct tls_connection {
+    SSL *ssl;
+    int fd;       // The client's TCP socket.
+    int relay_fd; // Our end of the handler's socketpair, or -1 when the kernel carries both directions.
+    pthread_t relay_thread;
+};
+
+static SSL_CTX *tls_context;
+
+/* Returns 1 if the kernel offers the "tls" upper layer protocol. */
+static int kernel_tls_available(void) {
+    char ulps[256];
+    FILE *file = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+    if (file == NULL) return 0;
+    int found = fgets(ulps, sizeof(ulps), file) != NULL && strstr(ulps, "tls") != NULL;
+    fclose(file);
+    return found;
+}
+
+int tls_init(const char *cert_path, const char *key_path, int ktls_tls12) {
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    if (context == NULL) goto fail;
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    if (ktls_tls12) SSL_CTX_set_max_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    if (SSL_CTX_use_certificate_chain_file(context, cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1)
+        goto fail;
+
+    /* Tickets carry the session to the client, so resumption costs the server
+     * no cache; one ticket per TLS 1.3 handshake is all a client uses. The
+     * ticket keys are generated per process. */
+    SSL_CTX_set_session_id_context(context, (const unsigned char *) TLS_SESSION_ID_CONTEXT,
+                                   strlen(TLS_SESSION_ID_CONTEXT));
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(context, 1);
+
+    if (!kernel_tls_available())
+        fprintf(stderr, "Kernel TLS is not available (modprobe tls); relaying TLS in userspace\n");
+    tls_context = context;
+    return 0;
+
+fail:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(context);
+    return -1;
+}
+
+int tls_enabled(void) {
+    return tls_context != NULL;
+}
+
+static void set_socket_timeouts(int fd, int timeout_ms) {
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) return -1;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int ssl_write_all(SSL *ssl, const char *data, size_t size) {
+    while (size > 0) {
+        int written = SSL_write(ssl, data, size);
+        if (written <= 0) return -1;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int splice_all(int pipe_fd, int fd, size_t size) {
+    while (size > 0) {
+        ssize_t moved = splice(pipe_fd, NULL, fd, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved <= 0) return -1;
+        size -= moved;
+    }
+    return 0;
+}
+
+/*
+ * Moves plaintext between the TLS session and the handler's socketpair until
+ * the handler closes its end. Responses are spliced straight into the socket
+ * when the kernel encrypts transmitted records.
+ */
+static void *tls_relay(void *args) {
+    tls_connection_t *connection = args;
+    SSL *ssl = connection->ssl;
+    char buffer[TLS_RELAY_BUFFER_SIZE];
+    int pipe_fds[2];
+    int splice_out = BIO_get_ktls_send(SSL_get_wbio(ssl)) && pipe2(pipe_fds, O_CLOEXEC) == 0;
+
+    struct pollfd fds[2] = {{connection->fd, POLLIN, 0}, {connection->relay_fd, POLLIN, 0}};
+    while (1) {
+        fds[0].revents = fds[1].revents = 0;
+        int pending = fds[0].fd >= 0 && SSL_pending(ssl) > 0;
+        if (poll(fds, 2, pending ? 0 : -1) == -1 && errno != EINTR) break;
+
+        if (pending || fds[0].revents) {
+            int bytes_read = SSL_read(ssl, buffer, sizeof(buffer));
+            if (bytes_read <= 0 || write_all(connection->relay_fd, buffer, bytes_read) == -1) {
+                /* The client is done sending; let the handler see EOF. */
+                fds[0].fd = -1;
+                shutdown(connection->relay_fd, SHUT_WR);
+            }
+        }
+
+        if (fds[1].revents) {
+            ssize_t bytes_read = splice_out
+                                 ? splice(connection->relay_fd, NULL, pipe_fds[1], NULL, TLS_RELAY_BUFFER_SIZE, SPLICE_F_MOVE)
+                                 : read(connection->relay_fd, buffer, sizeof(buffer));
+            if (bytes_read <= 0) break;
+            if ((splice_out ? splice_all(pipe_fds[0], connection->fd, bytes_read)
+                            : ssl_write_all(ssl, buffer, bytes_read)) == -1)
+                break;
+        }
+    }
+
+    if (splice_out) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    /* Closing our end also unblocks a handler still writing to a dead client. */
+    close(connection->relay_fd);
+    return NULL;
+}
+
+int tls_accept(int fd, tls_connection_t **connection) {
+    set_socket_timeouts(fd, TLS_HANDSHAKE_TIMEOUT_MS);
+
+    SSL *ssl = SSL_new(tls_context);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+        SSL_free(ssl);
+        ERR_clear_error();
+        return -1;
+    }
+
+    tls_connection_t *new_connection = calloc(1, sizeof(tls_connection_t));
+    new_connection->ssl = ssl;
+    new_connection->fd = fd;
+    new_connection->relay_fd = -1;
+
+    int handler_fd;
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        /* The handler owns a duplicate, so we can still send close_notify
+         * through the original once it is done. */
+        set_socket_timeouts(fd, 0);
+        handler_fd = dup(fd);
+    } else {
+        /* The timeouts stay: they bound how long the relay waits on a client
+         * that stalls mid-record. */
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+            handler_fd = -1;
+        } else {
+            new_connection->relay_fd = pair[1];
+            handler_fd = pair[0];
+            if (pthread_create(&new_connection->relay_thread, NULL, tls_relay, new_connection) != 0) {
+                close(pair[0]);
+                close(pair[1]);
+                handler_fd = -1;
+            }
+        }
+    }
+
+    if (handler_fd < 0) {
+        SSL_free(ssl);
+        free(new_connection);
+        return -1;
+    }
+    *connection = new_connection;
+    return handler_fd;
+}
+
+void tls_finish(tls_connection_t *connection) {
+    if (connection->relay_fd >= 0) pthread_join(connection->relay_thread, NULL);
+    SSL_shutdown(connection->ssl);
+    SSL_free(connection->ssl);
+    ERR_clear_error();
+    close(connection->fd);
+    free(connection);
+}
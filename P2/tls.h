@@ -0,0 +1,39 @@
+#ifndef __TLS__
+#define __TLS__
+
+/*
+ * HTTPS termination. After the handshake the session is handed to the kernel
+ * (kTLS) when it can carry both directions: the request handler then keeps
+ * using plain read, write and sendfile on the socket and the kernel does the
+ * record layer. Otherwise the handler gets one end of a socketpair and a relay
+ * thread moves plaintext between it and the TLS session; when only the
+ * transmit direction is offloaded, the relay splices responses into the socket.
+ *
+ * Session tickets are on, so a returning client resumes without a full
+ * handshake.
+ */
+
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+#define TLS_RELAY_BUFFER_SIZE 16384
+#define TLS_SESSION_ID_CONTEXT "httpserver"
+
+typedef struct tls_connection tls_connection_t;
+
+/* Loads the certificate chain and private key. KTLS_TLS12 caps the protocol at
+ * TLS 1.2, the version for which OpenSSL 3.0 offloads receive as well as
+ * transmit. Returns 0, or -1 after printing OpenSSL's errors. */
+int tls_init(const char *cert_path, const char *key_path, int ktls_tls12);
+
+/* Returns 1 once tls_init has succeeded. */
+int tls_enabled(void);
+
+/* Runs the server side of the handshake on FD. Returns the fd the request
+ * handler should use (and close), or -1 if the handshake failed; FD itself is
+ * left open either way. On success *CONNECTION must be passed to tls_finish
+ * after the handler returns. */
+int tls_accept(int fd, tls_connection_t **connection);
+
+/* Waits for the relay to drain, sends close_notify and closes the socket. */
+void tls_finish(tls_connection_t *connection);
+
+#endif
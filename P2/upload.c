@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "upload.h"
+
+typedef struct upload {
+    int fd; // The client socket.
+    int file_fd;
+    int pipe_fds[2]; // -1 once splice turns out not to work.
+    const char *pending; // Body bytes read but not used yet: those read with the head, then BUFFER's.
+    size_t pending_length;
+    size_t stored;
+    size_t max_size;
+    char buffer[UPLOAD_BUFFER_SIZE];
+} upload_t;
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) return -1;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/* Reads more of the body into the buffer once the pending bytes are used up.
+ * Returns 0, or 400 if the client stopped sending. */
+static int upload_fill(upload_t *upload) {
+    if (upload->pending_length > 0) return 0;
+    ssize_t bytes_read = read(upload->fd, upload->buffer, sizeof(upload->buffer));
+    if (bytes_read <= 0) return 400;
+    upload->pending = upload->buffer;
+    upload->pending_length = bytes_read;
+    return 0;
+}
+
+static size_t upload_take(upload_t *upload, size_t size) {
+    if (size > upload->pending_length) size = upload->pending_length;
+    upload->pending += size;
+    upload->pending_length -= size;
+    return size;
+}
+
+static void upload_stop_splicing(upload_t *upload) {
+    close(upload->pipe_fds[0]);
+    close(upload->pipe_fds[1]);
+    upload->pipe_fds[0] = upload->pipe_fds[1] = -1;
+}
+
+/* Splices SIZE bytes (at most a pipe's worth) from the socket to the file.
+ * Returns 0, or a status. */
+static int upload_splice(upload_t *upload, size_t *size) {
+    ssize_t moved = splice(upload->fd, NULL, upload->pipe_fds[1], NULL,
+                           *size < UPLOAD_SPLICE_SIZE ? *size : UPLOAD_SPLICE_SIZE, SPLICE_F_MOVE);
+    if (moved == -1 && errno == EINVAL) {
+        upload_stop_splicing(upload);
+        return 0;
+    }
+    if (moved <= 0) return 400;
+    *size -= moved;
+
+    while (moved > 0) {
+        ssize_t written = splice(upload->pipe_fds[0], NULL, upload->file_fd, NULL, moved, SPLICE_F_MOVE);
+        if (written == -1 && errno == EINVAL) {
+            /* The file system cannot take a splice: copy out what the pipe holds. */
+            while (moved > 0 && (written = read(upload->pipe_fds[0], upload->buffer, sizeof(upload->buffer))) > 0) {
+                if (write_all(upload->file_fd, upload->buffer, written) == -1) return 500;
+                moved -= written;
+            }
+            upload_stop_splicing(upload);
+            return moved > 0 ? 500 : 0;
+        }
+        if (written <= 0) return 500;
+        moved -= written;
+    }
+    return 0;
+}
+
+/* Stores the next SIZE bytes of the body: those already read first, then the
+ * rest straight from the socket. Returns 0, or a status. */
+static int upload_data(upload_t *upload, size_t size) {
+    if (size > upload->max_size - upload->stored) return 413;
+    upload->stored += size;
+
+    const char *data = upload->pending;
+    size_t taken = upload_take(upload, size);
+    if (taken > 0 && write_all(upload->file_fd, data, taken) == -1) return 500;
+    size -= taken;
+
+    int status;
+    while (size > 0) {
+        if (upload->pipe_fds[0] >= 0) {
+            if ((status = upload_splice(upload, &size)) != 0) return status;
+            continue;
+        }
+        if ((status = upload_fill(upload)) != 0) return status;
+        data = upload->pending;
+        taken = upload_take(upload, size);
+        if (write_all(upload->file_fd, data, taken) == -1) return 500;
+        size -= taken;
+    }
+    return 0;
+}
+
+/* Reads a line of chunk framing into LINE (UPLOAD_LINE_MAX_SIZE + 1 bytes),
+ * without its line ending. Returns 0, or 400. */
+static int upload_line(upload_t *upload, char *line) {
+    size_t length = 0;
+    const char *end = NULL;
+    while (end == NULL) {
+        int status = upload_fill(upload);
+        if (status != 0) return status;
+        end = memchr(upload->pending, '\n', upload->pending_length);
+        const char *data = upload->pending;
+        size_t taken = upload_take(upload, end ? (size_t) (end + 1 - data) : upload->pending_length);
+        if (length + taken > UPLOAD_LINE_MAX_SIZE) return 400;
+        memcpy(line + length, data, taken);
+        length += taken;
+    }
+
+    length--;
+    if (length > 0 && line[length - 1] == '\r') length--;
+    line[length] = '\0';
+    return 0;
+}
+
+/* Stores a chunked body: size lines, each followed by that many bytes and a
+ * line ending, up to a zero size, trailers and a blank line. */
+static int upload_chunked(upload_t *upload) {
+    char line[UPLOAD_LINE_MAX_SIZE + 1];
+    int status;
+    while (1) {
+        if ((status = upload_line(upload, line)) != 0) return status;
+        char *end;
+        errno = 0;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (!isxdigit((unsigned char) line[0]) || errno != 0 || (*end != '\0' && *end != ';' && *end != ' '))
+            return 400;
+        if (size == 0) break;
+        if (size > upload->max_size) return 413;
+
+        if ((status = upload_data(upload, size)) != 0) return status;
+        if ((status = upload_line(upload, line)) != 0) return status;
+        if (line[0] != '\0') return 400;
+    }
+
+    do {
+        if ((status = upload_line(upload, line)) != 0) return status;
+    } while (line[0] != '\0');
+    return 0;
+}
+
+int upload_store(int fd, struct http_request *request, const char *path, size_t max_size) {
+    /* A head that never ended (too long, or the client stopped) gives no
+     * telling where the body starts. */
+    const char *head_end = request->head + request->head_length;
+    if (!(request->head_length >= 3 && memcmp(head_end - 3, "\n\r\n", 3) == 0) &&
+        !(request->head_length >= 2 && memcmp(head_end - 2, "\n\n", 2) == 0))
+        return 400;
+
+    char value[64];
+    int chunked = 0;
+    unsigned long long content_length = 0;
+    if (http_request_header(request, "Transfer-Encoding", value, sizeof(value))) {
+        if (strcasecmp(value, "chunked") != 0) return 501;
+        chunked = 1;
+    } else if (http_request_header(request, "Content-Length", value, sizeof(value))) {
+        char *end;
+        errno = 0;
+        content_length = strtoull(value, &end, 10);
+        if (!isdigit((unsigned char) value[0]) || *end != '\0' || errno != 0) return 400;
+        if (content_length > max_size) return 413;
+    } else {
+        return 411;
+    }
+
+    struct stat path_stat;
+    int exists = stat(path, &path_stat) == 0;
+    if (exists && !S_ISREG(path_stat.st_mode)) return 409;
+
+    /* Next to PATH, so the rename does not cross file systems. */
+    char temp_path[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (snprintf(temp_path, sizeof(temp_path), "%.*s/" UPLOAD_TEMP_PREFIX "XXXXXX", slash ? (int) (slash - path) : 1,
+                 slash ? path : ".") >= (int) sizeof(temp_path))
+        return 400;
+
+    upload_t upload = {.fd = fd, .pending = request->body, .pending_length = request->body_length,
+                       .max_size = max_size};
+    if ((upload.file_fd = mkostemp(temp_path, O_CLOEXEC)) == -1)
+        return errno == ENOENT || errno == ENOTDIR ? 409 : errno == EACCES ? 403 : 500;
+    fchmod(upload.file_fd, 0644);
+    if (pipe2(upload.pipe_fds, O_CLOEXEC) == -1) upload.pipe_fds[0] = upload.pipe_fds[1] = -1;
+
+    /* Only now that the upload can go ahead is the client told to send it. */
+    if (http_request_header(request, "Expect", value, sizeof(value)) && strcasecmp(value, "100-continue") == 0)
+        http_send_string(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+
+    int status = chunked ? upload_chunked(&upload) : upload_data(&upload, content_length);
+    if (upload.pipe_fds[0] >= 0) upload_stop_splicing(&upload);
+    if (close(upload.file_fd) == -1 && status == 0) status = 500;
+    if (status == 0 && rename(temp_path, path) == -1) status = 500;
+    if (status != 0) {
+        unlink(temp_path);
+        return status;
+    }
+    return exists ? 204 : 201;
+}
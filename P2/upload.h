@@ -0,0 +1,33 @@
+#ifndef __UPLOAD__
+#define __UPLOAD__
+
+#include <stddef.h>
+
+#include "libhttp.h"
+
+/*
+ * Request bodies stored as files (PUT and POST in --files mode). A body,
+ * whether sized by Content-Length or chunked, goes to a temporary file next to
+ * its destination and is renamed over it once complete, so readers see the
+ * old file or the new one and never part of either. Body data is spliced from
+ * the socket to the file through a pipe; only chunk framing passes through a
+ * buffer of UPLOAD_BUFFER_SIZE, so an upload takes the same memory whatever
+ * its size.
+ */
+
+#define UPLOAD_BUFFER_SIZE 4096
+#define UPLOAD_SPLICE_SIZE 65536
+#define UPLOAD_LINE_MAX_SIZE 256 // Longest chunk-size or trailer line accepted.
+#define UPLOAD_TEMP_PREFIX ".upload-"
+
+/*
+ * Stores the body of REQUEST, the rest of which is read from FD, at PATH,
+ * allowing up to MAX_SIZE bytes. Returns the status to answer with: 201 if
+ * PATH was created, 204 if it was replaced, or else 400 (malformed or cut
+ * short), 403, 409 (PATH is a directory or its directory does not exist),
+ * 411 (no length), 413 (over MAX_SIZE), 500 or 501 (a transfer coding other
+ * than chunked).
+ */
+int upload_store(int fd, struct http_request *request, const char *path, size_t max_size);
+
+#endif
@@ -0,0 +1,268 @@
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upstream.h"
+#include "util.h"
+
+typedef struct ring_point {
+    uint32_t hash;
+    int upstream;
+} ring_point_t;
+
+static upstream_t upstreams[UPSTREAM_MAX];
+static int num_upstreams;
+static upstream_policy_t pool_policy;
+static ring_point_t *ring;
+static int ring_size;
+static unsigned int next_start; // Rotates where least-outstanding scans begin, to spread ties.
+static pthread_mutex_t upstream_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_string(const char *string) {
+    uint32_t hash = fnv1a(string, strlen(string));
+    /* Finish with a mixer: FNV alone leaves similar keys close on the ring. */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* Fills in UPSTREAM's address from SPEC. Returns 0, or -1 if it does not
+ * resolve. */
+static int resolve(upstream_t *upstream, const char *spec) {
+    if (strncmp(spec, UPSTREAM_UNIX_PREFIX, strlen(UPSTREAM_UNIX_PREFIX)) == 0) {
+        struct sockaddr_un *address = (struct sockaddr_un *) &upstream->address;
+        const char *path = spec + strlen(UPSTREAM_UNIX_PREFIX);
+        if (*path == '\0' || strlen(path) >= sizeof(address->sun_path)) return -1;
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, path);
+        upstream->address_length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    char host[256];
+    const char *port = "80";
+    const char *colon = strrchr(spec, ':');
+    size_t host_length = colon ? (size_t) (colon - spec) : strlen(spec);
+    if (host_length == 0 || host_length >= sizeof(host)) return -1;
+    memcpy(host, spec, host_length);
+    host[host_length] = '\0';
+    if (colon) port = colon + 1;
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *result;
+    if (getaddrinfo(host, port, &hints, &result) != 0) return -1;
+    memcpy(&upstream->address, result->ai_addr, result->ai_addrlen);
+    upstream->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+int upstream_add(const char *spec) {
+    if (num_upstreams == UPSTREAM_MAX) return -1;
+
+    upstream_t *upstream = &upstreams[num_upstreams];
+    memset(upstream, 0, sizeof(upstream_t));
+    if (resolve(upstream, spec) == -1) return -1;
+    upstream->index = num_upstreams;
+    upstream->name = strdup(spec);
+    num_upstreams++;
+    return 0;
+}
+
+int upstream_add_list(const char *list) {
+    char spec[512];
+    while (*list) {
+        size_t length = strcspn(list, ",");
+        if (length == 0 || length >= sizeof(spec)) return -1;
+        memcpy(spec, list, length);
+        spec[length] = '\0';
+        if (upstream_add(spec) == -1) return -1;
+        list += length;
+        if (*list == ',') list++;
+    }
+    return 0;
+}
+
+int upstream_count(void) {
+    return num_upstreams;
+}
+
+static int compare_ring_points(const void *a, const void *b) {
+    uint32_t hash_a = ((const ring_point_t *) a)->hash, hash_b = ((const ring_point_t *) b)->hash;
+    return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+void upstream_init(upstream_policy_t policy) {
+    pool_policy = policy;
+    if (policy != UPSTREAM_CONSISTENT_HASH) return;
+
+    char point_name[600];
+    ring_size = num_upstreams * UPSTREAM_RING_POINTS;
+    ring = malloc(ring_size * sizeof(ring_point_t));
+    for (int i = 0; i < num_upstreams; i++) {
+        for (int j = 0; j < UPSTREAM_RING_POINTS; j++) {
+            snprintf(point_name, sizeof(point_name), "%s#%d", upstreams[i].name, j);
+            ring[i * UPSTREAM_RING_POINTS + j] = (ring_point_t) {hash_string(point_name), i};
+        }
+    }
+    qsort(ring, ring_size, sizeof(ring_point_t), compare_ring_points);
+}
+
+/* Returns 1 if UPSTREAM is ejected, bringing it back if its time is up. The
+ * caller holds upstream_mutex. */
+static int is_ejected(upstream_t *upstream, uint64_t now) {
+    if (!upstream->ejected) return 0;
+    if (now < upstream->ejected_until_ns) return 1;
+    upstream->ejected = 0;
+    upstream->consecutive_failures = 0;
+    upstream->samples = 0;
+    upstream->latency_us = 0;
+    return 0;
+}
+
+static int is_candidate(upstream_t *upstream, uint64_t exclude, uint64_t now, int allow_ejected) {
+    return !(exclude & (1ull << upstream->index)) && (allow_ejected || !is_ejected(upstream, now));
+}
+
+static upstream_t *pick_least_outstanding(uint64_t exclude, uint64_t now, int allow_ejected) {
+    upstream_t *best = NULL;
+    unsigned int start = next_start++;
+    for (int i = 0; i < num_upstreams; i++) {
+        upstream_t *upstream = &upstreams[(start + i) % num_upstreams];
+        if (is_candidate(upstream, exclude, now, allow_ejected) &&
+            (best == NULL || upstream->outstanding < best->outstanding))
+            best = upstream;
+    }
+    return best;
+}
+
+static upstream_t *pick_consistent_hash(const char *key, uint64_t exclude, uint64_t now, int allow_ejected) {
+    uint32_t hash = hash_string(key ? key : "");
+    int low = 0, high = ring_size;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (ring[middle].hash < hash) low = middle + 1;
+        else high = middle;
+    }
+    /* Walk clockwise to the first usable owner, so only the keys of an
+     * unavailable upstream move. */
+    for (int i = 0; i < ring_size; i++) {
+        upstream_t *upstream = &upstreams[ring[(low + i) % ring_size].upstream];
+        if (is_candidate(upstream, exclude, now, allow_ejected)) return upstream;
+    }
+    return NULL;
+}
+
+upstream_t *upstream_pick(const char *key, uint64_t exclude) {
+    uint64_t now = now_ns();
+    upstream_t *upstream = NULL;
+    pthread_mutex_lock(&upstream_mutex);
+    for (int allow_ejected = 0; allow_ejected <= 1 && upstream == NULL; allow_ejected++) {
+        upstream = pool_policy == UPSTREAM_CONSISTENT_HASH
+                   ? pick_consistent_hash(key, exclude, now, allow_ejected)
+                   : pick_least_outstanding(exclude, now, allow_ejected);
+    }
+    if (upstream != NULL) {
+        upstream->outstanding++;
+        upstream->requests++;
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+    return upstream;
+}
+
+int upstream_connect(upstream_t *upstream) {
+    int fd = socket(upstream->address.ss_family, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *) &upstream->address, upstream->address_length) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Ejects UPSTREAM unless too much of the pool is out already. The caller
+ * holds upstream_mutex. */
+static void eject(upstream_t *upstream, uint64_t now) {
+    int ejected = 0;
+    for (int i = 0; i < num_upstreams; i++) ejected += is_ejected(&upstreams[i], now);
+    if ((ejected + 1) * 100 > num_upstreams * UPSTREAM_MAX_EJECTED_PERCENT) return;
+
+    uint64_t ejection_ms = (uint64_t) UPSTREAM_EJECTION_MS * ++upstream->ejections;
+    if (ejection_ms > UPSTREAM_MAX_EJECTION_MS) ejection_ms = UPSTREAM_MAX_EJECTION_MS;
+    upstream->ejected = 1;
+    upstream->ejected_until_ns = now + ejection_ms * 1000000ull;
+    fprintf(stderr, "Ejected upstream %s for %llu ms\n", upstream->name, (unsigned long long) ejection_ms);
+}
+
+/* Returns the median latency of the other upstreams with enough samples, or
+ * -1 if there are none. The caller holds upstream_mutex. */
+static double pool_median_latency(upstream_t *excluded, uint64_t now) {
+    double latencies[UPSTREAM_MAX];
+    int count = 0;
+    for (int i = 0; i < num_upstreams; i++) {
+        upstream_t *upstream = &upstreams[i];
+        if (upstream == excluded || is_ejected(upstream, now) || upstream->samples < UPSTREAM_OUTLIER_MIN_SAMPLES)
+            continue;
+        /* Insertion sort; the pool is small. */
+        int j = count++;
+        for (; j > 0 && latencies[j - 1] > upstream->latency_us; j--) latencies[j] = latencies[j - 1];
+        latencies[j] = upstream->latency_us;
+    }
+    if (count == 0) return -1;
+    return count % 2 ? latencies[count / 2] : (latencies[count / 2 - 1] + latencies[count / 2]) / 2;
+}
+
+void upstream_done(upstream_t *upstream, int ok, uint64_t latency_ns) {
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&upstream_mutex);
+    upstream->outstanding--;
+
+    if (!ok) {
+        upstream->failures++;
+        if (++upstream->consecutive_failures >= UPSTREAM_MAX_FAILURES && !is_ejected(upstream, now))
+            eject(upstream, now);
+        pthread_mutex_unlock(&upstream_mutex);
+        return;
+    }
+
+    upstream->consecutive_failures = 0;
+    if (latency_ns == 0) {
+        pthread_mutex_unlock(&upstream_mutex);
+        return;
+    }
+    double latency_us = latency_ns / 1000.0;
+    upstream->latency_us = upstream->samples++ == 0
+                           ? latency_us
+                           : upstream->latency_us + UPSTREAM_LATENCY_WEIGHT * (latency_us - upstream->latency_us);
+
+    if (upstream->samples >= UPSTREAM_OUTLIER_MIN_SAMPLES && !is_ejected(upstream, now)) {
+        double median = pool_median_latency(upstream, now);
+        if (median >= 0 && upstream->latency_us > UPSTREAM_OUTLIER_FACTOR * median &&
+            upstream->latency_us > median + UPSTREAM_OUTLIER_MIN_EXCESS_US)
+            eject(upstream, now);
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+}
+
+void upstream_dump_stats(FILE *out) {
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&upstream_mutex);
+    fprintf(out, "{\"policy\": \"%s\", \"upstreams\": [",
+            pool_policy == UPSTREAM_CONSISTENT_HASH ? "consistent-hash" : "least-outstanding");
+    for (int i = 0; i < num_upstreams; i++) {
+        upstream_t *upstream = &upstreams[i];
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"outstanding\": %d, \"requests\": %zu, \"failures\": %zu, "
+                     "\"latency_us\": %.0f, \"ejected\": %s, \"ejections\": %d}",
+                i ? "," : "", upstream->name, upstream->outstanding, upstream->requests, upstream->failures,
+                upstream->latency_us, is_ejected(upstream, now) ? "true" : "false", upstream->ejections);
+    }
+    fprintf(out, "\n]}\n");
+    pthread_mutex_unlock(&upstream_mutex);
+}
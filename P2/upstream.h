@@ -0,0 +1,83 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+/*
+ * The proxy's upstream pool. Each request picks one upstream, either the one
+ * with the fewest requests in flight or the owner of the request path on a
+ * consistent-hash ring, and reports back how it went.
+ *
+ * Health is checked passively: an upstream that fails several requests in a
+ * row, or whose time to first byte drifts well above the rest of the pool, is
+ * ejected for a while, longer each time. At most half the pool is ejected at
+ * once, and when every candidate is ejected requests go to them anyway.
+ */
+
+#define UPSTREAM_MAX 64
+#define UPSTREAM_RING_POINTS 160             // Points per upstream on the hash ring.
+#define UPSTREAM_MAX_FAILURES 5              // Consecutive failures before ejection.
+#define UPSTREAM_EJECTION_MS 10000           // Times the number of ejections so far...
+#define UPSTREAM_MAX_EJECTION_MS 300000      // ...up to this.
+#define UPSTREAM_MAX_EJECTED_PERCENT 50
+#define UPSTREAM_OUTLIER_FACTOR 3            // Eject above this many times the pool's median latency...
+#define UPSTREAM_OUTLIER_MIN_EXCESS_US 10000 // ...and this much above it, so jitter is no outlier...
+#define UPSTREAM_OUTLIER_MIN_SAMPLES 20      // ...with this many samples since the last ejection.
+#define UPSTREAM_LATENCY_WEIGHT 0.05         // Weight of a new sample in the moving average.
+#define UPSTREAM_ADMIN_PATH "/__upstreams"
+#define UPSTREAM_UNIX_PREFIX "unix:"
+
+typedef enum {
+    UPSTREAM_LEAST_OUTSTANDING,
+    UPSTREAM_CONSISTENT_HASH
+} upstream_policy_t;
+
+typedef struct upstream {
+    int index;
+    char *name; // As given on the command line.
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    int outstanding;
+    size_t requests;
+    size_t failures;
+    int consecutive_failures;
+    double latency_us; // Moving average of the time to the first response byte.
+    size_t samples;    // Latency samples since the upstream was last ejected.
+    int ejected;
+    int ejections;
+    uint64_t ejected_until_ns;
+} upstream_t;
+
+/* Adds the upstream "host[:port]" (port 80 by default) or "unix:/path" (a
+ * Unix domain socket). Returns 0, or -1 if the host does not resolve, the
+ * path is too long, or the pool is full. */
+int upstream_add(const char *spec);
+
+/* Adds each upstream of the comma-separated LIST. Returns 0, or -1 on the
+ * first one upstream_add rejects. */
+int upstream_add_list(const char *list);
+
+int upstream_count(void);
+
+/* Selects POLICY. Call once every upstream has been added. */
+void upstream_init(upstream_policy_t policy);
+
+/* Picks an upstream for a request, KEY being its path (used by the hash
+ * policy; may be NULL). Upstreams whose bit is set in EXCLUDE are skipped.
+ * Returns NULL if none is left. The pick counts as outstanding until
+ * upstream_done. */
+upstream_t *upstream_pick(const char *key, uint64_t exclude);
+
+/* Opens a stream connection to UPSTREAM. Returns the socket, or -1. */
+int upstream_connect(upstream_t *upstream);
+
+/* Reports the outcome of a request picked with upstream_pick. LATENCY_NS is
+ * the time to the first response byte, or 0 if it is not known. */
+void upstream_done(upstream_t *upstream, int ok, uint64_t latency_ns);
+
+/* Writes the pool's state as JSON. */
+void upstream_dump_stats(FILE *out);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __UTIL__
+#define __UTIL__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Small helpers shared by the server's modules and the benchmarks. They are
+ * inline so that the per-request callers pay no more than for the copies they
+ * replace.
+ */
+
+#define FNV1A_OFFSET_BASIS 2166136261u
+#define FNV1A_PRIME 16777619u
+
+/* 32-bit FNV-1a of LENGTH bytes at DATA. */
+static inline uint32_t fnv1a(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    uint32_t hash = FNV1A_OFFSET_BASIS;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ bytes[i]) * FNV1A_PRIME;
+    return hash;
+}
+
+/* Nanoseconds on the monotonic clock. */
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include "wq.h"
 #include "utlist.h"
@@ -38,3 +40,155 @@ void wq_push(wq_t *wq, int client_socket_fd) {
     pthread_cond_signal(&wq->cond);
     pthread_mutex_unlock(&wq->mutex);
 }
+
+static wsq_array_t *wsq_array_new(long capacity) {
+    wsq_array_t *array = malloc(sizeof(wsq_array_t) + capacity * sizeof(int));
+    array->capacity = capacity;
+    array->retired = NULL;
+    return array;
+}
+
+/* Allocates and initializes an empty deque from the calling thread. */
+static wsq_t *wsq_new(void) {
+    wsq_t *wsq;
+    if (posix_memalign((void **) &wsq, WSQ_CACHE_LINE, sizeof(wsq_t)) != 0) {
+        perror("Failed to allocate work-stealing deque");
+        exit(errno);
+    }
+    wsq_init(wsq);
+    return wsq;
+}
+
+/* Initializes an empty work-stealing deque WSQ. */
+void wsq_init(wsq_t *wsq) {
+    wsq->top = 0;
+    wsq->bottom = 0;
+    wsq->array = wsq_array_new(64);
+    wsq->sleeping = 0;
+    sem_init(&wsq->ready, 0, 0);
+}
+
+/* Doubles the capacity of WSQ. The old array stays alive because a thief may
+ * still be reading from it. */
+static wsq_array_t *wsq_grow(wsq_t *wsq, wsq_array_t *array, long bottom, long top) {
+    wsq_array_t *bigger = wsq_array_new(array->capacity * 2);
+    for (long i = top; i < bottom; i++)
+        bigger->buffer[i & (bigger->capacity - 1)] = array->buffer[i & (array->capacity - 1)];
+    bigger->retired = array;
+    __atomic_store_n(&wsq->array, bigger, __ATOMIC_RELEASE);
+    return bigger;
+}
+
+/* Add CLIENT_SOCKET_FD to the bottom of WSQ. Only the acceptor may call this. */
+void wsq_push(wsq_t *wsq, int client_socket_fd) {
+    long bottom = __atomic_load_n(&wsq->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&wsq->top, __ATOMIC_ACQUIRE);
+    wsq_array_t *array = __atomic_load_n(&wsq->array, __ATOMIC_RELAXED);
+
+    if (bottom - top > array->capacity - 1) array = wsq_grow(wsq, array, bottom, top);
+
+    __atomic_store_n(&array->buffer[bottom & (array->capacity - 1)], client_socket_fd, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&wsq->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+/* Take an item from the top of WSQ. Returns WSQ_EMPTY if there is nothing to
+ * take and WSQ_ABORT if another thread won the race for the same item. */
+int wsq_steal(wsq_t *wsq) {
+    long top = __atomic_load_n(&wsq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&wsq->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) return WSQ_EMPTY;
+
+    wsq_array_t *array = __atomic_load_n(&wsq->array, __ATOMIC_ACQUIRE);
+    int client_socket_fd = __atomic_load_n(&array->buffer[top & (array->capacity - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&wsq->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return WSQ_ABORT;
+    return client_socket_fd;
+}
+
+/* Initializes a pool of NUM_WORKERS deques. */
+void wq_pool_init(wq_pool_t *pool, int num_workers) {
+    pool->num_workers = num_workers;
+    pool->num_sleeping = 0;
+    pool->next_worker = 0;
+    pool->deques = calloc(num_workers, sizeof(wsq_t *));
+    for (int i = 0; i < num_workers; i++) pool->deques[i] = wsq_new();
+}
+
+/* Replaces WORKER_ID's deque with one allocated by the calling thread. Once
+ * the worker is pinned, first-touch places the deque on its local NUMA node.
+ * Must be called before anything is pushed to the pool. */
+void wq_pool_rehome(wq_pool_t *pool, int worker_id) {
+    wsq_t *old = pool->deques[worker_id];
+    pool->deques[worker_id] = wsq_new();
+    sem_destroy(&old->ready);
+    free(old->array);
+    free(old);
+}
+
+/* Wakes the worker owning WSQ if it is asleep. Returns 1 if it was. */
+static int wq_pool_wake(wq_pool_t *pool, wsq_t *wsq) {
+    if (!__atomic_exchange_n(&wsq->sleeping, 0, __ATOMIC_SEQ_CST)) return 0;
+    __atomic_sub_fetch(&pool->num_sleeping, 1, __ATOMIC_SEQ_CST);
+    sem_post(&wsq->ready);
+    return 1;
+}
+
+/* Add CLIENT_SOCKET_FD to the next worker's deque. If that worker is busy,
+ * wake an idle peer so it can steal the socket instead of leaving it queued. */
+void wq_pool_push(wq_pool_t *pool, int client_socket_fd) {
+    wq_pool_push_to(pool, pool->next_worker++ % pool->num_workers, client_socket_fd);
+}
+
+/* Add CLIENT_SOCKET_FD to WORKER_ID's deque. */
+void wq_pool_push_to(wq_pool_t *pool, int worker_id, int client_socket_fd) {
+    wsq_push(pool->deques[worker_id], client_socket_fd);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (wq_pool_wake(pool, pool->deques[worker_id])) return;
+    if (__atomic_load_n(&pool->num_sleeping, __ATOMIC_SEQ_CST) == 0) return;
+    for (int i = 1; i < pool->num_workers; i++)
+        if (wq_pool_wake(pool, pool->deques[(worker_id + i) % pool->num_workers])) return;
+}
+
+/* Scans the worker's own deque first, then its peers'. */
+static int wq_pool_take(wq_pool_t *pool, int worker_id) {
+    int retry;
+    do {
+        retry = 0;
+        for (int i = 0; i < pool->num_workers; i++) {
+            int client_socket_fd = wsq_steal(pool->deques[(worker_id + i) % pool->num_workers]);
+            if (client_socket_fd >= 0) return client_socket_fd;
+            if (client_socket_fd == WSQ_ABORT) retry = 1;
+        }
+    } while (retry);
+    return WSQ_EMPTY;
+}
+
+/* Remove an item for WORKER_ID from the pool. This function should block
+ * until there is at least one item on any of the deques. */
+int wq_pool_pop(wq_pool_t *pool, int worker_id) {
+    wsq_t *own = pool->deques[worker_id];
+    int client_socket_fd;
+
+    while (1) {
+        if ((client_socket_fd = wq_pool_take(pool, worker_id)) >= 0) return client_socket_fd;
+
+        /* Announce that we are going to sleep, then look once more: a push
+         * racing with us is either seen by this scan or wakes us up. */
+        __atomic_store_n(&own->sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&pool->num_sleeping, 1, __ATOMIC_SEQ_CST);
+
+        if ((client_socket_fd = wq_pool_take(pool, worker_id)) >= 0) {
+            if (__atomic_exchange_n(&own->sleeping, 0, __ATOMIC_SEQ_CST))
+                __atomic_sub_fetch(&pool->num_sleeping, 1, __ATOMIC_SEQ_CST);
+            else
+                while (sem_wait(&own->ready) == -1 && errno == EINTR); // Consume the wakeup already posted to us.
+            return client_socket_fd;
+        }
+
+        while (sem_wait(&own->ready) == -1 && errno == EINTR);
+    }
+}
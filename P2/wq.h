@@ -2,6 +2,7 @@
 #define __WQ__
 
 #include <pthread.h>
+#include <semaphore.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
  * waiting to be served. */
@@ -25,4 +26,53 @@ void wq_push(wq_t *wq, int client_socket_fd);
 
 int wq_pop(wq_t *wq);
 
+/* WSQ is a Chase-Lev work-stealing deque of client sockets. The acceptor plays
+ * the owner's role and is the only thread that pushes at the bottom; every
+ * worker (including the one the deque belongs to) takes from the top with a
+ * CAS, so connections are served in FIFO order. */
+
+#define WSQ_EMPTY (-1)
+#define WSQ_ABORT (-2)
+#define WSQ_CACHE_LINE 64
+
+typedef struct wsq_array {
+    long capacity; // Always a power of two.
+    struct wsq_array *retired; // Smaller array this one replaced, freed on destroy.
+    int buffer[];
+} wsq_array_t;
+
+typedef struct wsq {
+    long top __attribute__((aligned(WSQ_CACHE_LINE)));
+    long bottom __attribute__((aligned(WSQ_CACHE_LINE)));
+    wsq_array_t *array;
+    int sleeping; // 1 while the worker owning this deque waits on ready.
+    sem_t ready;
+} __attribute__((aligned(WSQ_CACHE_LINE))) wsq_t;
+
+void wsq_init(wsq_t *wsq);
+
+void wsq_push(wsq_t *wsq, int client_socket_fd);
+
+int wsq_steal(wsq_t *wsq);
+
+/* WQ_POOL gives each worker its own deque. The acceptor distributes sockets
+ * round-robin and idle workers steal from busy peers before going to sleep. */
+
+typedef struct wq_pool {
+    int num_workers;
+    int num_sleeping;
+    unsigned int next_worker; // Round-robin cursor, only touched by the acceptor.
+    wsq_t **deques;
+} wq_pool_t;
+
+void wq_pool_init(wq_pool_t *pool, int num_workers);
+
+void wq_pool_rehome(wq_pool_t *pool, int worker_id);
+
+void wq_pool_push(wq_pool_t *pool, int client_socket_fd);
+
+void wq_pool_push_to(wq_pool_t *pool, int worker_id, int client_socket_fd);
+
+int wq_pool_pop(wq_pool_t *pool, int worker_id);
+
 #endif
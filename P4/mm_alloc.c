@@ -1,87 +1,850 @@
 /*
  * mm_alloc.c
  *
- * Stub implementations of the mm_* routines. Remove this comment and provide
- * a summary of your allocator's design here.
+ * A heap grown with sbrk and cut into blocks, each an 8-byte struct s_block
+ * header followed by its data. The header holds the size of the data, a
+ * multiple of ALIGNMENT, with flags in its low bits: whether the block is
+ * free, whether the block before it is, and whether it is mapped. A free
+ * block also repeats its size in its last word, a boundary tag, so both of
+ * a block's neighbours are found in O(1): the next one right past its data,
+ * the previous one, when the flag says it is free, through the tag in front
+ * of the header. Allocated blocks carry no tag and no links, only the
+ * header. Each stretch of heap ends in an epilogue, a zero-size allocated
+ * header (heap_end for the latest one); sbrk is not only ours to call, so a
+ * stretch may start anywhere past the last one and is never merged across.
+ *
+ * Free blocks are also kept on segregated free lists, one per size class,
+ * linked through their own data (struct free_links), so allocated blocks
+ * are never visited when looking for space:
+ *   - sizes below SMALL_LIMIT each have a class of their own (every size is
+ *     a multiple of ALIGNMENT), so the head of the list fits exactly;
+ *   - larger sizes share a class per power of two, whose first FIT_TRIES
+ *     blocks are searched first-fit, which gives a good fit without
+ *     scanning the whole class.
+ * A bitmap of the non-empty classes finds the next class up in one step
+ * when a request's own class has nothing. Freed blocks are merged with free
+ * neighbours right away, so no two free blocks are ever adjacent.
+ *
+ * In MM_MODE_TLSF, the free lists are indexed two-level segregated fit
+ * instead: a first level per power of two, each cut into TLSF_SL_COUNT
+ * equal steps, with a bitmap per level. A request is rounded up to the next
+ * step, so the head of any list found fits without looking at it, and the
+ * list is found with two find-first-set instructions at most. Finding,
+ * splitting and merging thus take constant time in the worst case, while
+ * wasting at most 1/TLSF_SL_COUNT of a block. Growing the heap (sbrk) and
+ * purging are outside these bounds; mm_set_purge_decay(-1) turns the latter
+ * off.
+ *
+ * MM_MODE_FIRST_FIT is the allocator this one grew out of, kept for mm_bench
+ * to compare against: all free blocks are on one list, in address order, and
+ * the whole of it is walked for the first block big enough, which is the
+ * block the original walk over every block from the start of the heap would
+ * have found. Small objects skip the thread caches and the slabs too, and go
+ * to the heap like any other.
+ *
+ * Objects of SLAB_LIMIT bytes or less do not come from the heap at all but
+ * from slabs: SLAB_SIZE-byte pieces of a region reserved once with mmap,
+ * each cut into objects of one size after a struct slab header with a bitmap
+ * of the free ones. Objects carry no header of their own; the slab of one is
+ * found by rounding its address down to SLAB_SIZE, and whether an address is
+ * in a slab at all by whether it lies in the region. A class allocates from
+ * the slabs it has partly used first, so its objects stay packed into as few
+ * pages as possible, then from a spare empty slab it kept, and only then
+ * takes a new one. Any other slab that empties is purged and goes back to
+ * the region for any class to reuse. Once the region is used up, small
+ * objects come from the heap like the others.
+ *
+ * The heap and the slabs are shared by all threads under heap_lock. In front
+ * of them, each thread caches small objects it freed or took from them, per
+ * class, so most small allocations and frees take no lock at all. A cache
+ * that runs dry takes CACHE_BATCH objects in one trip, and one that grows
+ * past CACHE_MAX gives CACHE_BATCH back the same way; a thread's cache goes
+ * back when the thread exits. Cached objects count as allocated to the heap
+ * and the slabs. The heap is still grown with sbrk, which is only safe as long
+ * as nothing else moves the break at the same time.
+ *
+ * Requests of mmap_threshold bytes or more stay out of the heap altogether:
+ * each gets an anonymous mapping of its own (marked by the header's mapped
+ * flag), which munmap hands straight back to the OS on free and mremap grows
+ * or shrinks on realloc without copying.
+ *
+ * Freed heap memory goes back to the OS in two ways. A free block at the top
+ * of the heap of trim_threshold bytes or more is cut off with a negative
+ * sbrk. Free blocks elsewhere with whole pages in them are "dirty" until
+ * those pages are purged with madvise(MADV_DONTNEED); they are kept on a
+ * list, oldest first. Purging is paced by decay as in jemalloc: the time is
+ * cut into DECAY_EPOCHS epochs spanning purge_decay_ms, and at most once an
+ * epoch, dirty pages are purged, oldest blocks first, down to what each
+ * epoch dirtied weighted by how much of the decay time it has left. Memory
+ * freed after a spike is thus given back over purge_decay_ms, while memory
+ * reused sooner never pays for a purge.
  */
 
+#define _GNU_SOURCE // For mremap
 #include "mm_alloc.h"
 
+#include <pthread.h>
+#include <sys/mman.h>
 #include <unistd.h>   // For sbrk
 #include <string.h>   // For memset
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 /* Your final implementation should comment out this macro. */
 //#define MM_USE_STUBS
 
-static s_block_ptr base = NULL; // Base of the memory list
+#define ALIGNMENT 8
+#define MIN_SIZE 24 // Room for the free-list links and boundary tag of a free block.
+#define SMALL_LIMIT 512
+#define SMALL_CLASSES (SMALL_LIMIT / ALIGNMENT)
+#define NUM_CLASSES 128
+#define FIT_TRIES 8 // Blocks of a request's own class looked at before moving up a class.
+#define CACHE_MAX 64 // Blocks a thread keeps per class.
+#define CACHE_BATCH 16 // Blocks moved between a cache and the heap in one trip.
+#define DECAY_EPOCHS 20
+#define TLSF_SL_LOG2 5
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 3) // Sizes below 2^TLSF_FL_SHIFT are all in first level 0.
+#define TLSF_FL_COUNT (64 - TLSF_FL_SHIFT + 1)
+#define TLSF_CLASSES (TLSF_FL_COUNT * TLSF_SL_COUNT)
+#define SLAB_SIZE 4096
+#define SLAB_REGION (64ul << 20) // Address space reserved for slabs.
+#define SLAB_COUNT (SLAB_REGION / SLAB_SIZE)
+#define SLAB_MIN 16 // Smaller requests get an object of this size.
+#define SLAB_LIMIT 64
+#define SLAB_CLASSES (SLAB_LIMIT / ALIGNMENT + 1)
+#define SLAB_WORDS ((SLAB_SIZE / SLAB_MIN + 63) / 64)
+
+/* Links of a free block on its class's list, stored in its data. */
+struct free_links {
+    s_block_ptr next;
+    s_block_ptr prev;
+};
+
+/* Kept after the free links by free blocks with whole pages to purge. */
+struct dirty_links {
+    s_block_ptr next;
+    s_block_ptr prev;
+    size_t pages;
+    int dirty; // Whether the block is on the dirty list.
+};
+
+/* Header of a slab, followed by its objects. */
+struct slab {
+    struct slab *next; // On its class's list of partly used slabs.
+    struct slab *prev;
+    uint32_t size; // Of its objects.
+    uint32_t count; // Objects it holds.
+    uint32_t used; // Objects allocated or in a thread cache.
+    uint64_t free_map[SLAB_WORDS]; // Bit per free object.
+};
+
+static s_block_ptr heap_end = NULL; // Epilogue of the latest stretch of heap
+static int mode = MM_MODE_SEGREGATED;
+static s_block_ptr free_lists[TLSF_CLASSES]; // The first NUM_CLASSES outside MM_MODE_TLSF.
+static uint64_t free_classes[NUM_CLASSES / 64]; // Bit per class with a non-empty list.
+static uint64_t tlsf_fl_bitmap; // Bit per first level with a non-empty list.
+static uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT]; // Bit per non-empty list of each first level.
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t heap_size; // Bytes sbrk'd for the heap, updated atomically like mapped_size.
+static size_t mapped_size; // Bytes in mappings of their own.
+static size_t mmap_threshold = MM_MMAP_THRESHOLD;
+static size_t trim_threshold = MM_TRIM_THRESHOLD;
+static long purge_decay_ms = MM_PURGE_DECAY_MS;
+
+/* Free blocks with pages not purged yet, oldest first. heap_lock guards them
+ * and the decay state. */
+static s_block_ptr dirty_head, dirty_tail;
+static size_t dirty_pages; // Updated atomically too, for mm_get_stats.
+static size_t epoch_pages[DECAY_EPOCHS]; // Pages dirtied in each of the last epochs.
+static int epoch; // Index of the current epoch in epoch_pages.
+static uint64_t epoch_start_ns;
+
+/* The slab region and what heap_lock guards of it: the slabs of each class
+ * partly used and kept empty, and the purged slabs ready for any class. */
+static char *slab_region; // Set once; read without the lock, atomically.
+static int slab_region_failed;
+static size_t slab_next; // Index of the first slab never used.
+static struct slab *slab_partial[SLAB_CLASSES];
+static struct slab *slab_spare[SLAB_CLASSES];
+static uint32_t slab_purged[SLAB_COUNT]; // Indices of purged slabs, a stack.
+static size_t slab_purged_count;
+static size_t slab_bytes; // In slabs not purged, updated atomically.
+
+/* A thread's small objects (the data of heap blocks, or slab objects), by
+ * class, linked through their first word. */
+typedef struct thread_cache {
+    void *objects[SMALL_CLASSES];
+    int counts[SMALL_CLASSES];
+    int registered; // Whether the cache is handed back when the thread exits.
+} thread_cache_t;
+
+static __thread thread_cache_t cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static size_t block_size(s_block_ptr b) {
+    return b->size & ~(size_t) BLOCK_FLAGS;
+}
 
 /*
- * Find a suitable block using first-fit algorithm.
+ * The header of allocated block B, read without heap_lock by the thread that
+ * owns it. Its size and mapped flag stay put, but another thread may flip its
+ * BLOCK_PREV_FREE flag under the lock meanwhile, which is why that flag is
+ * only ever changed atomically on a block that may be allocated.
  */
-s_block_ptr find_block(s_block_ptr *last, size_t size) {
-    s_block_ptr b = base;
-    while (b && !(b->free && b->size >= size)) {
-        *last = b;
-        b = b->next;
+static size_t owned_header(s_block_ptr b) {
+    return __atomic_load_n(&b->size, __ATOMIC_RELAXED);
+}
+
+static s_block_ptr next_block(s_block_ptr b) {
+    return (s_block_ptr) (b->data + block_size(b));
+}
+
+/* The block before B, which must be free (BLOCK_PREV_FREE). */
+static s_block_ptr prev_block(s_block_ptr b) {
+    size_t prev_size = *((size_t *) b - 1);
+    return (s_block_ptr) ((char *) b - prev_size - BLOCK_SIZE);
+}
+
+/* Marks B free with SIZE bytes: header, boundary tag and the next block's flag. */
+static void set_free(s_block_ptr b, size_t size) {
+    b->size = size | BLOCK_FREE | (b->size & BLOCK_PREV_FREE);
+    *((size_t *) (b->data + size) - 1) = size;
+    __atomic_or_fetch(&next_block(b)->size, BLOCK_PREV_FREE, __ATOMIC_RELAXED);
+}
+
+static struct free_links *links(s_block_ptr b) {
+    return (struct free_links *) b->data;
+}
+
+/* The TLSF class: first level times TLSF_SL_COUNT plus second level. */
+static int tlsf_class(size_t size) {
+    if (size < 1 << TLSF_FL_SHIFT) return size / ALIGNMENT;
+    int fl = 63 - __builtin_clzl(size);
+    int sl = (size >> (fl - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    return (fl - TLSF_FL_SHIFT + 1) * TLSF_SL_COUNT + sl;
+}
+
+static int size_class(size_t size) {
+    if (mode == MM_MODE_TLSF) return tlsf_class(size);
+    if (mode == MM_MODE_FIRST_FIT) return 0;
+    if (size < SMALL_LIMIT) return size / ALIGNMENT;
+    /* 2^9 (SMALL_LIMIT) up to 2^10 is the first class after the small ones. */
+    return SMALL_CLASSES + (63 - __builtin_clzl(size)) - 9;
+}
+
+/* Records whether class C's list has blocks. */
+static void mark_class(int c, int nonempty) {
+    if (mode == MM_MODE_TLSF) {
+        int fl = c / TLSF_SL_COUNT;
+        if (nonempty) {
+            tlsf_sl_bitmap[fl] |= 1u << (c % TLSF_SL_COUNT);
+            tlsf_fl_bitmap |= 1ull << fl;
+        } else {
+            tlsf_sl_bitmap[fl] &= ~(1u << (c % TLSF_SL_COUNT));
+            if (!tlsf_sl_bitmap[fl]) tlsf_fl_bitmap &= ~(1ull << fl);
+        }
+    } else if (nonempty) {
+        free_classes[c / 64] |= 1ull << (c % 64);
+    } else {
+        free_classes[c / 64] &= ~(1ull << (c % 64));
     }
-    return b;
+}
+
+/* Returns the first class from C up with a free block, or -1. */
+static int nonempty_class(int c) {
+    for (int word = c / 64; word < NUM_CLASSES / 64; word++) {
+        uint64_t bits = free_classes[word];
+        if (word == c / 64) bits &= ~0ull << (c % 64);
+        if (bits) return word * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+static size_t page_size(void) {
+    static size_t size;
+    if (!size) size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static struct dirty_links *dirty_links(s_block_ptr b) {
+    return (struct dirty_links *) (b->data + sizeof(struct free_links));
+}
+
+/* Finds the whole pages of free block B's data between its links and its
+ * boundary tag, which a purge hands back. Returns how many there are. */
+static size_t purge_range(s_block_ptr b, char **start) {
+    uintptr_t page = page_size();
+    uintptr_t first = ((uintptr_t) (dirty_links(b) + 1) + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t) (b->data + block_size(b) - sizeof(size_t)) & ~(page - 1);
+    *start = (char *) first;
+    return end > first ? (end - first) / page : 0;
+}
+
+static int is_dirty(s_block_ptr b) {
+    char *start;
+    return purge_range(b, &start) > 0 && dirty_links(b)->dirty;
+}
+
+static size_t dirty_pages_of(s_block_ptr b) {
+    return is_dirty(b) ? dirty_links(b)->pages : 0;
+}
+
+/* Adds free block B to the dirty list, if it has pages. FRESH of them were
+ * dirtied just now; the rest were on the list already, in blocks B took in. */
+static void dirty_insert(s_block_ptr b, size_t fresh) {
+    char *start;
+    size_t pages = purge_range(b, &start);
+    if (pages == 0) return;
+
+    struct dirty_links *l = dirty_links(b);
+    l->pages = pages;
+    l->dirty = 1;
+    l->next = NULL;
+    l->prev = dirty_tail;
+    if (dirty_tail) dirty_links(dirty_tail)->next = b;
+    else dirty_head = b;
+    dirty_tail = b;
+    __atomic_add_fetch(&dirty_pages, pages, __ATOMIC_RELAXED);
+    epoch_pages[epoch] += fresh < pages ? fresh : pages;
+}
+
+static void dirty_remove(s_block_ptr b) {
+    struct dirty_links *l = dirty_links(b);
+    if (l->prev) dirty_links(l->prev)->next = l->next;
+    else dirty_head = l->next;
+    if (l->next) dirty_links(l->next)->prev = l->prev;
+    else dirty_tail = l->prev;
+    l->dirty = 0;
+    __atomic_sub_fetch(&dirty_pages, l->pages, __ATOMIC_RELAXED);
+}
+
+static void free_list_insert(s_block_ptr b) {
+    int c = size_class(block_size(b));
+    s_block_ptr prev = NULL, next = free_lists[c];
+    char *start;
+    if (purge_range(b, &start) > 0) dirty_links(b)->dirty = 0;
+    if (mode == MM_MODE_FIRST_FIT) {
+        for (; next && next < b; next = links(next)->next) prev = next;
+    }
+    links(b)->prev = prev;
+    links(b)->next = next;
+    if (next) links(next)->prev = b;
+    if (prev) links(prev)->next = b;
+    else free_lists[c] = b;
+    mark_class(c, 1);
+}
+
+static void free_list_remove(s_block_ptr b) {
+    int c = size_class(block_size(b));
+    struct free_links *l = links(b);
+    if (is_dirty(b)) dirty_remove(b);
+    if (l->prev) links(l->prev)->next = l->next;
+    else free_lists[c] = l->next;
+    if (l->next) links(l->next)->prev = l->prev;
+    if (!free_lists[c]) mark_class(c, 0);
+}
+
+/*
+ * Find a free block of at least SIZE bytes in MM_MODE_TLSF: the first one in
+ * the lowest non-empty list at or past SIZE rounded up to its next step.
+ */
+static s_block_ptr tlsf_find_block(size_t size) {
+    if (size >= 1 << TLSF_FL_SHIFT)
+        size += ((size_t) 1 << (63 - __builtin_clzl(size) - TLSF_SL_LOG2)) - 1;
+    int c = tlsf_class(size), fl = c / TLSF_SL_COUNT;
+    uint32_t sl_map = tlsf_sl_bitmap[fl] & (~0u << (c % TLSF_SL_COUNT));
+
+    if (!sl_map) {
+        uint64_t fl_map = fl + 1 < TLSF_FL_COUNT ? tlsf_fl_bitmap & (~0ull << (fl + 1)) : 0;
+        if (!fl_map) return NULL;
+        fl = __builtin_ctzll(fl_map);
+        sl_map = tlsf_sl_bitmap[fl];
+    }
+    return free_lists[fl * TLSF_SL_COUNT + __builtin_ctz(sl_map)];
 }
 
 /*
- * Extend the heap with a new block.
+ * Find a free block of at least SIZE bytes, good-fit by size class.
  */
-s_block_ptr extend_heap(s_block_ptr last, size_t s) {
-    s_block_ptr b = sbrk(0);
-    if (sbrk(BLOCK_SIZE + s) == (void*)-1)
+s_block_ptr find_block(size_t size) {
+    int c;
+    s_block_ptr b;
+
+    if (mode == MM_MODE_TLSF) return tlsf_find_block(size);
+    if (mode == MM_MODE_FIRST_FIT) {
+        for (b = free_lists[0]; b; b = links(b)->next)
+            if (block_size(b) >= size) return b;
         return NULL;
+    }
+
+    c = size_class(size);
+    if (c < SMALL_CLASSES) {
+        if (free_lists[c]) return free_lists[c];
+    } else {
+        int tries = 0;
+        for (b = free_lists[c]; b && tries < FIT_TRIES; b = links(b)->next, tries++)
+            if (block_size(b) >= size) return b;
+    }
+
+    /* Every block in a higher class is big enough. */
+    c = c + 1 < NUM_CLASSES ? nonempty_class(c + 1) : -1;
+    return c < 0 ? NULL : free_lists[c];
+}
+
+/*
+ * Extend the heap with an allocated block of at least S bytes. Where the
+ * break is still at the end of the heap, the epilogue becomes the block's
+ * header, or a free block at the very end is grown by what it lacks;
+ * otherwise a new stretch starts at the break.
+ */
+s_block_ptr extend_heap(size_t s) {
+    char *brk = sbrk(0);
+    s_block_ptr b;
+    size_t grow;
+
+    if (heap_end && brk == heap_end->data) {
+        b = heap_end;
+        grow = BLOCK_SIZE + s;
+        if (b->size & BLOCK_PREV_FREE) {
+            b = prev_block(b);
+            grow = s > block_size(b) ? s - block_size(b) : 0;
+        }
+        if (sbrk(grow) == (void*)-1)
+            return NULL;
+        if (b != heap_end) {
+            free_list_remove(b);
+            s = block_size(b) + grow;
+        }
+    } else {
+        size_t pad = -(uintptr_t) brk & (ALIGNMENT - 1);
+        grow = pad + BLOCK_SIZE + s + BLOCK_SIZE;
+        if (sbrk(grow) == (void*)-1)
+            return NULL;
+        b = (s_block_ptr) (brk + pad);
+    }
+    __atomic_add_fetch(&heap_size, grow, __ATOMIC_RELAXED);
 
     b->size = s;
-    b->next = NULL;
-    b->prev = last;
-    b->free = 0;
-    b->ptr = b->data;
+    heap_end = next_block(b);
+    heap_end->size = 0;
+    return b;
+}
+
+/*
+ * Take a block of SIZE bytes (aligned) from the heap. heap_lock must be held.
+ */
+static s_block_ptr heap_malloc(size_t size) {
+    s_block_ptr b, after;
+    int dirty = 0;
+
+    b = find_block(size);
+    if (b) {
+        dirty = is_dirty(b);
+        free_list_remove(b);
+        b->size &= ~(size_t) BLOCK_FREE;
+        __atomic_and_fetch(&next_block(b)->size, ~(size_t) BLOCK_PREV_FREE, __ATOMIC_RELAXED);
+    } else {
+        // No fitting block, extend the heap
+        b = extend_heap(size);
+        if (!b) return NULL;
+    }
+
+    after = next_block(b);
+    split_block(b, size);
+    // What is split off keeps the pages that were not purged
+    if (dirty && next_block(b) != after) dirty_insert(next_block(b), 0);
+    return b;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Purges the oldest dirty blocks until at most LIMIT dirty pages are left. */
+static void purge_down_to(size_t limit) {
+    char *start;
+    while (dirty_pages > limit && dirty_head) {
+        s_block_ptr b = dirty_head;
+        size_t pages = purge_range(b, &start);
+        dirty_remove(b);
+        madvise(start, pages * page_size(), MADV_DONTNEED);
+    }
+}
+
+/* Moves the decay epochs on and purges what has decayed, at most once an
+ * epoch. heap_lock must be held. */
+static void purge_decayed(void) {
+    long decay_ms = __atomic_load_n(&purge_decay_ms, __ATOMIC_RELAXED);
+    if (decay_ms < 0) return;
+    if (decay_ms == 0) {
+        purge_down_to(0);
+        return;
+    }
+
+    uint64_t epoch_ns = (uint64_t) decay_ms * 1000000 / DECAY_EPOCHS, now = now_ns();
+    if (now - epoch_start_ns < epoch_ns) return;
+    uint64_t passed = (now - epoch_start_ns) / epoch_ns;
+    for (uint64_t i = 0; i < passed && i < DECAY_EPOCHS; i++) {
+        epoch = (epoch + 1) % DECAY_EPOCHS;
+        epoch_pages[epoch] = 0;
+    }
+    epoch_start_ns = passed < DECAY_EPOCHS ? epoch_start_ns + passed * epoch_ns : now;
+
+    /* Pages dirtied AGE epochs ago may stay for (DECAY_EPOCHS - AGE) / DECAY_EPOCHS of them. */
+    size_t limit = 0;
+    for (int age = 0; age < DECAY_EPOCHS; age++)
+        limit += epoch_pages[(epoch - age + DECAY_EPOCHS) % DECAY_EPOCHS] * (DECAY_EPOCHS - age) / DECAY_EPOCHS;
+    purge_down_to(limit);
+}
+
+/*
+ * Cut free block B, which is on no free list, off the top of the heap if
+ * nothing lies past it; its header becomes the epilogue. Returns whether it
+ * was.
+ */
+static int trim_heap(s_block_ptr b) {
+    size_t length = BLOCK_SIZE + block_size(b);
+
+    if (next_block(b) != heap_end || sbrk(0) != heap_end->data) return 0;
+    if (sbrk(-(intptr_t) length) == (void*)-1) return 0;
+    __atomic_sub_fetch(&heap_size, length, __ATOMIC_RELAXED);
+
+    heap_end = b;
+    heap_end->size = 0;
+    return 1;
+}
+
+/*
+ * Give block B back to the heap. heap_lock must be held.
+ */
+static void heap_free(s_block_ptr b) {
+    s_block_ptr neighbour;
+    size_t already_dirty = 0;
+    char *start;
+
+    set_free(b, block_size(b));
+
+    // Merge with next if possible
+    neighbour = next_block(b);
+    if (neighbour->size & BLOCK_FREE) {
+        already_dirty += dirty_pages_of(neighbour);
+        free_list_remove(neighbour);
+        fusion(b);
+    }
 
-    if (last)
-        last->next = b;
+    // Merge with previous if possible
+    if (b->size & BLOCK_PREV_FREE) {
+        neighbour = prev_block(b);
+        already_dirty += dirty_pages_of(neighbour);
+        free_list_remove(neighbour);
+        b = fusion(neighbour);
+    }
+
+    if (BLOCK_SIZE + block_size(b) < __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED) || !trim_heap(b)) {
+        free_list_insert(b);
+        size_t pages = purge_range(b, &start);
+        dirty_insert(b, pages > already_dirty ? pages - already_dirty : 0);
+    }
+    purge_decayed();
+}
+
+static int is_slab_object(void *ptr) {
+    char *region = __atomic_load_n(&slab_region, __ATOMIC_ACQUIRE);
+    return region && (uintptr_t) ((char *) ptr - region) < SLAB_REGION;
+}
+
+static struct slab *slab_of(void *ptr) {
+    return (struct slab *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+static char *slab_objects(struct slab *s) {
+    return (char *) (s + 1);
+}
+
+/* Puts slab S at the head of class C's partly used slabs. */
+static void slab_push(int c, struct slab *s) {
+    s->prev = NULL;
+    s->next = slab_partial[c];
+    if (slab_partial[c]) slab_partial[c]->prev = s;
+    slab_partial[c] = s;
+}
+
+static void slab_unlink(int c, struct slab *s) {
+    if (s->prev) s->prev->next = s->next;
+    else slab_partial[c] = s->next;
+    if (s->next) s->next->prev = s->prev;
+}
+
+/*
+ * Take a slab from the region, a purged one first, for objects of SIZE bytes.
+ * Reserves the region on first use. heap_lock must be held.
+ */
+static struct slab *slab_new(size_t size) {
+    struct slab *s;
+    size_t index;
+
+    if (!slab_region) {
+        if (slab_region_failed) return NULL;
+        void *region = mmap(NULL, SLAB_REGION, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) {
+            slab_region_failed = 1;
+            return NULL;
+        }
+        __atomic_store_n(&slab_region, region, __ATOMIC_RELEASE);
+    }
+    if (slab_purged_count > 0) index = slab_purged[--slab_purged_count];
+    else if (slab_next < SLAB_COUNT) index = slab_next++;
+    else return NULL;
+    __atomic_add_fetch(&slab_bytes, SLAB_SIZE, __ATOMIC_RELAXED);
+
+    s = (struct slab *) (slab_region + index * SLAB_SIZE);
+    s->size = size;
+    s->count = (SLAB_SIZE - sizeof(struct slab)) / size;
+    s->used = 0;
+    for (uint32_t word = 0; word < SLAB_WORDS; word++) {
+        uint32_t first = word * 64;
+        s->free_map[word] = first >= s->count ? 0 : s->count - first >= 64 ? ~0ull : (1ull << (s->count - first)) - 1;
+    }
+    return s;
+}
+
+/* Purges empty slab S and hands it back to the region. */
+static void slab_release(struct slab *s) {
+    madvise(s, SLAB_SIZE, MADV_DONTNEED);
+    slab_purged[slab_purged_count++] = ((char *) s - slab_region) / SLAB_SIZE;
+    __atomic_sub_fetch(&slab_bytes, SLAB_SIZE, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take an object of class C from the slabs, partly used ones first, or NULL
+ * if the region is used up. heap_lock must be held.
+ */
+static void *slab_malloc(int c) {
+    struct slab *s = slab_partial[c];
+    uint32_t word = 0;
+
+    if (!s) {
+        s = slab_spare[c];
+        slab_spare[c] = NULL;
+        if (!s && !(s = slab_new(c * ALIGNMENT))) return NULL;
+        slab_push(c, s);
+    }
+
+    while (!s->free_map[word]) word++;
+    uint32_t index = word * 64 + __builtin_ctzll(s->free_map[word]);
+    s->free_map[word] &= s->free_map[word] - 1;
+    if (++s->used == s->count) slab_unlink(c, s);
+    return slab_objects(s) + index * s->size;
+}
+
+/*
+ * Give slab object PTR back to its slab. A class keeps one empty slab as a
+ * spare; others are released. heap_lock must be held.
+ */
+static void slab_free(void *ptr) {
+    struct slab *s = slab_of(ptr);
+    int c = s->size / ALIGNMENT;
+    uint32_t index = ((char *) ptr - slab_objects(s)) / s->size;
+
+    s->free_map[index / 64] |= 1ull << (index % 64);
+    if (s->used-- == s->count) slab_push(c, s);
+    if (s->used > 0) return;
+
+    slab_unlink(c, s);
+    if (!slab_spare[c]) slab_spare[c] = s;
+    else slab_release(s);
+}
+
+/* Give small object PTR back to its slab or to the heap. heap_lock must be held. */
+static void small_free(void *ptr) {
+    if (is_slab_object(ptr)) slab_free(ptr);
+    else heap_free(get_block(ptr));
+}
+
+static void cache_push(int c, void *ptr) {
+    *(void **) ptr = cache.objects[c];
+    cache.objects[c] = ptr;
+    cache.counts[c]++;
+}
+
+static void *cache_pop(int c) {
+    void *ptr = cache.objects[c];
+    if (ptr) {
+        cache.objects[c] = *(void **) ptr;
+        cache.counts[c]--;
+    }
+    return ptr;
+}
+
+/* Gives up to COUNT of the cache's objects of class C back. */
+static void cache_flush(int c, int count) {
+    pthread_mutex_lock(&heap_lock);
+    while (count-- > 0 && cache.objects[c])
+        small_free(cache_pop(c));
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void cache_release(void *unused) {
+    for (int c = 0; c < SMALL_CLASSES; c++)
+        if (cache.objects[c]) cache_flush(c, cache.counts[c]);
+}
+
+static void cache_create_key(void) {
+    pthread_key_create(&cache_key, cache_release);
+}
+
+/* Fills the cache's class C, which is empty, from the slabs or the heap. */
+static void cache_refill(int c) {
+    size_t size = c * ALIGNMENT < MIN_SIZE ? MIN_SIZE : c * ALIGNMENT;
+    s_block_ptr b;
+    void *ptr;
+
+    if (!cache.registered) {
+        pthread_once(&cache_key_once, cache_create_key);
+        pthread_setspecific(cache_key, &cache);
+        cache.registered = 1;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    for (int i = 0; i < CACHE_BATCH; i++) {
+        ptr = c < SLAB_CLASSES ? slab_malloc(c) : NULL;
+        if (!ptr && (b = heap_malloc(size))) ptr = b->data;
+        if (!ptr) break;
+        cache_push(c, ptr);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* Bytes of mapping for a block of SIZE bytes, header included. */
+static size_t mapping_length(size_t size) {
+    size_t page = page_size();
+    return (BLOCK_SIZE + size + page - 1) & ~(page - 1);
+}
+
+/*
+ * Give a block of SIZE bytes a mapping of its own. Its data comes zeroed.
+ */
+static s_block_ptr map_block(size_t size) {
+    size_t length = mapping_length(size);
+    s_block_ptr b = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) return NULL;
 
+    b->size = (length - BLOCK_SIZE) | BLOCK_MAPPED;
+    __atomic_add_fetch(&mapped_size, length, __ATOMIC_RELAXED);
+    return b;
+}
+
+static void unmap_block(s_block_ptr b) {
+    size_t length = BLOCK_SIZE + block_size(b);
+    munmap(b, length);
+    __atomic_sub_fetch(&mapped_size, length, __ATOMIC_RELAXED);
+}
+
+/*
+ * Resize mapped block B for SIZE bytes, moving it if need be.
+ */
+static s_block_ptr remap_block(s_block_ptr b, size_t size) {
+    size_t old_length = BLOCK_SIZE + block_size(b), length = mapping_length(size);
+    if (length == old_length) return b;
+
+    b = mremap(b, old_length, length, MREMAP_MAYMOVE);
+    if (b == MAP_FAILED) return NULL;
+    b->size = (length - BLOCK_SIZE) | BLOCK_MAPPED;
+    if (length > old_length) __atomic_add_fetch(&mapped_size, length - old_length, __ATOMIC_RELAXED);
+    else __atomic_sub_fetch(&mapped_size, old_length - length, __ATOMIC_RELAXED);
     return b;
 }
 
+int mm_set_mode(int new_mode) {
+    int status = -1;
+
+    if (new_mode != MM_MODE_SEGREGATED && new_mode != MM_MODE_TLSF && new_mode != MM_MODE_FIRST_FIT) return -1;
+    pthread_mutex_lock(&heap_lock);
+    if (!heap_end) {
+        mode = new_mode;
+        status = 0;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return status;
+}
+
+void mm_set_mmap_threshold(size_t threshold) {
+    __atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+void mm_set_trim_threshold(size_t threshold) {
+    __atomic_store_n(&trim_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+void mm_set_purge_decay(long decay_ms) {
+    __atomic_store_n(&purge_decay_ms, decay_ms, __ATOMIC_RELAXED);
+}
+
+void mm_trim(void) {
+    cache_release(NULL);
+
+    pthread_mutex_lock(&heap_lock);
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        if (slab_spare[c]) slab_release(slab_spare[c]);
+        slab_spare[c] = NULL;
+    }
+    purge_down_to(0);
+    if (heap_end && (heap_end->size & BLOCK_PREV_FREE)) {
+        s_block_ptr b = prev_block(heap_end);
+        free_list_remove(b);
+        if (!trim_heap(b)) free_list_insert(b);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void mm_get_stats(struct mm_stats *stats) {
+    stats->dirty = __atomic_load_n(&dirty_pages, __ATOMIC_RELAXED) * page_size();
+    stats->heap = __atomic_load_n(&heap_size, __ATOMIC_RELAXED);
+    stats->mapped = __atomic_load_n(&mapped_size, __ATOMIC_RELAXED);
+    stats->slabs = __atomic_load_n(&slab_bytes, __ATOMIC_RELAXED);
+}
+
 void* mm_malloc(size_t size) {
-    s_block_ptr b, last;
+    s_block_ptr b;
+    void *ptr;
 
-    if (size <= 0) return NULL;
+    if (size == 0 || size > SIZE_MAX / 2) return NULL;
 
-    // Initialize if this is the first call
-    if (!base) {
-        b = extend_heap(NULL, size);
-        if (!b) return NULL;
-        base = b;
+    size = (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+    if (size < SLAB_MIN) size = SLAB_MIN; // A slab object needs no room for free-list links
+
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        b = map_block(size);
+        return b ? b->data : NULL;
+    }
+
+    if (size < SMALL_LIMIT && mode != MM_MODE_FIRST_FIT) {
+        int c = size / ALIGNMENT;
+        if (!cache.objects[c]) cache_refill(c);
+        ptr = cache_pop(c);
     } else {
-        // Find a block
-        last = base;
-        b = find_block(&last, size);
-        if (!b) {
-            // No fitting block, extend the heap
-            b = extend_heap(last, size);
-            if (!b) return NULL;
-        } else if (b->size - size >= BLOCK_SIZE + sizeof(struct s_block)) {
-            // Split block if too large
-            split_block(b, size);
-        }
-        b->free = 0;
+        pthread_mutex_lock(&heap_lock);
+        b = heap_malloc(size < MIN_SIZE ? MIN_SIZE : size);
+        pthread_mutex_unlock(&heap_lock);
+        ptr = b ? b->data : NULL;
     }
+    if (!ptr) return NULL;
 
-    memset(b->data, 0, size);
-    return b->data;
+    memset(ptr, 0, size);
+    return ptr;
 }
 
 void *mm_realloc(void *ptr, size_t size) {
     void *new_ptr;
     s_block_ptr block;
-    size_t copy_size;
+    size_t header, old_size, copy_size;
 
     // Equivalent to mm_malloc(size) if ptr is NULL
     if (!ptr) return mm_malloc(size);
@@ -92,17 +855,29 @@ void *mm_realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    block = get_block(ptr);
-    if (block->size >= size) return ptr;  // Current block is big enough
+    if (is_slab_object(ptr)) {
+        old_size = slab_of(ptr)->size;
+        if (old_size >= size) return ptr;  // Current object is big enough
+    } else {
+        block = get_block(ptr);
+        header = owned_header(block);
 
+        // A mapping of its own is resized in place, or moved by the kernel
+        if ((header & BLOCK_MAPPED) && size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+            block = remap_block(block, size);
+            return block ? block->data : NULL;
+        }
 
+        old_size = header & ~(size_t) BLOCK_FLAGS;
+        if (!(header & BLOCK_MAPPED) && old_size >= size) return ptr;  // Current block is big enough
+    }
 
     // Allocate new block
     new_ptr = mm_malloc(size);
     if (!new_ptr) return NULL; // Allocation failed
 
     // Copy old data to new block
-    copy_size = block->size;
+    copy_size = old_size < size ? old_size : size;
     memcpy(new_ptr, ptr, copy_size);
 
     // Free old block
@@ -123,64 +898,66 @@ s_block_ptr get_block(void *p) {
     return (s_block_ptr)((char*)p - BLOCK_SIZE);
 }
 
+/*
+ * Cut allocated block B down to S bytes if what is left over can make a
+ * block of its own, and put that block on its free list.
+ */
 void split_block(s_block_ptr b, size_t s) {
     s_block_ptr new_block;
     size_t total_size;
 
-    total_size = b->size;
+    total_size = block_size(b);
 
     // Check if splitting is possible
-    if (total_size < s + BLOCK_SIZE + sizeof(struct s_block)) return;
+    if (total_size < s + BLOCK_SIZE + MIN_SIZE) return;
 
     // Create a new block at the address right after s
-    new_block = (s_block_ptr)(b->data + s);
-    new_block->size = total_size - s - BLOCK_SIZE;
-    new_block->next = b->next;
-    new_block->prev = b;
-    new_block->free = 1;
-    new_block->ptr = new_block->data;
-
-    // Update the original block
-    b->size = s;
-    b->next = new_block;
+    b->size = s | (b->size & BLOCK_FLAGS);
+    new_block = next_block(b);
+    new_block->size = 0;
+    set_free(new_block, total_size - s - BLOCK_SIZE);
 
-    // Update the next block's previous pointer if it exists
-    if (new_block->next) new_block->next->prev = new_block;
+    free_list_insert(new_block);
 }
 
 
 /*
- * Coalesce free adjacent blocks.
+ * Merge free block B with the free block after it. Neither may be on a free
+ * list.
  */
 s_block_ptr fusion(s_block_ptr b) {
-    if (b->next && b->next->free) {
-        b->size += BLOCK_SIZE + b->next->size;
-        b->next = b->next->next;
-        if (b->next)
-            b->next->prev = b;
-    }
+    set_free(b, block_size(b) + BLOCK_SIZE + block_size(next_block(b)));
     return b;
 }
 
 void mm_free(void *ptr) {
     s_block_ptr b;
+    size_t header;
+    int c;
 
     if (!ptr) return;
 
-    // Get the block from the pointer
-    b = get_block(ptr);
-    b->free = 1;
+    if (is_slab_object(ptr)) {
+        c = slab_of(ptr)->size / ALIGNMENT;
+    } else {
+        // Get the block from the pointer
+        b = get_block(ptr);
+        header = owned_header(b);
 
-    // Merge with previous if possible
-    if (b->prev && b->prev->free)
-        b = fusion(b->prev);
+        if (header & BLOCK_MAPPED) {
+            unmap_block(b);
+            return;
+        }
 
-    // Merge with next if possible
-    if (b->next) {
-        fusion(b);
-    } else {
-        // Reset the base/prev pointer
-        if (b->prev) b->prev->next = NULL;
-        else base = NULL;
+        if ((header & ~(size_t) BLOCK_FLAGS) >= SMALL_LIMIT || mode == MM_MODE_FIRST_FIT) {
+            pthread_mutex_lock(&heap_lock);
+            heap_free(b);
+            pthread_mutex_unlock(&heap_lock);
+            return;
+        }
+        c = (header & ~(size_t) BLOCK_FLAGS) / ALIGNMENT;
     }
+
+    cache_push(c, ptr);
+    if (cache.counts[c] > CACHE_MAX) cache_flush(c, CACHE_BATCH);
 }
@@ -10,7 +10,7 @@
 #define _malloc_H_
 
  /* Define the block size since the sizeof will be wrong */
-#define BLOCK_SIZE 40
+#define BLOCK_SIZE 8
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,33 +22,79 @@ void* mm_malloc(size_t size);
 void* mm_realloc(void* ptr, size_t size);
 void mm_free(void* ptr);
 
+/* Heap engines: segregated fit, the default, TLSF for bounded latency, or
+ * plain first fit, the original allocator's, kept as a baseline for mm_bench */
+#define MM_MODE_SEGREGATED 0
+#define MM_MODE_TLSF 1
+#define MM_MODE_FIRST_FIT 2
+
+/* Choose the engine; only before the heap is first used, -1 after */
+int mm_set_mode(int mode);
+
+/* Requests of at least this many bytes get an mmap of their own by default */
+#define MM_MMAP_THRESHOLD (128 * 1024)
+
+/* Change the mmap threshold; SIZE_MAX keeps every request in the heap */
+void mm_set_mmap_threshold(size_t threshold);
+
+/* A free block this big at the top of the heap is given back by default */
+#define MM_TRIM_THRESHOLD (128 * 1024)
+
+/* Change the trim threshold; SIZE_MAX never shrinks the heap */
+void mm_set_trim_threshold(size_t threshold);
+
+/* Free heap pages are purged over this many milliseconds by default */
+#define MM_PURGE_DECAY_MS 10000
+
+/* Change the purge decay time; 0 purges right away, -1 never */
+void mm_set_purge_decay(long decay_ms);
+
+/* Hand the calling thread's cached blocks back, purge every free heap page
+ * and trim the top of the heap now */
+void mm_trim(void);
+
+/* Memory the allocator holds from the OS, in bytes */
+struct mm_stats {
+    size_t heap;    /* grown with sbrk */
+    size_t mapped;  /* in mappings of their own */
+    size_t dirty;   /* of the heap, free but not purged yet */
+    size_t slabs;   /* in slabs of small objects */
+};
+
+void mm_get_stats(struct mm_stats *stats);
+
 
 typedef struct s_block *s_block_ptr;
 
-/* block struct */
+/* Flags in the low bits of a block's size */
+#define BLOCK_FREE 1
+#define BLOCK_PREV_FREE 2  /* the block right before is free */
+#define BLOCK_MAPPED 4     /* has an mmap of its own, not in the heap */
+#define BLOCK_FLAGS (BLOCK_FREE | BLOCK_PREV_FREE | BLOCK_MAPPED)
+
+/* block struct; a free block ends with a copy of its size */
 struct s_block {
     size_t size;
-    struct s_block *next;
-    struct s_block *prev;
-    int free;
-    void *ptr;
-    /* A pointer to the allocated block */
+    /* The allocated block */
     char data [0];
  };
 
 /* Split block according to size, b must exist */
 void split_block (s_block_ptr b, size_t s);
 
-/* Try fusing block with neighbors */
+/* Merge free b with the free block after it, neither on a free list */
 s_block_ptr fusion(s_block_ptr b);
 
+/* Find a free block of at least size bytes, NULL if none */
+s_block_ptr find_block(size_t size);
+
 /* Get the block from addr */
 s_block_ptr get_block (void *p);
 
 /* Add a new block at the of heap,
  * return NULL if things go wrong
  */
-s_block_ptr extend_heap (s_block_ptr last , size_t s);
+s_block_ptr extend_heap (size_t s);
 
 
 #ifdef __cplusplus
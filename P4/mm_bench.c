@@ -0,0 +1,449 @@
+/*
+ * Replays allocation traces against mm_malloc and against the C library's
+ * malloc, and reports operations per second and, for mm_malloc, how much of
+ * the memory it held from the OS (heap, mappings and slabs) was live data at
+ * its peak. "first" is mm_malloc with MM_MODE_FIRST_FIT and no mappings, the
+ * first-fit allocator it started out as, for a baseline.
+ *
+ * A trace is a sequence of operations on numbered slots:
+ *     a ID SIZE   allocate SIZE bytes into slot ID
+ *     r ID SIZE   reallocate slot ID to SIZE bytes
+ *     f ID        free slot ID
+ * The built-in traces are generated from a fixed seed:
+ *     small     16-128 byte objects allocated and freed at random
+ *     mixed     16 bytes to 64 KiB, spread evenly over the powers of two
+ *     grow      buffers grown by realloc until they reach 1 MiB
+ *     holes     every other small object freed, then slightly larger ones
+ *               allocated, which none of the holes can take
+ * --trace adds one read from a file in the format above.
+ *
+ * Then each trace is replayed again with every operation timed on its own,
+ * and the median, 99th and 99.9th percentile and worst latencies are
+ * reported, in nanoseconds; "tlsf" is mm_malloc with MM_MODE_TLSF, whose
+ * worst case should stay close to its median.
+ *
+ * Then, for each count in --threads, that many threads replay the small
+ * trace at once, each on slots of its own, and the total operations per
+ * second are reported; with the thread caches, those should grow with the
+ * number of CPUs. "first" has no thread caches and is left out.
+ *
+ * Every run is made in a child process of its own, so each allocator starts
+ * from an empty heap. The C library is called through calloc, since
+ * mm_malloc hands out zeroed memory too.
+ *
+ * --mmap-threshold sets mm_malloc's; the default is MM_MMAP_THRESHOLD.
+ *
+ * Usage: ./mm_bench [--ops 200000] [--trace FILE]... [--threads 1,2,4,8,16,32,64]
+ *                   [--mmap-threshold BYTES]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm_alloc.h"
+
+#define MAX_TRACES 16
+#define MAX_THREADS 256
+
+typedef struct op {
+    char kind; // 'a', 'r' or 'f'
+    int id;
+    size_t size;
+} op_t;
+
+typedef struct trace {
+    const char *name;
+    op_t *ops;
+    int num_ops;
+    int num_slots;
+} trace_t;
+
+typedef struct allocator {
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+    size_t (*footprint)(void); // Bytes held from the OS, if known.
+    void (*setup)(void); // Called in the child before the replay, if not NULL.
+    int single_threaded; // Left out of the thread runs.
+} allocator_t;
+
+typedef struct result {
+    double ops_per_sec;
+    size_t peak_live;
+    size_t peak_footprint;
+    int corrupted; // Objects found overwritten by other objects.
+    uint64_t latency[4]; // Median, 99th, 99.9th percentile and worst ns per operation, if timed.
+} result_t;
+
+static void *libc_malloc(size_t size) {
+    return calloc(1, size);
+}
+
+static size_t mm_footprint(void) {
+    struct mm_stats stats;
+    mm_get_stats(&stats);
+    return stats.heap + stats.mapped + stats.slabs;
+}
+
+static void tlsf_setup(void) {
+    mm_set_mode(MM_MODE_TLSF);
+}
+
+/* The original allocator, as near as can be: first fit, all in the heap. */
+static void first_fit_setup(void) {
+    mm_set_mode(MM_MODE_FIRST_FIT);
+    mm_set_mmap_threshold(SIZE_MAX);
+}
+
+static const allocator_t allocators[] = {
+    {"mm", mm_malloc, mm_realloc, mm_free, mm_footprint, NULL, 0},
+    {"tlsf", mm_malloc, mm_realloc, mm_free, mm_footprint, tlsf_setup, 0},
+    {"first", mm_malloc, mm_realloc, mm_free, mm_footprint, first_fit_setup, 1},
+    {"libc", libc_malloc, realloc, free, NULL, NULL, 0},
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t rng_range(size_t low, size_t high) {
+    return low + rng_next() % (high - low + 1);
+}
+
+/* A size between 2^LOW and 2^HIGH bytes, each power of two equally likely. */
+static size_t rng_log_size(int low, int high) {
+    int shift = rng_range(low, high - 1);
+    return rng_range((size_t) 1 << shift, (size_t) 2 << shift);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static trace_t trace_new(const char *name, int num_ops, int num_slots) {
+    trace_t trace = {name, calloc(num_ops, sizeof(op_t)), 0, num_slots};
+    return trace;
+}
+
+static void trace_add(trace_t *trace, char kind, int id, size_t size) {
+    trace->ops[trace->num_ops++] = (op_t) {kind, id, size};
+}
+
+/* Allocates into a random slot when it is empty and frees it otherwise. */
+static trace_t trace_random(const char *name, int num_ops, int num_slots, int min_shift, int max_shift,
+                            size_t min_size, size_t max_size) {
+    trace_t trace = trace_new(name, num_ops + num_slots, num_slots);
+    char *used = calloc(num_slots, 1);
+    for (int i = 0; i < num_ops; i++) {
+        int id = rng_next() % num_slots;
+        if (used[id]) trace_add(&trace, 'f', id, 0);
+        else trace_add(&trace, 'a', id, max_shift ? rng_log_size(min_shift, max_shift) : rng_range(min_size, max_size));
+        used[id] = !used[id];
+    }
+    for (int id = 0; id < num_slots; id++)
+        if (used[id]) trace_add(&trace, 'f', id, 0);
+    free(used);
+    return trace;
+}
+
+static trace_t trace_grow(int num_ops) {
+    int num_slots = 64;
+    trace_t trace = trace_new("grow", num_ops + num_slots, num_slots);
+    size_t *sizes = calloc(num_slots, sizeof(size_t));
+    for (int i = 0; i < num_ops; i++) {
+        int id = rng_next() % num_slots;
+        if (!sizes[id]) {
+            sizes[id] = rng_range(16, 256);
+            trace_add(&trace, 'a', id, sizes[id]);
+        } else if (sizes[id] < 1 << 20) {
+            sizes[id] += sizes[id] / 2;
+            trace_add(&trace, 'r', id, sizes[id]);
+        } else {
+            sizes[id] = 0;
+            trace_add(&trace, 'f', id, 0);
+        }
+    }
+    for (int id = 0; id < num_slots; id++)
+        if (sizes[id]) trace_add(&trace, 'f', id, 0);
+    free(sizes);
+    return trace;
+}
+
+static trace_t trace_holes(int num_ops) {
+    int half = num_ops / 4;
+    trace_t trace = trace_new("holes", 6 * half, 2 * half);
+    for (int id = 0; id < 2 * half; id++) trace_add(&trace, 'a', id, 32);
+    for (int id = 0; id < 2 * half; id += 2) trace_add(&trace, 'f', id, 0);
+    for (int id = 0; id < 2 * half; id += 2) trace_add(&trace, 'a', id, 64);
+    for (int id = 0; id < 2 * half; id++) trace_add(&trace, 'f', id, 0);
+    return trace;
+}
+
+static int trace_read(const char *path, trace_t *trace) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+
+    int capacity = 1024;
+    *trace = trace_new(path, capacity, 0);
+    char kind;
+    int id;
+    size_t size;
+    while (fscanf(file, " %c %d", &kind, &id) == 2) {
+        size = 0;
+        if ((kind == 'a' || kind == 'r') && fscanf(file, "%zu", &size) != 1) break;
+        if ((kind != 'a' && kind != 'r' && kind != 'f') || id < 0) break;
+        if (trace->num_ops == capacity) trace->ops = realloc(trace->ops, (capacity *= 2) * sizeof(op_t));
+        trace_add(trace, kind, id, size);
+        if (id >= trace->num_slots) trace->num_slots = id + 1;
+    }
+    int complete = feof(file);
+    fclose(file);
+    return complete ? 0 : -1;
+}
+
+typedef struct replayer {
+    const trace_t *trace;
+    const allocator_t *allocator;
+    pthread_barrier_t *start_line; // Waited on before the clock starts, if not NULL.
+    result_t result;
+} replayer_t;
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Replays TRACE in the calling thread. Each object's first byte is marked
+ * with its slot so that one handed out twice shows up as corrupted. If TIMED,
+ * every call into the allocator is timed on its own. */
+static result_t replay(const trace_t *trace, const allocator_t *allocator, pthread_barrier_t *start_line, int timed) {
+    result_t result = {0};
+    void **slots = calloc(trace->num_slots, sizeof(void *));
+    size_t *sizes = calloc(trace->num_slots, sizeof(size_t));
+    uint64_t *latencies = timed ? calloc(trace->num_ops, sizeof(uint64_t)) : NULL;
+    size_t live = 0;
+
+    if (start_line) pthread_barrier_wait(start_line);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < trace->num_ops; i++) {
+        const op_t *op = &trace->ops[i];
+        unsigned char mark = op->id;
+        if (op->kind != 'a' && slots[op->id] && *(unsigned char *) slots[op->id] != mark) result.corrupted++;
+
+        uint64_t op_start = latencies ? now_ns() : 0;
+        if (op->kind == 'f') {
+            allocator->free(slots[op->id]);
+            if (latencies) latencies[i] = now_ns() - op_start;
+            slots[op->id] = NULL;
+            live -= sizes[op->id];
+            sizes[op->id] = 0;
+            continue;
+        }
+        void *ptr = op->kind == 'a' ? allocator->malloc(op->size) : allocator->realloc(slots[op->id], op->size);
+        if (latencies) latencies[i] = now_ns() - op_start;
+        if (!ptr) {
+            result.corrupted++;
+            break;
+        }
+        *(unsigned char *) ptr = mark;
+        slots[op->id] = ptr;
+        live += op->size - sizes[op->id];
+        sizes[op->id] = op->size;
+
+        if (live > result.peak_live) result.peak_live = live;
+        size_t footprint = allocator->footprint ? allocator->footprint() : 0;
+        if (footprint > result.peak_footprint) result.peak_footprint = footprint;
+    }
+    result.ops_per_sec = trace->num_ops / ((now_ns() - start) / 1e9);
+    if (latencies) {
+        qsort(latencies, trace->num_ops, sizeof(uint64_t), compare_u64);
+        int last = trace->num_ops - 1;
+        result.latency[0] = latencies[last / 2];
+        result.latency[1] = latencies[last * 99 / 100];
+        result.latency[2] = latencies[last * 999 / 1000];
+        result.latency[3] = latencies[last];
+    }
+    free(slots);
+    free(sizes);
+    free(latencies);
+    return result;
+}
+
+static void *replayer_thread(void *args) {
+    replayer_t *replayer = args;
+    replayer->result = replay(replayer->trace, replayer->allocator, replayer->start_line, 0);
+    return NULL;
+}
+
+/* Replays TRACE on NUM_THREADS threads at once. The operations per second
+ * are those of all threads together, timed by the slowest. */
+static result_t replay_threads(const trace_t *trace, const allocator_t *allocator, int num_threads) {
+    result_t result = {0};
+    pthread_barrier_t start_line;
+    pthread_t threads[num_threads];
+    replayer_t replayers[num_threads];
+
+    pthread_barrier_init(&start_line, NULL, num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        replayers[i] = (replayer_t) {trace, allocator, &start_line};
+        pthread_create(&threads[i], NULL, replayer_thread, &replayers[i]);
+    }
+    double slowest = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        double elapsed = trace->num_ops / replayers[i].result.ops_per_sec;
+        if (elapsed > slowest) slowest = elapsed;
+        result.corrupted += replayers[i].result.corrupted;
+    }
+    pthread_barrier_destroy(&start_line);
+    result.ops_per_sec = (double) trace->num_ops * num_threads / slowest;
+    return result;
+}
+
+/* Replays TRACE in a child process, on NUM_THREADS threads if not 0, or
+ * timing each operation if TIMED. */
+static int run(const trace_t *trace, const allocator_t *allocator, int num_threads, int timed, result_t *result) {
+    int fds[2];
+    if (pipe(fds) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (allocator->setup) allocator->setup();
+        *result = num_threads ? replay_threads(trace, allocator, num_threads) : replay(trace, allocator, NULL, timed);
+        _exit(write(fds[1], result, sizeof(*result)) == sizeof(*result) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t bytes_read = pid > 0 ? read(fds[0], result, sizeof(*result)) : -1;
+    close(fds[0]);
+    int status = 0;
+    if (pid > 0) waitpid(pid, &status, 0);
+    return bytes_read == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static void report(const trace_t *trace) {
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        const allocator_t *allocator = &allocators[i];
+        result_t result;
+        if (run(trace, allocator, 0, 0, &result) == -1) {
+            printf("%-8s %-6s crashed\n", trace->name, allocator->name);
+            continue;
+        }
+        printf("%-8s %-6s %12.0f %14zu", trace->name, allocator->name, result.ops_per_sec, result.peak_live / 1024);
+        if (result.peak_footprint)
+            printf(" %14zu %11.1f%%", result.peak_footprint / 1024, 100.0 * result.peak_live / result.peak_footprint);
+        else
+            printf(" %14s %12s", "-", "-");
+        printf(result.corrupted ? "  CORRUPTED\n" : "\n");
+    }
+}
+
+static void report_latency(const trace_t *trace) {
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        const allocator_t *allocator = &allocators[i];
+        result_t result;
+        if (run(trace, allocator, 0, 1, &result) == -1) {
+            printf("%-8s %-6s crashed\n", trace->name, allocator->name);
+            continue;
+        }
+        printf("%-8s %-6s %10llu %10llu %10llu %10llu%s\n", trace->name, allocator->name,
+               (unsigned long long) result.latency[0], (unsigned long long) result.latency[1],
+               (unsigned long long) result.latency[2], (unsigned long long) result.latency[3],
+               result.corrupted ? "  CORRUPTED" : "");
+    }
+}
+
+static void report_threads(const trace_t *trace, int num_threads) {
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        const allocator_t *allocator = &allocators[i];
+        result_t result;
+        if (allocator->single_threaded) continue;
+        if (run(trace, allocator, num_threads, 0, &result) == -1) {
+            printf("%-8d %-6s crashed\n", num_threads, allocator->name);
+            continue;
+        }
+        printf("%-8d %-6s %12.0f%s\n", num_threads, allocator->name, result.ops_per_sec,
+               result.corrupted ? "  CORRUPTED" : "");
+    }
+}
+
+int main(int argc, char **argv) {
+    int num_ops = 200000;
+    const char *paths[MAX_TRACES];
+    int num_paths = 0;
+    char *thread_list = "1,2,4,8,16,32,64";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--ops", argv[i]) == 0 && i + 1 < argc) num_ops = atoi(argv[++i]);
+        else if (strcmp("--trace", argv[i]) == 0 && i + 1 < argc && num_paths < MAX_TRACES)
+            paths[num_paths++] = argv[++i];
+        else if (strcmp("--threads", argv[i]) == 0 && i + 1 < argc) thread_list = argv[++i];
+        else if (strcmp("--mmap-threshold", argv[i]) == 0 && i + 1 < argc)
+            mm_set_mmap_threshold(strtoull(argv[++i], NULL, 10));
+        else {
+            fprintf(stderr, "Usage: %s [--ops N] [--trace FILE]... [--threads 1,2,4] [--mmap-threshold BYTES]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_ops < 4) {
+        fprintf(stderr, "--ops must be at least 4\n");
+        return EXIT_FAILURE;
+    }
+
+    trace_t traces[MAX_TRACES + 4];
+    int num_traces = 0;
+    traces[num_traces++] = trace_random("small", num_ops, 8192, 0, 0, 16, 128);
+    traces[num_traces++] = trace_random("mixed", num_ops, 2048, 4, 16, 0, 0);
+    traces[num_traces++] = trace_grow(num_ops);
+    traces[num_traces++] = trace_holes(num_ops);
+    for (int i = 0; i < num_paths; i++) {
+        if (trace_read(paths[i], &traces[num_traces]) == -1) {
+            fprintf(stderr, "Cannot read a trace from %s\n", paths[i]);
+            return EXIT_FAILURE;
+        }
+        num_traces++;
+    }
+
+    printf("%-8s %-6s %12s %14s %14s %12s\n", "trace", "alloc", "ops/s", "peak live KiB", "peak held KiB",
+           "utilization");
+    fflush(stdout);
+    for (int i = 0; i < num_traces; i++) {
+        report(&traces[i]);
+        fflush(stdout);
+    }
+
+    printf("\n%-8s %-6s %10s %10s %10s %10s\n", "trace", "alloc", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    fflush(stdout);
+    for (int i = 0; i < num_traces; i++) {
+        report_latency(&traces[i]);
+        fflush(stdout);
+    }
+
+    printf("\n%-8s %-6s %12s\n", "threads", "alloc", "ops/s");
+    fflush(stdout);
+    char *list = strdup(thread_list), *saveptr = NULL;
+    for (char *token = strtok_r(list, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        int num_threads = atoi(token);
+        if (num_threads < 1 || num_threads > MAX_THREADS) continue;
+        report_threads(&traces[0], num_threads);
+        fflush(stdout);
+    }
+    free(list);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,248 @@
+/*
+ * A correctness stress test for mm_alloc, run once per engine
+ * (MM_MODE_SEGREGATED, MM_MODE_TLSF and MM_MODE_FIRST_FIT), each in a child
+ * process of its own since the engine is chosen before the heap is first
+ * used. In each:
+ *
+ *   - random mallocs, reallocs and frees of 1 byte to 512 KiB, on either side
+ *     of the mmap threshold; every byte of an object holds a pattern of its
+ *     own and is checked before it is freed or reallocated, so two objects
+ *     handed out over each other show up, as does mm_malloc memory not
+ *     zeroed;
+ *   - one object grown by realloc from 1 KiB to 1 MiB and shrunk back, into
+ *     and out of a mapping of its own, keeping its contents all the way;
+ *   - NUM_THREADS threads each allocating objects that the next thread checks
+ *     and frees, so objects go back through another thread's cache;
+ *   - everything freed and mm_trim called, after which the heap, the
+ *     mappings and the slabs must be back to what they were at the start.
+ *
+ * Also meant to be built with -fsanitize=thread:
+ *     make clean && make CFLAGS="-g -Wall -fsanitize=thread" LDFLAGS="-pthread -fsanitize=thread"
+ *
+ * Usage: ./mm_stress [--ops 100000]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mm_alloc.h"
+
+#define NUM_SLOTS 4096
+#define NUM_THREADS 8
+#define THREAD_OBJECTS 10000 // Per thread and round.
+#define THREAD_ROUNDS 10
+
+typedef struct object {
+    unsigned char *ptr;
+    size_t size;
+    uint32_t seed;
+} object_t;
+
+static const struct {
+    const char *name;
+    int mode;
+} engines[] = {
+    {"segregated", MM_MODE_SEGREGATED},
+    {"tlsf", MM_MODE_TLSF},
+    {"first-fit", MM_MODE_FIRST_FIT},
+};
+
+static object_t slots[NUM_SLOTS];
+static object_t handoff[NUM_THREADS][THREAD_OBJECTS];
+static pthread_barrier_t round_line;
+
+static void fail(const char *what, const object_t *object) {
+    if (object)
+        fprintf(stderr, "FAIL: %s (object %p, %zu bytes, seed %u)\n", what, (void *) object->ptr, object->size,
+                object->seed);
+    else
+        fprintf(stderr, "FAIL: %s\n", what);
+    exit(1);
+}
+
+static uint64_t rng_next(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* Mostly small objects, for the slabs and the thread caches, then heap
+ * blocks, then a few on either side of the mmap threshold. */
+static size_t random_size(uint64_t *state) {
+    uint64_t kind = rng_next(state) % 100;
+    if (kind < 80) return 1 + rng_next(state) % 512;
+    if (kind < 99) return 512 + rng_next(state) % 16384;
+    return 65536 + rng_next(state) % (4 * MM_MMAP_THRESHOLD);
+}
+
+static unsigned char pattern(uint32_t seed, size_t i) {
+    return (unsigned char) (seed + i * 131 + (i >> 8));
+}
+
+static void fill(object_t *object, size_t from) {
+    for (size_t i = from; i < object->size; i++) object->ptr[i] = pattern(object->seed, i);
+}
+
+/* Checks the first LENGTH bytes of OBJECT still hold its pattern. */
+static void check(const object_t *object, size_t length) {
+    for (size_t i = 0; i < length; i++)
+        if (object->ptr[i] != pattern(object->seed, i)) fail("pattern overwritten", object);
+}
+
+static void check_zero(const object_t *object, size_t from) {
+    for (size_t i = from; i < object->size; i++)
+        if (object->ptr[i] != 0) fail("memory not zeroed", object);
+}
+
+static void allocate(object_t *object, size_t size, uint32_t seed) {
+    object->ptr = mm_malloc(size);
+    object->size = size;
+    object->seed = seed;
+    if (!object->ptr) fail("mm_malloc returned NULL", object);
+    if ((uintptr_t) object->ptr % 8 != 0) fail("misaligned", object);
+    check_zero(object, 0);
+    fill(object, 0);
+}
+
+static void reallocate(object_t *object, size_t size) {
+    size_t old_size = object->size;
+    check(object, old_size);
+    object->ptr = mm_realloc(object->ptr, size);
+    object->size = size;
+    if (!object->ptr) fail("mm_realloc returned NULL", object);
+    if ((uintptr_t) object->ptr % 8 != 0) fail("misaligned", object);
+    check(object, old_size < size ? old_size : size); // What lies past it need not be zero after a shrink.
+    if (size > old_size) fill(object, old_size);
+}
+
+static void release(object_t *object) {
+    check(object, object->size);
+    mm_free(object->ptr);
+    object->ptr = NULL;
+}
+
+static void random_ops(int num_ops) {
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    uint32_t seed = 0;
+
+    for (int i = 0; i < num_ops; i++) {
+        object_t *object = &slots[rng_next(&state) % NUM_SLOTS];
+        uint64_t kind = rng_next(&state) % 3;
+        if (!object->ptr) allocate(object, random_size(&state), seed++);
+        else if (kind == 0) release(object);
+        else reallocate(object, random_size(&state));
+    }
+    for (int i = 0; i < NUM_SLOTS; i++)
+        if (slots[i].ptr) release(&slots[i]);
+}
+
+static void grow_and_shrink(void) {
+    static const size_t sizes[] = {1024, 65536, MM_MMAP_THRESHOLD - 8, MM_MMAP_THRESHOLD, 200000, 1 << 20,
+                                   MM_MMAP_THRESHOLD + 8, MM_MMAP_THRESHOLD - 8, 1000, 10};
+    object_t object;
+
+    allocate(&object, sizes[0], 7);
+    for (size_t i = 1; i < sizeof(sizes) / sizeof(sizes[0]); i++) reallocate(&object, sizes[i]);
+    release(&object);
+}
+
+/* Thread ID allocates into handoff[ID], then checks and frees what the
+ * thread before it allocated, round after round. */
+static void *cross_thread(void *arg) {
+    int id = (int) (intptr_t) arg;
+    uint64_t state = 0x2545f4914f6cdd1dull * (id + 1);
+
+    for (int round = 0; round < THREAD_ROUNDS; round++) {
+        for (int i = 0; i < THREAD_OBJECTS; i++) {
+            size_t size = rng_next(&state) % 16 ? 1 + rng_next(&state) % 512 : 512 + rng_next(&state) % 4096;
+            allocate(&handoff[id][i], size, round * THREAD_OBJECTS + i);
+        }
+        pthread_barrier_wait(&round_line);
+        object_t *theirs = handoff[(id + NUM_THREADS - 1) % NUM_THREADS];
+        for (int i = 0; i < THREAD_OBJECTS; i++) release(&theirs[i]);
+        pthread_barrier_wait(&round_line);
+    }
+    return NULL;
+}
+
+static void cross_threads(void) {
+    pthread_t threads[NUM_THREADS];
+
+    pthread_barrier_init(&round_line, NULL, NUM_THREADS);
+    for (int i = 0; i < NUM_THREADS; i++) pthread_create(&threads[i], NULL, cross_thread, (void *) (intptr_t) i);
+    for (int i = 0; i < NUM_THREADS; i++) pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&round_line);
+}
+
+static void *idle(void *arg) {
+    return arg;
+}
+
+static void stress(int mode, int num_ops) {
+    struct mm_stats baseline, stats;
+    pthread_t threads[NUM_THREADS];
+    object_t warmup;
+
+    if (mm_set_mode(mode) != 0) fail("mm_set_mode", NULL);
+    /* The C library grows the break for itself when the first threads start,
+     * which would leave the heap in two stretches, only the last of which
+     * mm_trim can shrink; so threads are started once before the heap is
+     * used. The heap then keeps its epilogue once trimmed, so the baseline
+     * is taken after it exists. */
+    for (int i = 0; i < NUM_THREADS; i++) pthread_create(&threads[i], NULL, idle, NULL);
+    for (int i = 0; i < NUM_THREADS; i++) pthread_join(threads[i], NULL);
+    allocate(&warmup, 1000, 1);
+    release(&warmup);
+    mm_trim();
+    mm_get_stats(&baseline);
+
+    random_ops(num_ops);
+    grow_and_shrink();
+    cross_threads();
+    if (mm_set_mode(mode) != -1) fail("mm_set_mode after use", NULL);
+
+    mm_trim();
+    mm_get_stats(&stats);
+    if (stats.heap != baseline.heap || stats.mapped != baseline.mapped || stats.slabs != baseline.slabs ||
+        stats.dirty != 0) {
+        fprintf(stderr, "FAIL: after mm_trim: heap %zu, mapped %zu, slabs %zu, dirty %zu; expected %zu, %zu, %zu, 0\n",
+                stats.heap, stats.mapped, stats.slabs, stats.dirty, baseline.heap, baseline.mapped, baseline.slabs);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    int num_ops = 100000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--ops", argv[i]) == 0 && i + 1 < argc) num_ops = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [--ops N]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            stress(engines[i].mode, num_ops);
+            _exit(0);
+        }
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("%s: failed\n", engines[i].name);
+            return EXIT_FAILURE;
+        }
+        printf("%s: %d random operations, %d objects freed on other threads\n", engines[i].name, num_ops,
+               NUM_THREADS * THREAD_OBJECTS * THREAD_ROUNDS);
+    }
+    printf("malloc stress test successful!\n");
+    return EXIT_SUCCESS;
+}